@@ -16,6 +16,7 @@ _ag() {
     --all-text
     --all-types
     --before
+    --binary-output
     --break
     --case-sensitive
     --color
@@ -24,11 +25,15 @@ _ag() {
     --color-path
     --color-win-ansi
     --column
+    --connect
     --context
     --count
+    --count-lines
     --debug
     --depth
+    --dir-cache
     --file-search-regex
+    --file-time-limit
     --filename
     --files-with-matches
     --files-without-matches
@@ -42,16 +47,20 @@ _ag() {
     --ignore-case
     --ignore-dir
     --invert-match
+    --json
+    --kernel
     --line-numbers
     --list-file-types
     --literal
     --match
     --max-count
+    --max-total-matches
     --no-numbers
     --no-recurse
     --noaffinity
     --nobreak
     --nocolor
+    --nodfa
     --nofilename
     --nofollow
     --nogroup
@@ -70,14 +79,19 @@ _ag() {
     --path-to-ignore
     --print-long-lines
     --print0
+    --queries
     --recurse
+    --regex-depth-limit
+    --regex-match-limit
     --search-binary
     --search-files
     --search-zip
+    --serve
     --silent
     --skip-vcs-ignores
     --smart-case
     --stats
+    --trace
     --unrestricted
     --version
     --vimgrep
@@ -106,14 +120,17 @@ _ag() {
     --ignore-dir) # directory completion
               _filedir -d
               return 0;;
-    --path-to-ignore) # file completion
+    --connect|--dir-cache|--path-to-ignore|--queries|--serve|--trace) # file completion
               _filedir
               return 0;;
+    --kernel)
+              COMPREPLY=( $(compgen -W "generic sse2 sse4.2 avx2 avx512bw" -- "${cur}") )
+              return 0;;
     --pager) # command completion
               COMPREPLY=( $(compgen -c -- "${cur}") )
               return 0;;
     --ackmate-dir-filter|--after|--before|--color-*|--context|--depth\
-    |--file-search-regex|--ignore|--max-count|--workers)
+    |--file-search-regex|--ignore|--max-count|--max-total-matches|--workers)
               return 0;;
   esac
 
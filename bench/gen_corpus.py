@@ -0,0 +1,166 @@
+#!/usr/bin/env python3
+
+# Generate the benchmark corpus used by run_bench.py:
+#   src/      deep trees of small source-like files, with nested .gitignores
+#             and the build output they ignore
+#   logs/     a few large log files
+#   archives/ gzip and xz copies of some logs and sources
+#   blobs/    binary files
+#
+# The output only depends on --seed and --scale, so every machine generates
+# the same corpus. If DIR already holds a corpus generated with the same
+# parameters, nothing is done.
+
+import argparse
+import gzip
+import json
+import lzma
+import os
+import random
+import shutil
+import sys
+
+VERSION = 1
+
+WORDS = (
+    "alpha beta gamma delta buffer queue worker thread mutex search match "
+    "result index offset length cursor token parser lexer config option "
+    "value key table hash entry node tree walker ignore pattern regex "
+    "literal path file dir stream reader writer cache count total error"
+).split()
+
+EXTENSIONS = {
+    ".c": ("/* %s */", "static int %s(const char *%s, size_t %s) {", "    return %s(%s, %s);", "}"),
+    ".py": ("# %s", "def %s(%s, %s):", "    return %s(%s, %s)", ""),
+    ".js": ("// %s", "function %s(%s, %s) {", "    return %s(%s, %s);", "}"),
+    ".go": ("// %s", "func %s(%s string, %s int) int {", "\treturn %s(%s, %s)", "}"),
+}
+
+MARKERS = ["TODO", "FIXME", "XXX"]
+LOG_LEVELS = ["DEBUG"] * 6 + ["INFO"] * 10 + ["WARN"] * 3 + ["ERROR"]
+
+
+def ident(rng):
+    return "%s_%s" % (rng.choice(WORDS), rng.choice(WORDS))
+
+
+def source_file(rng, ext, lines):
+    comment, header, body, footer = EXTENSIONS[ext]
+    out = []
+    while len(out) < lines:
+        if rng.random() < 0.05:
+            out.append(comment % ("%s: %s %s" % (rng.choice(MARKERS), rng.choice(WORDS), rng.choice(WORDS))))
+        else:
+            out.append(comment % " ".join(rng.choice(WORDS) for _ in range(rng.randint(3, 10))))
+        out.append(header % (ident(rng), rng.choice(WORDS), rng.choice(WORDS)))
+        for _ in range(rng.randint(1, 6)):
+            out.append(body % (ident(rng), rng.choice(WORDS), rng.choice(WORDS)))
+        out.append(footer)
+    return "\n".join(out) + "\n"
+
+
+def gen_tree(rng, root, depth, scale):
+    files = 0
+    # Every directory ignores its build output. Some also ignore a pattern
+    # that only applies below them.
+    with open(os.path.join(root, ".gitignore"), "w") as fd:
+        fd.write("build/\n*.o\n")
+        if rng.random() < 0.3:
+            fd.write("*.%s.tmp\n" % rng.choice(WORDS))
+        if rng.random() < 0.2:
+            fd.write("/%s_generated*\n" % rng.choice(WORDS))
+    build = os.path.join(root, "build")
+    os.mkdir(build)
+    for i in range(3):
+        with open(os.path.join(build, "out%d.o" % i), "wb") as fd:
+            fd.write(bytes(rng.getrandbits(8) for _ in range(2048)))
+
+    for i in range(rng.randint(4, 4 + 4 * scale)):
+        ext = rng.choice(sorted(EXTENSIONS))
+        name = "%s_%d%s" % (rng.choice(WORDS), i, ext)
+        with open(os.path.join(root, name), "w") as fd:
+            fd.write(source_file(rng, ext, rng.randint(20, 400)))
+        files += 1
+
+    if depth > 0:
+        for i in range(rng.randint(2, 4)):
+            sub = os.path.join(root, "%s%d" % (rng.choice(WORDS), i))
+            os.mkdir(sub)
+            files += gen_tree(rng, sub, depth - 1 if rng.random() < 0.8 else 0, scale)
+    return files
+
+
+def gen_log(rng, path, size):
+    written = 0
+    with open(path, "w") as fd:
+        t = 1500000000
+        while written < size:
+            t += rng.randint(0, 3)
+            line = "%d %s [%s] %s request_id=%08x took %dms\n" % (
+                t, rng.choice(LOG_LEVELS), ident(rng),
+                " ".join(rng.choice(WORDS) for _ in range(rng.randint(4, 12))),
+                rng.getrandbits(32), rng.randint(0, 5000))
+            fd.write(line)
+            written += len(line)
+
+
+def generate(out, seed, scale):
+    rng = random.Random(seed)
+    os.makedirs(out)
+
+    src = os.path.join(out, "src")
+    os.mkdir(src)
+    files = gen_tree(rng, src, 5, scale)
+
+    logs = os.path.join(out, "logs")
+    os.mkdir(logs)
+    for i in range(2):
+        gen_log(rng, os.path.join(logs, "app%d.log" % i), 16 * 1024 * 1024 * scale)
+
+    archives = os.path.join(out, "archives")
+    os.mkdir(archives)
+    with open(os.path.join(logs, "app0.log"), "rb") as fd:
+        data = fd.read(4 * 1024 * 1024 * scale)
+    with gzip.GzipFile(os.path.join(archives, "app0.log.gz"), "wb", mtime=0) as fd:
+        fd.write(data)
+    with lzma.open(os.path.join(archives, "app0.log.xz"), "wb") as fd:
+        fd.write(data)
+    for i in range(20 * scale):
+        ext = rng.choice(sorted(EXTENSIONS))
+        with gzip.GzipFile(os.path.join(archives, "src%d%s.gz" % (i, ext)), "wb", mtime=0) as fd:
+            fd.write(source_file(rng, ext, 300).encode())
+
+    blobs = os.path.join(out, "blobs")
+    os.mkdir(blobs)
+    for i in range(10 * scale):
+        with open(os.path.join(blobs, "blob%d.bin" % i), "wb") as fd:
+            fd.write(bytes(rng.getrandbits(8) for _ in range(rng.randint(1024, 256 * 1024))))
+
+    return files
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Generate the ag benchmark corpus.")
+    parser.add_argument("dir")
+    parser.add_argument("--seed", type=int, default=1)
+    parser.add_argument("--scale", type=int, default=1, help="multiplies the size of everything")
+    args = parser.parse_args()
+
+    params = {"version": VERSION, "seed": args.seed, "scale": args.scale}
+    stamp = os.path.join(args.dir, "corpus.json")
+    if os.path.exists(stamp):
+        with open(stamp) as fd:
+            if json.load(fd) == params:
+                return
+        shutil.rmtree(args.dir)
+    elif os.path.exists(args.dir):
+        print("%s exists and isn't a corpus. Not overwriting it." % args.dir)
+        return 1
+    files = generate(args.dir, args.seed, args.scale)
+    with open(stamp, "w") as fd:
+        json.dump(params, fd)
+    print("Generated %s (%d source files)" % (args.dir, files))
+
+
+if __name__ == "__main__":
+    sys.exit(main())
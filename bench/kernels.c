@@ -0,0 +1,745 @@
+/*
+ * Microbenchmarks for ag's search kernels. Run with `make bench`.
+ *
+ *   ag_bench [-s MB] [-r REPETITIONS] [FILTER]
+ *
+ * Every kernel scans the same generated buffers. A case is run once to warm
+ * up, then REPETITIONS times, and the median throughput is reported along
+ * with the fastest and slowest run. Only cases whose name contains FILTER
+ * are run. Buffers come from a fixed-seed PRNG, so runs are comparable
+ * across builds.
+ *
+ * Before is_binary() is timed, every is_binary kernel the CPU can run is
+ * checked against it on a few hundred thousand generated files.
+ */
+
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "config.h"
+#include "kernels.h"
+#include "litset.h"
+#include "util.h"
+#ifdef HAVE_PCRE2
+#include "pcre_api.h"
+#endif
+
+typedef struct {
+    const char *name;
+    const char *chars; /* Bytes are drawn from this, weighted by repetition */
+} alphabet_t;
+
+static const alphabet_t alphabets[] = {
+    /* Roughly English letter frequencies, with spaces, capitals and newlines */
+    { "text", "eeeeeeeeeeeetttttttttaaaaaaaaooooooooiiiiiiinnnnnnnssssssrrrrrrhhhhhhddddllllcccuuummmwwffggyyppbbvkjxqzETAOIN          \n" },
+    { "dna", "ACGT" },
+    { "ascii", " !\"#$%&'()*+,-./0123456789:;<=>?@ABCDEFGHIJKLMNOPQRSTUVWXYZ[\\]^_`abcdefghijklmnopqrstuvwxyz{|}~\n" },
+};
+
+/* Bytes between planted needles. 0 plants none. */
+static const size_t densities[] = { 0, 64 * 1024, 1024 };
+static const size_t needle_lens[] = { 3, 8, 16, 32, 64, 256, 1024 };
+#define MAX_NEEDLE_LEN 1024
+
+static size_t buf_len = 32 * 1024 * 1024;
+static int reps = 9;
+static const char *filter = NULL;
+
+static uint64_t rng_state = 0x9E3779B97F4A7C15ULL;
+
+static uint64_t rng(void) {
+    /* xorshift64* */
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return rng_state * 0x2545F4914F6CDD1DULL;
+}
+
+static void fill(char *buf, const size_t len, const alphabet_t *a) {
+    size_t chars_len = strlen(a->chars);
+    size_t i;
+    for (i = 0; i < len; i++) {
+        buf[i] = a->chars[rng() % chars_len];
+    }
+}
+
+static void plant(char *buf, const size_t len, const char *needle, const size_t needle_len, const size_t density) {
+    size_t pos;
+    if (density == 0) {
+        return;
+    }
+    for (pos = density / 2; pos + needle_len < len; pos += density) {
+        memcpy(buf + pos, needle, needle_len);
+    }
+}
+
+static const char *density_name(const size_t density) {
+    if (density == 0) {
+        return "none";
+    }
+    return density == 1024 ? "1k" : "64k";
+}
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int cmp_double(const void *a, const void *b) {
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+typedef size_t (*kernel_fn)(const char *buf, const size_t len, void *baton);
+
+static void run(const char *name, kernel_fn fn, const char *buf, const size_t len, void *baton) {
+    double *gbps;
+    size_t result;
+    int i;
+
+    if (filter && strstr(name, filter) == NULL) {
+        return;
+    }
+    gbps = ag_calloc(reps, sizeof(double));
+    result = fn(buf, len, baton);
+    for (i = 0; i < reps; i++) {
+        double start = now();
+        size_t r = fn(buf, len, baton);
+        double elapsed = now() - start;
+        if (r != result) {
+            die("%s: got %lu results, then %lu", name, (unsigned long)result, (unsigned long)r);
+        }
+        gbps[i] = len / elapsed / 1e9;
+    }
+    qsort(gbps, reps, sizeof(double), &cmp_double);
+    printf("%-44s %8.2f GB/s  (%.2f - %.2f)  %10lu results\n",
+           name, gbps[reps / 2], gbps[0], gbps[reps - 1], (unsigned long)result);
+    fflush(stdout);
+    free(gbps);
+}
+
+typedef enum {
+    SEARCH_STRNSTR,
+    SEARCH_HASH,
+    SEARCH_KERNEL,
+    SEARCH_TWO_WAY
+} search_t;
+
+typedef struct {
+    const char *needle;
+    size_t needle_len;
+    int case_sensitive;
+    size_t alpha_skip_lookup[UCHAR_MAX + 1];
+    size_t bad_char_skip_lookup[UCHAR_MAX + 1];
+    size_t *find_skip_lookup;
+    uint8_t *h_table;
+    two_way_t two_way;
+    search_t search;
+    strncmp_fp strnstr;
+    kernel_strnstr_fp kernel_strnstr;
+    int budgeted; /* Switch to Two-Way when the verify budget runs out, like find_matches() */
+} literal_t;
+
+static size_t bench_literal(const char *buf, const size_t len, void *baton) {
+    const literal_t *l = baton;
+    const size_t *lookup = (l->strnstr == &boyer_moore_strnstr || l->strnstr == &boyer_moore_strncasestr)
+                               ? l->alpha_skip_lookup
+                               : l->bad_char_skip_lookup;
+    search_t search = l->search;
+    size_t budget = l->budgeted ? VERIFY_BUDGET(len) : SIZE_MAX;
+    const char *p = buf;
+    const char *found;
+    size_t count = 0;
+
+    while (p <= buf + len) {
+        switch (search) {
+            case SEARCH_STRNSTR:
+                found = l->strnstr(p, l->needle, len - (p - buf), l->needle_len, lookup, l->find_skip_lookup, &budget);
+                break;
+            case SEARCH_HASH:
+                found = hash_strnstr(p, l->needle, len - (p - buf), l->needle_len, l->h_table, l->case_sensitive, &budget);
+                break;
+            case SEARCH_KERNEL:
+                found = l->kernel_strnstr(p, l->needle, len - (p - buf), l->needle_len, &budget);
+                break;
+            default:
+                found = two_way_strnstr(p, l->needle, len - (p - buf), l->needle_len, &l->two_way);
+                break;
+        }
+        if (found == NULL) {
+            if (budget > 0 || search == SEARCH_TWO_WAY) {
+                break;
+            }
+            search = SEARCH_TWO_WAY;
+            continue;
+        }
+        count++;
+        p = found + l->needle_len;
+    }
+    return count;
+}
+
+static const char *naive_strnstr(const char *s, const char *find, const size_t s_len, const size_t f_len, const int case_sensitive) {
+    size_t i;
+    size_t j;
+    for (i = 0; i + f_len <= s_len; i++) {
+        for (j = 0; j < f_len; j++) {
+            if ((case_sensitive ? s[i + j] : AG_FOLD(s[i + j])) != find[j]) {
+                break;
+            }
+        }
+        if (j == f_len) {
+            return s + i;
+        }
+    }
+    return NULL;
+}
+
+/* Differential test: two_way_strnstr must find the same matches as a naive search, mostly on periodic needles */
+static void check_two_way(char *buf) {
+    const size_t checks = 100000;
+    static const char *chars[] = { "ab", "aB", "abc", "aaab", "abcdefghijklmnopqrstuvwxyz" };
+    char needle[MAX_NEEDLE_LEN + 1];
+    two_way_t tw;
+    size_t n;
+
+    for (n = 0; n < checks; n++) {
+        const char *c = chars[rng() % (sizeof(chars) / sizeof(chars[0]))];
+        const size_t chars_len = strlen(c);
+        const size_t f_len = 2 + rng() % (rng() % 8 == 0 ? 600 : 40);
+        const size_t s_len = rng() % 2000;
+        const int case_sensitive = rng() % 2;
+        const size_t period = 1 + rng() % 8;
+        const char *expected;
+        const char *got;
+        size_t i;
+
+        /* Mostly repeat a short random prefix, then maybe break the pattern */
+        for (i = 0; i < f_len; i++) {
+            needle[i] = i < period ? c[rng() % chars_len] : needle[i - period];
+        }
+        if (rng() % 2) {
+            needle[rng() % f_len] = c[rng() % chars_len];
+        }
+        for (i = 0; i < s_len; i++) {
+            buf[i] = rng() % 4 ? needle[i % f_len] : c[rng() % chars_len];
+        }
+        if (!case_sensitive) {
+            for (i = 0; i < f_len; i++) {
+                needle[i] = AG_FOLD(needle[i]);
+            }
+        }
+
+        generate_two_way(needle, f_len, &tw, case_sensitive);
+        for (i = 0; i <= s_len; i++) {
+            expected = naive_strnstr(buf + i, needle, s_len - i, f_len, case_sensitive);
+            got = two_way_strnstr(buf + i, needle, s_len - i, f_len, &tw);
+            if (got != expected) {
+                die("two_way_strnstr found a match at %ld, not %ld, for %.*s",
+                    got ? (long)(got - buf) : -1L, expected ? (long)(expected - buf) : -1L, (int)f_len, needle);
+            }
+            if (expected == NULL) {
+                break;
+            }
+            i = expected - buf;
+        }
+    }
+    printf("two_way_strnstr agrees with a naive search on %lu generated needles\n", (unsigned long)checks);
+}
+
+static void bench_literals(const alphabet_t *a, char *buf) {
+    size_t i;
+    size_t j;
+    size_t k;
+    char name[128];
+    char needle[MAX_NEEDLE_LEN + 1];
+    literal_t l;
+    int level;
+
+    for (i = 0; i < sizeof(needle_lens) / sizeof(needle_lens[0]); i++) {
+        for (j = 0; j < sizeof(densities) / sizeof(densities[0]); j++) {
+            const size_t needle_len = needle_lens[i];
+            fill(needle, needle_len, a);
+            for (k = 0; k < needle_len; k++) {
+                if (needle[k] == '\n') {
+                    needle[k] = a->chars[0];
+                }
+            }
+            needle[needle_len] = '\0';
+            fill(buf, buf_len, a);
+            plant(buf, buf_len, needle, needle_len, densities[j]);
+
+            for (k = 0; k < 2; k++) {
+                const char *suffix = k ? "_case" : "";
+                char lower[MAX_NEEDLE_LEN + 1];
+                size_t n;
+
+                memset(&l, 0, sizeof(l));
+                l.case_sensitive = !k;
+                for (n = 0; n <= needle_len; n++) {
+                    lower[n] = l.case_sensitive ? needle[n] : (char)tolower((unsigned char)needle[n]);
+                }
+                l.needle = lower;
+                l.needle_len = needle_len;
+                generate_alpha_skip(l.needle, needle_len, l.alpha_skip_lookup, l.case_sensitive);
+                generate_bad_char_skip(l.needle, needle_len, l.bad_char_skip_lookup, l.case_sensitive);
+                generate_find_skip(l.needle, needle_len, &l.find_skip_lookup, l.case_sensitive);
+                l.h_table = ag_calloc(H_SIZE, sizeof(uint8_t));
+                generate_hash(l.needle, needle_len, l.h_table, l.case_sensitive);
+                generate_two_way(l.needle, needle_len, &l.two_way, l.case_sensitive);
+
+                snprintf(name, sizeof(name), "boyer_moore%s/%s/len%lu/%s", suffix, a->name, (unsigned long)needle_len, density_name(densities[j]));
+                l.search = SEARCH_STRNSTR;
+                l.strnstr = k ? &boyer_moore_strncasestr : &boyer_moore_strnstr;
+                run(name, &bench_literal, buf, buf_len, &l);
+
+                snprintf(name, sizeof(name), "horspool%s/%s/len%lu/%s", suffix, a->name, (unsigned long)needle_len, density_name(densities[j]));
+                l.strnstr = k ? &boyer_moore_horspool_strncasestr : &boyer_moore_horspool_strnstr;
+                run(name, &bench_literal, buf, buf_len, &l);
+
+/* hash_strnstr does unaligned loads, so ag only uses it on x86. Its offsets are a byte. */
+#if defined(__i386__) || defined(__x86_64__)
+                if (needle_len < UCHAR_MAX) {
+                    snprintf(name, sizeof(name), "hash%s/%s/len%lu/%s", suffix, a->name, (unsigned long)needle_len, density_name(densities[j]));
+                    l.search = SEARCH_HASH;
+                    run(name, &bench_literal, buf, buf_len, &l);
+                }
+#endif
+
+                snprintf(name, sizeof(name), "two_way%s/%s/len%lu/%s", suffix, a->name, (unsigned long)needle_len, density_name(densities[j]));
+                l.search = SEARCH_TWO_WAY;
+                run(name, &bench_literal, buf, buf_len, &l);
+
+                /* Every SIMD kernel this CPU can run, but not the same one twice */
+                for (level = KERNEL_SSE2; level < KERNEL_LEVEL_COUNT; level++) {
+                    ag_kernels kk;
+                    if (!kernels_level_supported(level)) {
+                        continue;
+                    }
+                    kernels_for_level(&kk, level);
+                    if ((k ? kk.strncasestr_level : kk.strnstr_level) != (kernel_level_t)level) {
+                        continue;
+                    }
+                    l.search = SEARCH_KERNEL;
+                    l.kernel_strnstr = k ? kk.strncasestr : kk.strnstr;
+                    snprintf(name, sizeof(name), "simd_%s%s/%s/len%lu/%s", kernel_level_name(level), suffix, a->name, (unsigned long)needle_len, density_name(densities[j]));
+                    run(name, &bench_literal, buf, buf_len, &l);
+                }
+
+                free(l.find_skip_lookup);
+                free(l.h_table);
+            }
+        }
+    }
+}
+
+/*
+ * A run of 'a's searched for needles that nearly match everywhere. Without
+ * the verify budget, Horspool, the hash search and the SIMD kernels do
+ * O(n * m) work on these. With it, they should switch to Two-Way and stay
+ * linear.
+ */
+static void bench_near_misses(char *buf) {
+    static const size_t halves[] = { 8, 64, 512 };
+    const size_t len = buf_len < 4 * 1024 * 1024 ? buf_len : 4 * 1024 * 1024;
+    char needle[2 * 512 + 2];
+    char name[128];
+    literal_t l;
+    size_t i;
+    int budgeted;
+    int level;
+
+    memset(buf, 'a', len);
+    for (i = 0; i < sizeof(halves) / sizeof(halves[0]); i++) {
+        const size_t half = halves[i];
+        /* a..aba..a for the first/last byte filters, and ba..a for Horspool */
+        const char *shapes[] = { "middle", "start" };
+        int shape;
+
+        for (shape = 0; shape < 2; shape++) {
+            memset(needle, 'a', 2 * half + 1);
+            needle[shape ? 0 : half] = 'b';
+            needle[2 * half + 1] = '\0';
+
+            memset(&l, 0, sizeof(l));
+            l.case_sensitive = TRUE;
+            l.needle = needle;
+            l.needle_len = 2 * half + 1;
+            generate_alpha_skip(l.needle, l.needle_len, l.alpha_skip_lookup, TRUE);
+            generate_bad_char_skip(l.needle, l.needle_len, l.bad_char_skip_lookup, TRUE);
+            generate_find_skip(l.needle, l.needle_len, &l.find_skip_lookup, TRUE);
+            l.h_table = ag_calloc(H_SIZE, sizeof(uint8_t));
+            generate_hash(l.needle, l.needle_len, l.h_table, TRUE);
+            generate_two_way(l.needle, l.needle_len, &l.two_way, TRUE);
+
+            /* Without the budget, only the short needles finish in reasonable time */
+            for (budgeted = half > 64; budgeted < 2; budgeted++) {
+                const char *mode = budgeted ? "budget" : "unbounded";
+                l.budgeted = budgeted;
+
+                snprintf(name, sizeof(name), "near_miss_%s/boyer_moore/len%lu/%s", shapes[shape], (unsigned long)l.needle_len, mode);
+                l.search = SEARCH_STRNSTR;
+                l.strnstr = &boyer_moore_strnstr;
+                run(name, &bench_literal, buf, len, &l);
+
+                snprintf(name, sizeof(name), "near_miss_%s/horspool/len%lu/%s", shapes[shape], (unsigned long)l.needle_len, mode);
+                l.strnstr = &boyer_moore_horspool_strnstr;
+                run(name, &bench_literal, buf, len, &l);
+
+#if defined(__i386__) || defined(__x86_64__)
+                if (l.needle_len < UCHAR_MAX) {
+                    snprintf(name, sizeof(name), "near_miss_%s/hash/len%lu/%s", shapes[shape], (unsigned long)l.needle_len, mode);
+                    l.search = SEARCH_HASH;
+                    run(name, &bench_literal, buf, len, &l);
+                }
+#endif
+
+                for (level = KERNEL_SSE2; level < KERNEL_LEVEL_COUNT; level++) {
+                    ag_kernels kk;
+                    if (!kernels_level_supported(level)) {
+                        continue;
+                    }
+                    kernels_for_level(&kk, level);
+                    if (kk.strnstr_level != (kernel_level_t)level) {
+                        continue;
+                    }
+                    snprintf(name, sizeof(name), "near_miss_%s/simd_%s/len%lu/%s", shapes[shape], kernel_level_name(level), (unsigned long)l.needle_len, mode);
+                    l.search = SEARCH_KERNEL;
+                    l.kernel_strnstr = kk.strnstr;
+                    run(name, &bench_literal, buf, len, &l);
+                }
+            }
+
+            snprintf(name, sizeof(name), "near_miss_%s/two_way/len%lu", shapes[shape], (unsigned long)l.needle_len);
+            l.search = SEARCH_TWO_WAY;
+            run(name, &bench_literal, buf, len, &l);
+
+            free(l.find_skip_lookup);
+            free(l.h_table);
+        }
+    }
+}
+
+/* is_binary() only looks at the start of a file, so it's run on every 4k block like a tree of small files */
+static size_t bench_is_binary(const char *buf, const size_t len, void *baton) {
+    size_t block = 4096;
+    size_t count = 0;
+    size_t pos;
+    (void)baton;
+
+    for (pos = 0; pos + block <= len; pos += block) {
+        count += is_binary(buf + pos, block);
+    }
+    return count;
+}
+
+static size_t bench_is_binary_kernel(const char *buf, const size_t len, void *baton) {
+    const ag_kernels *k = baton;
+    size_t block = 4096;
+    size_t count = 0;
+    size_t pos;
+
+    for (pos = 0; pos + block <= len; pos += block) {
+        count += k->is_binary(buf + pos, block);
+    }
+    return count;
+}
+
+/* Appends one character of the given kind. Returns how many bytes it took. */
+static size_t gen_char(char *out, const int kind) {
+    static const char *starts[] = { "%PDF-", "\xEF\xBB\xBF" };
+    size_t len;
+    size_t i;
+
+    switch (kind) {
+        case 0: /* Printable ASCII or whitespace */
+            out[0] = rng() % 8 == 0 ? "\t\n\r\b\v\f"[rng() % 6] : (char)(32 + rng() % 95);
+            return 1;
+        case 1: /* Suspicious control characters and DEL */
+            out[0] = (char)(rng() % 4 == 0 ? 127 : 1 + rng() % 31);
+            return 1;
+        case 2:
+            out[0] = '\0';
+            return 1;
+        case 3: /* A UTF-8 character of 2-4 bytes, the way is_binary() defines them */
+            len = 2 + rng() % 3;
+            out[0] = (char)(len == 2 ? 0xC2 + rng() % 30 : len == 3 ? 0xE0 + rng() % 16 : 0xF0 + rng() % 5);
+            for (i = 1; i < len; i++) {
+                out[i] = (char)(0x80 + rng() % 64);
+            }
+            return len;
+        case 4: /* Any byte >= 0x80 */
+            out[0] = (char)(0x80 + rng() % 128);
+            return 1;
+        default: /* Something is_binary() looks for at the start */
+            len = strlen(starts[kind % 2]);
+            memcpy(out, starts[kind % 2], len);
+            return len;
+    }
+}
+
+/* Differential test: every kernel must agree with is_binary() on every input */
+static void check_is_binary(char *buf) {
+    const size_t checks = 300000;
+    /* Percentages of ASCII, control, NUL and UTF-8 characters. The rest are random high bytes. */
+    static const int mixes[][4] = {
+        { 100, 0, 0, 0 }, { 97, 3, 0, 0 }, { 88, 12, 0, 0 }, { 90, 0, 0, 10 }, { 80, 5, 0, 15 },
+        { 50, 0, 0, 50 }, { 98, 0, 0, 1 }, { 95, 0, 1, 4 }, { 80, 10, 0, 9 }, { 20, 20, 20, 20 },
+    };
+    size_t n;
+    int level;
+
+    for (n = 0; n < checks; n++) {
+        const int *mix = mixes[rng() % (sizeof(mixes) / sizeof(mixes[0]))];
+        const size_t len = rng() % 700;
+        size_t pos = 0;
+        int expected;
+
+        if (rng() % 16 == 0) {
+            pos += gen_char(buf, 5 + rng() % 2);
+        }
+        while (pos < len + 4) {
+            const int r = (int)(rng() % 100);
+            int kind = 4;
+            if (r < mix[0]) {
+                kind = 0;
+            } else if (r < mix[0] + mix[1]) {
+                kind = 1;
+            } else if (r < mix[0] + mix[1] + mix[2]) {
+                kind = 2;
+            } else if (r < mix[0] + mix[1] + mix[2] + mix[3]) {
+                kind = 3;
+            }
+            pos += gen_char(buf + pos, kind);
+        }
+
+        expected = is_binary(buf, len);
+        for (level = KERNEL_GENERIC + 1; level < KERNEL_LEVEL_COUNT; level++) {
+            ag_kernels kk;
+            if (!kernels_level_supported(level)) {
+                continue;
+            }
+            kernels_for_level(&kk, level);
+            if (kk.is_binary(buf, len) != expected) {
+                size_t i;
+                fprintf(stderr, "is_binary returned %i but the %s kernel returned %i for:\n", expected, kernel_level_name(level), !expected);
+                for (i = 0; i < len; i++) {
+                    fprintf(stderr, "%02x%s", (unsigned char)buf[i], i % 32 == 31 ? "\n" : " ");
+                }
+                die("\nis_binary kernels disagree.");
+            }
+        }
+    }
+    printf("is_binary kernels agree on %lu generated files\n", (unsigned long)checks);
+}
+
+static size_t bench_count_newlines(const char *buf, const size_t len, void *baton) {
+    return ((const ag_kernels *)baton)->count_newlines(buf, len);
+}
+
+static size_t bench_buf_getline(const char *buf, const size_t len, void *baton) {
+    const char *line;
+    size_t pos = 0;
+    size_t count = 0;
+    (void)baton;
+
+    while (pos < len) {
+        pos += buf_getline(&line, buf, len, pos) + 1;
+        count++;
+    }
+    return count;
+}
+
+typedef struct {
+    match_t *matches;
+    match_t *scratch;
+    size_t matches_len;
+} invert_t;
+
+static size_t bench_invert_matches(const char *buf, const size_t len, void *baton) {
+    invert_t *inv = baton;
+    memcpy(inv->scratch, inv->matches, (inv->matches_len + 1) * sizeof(match_t));
+    return invert_matches(buf, len, inv->scratch, inv->matches_len);
+}
+
+typedef struct {
+#ifdef HAVE_PCRE2
+    ag_pcre_re_t *re;
+    ag_pcre_extra_t *re_extra;
+#else
+    pcre *re;
+    pcre_extra *re_extra;
+#endif
+} regex_bench_t;
+
+static size_t bench_pcre(const char *buf, const size_t len, void *baton) {
+    regex_bench_t *r = baton;
+    int offset_vector[3];
+    size_t offset = 0;
+    size_t count = 0;
+
+#ifdef HAVE_PCRE2
+    while (offset < len && ag_pcre_match(r->re, r->re_extra, buf, len, offset, 0, offset_vector, 3) >= 0) {
+#else
+    while (offset < len && pcre_exec(r->re, r->re_extra, buf, len, offset, 0, offset_vector, 3) >= 0) {
+#endif
+        count++;
+        offset = offset_vector[1] > offset_vector[0] ? (size_t)offset_vector[1] : (size_t)offset_vector[1] + 1;
+    }
+    return count;
+}
+
+static size_t bench_litset(const char *buf, const size_t len, void *baton) {
+    size_t offset = 0;
+    size_t count = 0;
+    size_t match_start;
+
+    while (litset_search(baton, buf, len, offset, &match_start, &offset)) {
+        count++;
+    }
+    return count;
+}
+
+#ifdef USE_PCRE_JIT
+#define REGEX_MODES 2
+#else
+#define REGEX_MODES 1
+#endif
+
+static void bench_misc(char *buf) {
+    static const char *patterns[] = { "[A-Z][a-z]+ing", "\\bthe\\b", "(foo|bar|baz)\\d+", "q[^u]", "foo|bar|baz", "the|and|that|with" };
+    /* The same as the last two regexes, for comparison */
+    static const char *literal_sets[] = { "foo|bar|baz", "the|and|that|with", "alpha|beta|gamma|delta|epsilon|zeta|eta|theta|iota|kappa|lambda|omicron" };
+    char name[128];
+    size_t i;
+    size_t j;
+    int level;
+
+    if (!filter || strstr("is_binary", filter) || strstr(filter, "is_binary")) {
+        check_is_binary(buf);
+    }
+    fill(buf, buf_len, &alphabets[0]);
+    run("is_binary/text", &bench_is_binary, buf, buf_len, NULL);
+    for (level = KERNEL_SSE2; level < KERNEL_LEVEL_COUNT; level++) {
+        ag_kernels kk;
+        kernels_for_level(&kk, level);
+        if (!kernels_level_supported(level) || kk.is_binary_level != (kernel_level_t)level) {
+            continue;
+        }
+        snprintf(name, sizeof(name), "is_binary_%s/text", kernel_level_name(level));
+        run(name, &bench_is_binary_kernel, buf, buf_len, &kk);
+    }
+    run("buf_getline/text", &bench_buf_getline, buf, buf_len, NULL);
+    for (level = KERNEL_GENERIC; level < KERNEL_LEVEL_COUNT; level++) {
+        ag_kernels kk;
+        kernels_for_level(&kk, level);
+        if (!kernels_level_supported(level) || kk.count_newlines_level != (kernel_level_t)level) {
+            continue;
+        }
+        snprintf(name, sizeof(name), "count_newlines_%s/text", kernel_level_name(level));
+        run(name, &bench_count_newlines, buf, buf_len, &kk);
+    }
+
+    for (j = 1; j < sizeof(densities) / sizeof(densities[0]); j++) {
+        invert_t inv;
+        size_t pos;
+        inv.matches_len = 0;
+        inv.matches = ag_calloc(buf_len / densities[j] + 2, sizeof(match_t));
+        inv.scratch = ag_calloc(buf_len / densities[j] + 2, sizeof(match_t));
+        for (pos = densities[j] / 2; pos + 8 < buf_len; pos += densities[j]) {
+            inv.matches[inv.matches_len].start = pos;
+            inv.matches[inv.matches_len].end = pos + 8;
+            inv.matches_len++;
+        }
+        snprintf(name, sizeof(name), "invert_matches/text/%s", density_name(densities[j]));
+        run(name, &bench_invert_matches, buf, buf_len, &inv);
+        free(inv.matches);
+        free(inv.scratch);
+    }
+
+    for (i = 0; i < sizeof(patterns) / sizeof(patterns[0]); i++) {
+        /* With and without the JIT */
+        for (j = 0; j < REGEX_MODES; j++) {
+            regex_bench_t r;
+            char *q = ag_strdup(patterns[i]);
+#ifdef HAVE_PCRE2
+            ag_pcre_compile(&r.re, &r.re_extra, q, AG_PCRE_MULTILINE, j);
+#elif defined(USE_PCRE_JIT)
+            compile_study(&r.re, &r.re_extra, q, PCRE_MULTILINE, j ? PCRE_STUDY_JIT_COMPILE : 0);
+#else
+            compile_study(&r.re, &r.re_extra, q, PCRE_MULTILINE, 0);
+#endif
+            snprintf(name, sizeof(name), "pcre%s/text/%s", j ? "_jit" : "", patterns[i]);
+            run(name, &bench_pcre, buf, buf_len, &r);
+#ifdef HAVE_PCRE2
+            ag_pcre_free_re(&r.re);
+            ag_pcre_free_extra(&r.re_extra);
+#else
+            pcre_free(r.re);
+            pcre_free_study(r.re_extra);
+#endif
+            free(q);
+        }
+    }
+
+    for (i = 0; i < sizeof(literal_sets) / sizeof(literal_sets[0]); i++) {
+        litset_t *ls = litset_compile(literal_sets[i], FALSE, FALSE);
+        const ag_kernels saved = kernels;
+        for (level = KERNEL_GENERIC; level < KERNEL_LEVEL_COUNT; level++) {
+            kernels_for_level(&kernels, level);
+            if (!kernels_level_supported(level) || kernels.litset_level != (kernel_level_t)level) {
+                continue;
+            }
+            snprintf(name, sizeof(name), "litset_%s/text/%s", kernel_level_name(level), literal_sets[i]);
+            run(name, &bench_litset, buf, buf_len, ls);
+        }
+        kernels = saved;
+        litset_free(ls);
+    }
+}
+
+int main(int argc, char **argv) {
+    char *buf;
+    size_t i;
+    int ch;
+
+    set_log_level(LOG_LEVEL_WARN);
+    while ((ch = getopt(argc, argv, "s:r:")) != -1) {
+        switch (ch) {
+            case 's':
+                buf_len = (size_t)atol(optarg) * 1024 * 1024;
+                break;
+            case 'r':
+                reps = atoi(optarg);
+                break;
+            default:
+                fprintf(stderr, "Usage: %s [-s MB] [-r REPETITIONS] [FILTER]\n", argv[0]);
+                return 1;
+        }
+    }
+    if (optind < argc) {
+        filter = argv[optind];
+    }
+    if (buf_len == 0 || reps < 1) {
+        die("Buffer size and repetitions must be positive.");
+    }
+
+    printf("%lu MB buffers, median of %i runs\n", (unsigned long)(buf_len / 1024 / 1024), reps);
+    buf = ag_malloc(buf_len);
+    if (!filter || strstr("two_way", filter) || strstr(filter, "two_way")) {
+        check_two_way(buf);
+    }
+    for (i = 0; i < sizeof(alphabets) / sizeof(alphabets[0]); i++) {
+        bench_literals(&alphabets[i], buf);
+    }
+    bench_near_misses(buf);
+    bench_misc(buf);
+    free(buf);
+    return 0;
+}
@@ -0,0 +1,120 @@
+#!/usr/bin/env python3
+
+# Time ag over a fixed matrix of queries and options on the corpus from
+# gen_corpus.py, and compare the results against a stored baseline.
+#
+# Each case runs --runs times after a warm-up run. The median wall time is
+# compared with the baseline's, and a case counts as a regression if it's
+# more than --threshold slower and the difference is over the noise floor.
+# Exits 1 if any case regressed. If there's no baseline yet, this run is
+# saved as the baseline.
+
+import argparse
+import json
+import os
+import resource
+import subprocess
+import sys
+import time
+
+# (name, ag arguments, file fed to stdin or None)
+CASES = [
+    ("literal", ["TODO", "src"], None),
+    ("literal_no_match", ["zzqxjv", "."], None),
+    ("literal_logs", ["-Q", "request_id=0000", "logs"], None),
+    ("ignore_case", ["-i", "error", "logs"], None),
+    ("word", ["-w", "match", "src"], None),
+    ("regex", ["took \\d{4}ms", "logs"], None),
+    ("regex_alternation", ["(walker|parser|lexer)_(cache|queue)", "src"], None),
+    ("context", ["-C", "2", "FIXME", "src"], None),
+    ("count", ["-c", "INFO", "logs"], None),
+    ("files_with_matches", ["-l", "queue", "src"], None),
+    ("file_search_regex", ["-G", "\\.c$", "static", "src"], None),
+    ("unrestricted", ["-u", "thread", "src"], None),
+    ("search_binary", ["--search-binary", "-c", "abc", "blobs"], None),
+    ("search_zip", ["-z", "walker", "archives"], None),
+    ("multiline", ["static int [a-z_]+\\([^)]*\\) \\{\\n    return", "src"], None),
+    ("stream", ["ERROR"], os.path.join("logs", "app1.log")),
+]
+
+
+def run_case(ag, corpus, args, stdin_path):
+    stdin = open(os.path.join(corpus, stdin_path), "rb") if stdin_path else subprocess.DEVNULL
+    before = resource.getrusage(resource.RUSAGE_CHILDREN)
+    start = time.perf_counter()
+    rc = subprocess.call([ag, "--nocolor", "--noaffinity"] + args, cwd=corpus,
+                         stdin=stdin, stdout=subprocess.DEVNULL)
+    wall = time.perf_counter() - start
+    after = resource.getrusage(resource.RUSAGE_CHILDREN)
+    if stdin_path:
+        stdin.close()
+    if rc not in (0, 1):
+        raise RuntimeError("ag %s exited with %d" % (" ".join(args), rc))
+    cpu = (after.ru_utime - before.ru_utime) + (after.ru_stime - before.ru_stime)
+    return wall, cpu
+
+
+def median(values):
+    values = sorted(values)
+    return values[len(values) // 2]
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Run ag's end-to-end benchmarks.")
+    parser.add_argument("--ag", default="./ag")
+    parser.add_argument("--corpus", required=True)
+    parser.add_argument("--runs", type=int, default=5)
+    parser.add_argument("--baseline", default="bench_baseline.json")
+    parser.add_argument("--save-baseline", action="store_true", help="replace the baseline with this run")
+    parser.add_argument("--no-baseline", action="store_true", help="don't read or write a baseline (e.g. for PGO training)")
+    parser.add_argument("--threshold", type=float, default=0.10, help="allowed slowdown (default 0.10)")
+    parser.add_argument("--noise", type=float, default=0.005, help="ignore differences under this many seconds")
+    parser.add_argument("filter", nargs="?", help="only run cases whose name contains this")
+    args = parser.parse_args()
+
+    ag = os.path.abspath(args.ag)
+    baseline = {}
+    if os.path.exists(args.baseline) and not args.save_baseline and not args.no_baseline:
+        with open(args.baseline) as fd:
+            baseline = json.load(fd)["cases"]
+
+    results = {}
+    regressions = []
+    print("%-20s %10s %10s %10s %8s" % ("case", "wall s", "cpu s", "baseline", "change"))
+    for name, ag_args, stdin_path in CASES:
+        if args.filter and args.filter not in name:
+            continue
+        run_case(ag, args.corpus, ag_args, stdin_path)
+        runs = [run_case(ag, args.corpus, ag_args, stdin_path) for _ in range(args.runs)]
+        wall = median([r[0] for r in runs])
+        cpu = median([r[1] for r in runs])
+        results[name] = {"wall": wall, "cpu": cpu}
+
+        line = "%-20s %10.4f %10.4f" % (name, wall, cpu)
+        if name in baseline:
+            base = baseline[name]["wall"]
+            change = wall / base - 1 if base > 0 else 0
+            line += " %10.4f %+7.1f%%" % (base, change * 100)
+            if change > args.threshold and wall - base > args.noise:
+                line += "  REGRESSION"
+                regressions.append(name)
+        print(line)
+        sys.stdout.flush()
+
+    if args.no_baseline:
+        return 0
+    if not baseline:
+        with open(args.baseline, "w") as fd:
+            json.dump({"ag": ag, "runs": args.runs, "cases": results}, fd, indent=2, sort_keys=True)
+        print("Saved baseline to %s" % args.baseline)
+        return 0
+
+    if regressions:
+        print("%d case(s) more than %.0f%% slower than %s: %s" %
+              (len(regressions), args.threshold * 100, args.baseline, ", ".join(regressions)))
+        return 1
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
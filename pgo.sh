@@ -1,10 +1,81 @@
 #!/bin/sh
 
+# Build ag with profile-guided optimization.
+#
+#   ./pgo.sh [CONFIGURE ARGS...]
+#
+# The profile is trained on every workload in bench/run_bench.py (literal,
+# regex, -i, -w, context, -z, multiline, stdin, ...) over the corpus from
+# bench/gen_corpus.py. With gcc, the counts from every run accumulate in the
+# .gcda files. With clang, each run writes its own .profraw and they're
+# merged with llvm-profdata.
+#
+# Set BOLT=1 to also optimize the layout of the PGO binary with llvm-bolt,
+# trained on the same workloads (needs llvm-bolt and merge-fdata).
+#
+# A plain build is timed first and saved to pgo_before.json. The final
+# binary is then timed and compared against it.
+
 set -e
 cd "$(dirname "$0")"
 
+CORPUS=${BENCH_CORPUS:-bench_corpus}
+# configure only adds -O2 when CFLAGS is empty, and we always pass some
+CFLAGS=${CFLAGS:--O2}
+PROFILE_DIR="$(pwd)/pgo_data"
+
+train() {
+    python3 bench/run_bench.py --ag "$1" --corpus "$CORPUS" --runs 1 --no-baseline >/dev/null
+}
+
+python3 bench/gen_corpus.py "$CORPUS"
+rm -rf "$PROFILE_DIR"
+mkdir -p "$PROFILE_DIR"
+find . -name '*.gcda' -exec rm -f {} +
+
+if ${CC:-cc} --version 2>/dev/null | grep -q clang; then
+    GEN_FLAGS="-fprofile-instr-generate"
+    USE_FLAGS="-fprofile-instr-use=$PROFILE_DIR/ag.profdata"
+else
+    GEN_FLAGS="-fprofile-generate"
+    USE_FLAGS="-fprofile-correction -fprofile-use"
+fi
+if [ -n "$BOLT" ]; then
+    # BOLT needs relocations to move functions around
+    LDFLAGS="$LDFLAGS -Wl,--emit-relocs"
+    export LDFLAGS
+fi
+
+echo "Timing a build without PGO"
+make clean >/dev/null 2>&1 || true
+./build.sh "$@" CFLAGS="$CFLAGS"
+python3 bench/run_bench.py --ag ./ag --corpus "$CORPUS" --baseline pgo_before.json --save-baseline
+
+echo "Training"
 make clean
-./build.sh CFLAGS="$CFLAGS -fprofile-generate"
-./ag example ..
+./build.sh "$@" CFLAGS="$CFLAGS $GEN_FLAGS"
+LLVM_PROFILE_FILE="$PROFILE_DIR/ag-%p.profraw"
+export LLVM_PROFILE_FILE
+train ./ag
+unset LLVM_PROFILE_FILE
+if [ -n "$(ls "$PROFILE_DIR"/*.profraw 2>/dev/null)" ]; then
+    llvm-profdata merge -output="$PROFILE_DIR/ag.profdata" "$PROFILE_DIR"/*.profraw
+fi
+
 make clean
-./build.sh CFLAGS="$CFLAGS -fprofile-correction -fprofile-use"
+./build.sh "$@" CFLAGS="$CFLAGS $USE_FLAGS"
+
+if [ -n "$BOLT" ]; then
+    echo "Training BOLT"
+    llvm-bolt ag -instrument -o ag.bolt-instrumented \
+        -instrumentation-file="$PROFILE_DIR/ag.fdata" -instrumentation-file-append-pid
+    train ./ag.bolt-instrumented
+    merge-fdata "$PROFILE_DIR"/ag.fdata.* > "$PROFILE_DIR/ag.fdata"
+    llvm-bolt ag -o ag.bolt -data="$PROFILE_DIR/ag.fdata" \
+        -reorder-blocks=ext-tsp -reorder-functions=hfsort -split-functions -split-all-cold -icf=1
+    mv ag.bolt ag
+    rm -f ag.bolt-instrumented
+fi
+
+echo "Comparing against the build without PGO"
+python3 bench/run_bench.py --ag ./ag --corpus "$CORPUS" --baseline pgo_before.json || true
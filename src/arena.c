@@ -0,0 +1,121 @@
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "arena.h"
+#include "stats.h"
+#include "util.h"
+
+/* Everything handed out is aligned to this */
+#define ARENA_ALIGN 16
+#define ARENA_ROUND(n) (((n) + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1))
+
+typedef struct arena_block {
+    struct arena_block *prev; /* Filled up before this one */
+    size_t size;
+    size_t used;
+} arena_block_t;
+
+#define ARENA_HEADER ARENA_ROUND(sizeof(arena_block_t))
+#define BLOCK_DATA(b) ((char *)(b) + ARENA_HEADER)
+
+static __thread arena_block_t *block = NULL;
+/* Bytes handed out since the last reset, in every block */
+static __thread size_t arena_used = 0;
+
+void *arena_alloc(const size_t size) {
+    const size_t rounded = ARENA_ROUND(size);
+    void *ptr;
+
+    if (block == NULL || block->size - block->used < rounded) {
+        /* Each block is at least twice the last, so a growing array only gets copied a few times */
+        size_t block_size = block ? block->size * 2 : ARENA_BLOCK_SIZE;
+        arena_block_t *b;
+        if (block_size < rounded) {
+            block_size = rounded;
+        }
+        b = ag_malloc(ARENA_HEADER + block_size);
+        b->prev = block;
+        b->size = block_size;
+        b->used = 0;
+        block = b;
+    }
+    ptr = BLOCK_DATA(block) + block->used;
+    block->used += rounded;
+    arena_used += rounded;
+    return ptr;
+}
+
+void *arena_grow(void *ptr, const size_t old_size, const size_t new_size) {
+    const size_t old_rounded = ARENA_ROUND(old_size);
+    const size_t new_rounded = ARENA_ROUND(new_size);
+    void *new_ptr;
+
+    if (ptr == NULL) {
+        return arena_alloc(new_size);
+    }
+    if ((char *)ptr + old_rounded == BLOCK_DATA(block) + block->used &&
+        block->size - block->used + old_rounded >= new_rounded) {
+        block->used = block->used - old_rounded + new_rounded;
+        arena_used = arena_used - old_rounded + new_rounded;
+        return ptr;
+    }
+    new_ptr = arena_alloc(new_size);
+    memcpy(new_ptr, ptr, old_size < new_size ? old_size : new_size);
+    return new_ptr;
+}
+
+char *arena_sprintf(const char *fmt, ...) {
+    va_list args;
+    int len;
+    char *str;
+
+    va_start(args, fmt);
+    len = vsnprintf(NULL, 0, fmt, args);
+    va_end(args);
+    if (len < 0) {
+        die("vsnprintf failed");
+    }
+    str = arena_alloc(len + 1);
+    va_start(args, fmt);
+    vsnprintf(str, len + 1, fmt, args);
+    va_end(args);
+    return str;
+}
+
+void arena_reset(void) {
+    ag_stats *thread_stats = stats_thread();
+    arena_block_t *b;
+
+    if (thread_stats && arena_used > thread_stats->arena_peak) {
+        thread_stats->arena_peak = arena_used;
+    }
+    if (block == NULL) {
+        return;
+    }
+    /* The newest block is the biggest, so the next file will probably fit in it alone */
+    while (block->prev) {
+        b = block->prev;
+        block->prev = b->prev;
+        free(b);
+    }
+    if (block->size > ARENA_KEEP_SIZE) {
+        free(block);
+        block = NULL;
+    } else {
+        block->used = 0;
+    }
+    arena_used = 0;
+}
+
+void arena_thread_cleanup(void) {
+    arena_block_t *b;
+
+    while (block) {
+        b = block->prev;
+        free(block);
+        block = b;
+    }
+    arena_used = 0;
+}
@@ -0,0 +1,27 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+
+/*
+ * Scratch memory for whatever only lives as long as one search_buf() call:
+ * match arrays and the paths printed with --queries. Each thread bumps
+ * through its own blocks, so there's no allocator lock to fight over, and
+ * arena_reset() hands it all back at once. The blocks are kept for the next
+ * file, up to ARENA_KEEP_SIZE, so a huge file doesn't pin its memory.
+ */
+
+#define ARENA_BLOCK_SIZE (64 * 1024)
+#define ARENA_KEEP_SIZE (1024 * 1024)
+
+void *arena_alloc(const size_t size);
+/* Like realloc. Grows in place if ptr was the last thing allocated. */
+void *arena_grow(void *ptr, const size_t old_size, const size_t new_size);
+char *arena_sprintf(const char *fmt, ...);
+
+/* Frees everything the calling thread allocated, and records its peak for --stats */
+void arena_reset(void);
+/* Frees the calling thread's blocks */
+void arena_thread_cleanup(void);
+
+#endif
@@ -0,0 +1,1389 @@
+#include <ctype.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "dfa.h"
+#include "kernels.h"
+#include "uthash.h"
+#include "util.h"
+
+/* Past these, the pattern is left to PCRE */
+#define DFA_MAX_NFA_NODES 10000
+#define DFA_MAX_REPEAT 1000
+#define DFA_MAX_DEPTH 250
+
+/* Give up if the cache filled up again in fewer bytes than this per state */
+#define DFA_MIN_BYTES_PER_STATE 10
+
+/* A prefix of a required literal is still required, so longer ones are cut short */
+#define DFA_MAX_LITERAL 64
+/* Without a literal of two bytes or more, look for the bytes matches start with if there are at most this many */
+#define DFA_MAX_FIRST_BYTES 16
+/* How far to follow a match starting at a candidate before looking for any match instead */
+#define DFA_ANCHORED_LIMIT 1024
+
+#define DFA_RAN_OUT ((size_t)-3)
+
+typedef struct {
+    uint64_t bits[4];
+} byte_set_t;
+
+enum {
+    AST_EMPTY,
+    AST_SET,
+    AST_ASSERT,
+    AST_CONCAT,
+    AST_ALT,
+    AST_REPEAT
+};
+
+enum {
+    ASSERT_BOL,
+    ASSERT_EOL,
+    ASSERT_WORD_BOUNDARY,
+    ASSERT_NOT_WORD_BOUNDARY
+};
+
+enum {
+    NFA_MATCH,
+    NFA_SET,
+    NFA_ASSERT,
+    NFA_SPLIT
+};
+
+/* What the previous byte was. The start of the buffer counts as a newline. */
+#define PREV_WORD 1
+#define PREV_NEWLINE 2
+
+/* Transitions that aren't the row of another state */
+#define TRANS_UNKNOWN -1
+#define TRANS_MATCH -2
+#define TRANS_DEAD -3
+#define TRANS_GAVE_UP -4
+
+/* parse_escape() returns one of these or the assertion */
+#define ESCAPE_SET -1
+#define ESCAPE_UNSUPPORTED -2
+
+typedef struct ast {
+    int type;
+    int assertion;
+    int min;
+    int max; /* -1 for no limit */
+    byte_set_t set;
+    struct ast *left;
+    struct ast *right;
+} ast_t;
+
+typedef struct {
+    const char *p;
+    int caseless;
+    int depth;
+    /* Every node allocated, so they can all be freed at the end */
+    ast_t **nodes;
+    size_t nodes_len;
+    size_t nodes_size;
+} parser_t;
+
+typedef struct {
+    int type;
+    int arg; /* Index into sets, or the assertion */
+    int out;
+    int out1; /* Only for NFA_SPLIT */
+} nfa_node_t;
+
+struct dfa {
+    size_t id;            /* Index into each thread's caches */
+    unsigned long serial; /* Tells apart DFAs that got the same id */
+    nfa_node_t *nodes;
+    int nodes_len;
+    size_t nodes_size;
+    byte_set_t *sets;
+    int sets_len;
+    size_t sets_size;
+    int start;
+    int anchored_start;
+    int flags_mask; /* The PREV_ flags any assertion looks at */
+    int can_match_newline;
+    unsigned char classes[256];
+    int classes_len; /* The end of the buffer is class classes_len */
+    int class_bytes[256];
+    /* Bytes every match contains, found with the literal search before running the DFA */
+    char literal[DFA_MAX_LITERAL];
+    size_t literal_len;
+    int literal_caseless; /* literal is lowercase */
+    int literal_is_prefix; /* Matches start with literal, so the DFA can start there */
+    two_way_t *two_way;
+    /* Or the bytes every match starts with */
+    int use_first_bytes;
+    unsigned char first_bytes[256];
+};
+
+typedef struct {
+    int *key; /* The PREV_ flags, then the state's NFA nodes in order */
+    size_t key_len;
+    int row;
+    UT_hash_handle hh;
+} dfa_state_t;
+
+typedef struct {
+    unsigned long serial;
+    int stride; /* Transitions per row: each byte class, then the end of the buffer */
+    int *table;
+    dfa_state_t **states; /* By row */
+    size_t states_len;
+    size_t states_size;
+    dfa_state_t *by_key;
+    int start[8]; /* By PREV_ flags, and 4 if anchored */
+    size_t mem;
+    size_t scanned; /* Bytes searched since the last flush */
+    size_t flushes;
+    /* Scratch space for building states */
+    unsigned int *seen;
+    unsigned int seen_gen;
+    int *stack;
+    int *list;
+    int *key;
+} dfa_cache_t;
+
+static __thread dfa_cache_t **thread_caches = NULL;
+static __thread size_t thread_caches_len = 0;
+
+static size_t dfa_ids_used = 0;
+static size_t dfa_live = 0;
+static unsigned long dfa_serial = 0;
+
+static inline int set_has(const byte_set_t *set, const int c) {
+    return (set->bits[c >> 6] >> (c & 63)) & 1;
+}
+
+static void set_add(byte_set_t *set, const int c) {
+    set->bits[c >> 6] |= (uint64_t)1 << (c & 63);
+}
+
+static void set_add_range(byte_set_t *set, int lo, const int hi) {
+    for (; lo <= hi; lo++) {
+        set_add(set, lo);
+    }
+}
+
+static void set_negate(byte_set_t *set) {
+    int i;
+    for (i = 0; i < 4; i++) {
+        set->bits[i] = ~set->bits[i];
+    }
+}
+
+static void set_union(byte_set_t *set, const byte_set_t *other) {
+    int i;
+    for (i = 0; i < 4; i++) {
+        set->bits[i] |= other->bits[i];
+    }
+}
+
+static int set_count(const byte_set_t *set) {
+    int c, count = 0;
+    for (c = 0; c < 256; c++) {
+        count += set_has(set, c);
+    }
+    return count;
+}
+
+static void set_fold_case(byte_set_t *set) {
+    int c;
+    for (c = 'a'; c <= 'z'; c++) {
+        if (set_has(set, c) || set_has(set, c - 'a' + 'A')) {
+            set_add(set, c);
+            set_add(set, c - 'a' + 'A');
+        }
+    }
+}
+
+/* PCRE's default character tables only have ASCII word characters */
+static int is_word_byte(const int c) {
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '_';
+}
+
+static void set_add_word(byte_set_t *set) {
+    set_add_range(set, 'a', 'z');
+    set_add_range(set, 'A', 'Z');
+    set_add_range(set, '0', '9');
+    set_add(set, '_');
+}
+
+/* Adds \d, \D, \w, \W, \s or \S */
+static void set_add_escape_class(byte_set_t *set, const int c) {
+    byte_set_t class;
+
+    memset(&class, 0, sizeof(class));
+    switch (c) {
+        case 'd':
+        case 'D':
+            set_add_range(&class, '0', '9');
+            break;
+        case 'w':
+        case 'W':
+            set_add_word(&class);
+            break;
+        default:
+            set_add(&class, ' ');
+            set_add_range(&class, '\t', '\r');
+            /* Whether \s matches \v depends on the PCRE version. Let both \s and \S match it. */
+            if (c == 'S') {
+                set_negate(&class);
+                set_add(&class, '\v');
+                set_union(set, &class);
+                return;
+            }
+            break;
+    }
+    if (isupper(c)) {
+        set_negate(&class);
+    }
+    set_union(set, &class);
+}
+
+static ast_t *new_node(parser_t *ps, const int type, ast_t *left, ast_t *right) {
+    ast_t *node = ag_calloc(1, sizeof(ast_t));
+    if (ps->nodes_len == ps->nodes_size) {
+        ps->nodes_size = ps->nodes_size ? ps->nodes_size * 2 : 64;
+        ps->nodes = ag_realloc(ps->nodes, ps->nodes_size * sizeof(ast_t *));
+    }
+    ps->nodes[ps->nodes_len++] = node;
+    node->type = type;
+    node->left = left;
+    node->right = right;
+    return node;
+}
+
+static int hex_value(const int c) {
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    }
+    return tolower(c) - 'a' + 10;
+}
+
+/* Parses what follows a backslash. Returns ESCAPE_SET after adding it to set, an assertion, or ESCAPE_UNSUPPORTED. */
+static int parse_escape(parser_t *ps, byte_set_t *set, const int in_class) {
+    const int c = (unsigned char)*ps->p;
+    int value = 0;
+    int digits = 0;
+
+    if (c == '\0') {
+        return ESCAPE_UNSUPPORTED;
+    }
+    ps->p++;
+    switch (c) {
+        case 'd':
+        case 'D':
+        case 'w':
+        case 'W':
+        case 's':
+        case 'S':
+            set_add_escape_class(set, c);
+            return ESCAPE_SET;
+        case 'b':
+            if (in_class) {
+                set_add(set, '\b');
+                return ESCAPE_SET;
+            }
+            return ASSERT_WORD_BOUNDARY;
+        case 'B':
+            return in_class ? ESCAPE_UNSUPPORTED : ASSERT_NOT_WORD_BOUNDARY;
+        case 't':
+            set_add(set, '\t');
+            return ESCAPE_SET;
+        case 'n':
+            set_add(set, '\n');
+            return ESCAPE_SET;
+        case 'r':
+            set_add(set, '\r');
+            return ESCAPE_SET;
+        case 'f':
+            set_add(set, '\f');
+            return ESCAPE_SET;
+        case 'a':
+            set_add(set, '\a');
+            return ESCAPE_SET;
+        case 'e':
+            set_add(set, 27);
+            return ESCAPE_SET;
+        case 'x':
+            if (*ps->p == '{') {
+                for (ps->p++; isxdigit((unsigned char)*ps->p); ps->p++, digits++) {
+                    value = value * 16 + hex_value((unsigned char)*ps->p);
+                    if (value > UCHAR_MAX) {
+                        return ESCAPE_UNSUPPORTED;
+                    }
+                }
+                if (*ps->p != '}' || digits == 0) {
+                    return ESCAPE_UNSUPPORTED;
+                }
+                ps->p++;
+            } else {
+                for (; digits < 2 && isxdigit((unsigned char)*ps->p); ps->p++, digits++) {
+                    value = value * 16 + hex_value((unsigned char)*ps->p);
+                }
+            }
+            set_add(set, value);
+            return ESCAPE_SET;
+        default:
+            /* Other letters and digits are backrefs, \Q, \p, \A, \K, ... */
+            if (isalnum(c)) {
+                return ESCAPE_UNSUPPORTED;
+            }
+            set_add(set, c);
+            return ESCAPE_SET;
+    }
+}
+
+/* Parses [:name:] or [:^name:] inside a class */
+static int parse_posix_class(parser_t *ps, byte_set_t *set) {
+    const char *name = ps->p + 2;
+    const char *end;
+    byte_set_t class;
+    int negate = FALSE;
+    size_t len;
+
+    if (ps->p[1] != ':') {
+        /* [.x.] and [=x=] */
+        return FALSE;
+    }
+    if (*name == '^') {
+        negate = TRUE;
+        name++;
+    }
+    end = strstr(name, ":]");
+    if (!end) {
+        return FALSE;
+    }
+    len = end - name;
+
+    memset(&class, 0, sizeof(class));
+#define POSIX_CLASS_IS(n) (len == strlen(n) && strncmp(name, n, len) == 0)
+    if (POSIX_CLASS_IS("alpha")) {
+        set_add_range(&class, 'a', 'z');
+        set_add_range(&class, 'A', 'Z');
+    } else if (POSIX_CLASS_IS("digit")) {
+        set_add_range(&class, '0', '9');
+    } else if (POSIX_CLASS_IS("alnum")) {
+        set_add_range(&class, 'a', 'z');
+        set_add_range(&class, 'A', 'Z');
+        set_add_range(&class, '0', '9');
+    } else if (POSIX_CLASS_IS("upper")) {
+        set_add_range(&class, 'A', 'Z');
+    } else if (POSIX_CLASS_IS("lower")) {
+        set_add_range(&class, 'a', 'z');
+    } else if (POSIX_CLASS_IS("space")) {
+        set_add(&class, ' ');
+        set_add_range(&class, '\t', '\r');
+    } else if (POSIX_CLASS_IS("blank")) {
+        set_add(&class, ' ');
+        set_add(&class, '\t');
+    } else if (POSIX_CLASS_IS("punct")) {
+        set_add_range(&class, '!', '/');
+        set_add_range(&class, ':', '@');
+        set_add_range(&class, '[', '`');
+        set_add_range(&class, '{', '~');
+    } else if (POSIX_CLASS_IS("xdigit")) {
+        set_add_range(&class, '0', '9');
+        set_add_range(&class, 'a', 'f');
+        set_add_range(&class, 'A', 'F');
+    } else if (POSIX_CLASS_IS("word")) {
+        set_add_word(&class);
+    } else if (POSIX_CLASS_IS("cntrl")) {
+        set_add_range(&class, 0, 31);
+        set_add(&class, 127);
+    } else if (POSIX_CLASS_IS("print")) {
+        set_add_range(&class, ' ', '~');
+    } else if (POSIX_CLASS_IS("graph")) {
+        set_add_range(&class, '!', '~');
+    } else if (POSIX_CLASS_IS("ascii")) {
+        set_add_range(&class, 0, 127);
+    } else {
+        return FALSE;
+    }
+#undef POSIX_CLASS_IS
+
+    if (negate) {
+        set_negate(&class);
+    }
+    set_union(set, &class);
+    ps->p = end + 2;
+    return TRUE;
+}
+
+/* Returns a single byte in a class, or ESCAPE_SET after adding a class like \d to set */
+static int parse_class_byte(parser_t *ps, byte_set_t *set) {
+    byte_set_t escape;
+    int c;
+
+    if (*ps->p != '\\') {
+        return (unsigned char)*ps->p++;
+    }
+    ps->p++;
+    memset(&escape, 0, sizeof(escape));
+    if (parse_escape(ps, &escape, TRUE) != ESCAPE_SET) {
+        return ESCAPE_UNSUPPORTED;
+    }
+    if (set_count(&escape) == 1) {
+        for (c = 0; !set_has(&escape, c); c++) {
+        }
+        return c;
+    }
+    set_union(set, &escape);
+    return ESCAPE_SET;
+}
+
+static ast_t *parse_class(parser_t *ps) {
+    ast_t *node = new_node(ps, AST_SET, NULL, NULL);
+    int negate = FALSE;
+    int first = TRUE;
+    int lo, hi;
+
+    if (*ps->p == '^') {
+        negate = TRUE;
+        ps->p++;
+    }
+    for (;;) {
+        if (*ps->p == '\0') {
+            return NULL;
+        }
+        if (*ps->p == ']' && !first) {
+            ps->p++;
+            break;
+        }
+        first = FALSE;
+
+        if (*ps->p == '[' && (ps->p[1] == ':' || ps->p[1] == '.' || ps->p[1] == '=')) {
+            if (!parse_posix_class(ps, &node->set)) {
+                return NULL;
+            }
+            continue;
+        }
+        lo = parse_class_byte(ps, &node->set);
+        if (lo == ESCAPE_UNSUPPORTED) {
+            return NULL;
+        }
+        if (*ps->p != '-' || ps->p[1] == ']' || ps->p[1] == '\0') {
+            if (lo != ESCAPE_SET) {
+                set_add(&node->set, lo);
+            }
+            continue;
+        }
+        /* A range. PCRE treats the - in [\d-z] as a literal, but that's rare enough to leave to PCRE. */
+        ps->p++;
+        if (lo == ESCAPE_SET || (*ps->p == '[' && ps->p[1] == ':')) {
+            return NULL;
+        }
+        hi = parse_class_byte(ps, &node->set);
+        if (hi < lo) {
+            return NULL;
+        }
+        set_add_range(&node->set, lo, hi);
+    }
+
+    if (ps->caseless) {
+        set_fold_case(&node->set);
+    }
+    if (negate) {
+        set_negate(&node->set);
+    }
+    return node;
+}
+
+static ast_t *parse_alt(parser_t *ps);
+
+static ast_t *parse_atom(parser_t *ps) {
+    ast_t *node;
+    int assertion;
+    const int c = (unsigned char)*ps->p;
+
+    switch (c) {
+        case '(':
+            ps->p++;
+            if (*ps->p == '?') {
+                /* Only non-capturing groups. Lookaround, inline flags, named groups and the rest need PCRE. */
+                if (ps->p[1] != ':') {
+                    return NULL;
+                }
+                ps->p += 2;
+            }
+            if (++ps->depth > DFA_MAX_DEPTH) {
+                return NULL;
+            }
+            node = parse_alt(ps);
+            ps->depth--;
+            if (!node || *ps->p != ')') {
+                return NULL;
+            }
+            ps->p++;
+            return node;
+        case '[':
+            ps->p++;
+            return parse_class(ps);
+        case '.':
+            ps->p++;
+            node = new_node(ps, AST_SET, NULL, NULL);
+            set_add(&node->set, '\n');
+            set_negate(&node->set);
+            return node;
+        case '^':
+        case '$':
+            ps->p++;
+            node = new_node(ps, AST_ASSERT, NULL, NULL);
+            node->assertion = c == '^' ? ASSERT_BOL : ASSERT_EOL;
+            return node;
+        case '\\':
+            ps->p++;
+            node = new_node(ps, AST_SET, NULL, NULL);
+            assertion = parse_escape(ps, &node->set, FALSE);
+            if (assertion == ESCAPE_UNSUPPORTED) {
+                return NULL;
+            }
+            if (assertion != ESCAPE_SET) {
+                node->type = AST_ASSERT;
+                node->assertion = assertion;
+            } else if (ps->caseless) {
+                set_fold_case(&node->set);
+            }
+            return node;
+        case '*':
+        case '+':
+        case '?':
+        case '{':
+        case '|':
+        case ')':
+        case '\0':
+            return NULL;
+        default:
+            ps->p++;
+            node = new_node(ps, AST_SET, NULL, NULL);
+            set_add(&node->set, c);
+            if (ps->caseless) {
+                set_fold_case(&node->set);
+            }
+            return node;
+    }
+}
+
+static int parse_number(const char **p) {
+    int n = 0;
+    for (; isdigit((unsigned char)**p); (*p)++) {
+        if (n <= DFA_MAX_REPEAT) {
+            n = n * 10 + (**p - '0');
+        }
+    }
+    return n;
+}
+
+/* Parses {n}, {n,} or {n,m}. Anything else is left to PCRE. */
+static int parse_bounds(parser_t *ps, int *min, int *max) {
+    const char *p = ps->p + 1;
+
+    if (!isdigit((unsigned char)*p)) {
+        return FALSE;
+    }
+    *min = parse_number(&p);
+    *max = *min;
+    if (*p == ',') {
+        p++;
+        if (*p == '}') {
+            *max = -1;
+        } else if (isdigit((unsigned char)*p)) {
+            *max = parse_number(&p);
+        } else {
+            return FALSE;
+        }
+    }
+    if (*p != '}' || *min > DFA_MAX_REPEAT || *max > DFA_MAX_REPEAT || (*max >= 0 && *max < *min)) {
+        return FALSE;
+    }
+    ps->p = p + 1;
+    return TRUE;
+}
+
+static ast_t *parse_repeat(parser_t *ps) {
+    ast_t *node = parse_atom(ps);
+    int min, max;
+
+    while (node) {
+        switch (*ps->p) {
+            case '*':
+                min = 0;
+                max = -1;
+                break;
+            case '+':
+                min = 1;
+                max = -1;
+                break;
+            case '?':
+                min = 0;
+                max = 1;
+                break;
+            case '{':
+                if (!parse_bounds(ps, &min, &max)) {
+                    return NULL;
+                }
+                ps->p--;
+                break;
+            default:
+                return node;
+        }
+        ps->p++;
+        if (node->type == AST_ASSERT || *ps->p == '+') {
+            /* A repeated assertion or a possessive quantifier */
+            return NULL;
+        }
+        if (*ps->p == '?') {
+            /* Lazy quantifiers match the same strings */
+            ps->p++;
+        }
+        node = new_node(ps, AST_REPEAT, node, NULL);
+        node->min = min;
+        node->max = max;
+    }
+    return node;
+}
+
+static ast_t *parse_concat(parser_t *ps) {
+    ast_t *node = new_node(ps, AST_EMPTY, NULL, NULL);
+    ast_t *next;
+
+    while (*ps->p != '\0' && *ps->p != '|' && *ps->p != ')') {
+        next = parse_repeat(ps);
+        if (!next) {
+            return NULL;
+        }
+        node = node->type == AST_EMPTY ? next : new_node(ps, AST_CONCAT, node, next);
+    }
+    return node;
+}
+
+static ast_t *parse_alt(parser_t *ps) {
+    ast_t *node = parse_concat(ps);
+    ast_t *next;
+
+    while (node && *ps->p == '|') {
+        ps->p++;
+        next = parse_concat(ps);
+        if (!next) {
+            return NULL;
+        }
+        node = new_node(ps, AST_ALT, node, next);
+    }
+    return node;
+}
+
+static int nfa_add(dfa_t *dfa, const int type, const int arg, const int out, const int out1) {
+    nfa_node_t *node;
+
+    if (dfa->nodes_len >= DFA_MAX_NFA_NODES) {
+        return -1;
+    }
+    if ((size_t)dfa->nodes_len == dfa->nodes_size) {
+        dfa->nodes_size = dfa->nodes_size ? dfa->nodes_size * 2 : 64;
+        dfa->nodes = ag_realloc(dfa->nodes, dfa->nodes_size * sizeof(nfa_node_t));
+    }
+    node = &dfa->nodes[dfa->nodes_len];
+    node->type = type;
+    node->arg = arg;
+    node->out = out;
+    node->out1 = out1;
+    return dfa->nodes_len++;
+}
+
+static int nfa_add_set(dfa_t *dfa, const byte_set_t *set, const int out) {
+    if (dfa->nodes_len >= DFA_MAX_NFA_NODES) {
+        return -1;
+    }
+    if ((size_t)dfa->sets_len == dfa->sets_size) {
+        dfa->sets_size = dfa->sets_size ? dfa->sets_size * 2 : 64;
+        dfa->sets = ag_realloc(dfa->sets, dfa->sets_size * sizeof(byte_set_t));
+    }
+    dfa->sets[dfa->sets_len] = *set;
+    return nfa_add(dfa, NFA_SET, dfa->sets_len++, out, -1);
+}
+
+/* Builds the NFA for ast backwards from next. Returns the node to start at, or -1 if it got too big. */
+static int nfa_compile(dfa_t *dfa, const ast_t *ast, int next) {
+    int body, left, i;
+
+    if (next < 0) {
+        return -1;
+    }
+    switch (ast->type) {
+        case AST_EMPTY:
+            return next;
+        case AST_SET:
+            return nfa_add_set(dfa, &ast->set, next);
+        case AST_ASSERT:
+            return nfa_add(dfa, NFA_ASSERT, ast->assertion, next, -1);
+        case AST_CONCAT:
+            return nfa_compile(dfa, ast->left, nfa_compile(dfa, ast->right, next));
+        case AST_ALT:
+            left = nfa_compile(dfa, ast->left, next);
+            body = nfa_compile(dfa, ast->right, next);
+            if (left < 0 || body < 0) {
+                return -1;
+            }
+            return nfa_add(dfa, NFA_SPLIT, 0, left, body);
+        default:
+            if (ast->max < 0) {
+                next = nfa_add(dfa, NFA_SPLIT, 0, -1, next);
+                body = nfa_compile(dfa, ast->left, next);
+                if (body < 0) {
+                    return -1;
+                }
+                dfa->nodes[next].out = body;
+            } else {
+                for (i = ast->min; i < ast->max && next >= 0; i++) {
+                    body = nfa_compile(dfa, ast->left, next);
+                    if (body < 0) {
+                        return -1;
+                    }
+                    next = nfa_add(dfa, NFA_SPLIT, 0, body, next);
+                }
+            }
+            for (i = 0; i < ast->min && next >= 0; i++) {
+                next = nfa_compile(dfa, ast->left, next);
+            }
+            return next;
+    }
+}
+
+/* Splits the byte classes so that set doesn't have only part of any class */
+static void refine_classes(dfa_t *dfa, const byte_set_t *set) {
+    int remap[512];
+    int c, len = 0;
+
+    for (c = 0; c < 512; c++) {
+        remap[c] = -1;
+    }
+    for (c = 0; c < 256; c++) {
+        int key = dfa->classes[c] * 2 + set_has(set, c);
+        if (remap[key] < 0) {
+            remap[key] = len++;
+        }
+        dfa->classes[c] = remap[key];
+    }
+    dfa->classes_len = len;
+}
+
+static void compute_classes(dfa_t *dfa) {
+    byte_set_t set;
+    int c, i;
+
+    memset(dfa->classes, 0, sizeof(dfa->classes));
+    dfa->classes_len = 1;
+    for (i = 0; i < dfa->sets_len && dfa->classes_len < 256; i++) {
+        refine_classes(dfa, &dfa->sets[i]);
+    }
+    /* The flags of the next state depend on these too */
+    memset(&set, 0, sizeof(set));
+    set_add_word(&set);
+    refine_classes(dfa, &set);
+    memset(&set, 0, sizeof(set));
+    set_add(&set, '\n');
+    refine_classes(dfa, &set);
+
+    for (c = 255; c >= 0; c--) {
+        dfa->class_bytes[dfa->classes[c]] = c;
+    }
+}
+
+/* Returns the byte a set matches, lowercase if caseless, or -1 if it matches more than one */
+static int literal_byte(const byte_set_t *set, const int caseless) {
+    int c = -1;
+    int i;
+
+    for (i = 0; i < 256; i++) {
+        if (!set_has(set, i)) {
+            continue;
+        }
+        if (c < 0) {
+            c = i;
+        } else if (!(caseless && isupper(c) && i == tolower(c))) {
+            return -1;
+        }
+    }
+    return caseless ? tolower(c) : c;
+}
+
+static void flatten_concat(const ast_t *ast, const ast_t **list, size_t *len) {
+    if (ast->type == AST_CONCAT) {
+        flatten_concat(ast->left, list, len);
+        flatten_concat(ast->right, list, len);
+    } else {
+        list[(*len)++] = ast;
+    }
+}
+
+/* Finds the longest run of bytes that every match contains, with nothing but assertions between them */
+static void find_literal(dfa_t *dfa, const ast_t *ast, const size_t ast_len, const int caseless) {
+    const ast_t **list = ag_malloc(ast_len * sizeof(ast_t *));
+    char run[DFA_MAX_LITERAL];
+    size_t list_len = 0;
+    size_t run_len = 0;
+    size_t seen = 0; /* Elements before this one that match bytes */
+    size_t i;
+    int run_is_prefix = FALSE;
+
+    flatten_concat(ast, list, &list_len);
+    for (i = 0; i <= list_len; i++) {
+        const ast_t *node = i < list_len ? list[i] : NULL;
+        int repeated = FALSE;
+        int ends_run = TRUE;
+        int c = -1;
+
+        if (node && node->type == AST_ASSERT) {
+            continue;
+        }
+        if (node && node->type == AST_SET) {
+            c = literal_byte(&node->set, caseless);
+        } else if (node && node->type == AST_REPEAT && node->min > 0 && node->left->type == AST_SET) {
+            /* The first byte of x+ follows the run, but the next byte might not follow the last x */
+            c = literal_byte(&node->left->set, caseless);
+            repeated = TRUE;
+        }
+        if (c >= 0) {
+            if (run_len == 0) {
+                run_is_prefix = seen == 0;
+            }
+            run[run_len++] = c;
+            ends_run = repeated || run_len == DFA_MAX_LITERAL;
+        }
+        /* A prefix lets the DFA start at the literal instead of the start of its line, so keep one that's long enough */
+        if (ends_run && run_len > dfa->literal_len && !(dfa->literal_is_prefix && dfa->literal_len >= 3)) {
+            memcpy(dfa->literal, run, run_len);
+            dfa->literal_len = run_len;
+            dfa->literal_is_prefix = run_is_prefix;
+        }
+        if (ends_run) {
+            run_len = 0;
+        }
+        seen++;
+    }
+    free(list);
+    dfa->literal_caseless = caseless;
+}
+
+/* Finds the bytes that matches starting at root can start with, if none are empty */
+static void find_first_bytes(dfa_t *dfa, const int root) {
+    byte_set_t first;
+    int *stack = ag_malloc(dfa->nodes_len * sizeof(int));
+    char *seen = ag_calloc(dfa->nodes_len, 1);
+    int sp = 0;
+    int empty = FALSE;
+    int c;
+
+    memset(&first, 0, sizeof(first));
+    stack[sp++] = root;
+    seen[root] = TRUE;
+    while (sp > 0) {
+        const nfa_node_t *node = &dfa->nodes[stack[--sp]];
+        switch (node->type) {
+            case NFA_MATCH:
+                empty = TRUE;
+                break;
+            case NFA_SET:
+                set_union(&first, &dfa->sets[node->arg]);
+                break;
+            case NFA_SPLIT:
+                if (!seen[node->out1]) {
+                    seen[node->out1] = TRUE;
+                    stack[sp++] = node->out1;
+                }
+            /* FALLTHROUGH */
+            default:
+                /* Assertions don't rule any bytes out */
+                if (!seen[node->out]) {
+                    seen[node->out] = TRUE;
+                    stack[sp++] = node->out;
+                }
+                break;
+        }
+    }
+    free(stack);
+    free(seen);
+
+    if (!empty && set_count(&first) <= DFA_MAX_FIRST_BYTES) {
+        for (c = 0; c < 256; c++) {
+            dfa->first_bytes[c] = set_has(&first, c);
+        }
+        dfa->use_first_bytes = TRUE;
+    }
+}
+
+dfa_t *dfa_compile(const char *pattern, const int caseless) {
+    parser_t ps;
+    ast_t *ast;
+    dfa_t *dfa = NULL;
+    byte_set_t any;
+    int match, root, loop, i;
+
+    memset(&ps, 0, sizeof(ps));
+    ps.p = pattern;
+    ps.caseless = caseless;
+    ast = parse_alt(&ps);
+    if (!ast || *ps.p != '\0') {
+        goto cleanup;
+    }
+
+    dfa = ag_calloc(1, sizeof(dfa_t));
+    match = nfa_add(dfa, NFA_MATCH, 0, -1, -1);
+    root = nfa_compile(dfa, ast, match);
+    if (root < 0) {
+        goto fail;
+    }
+    for (i = 0; i < dfa->sets_len; i++) {
+        dfa->can_match_newline |= set_has(&dfa->sets[i], '\n');
+    }
+    for (i = 0; i < dfa->nodes_len; i++) {
+        if (dfa->nodes[i].type == NFA_ASSERT) {
+            dfa->flags_mask |= dfa->nodes[i].arg == ASSERT_BOL ? PREV_NEWLINE : 0;
+            dfa->flags_mask |= dfa->nodes[i].arg >= ASSERT_WORD_BOUNDARY ? PREV_WORD : 0;
+        }
+    }
+
+    /* Matches can start anywhere, so loop over any byte before the pattern */
+    memset(&any, 0xff, sizeof(any));
+    loop = nfa_add(dfa, NFA_SPLIT, 0, root, -1);
+    i = loop < 0 ? -1 : nfa_add_set(dfa, &any, loop);
+    if (i < 0) {
+        goto fail;
+    }
+    dfa->nodes[loop].out1 = i;
+    dfa->start = loop;
+    dfa->anchored_start = root;
+    compute_classes(dfa);
+
+    find_literal(dfa, ast, ps.nodes_len, caseless);
+    if (dfa->literal_len >= 2) {
+        dfa->two_way = ag_malloc(sizeof(two_way_t));
+        generate_two_way(dfa->literal, dfa->literal_len, dfa->two_way, !caseless);
+    } else if (!dfa->literal_is_prefix) {
+        /* A prefix of one byte is as good as the first bytes, and memchr() is faster */
+        find_first_bytes(dfa, root);
+        if (dfa->use_first_bytes) {
+            dfa->literal_len = 0;
+        }
+    }
+
+    dfa->id = dfa_ids_used++;
+    dfa->serial = ++dfa_serial;
+    dfa_live++;
+    goto cleanup;
+
+fail:
+    free(dfa->nodes);
+    free(dfa->sets);
+    free(dfa);
+    dfa = NULL;
+cleanup:
+    for (i = 0; (size_t)i < ps.nodes_len; i++) {
+        free(ps.nodes[i]);
+    }
+    free(ps.nodes);
+    return dfa;
+}
+
+void dfa_free(dfa_t *dfa) {
+    if (!dfa) {
+        return;
+    }
+    free(dfa->nodes);
+    free(dfa->sets);
+    free(dfa->two_way);
+    free(dfa);
+    if (--dfa_live == 0) {
+        /* Each thread's caches are tied to a serial as well as an id, so ids can be reused */
+        dfa_ids_used = 0;
+    }
+}
+
+static void cache_flush(dfa_cache_t *c) {
+    dfa_state_t *state, *tmp;
+    size_t i;
+
+    HASH_ITER(hh, c->by_key, state, tmp) {
+        HASH_DEL(c->by_key, state);
+        free(state->key);
+        free(state);
+    }
+    c->states_len = 0;
+    for (i = 0; i < sizeof(c->start) / sizeof(c->start[0]); i++) {
+        c->start[i] = TRANS_UNKNOWN;
+    }
+    c->mem = 0;
+    c->scanned = 0;
+    c->flushes++;
+}
+
+static dfa_cache_t *cache_new(const dfa_t *dfa) {
+    dfa_cache_t *c = ag_calloc(1, sizeof(dfa_cache_t));
+    c->serial = dfa->serial;
+    c->stride = dfa->classes_len + 1;
+    c->seen = ag_calloc(dfa->nodes_len, sizeof(unsigned int));
+    c->stack = ag_malloc(dfa->nodes_len * sizeof(int));
+    c->list = ag_malloc(dfa->nodes_len * sizeof(int));
+    c->key = ag_malloc((dfa->nodes_len + 1) * sizeof(int));
+    cache_flush(c);
+    c->flushes = 0;
+    return c;
+}
+
+static void cache_free(dfa_cache_t *c) {
+    cache_flush(c);
+    free(c->table);
+    free(c->states);
+    free(c->seen);
+    free(c->stack);
+    free(c->list);
+    free(c->key);
+    free(c);
+}
+
+static dfa_cache_t *get_cache(const dfa_t *dfa) {
+    dfa_cache_t *c;
+
+    if (dfa->id >= thread_caches_len) {
+        thread_caches = ag_realloc(thread_caches, (dfa->id + 1) * sizeof(dfa_cache_t *));
+        memset(thread_caches + thread_caches_len, 0, (dfa->id + 1 - thread_caches_len) * sizeof(dfa_cache_t *));
+        thread_caches_len = dfa->id + 1;
+    }
+    c = thread_caches[dfa->id];
+    if (c && c->serial != dfa->serial) {
+        cache_free(c);
+        c = NULL;
+    }
+    if (!c) {
+        c = thread_caches[dfa->id] = cache_new(dfa);
+    }
+    return c;
+}
+
+void dfa_thread_cleanup(void) {
+    size_t i;
+
+    for (i = 0; i < thread_caches_len; i++) {
+        if (thread_caches[i]) {
+            cache_free(thread_caches[i]);
+        }
+    }
+    free(thread_caches);
+    thread_caches = NULL;
+    thread_caches_len = 0;
+}
+
+static void new_seen_gen(dfa_cache_t *c, const dfa_t *dfa) {
+    if (++c->seen_gen == 0) {
+        memset(c->seen, 0, dfa->nodes_len * sizeof(unsigned int));
+        c->seen_gen = 1;
+    }
+}
+
+#define PUSH(c, n)                            \
+    do {                                      \
+        if ((c)->seen[n] != (c)->seen_gen) {  \
+            (c)->seen[n] = (c)->seen_gen;     \
+            (c)->stack[sp++] = (n);           \
+        }                                     \
+    } while (0)
+
+/* Adds the nodes reachable from node through splits to c->key */
+static size_t closure_add(const dfa_t *dfa, dfa_cache_t *c, const int node, size_t key_len) {
+    int sp = 0;
+
+    PUSH(c, node);
+    while (sp > 0) {
+        const int n = c->stack[--sp];
+        if (dfa->nodes[n].type == NFA_SPLIT) {
+            PUSH(c, dfa->nodes[n].out1);
+            PUSH(c, dfa->nodes[n].out);
+        } else {
+            c->key[key_len++] = n;
+        }
+    }
+    return key_len;
+}
+
+static int cmp_int(const void *a, const void *b) {
+    return *(const int *)a - *(const int *)b;
+}
+
+static int flags_for(const dfa_t *dfa, const int c) {
+    int flags = 0;
+    if (c == '\n') {
+        flags |= PREV_NEWLINE;
+    }
+    if (is_word_byte(c)) {
+        flags |= PREV_WORD;
+    }
+    return flags & dfa->flags_mask;
+}
+
+static int assertion_holds(const int assertion, const int flags, const int next) {
+    const int next_word = next >= 0 && is_word_byte(next);
+    switch (assertion) {
+        case ASSERT_BOL:
+            return (flags & PREV_NEWLINE) != 0;
+        case ASSERT_EOL:
+            return next < 0 || next == '\n';
+        case ASSERT_WORD_BOUNDARY:
+            return ((flags & PREV_WORD) != 0) != next_word;
+        default:
+            return ((flags & PREV_WORD) != 0) == next_word;
+    }
+}
+
+/* Returns the row of the state in c->key, adding it if it's new */
+static int find_state(dfa_cache_t *c, const size_t key_len) {
+    dfa_state_t *state;
+    const size_t key_size = key_len * sizeof(int);
+    const size_t state_mem = sizeof(dfa_state_t) + key_size + c->stride * sizeof(int) + sizeof(dfa_state_t *);
+
+    qsort(c->key + 1, key_len - 1, sizeof(int), cmp_int);
+    HASH_FIND(hh, c->by_key, c->key, key_size, state);
+    if (state) {
+        return state->row * c->stride;
+    }
+
+    if (c->mem + state_mem > DFA_CACHE_SIZE) {
+        if (c->scanned < DFA_MIN_BYTES_PER_STATE * c->states_len) {
+            cache_flush(c);
+            return TRANS_GAVE_UP;
+        }
+        cache_flush(c);
+    }
+    if (c->states_len == c->states_size) {
+        c->states_size = c->states_size ? c->states_size * 2 : 64;
+        c->states = ag_realloc(c->states, c->states_size * sizeof(dfa_state_t *));
+        c->table = ag_realloc(c->table, c->states_size * c->stride * sizeof(int));
+    }
+    state = ag_malloc(sizeof(dfa_state_t));
+    state->key = ag_malloc(key_size);
+    memcpy(state->key, c->key, key_size);
+    state->key_len = key_len;
+    state->row = c->states_len;
+    c->states[c->states_len++] = state;
+    memset(c->table + state->row * c->stride, 0xff, c->stride * sizeof(int)); /* TRANS_UNKNOWN */
+    HASH_ADD_KEYPTR(hh, c->by_key, state->key, key_size, state);
+    c->mem += state_mem;
+    return state->row * c->stride;
+}
+
+static int start_state(const dfa_t *dfa, dfa_cache_t *c, const int flags, const int anchored) {
+    size_t key_len;
+    int row;
+
+    c->key[0] = flags;
+    new_seen_gen(c, dfa);
+    key_len = closure_add(dfa, c, anchored ? dfa->anchored_start : dfa->start, 1);
+    row = find_state(c, key_len);
+    if (row >= 0) {
+        c->start[flags | (anchored ? 4 : 0)] = row;
+    }
+    return row;
+}
+
+/* Works out where the state at row goes on a byte of class cls */
+static int compute_transition(const dfa_t *dfa, dfa_cache_t *c, const int row, const int cls) {
+    const dfa_state_t *state = c->states[row / c->stride];
+    const int next = cls == dfa->classes_len ? -1 : dfa->class_bytes[cls];
+    const int flags = state->key[0];
+    const size_t flushes = c->flushes;
+    size_t i, list_len = 0, key_len;
+    int sp = 0;
+    int result;
+
+    /* Follow the assertions that hold between the last byte and this one, then step over this one */
+    new_seen_gen(c, dfa);
+    for (i = 1; i < state->key_len; i++) {
+        PUSH(c, state->key[i]);
+    }
+    result = TRANS_DEAD;
+    while (sp > 0) {
+        const nfa_node_t *node = &dfa->nodes[c->stack[--sp]];
+        switch (node->type) {
+            case NFA_MATCH:
+                result = TRANS_MATCH;
+                break;
+            case NFA_SPLIT:
+                PUSH(c, node->out1);
+                PUSH(c, node->out);
+                break;
+            case NFA_ASSERT:
+                if (assertion_holds(node->arg, flags, next)) {
+                    PUSH(c, node->out);
+                }
+                break;
+            default:
+                if (next >= 0 && set_has(&dfa->sets[node->arg], next)) {
+                    c->list[list_len++] = node->out;
+                }
+                break;
+        }
+    }
+
+    if (result != TRANS_MATCH && next >= 0) {
+        c->key[0] = flags_for(dfa, next);
+        new_seen_gen(c, dfa);
+        key_len = 1;
+        for (i = 0; i < list_len; i++) {
+            key_len = closure_add(dfa, c, c->list[i], key_len);
+        }
+        /* Only anchored searches can run out of NFA nodes */
+        result = key_len > 1 ? find_state(c, key_len) : TRANS_DEAD;
+        if (c->flushes != flushes) {
+            /* row is gone */
+            return result;
+        }
+    }
+    c->table[row + cls] = result;
+    return result;
+}
+
+/* Returns where the first match starting at or after start ends, or where one starting at start ends if anchored.
+ * If buf_len isn't the end of the buffer, returns DFA_RAN_OUT instead of looking for a match that ends there. */
+static size_t dfa_run(const dfa_t *dfa, dfa_cache_t *c, const char *buf, const size_t buf_len, const size_t start,
+                      const int anchored, const int at_end) {
+    const unsigned char *classes = dfa->classes;
+    const int *table;
+    const int flags = start == 0 ? PREV_NEWLINE & dfa->flags_mask : flags_for(dfa, (unsigned char)buf[start - 1]);
+    size_t i = start;
+    size_t mark = start;
+    int s = c->start[flags | (anchored ? 4 : 0)];
+    int t;
+
+    if (s < 0) {
+        s = start_state(dfa, c, flags, anchored);
+        if (s < 0) {
+            return DFA_GAVE_UP;
+        }
+    }
+    table = c->table;
+    for (; i < buf_len; i++) {
+        t = table[s + classes[(unsigned char)buf[i]]];
+        if (t < 0) {
+            if (t == TRANS_UNKNOWN) {
+                c->scanned += i - mark;
+                mark = i;
+                t = compute_transition(dfa, c, s, classes[(unsigned char)buf[i]]);
+                table = c->table;
+            }
+            if (t == TRANS_MATCH) {
+                return i;
+            }
+            if (t == TRANS_DEAD) {
+                return DFA_NO_MATCH;
+            }
+            if (t == TRANS_GAVE_UP) {
+                return DFA_GAVE_UP;
+            }
+        }
+        s = t;
+    }
+    c->scanned += i - mark;
+    if (!at_end) {
+        return DFA_RAN_OUT;
+    }
+
+    t = table[s + dfa->classes_len];
+    if (t == TRANS_UNKNOWN) {
+        t = compute_transition(dfa, c, s, dfa->classes_len);
+    }
+    return t == TRANS_MATCH ? buf_len : DFA_NO_MATCH;
+}
+
+static size_t line_start(const char *buf, const size_t from, size_t pos) {
+    while (pos > from && buf[pos - 1] != '\n') {
+        pos--;
+    }
+    return pos;
+}
+
+/* Returns the next place a match could start (or the literal every match contains is) */
+static const char *find_candidate(const dfa_t *dfa, const char *s, const size_t s_len) {
+    kernel_strnstr_fp kernel_strnstr = dfa->literal_caseless ? kernels.strncasestr : kernels.strnstr;
+    size_t budget = VERIFY_BUDGET(s_len);
+    const char *end = s + s_len;
+    const char *found;
+
+    if (dfa->use_first_bytes) {
+        for (; s < end; s++) {
+            if (dfa->first_bytes[(unsigned char)*s]) {
+                return s;
+            }
+        }
+        return NULL;
+    }
+    if (dfa->literal_len == 1) {
+        found = memchr(s, dfa->literal[0], s_len);
+        if (dfa->literal_caseless && isalpha((unsigned char)dfa->literal[0])) {
+            /* Each call only looks for the uppercase one as far as the lowercase one, so this stays linear */
+            const char *upper = memchr(s, toupper((unsigned char)dfa->literal[0]), found ? (size_t)(found - s) : s_len);
+            return upper ? upper : found;
+        }
+        return found;
+    }
+    if (kernel_strnstr) {
+        found = kernel_strnstr(s, dfa->literal, s_len, dfa->literal_len, &budget);
+        if (found || budget > 0) {
+            return found;
+        }
+    }
+    return two_way_strnstr(s, dfa->literal, s_len, dfa->literal_len, dfa->two_way);
+}
+
+size_t dfa_search(const dfa_t *dfa, const char *buf, const size_t buf_len, const size_t start, const int one_line) {
+    dfa_cache_t *c = get_cache(dfa);
+    const int spans_lines = dfa->can_match_newline && !one_line;
+    const int at_match_start = dfa->literal_is_prefix || dfa->use_first_bytes;
+    const char *found;
+    const char *line_end;
+    size_t pos = start;
+    size_t at, to, end;
+
+    if ((dfa->literal_len == 0 && !dfa->use_first_bytes) || (spans_lines && !at_match_start)) {
+        end = dfa_run(dfa, c, buf, buf_len, start, FALSE, TRUE);
+        if (end == DFA_NO_MATCH || end == DFA_GAVE_UP) {
+            return end;
+        }
+        /* The match that ends first might not start first, but if matches are on one line, it's on the first one's line */
+        return spans_lines ? start : line_start(buf, start, end);
+    }
+
+    /* Every match contains the literal (or starts with one of the first bytes), so only run the DFA there */
+    while (pos < buf_len) {
+        found = find_candidate(dfa, buf + pos, buf_len - pos);
+        if (!found) {
+            break;
+        }
+        at = found - buf;
+        if (at_match_start) {
+            /* Try a match starting here */
+            to = buf_len - at > DFA_ANCHORED_LIMIT ? at + DFA_ANCHORED_LIMIT : buf_len;
+            end = dfa_run(dfa, c, buf, to, at, TRUE, to == buf_len);
+            if (end == DFA_NO_MATCH) {
+                pos = at + 1;
+                continue;
+            }
+            if (end == DFA_RAN_OUT) {
+                /* Rather than risk doing this again for the next candidate, look for any match from here */
+                end = dfa_run(dfa, c, buf, buf_len, at, FALSE, TRUE);
+            }
+            return end == DFA_NO_MATCH || end == DFA_GAVE_UP ? end : at;
+        }
+        /* Matches are on one line, so look for one on the literal's line */
+        line_end = memchr(found, '\n', buf_len - at);
+        to = line_end ? (size_t)(line_end - buf) + 1 : buf_len;
+        end = dfa_run(dfa, c, buf, to, line_start(buf, pos, at), FALSE, TRUE);
+        if (end != DFA_NO_MATCH) {
+            return end == DFA_GAVE_UP ? end : line_start(buf, pos, at);
+        }
+        pos = to;
+    }
+    return DFA_NO_MATCH;
+}
@@ -0,0 +1,45 @@
+#ifndef DFA_H
+#define DFA_H
+
+#include <stddef.h>
+
+/*
+ * A lazy DFA for the regexes that don't need backtracking: no backrefs,
+ * lookaround, inline flags or possessive quantifiers. It only finds where
+ * the next match could start. PCRE still finds the match's bounds from
+ * there, so -o, --column and the rest behave exactly as before. It matches
+ * a superset of what PCRE does (\s vs. \v, for one), which at worst costs
+ * PCRE a wasted search.
+ *
+ * Bytes that no part of the pattern tells apart share a byte class, and
+ * DFA states are built the first time the search reaches them. Each thread
+ * caches its own states, up to DFA_CACHE_SIZE per pattern. When the cache
+ * fills up it's flushed, and if that keeps happening without getting much
+ * further, the DFA gives up and the caller goes back to PCRE.
+ *
+ * If every match has to contain some literal, the literal search finds
+ * candidates and the DFA only runs from there (or from the start of their
+ * line), much like PCRE's own start-of-match optimizations.
+ */
+
+#define DFA_CACHE_SIZE (2 * 1024 * 1024)
+
+#define DFA_NO_MATCH ((size_t)-1)
+#define DFA_GAVE_UP ((size_t)-2)
+
+typedef struct dfa dfa_t;
+
+/* Returns NULL if the pattern uses syntax the DFA doesn't handle. pattern must already compile with PCRE. */
+dfa_t *dfa_compile(const char *pattern, const int caseless);
+void dfa_free(dfa_t *dfa);
+
+/*
+ * Returns a position at or after start that no match starts before, DFA_NO_MATCH or DFA_GAVE_UP.
+ * With one_line, only matches within a line count (for --nomultiline), so it can often skip further.
+ */
+size_t dfa_search(const dfa_t *dfa, const char *buf, const size_t buf_len, const size_t start, const int one_line);
+
+/* Frees the calling thread's state caches */
+void dfa_thread_cleanup(void);
+
+#endif
@@ -0,0 +1,454 @@
+#include <errno.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "config.h"
+#include "dircache.h"
+#include "log.h"
+#include "options.h"
+#include "uthash.h"
+#include "util.h"
+
+#define DIRCACHE_MAGIC "AGDC"
+#define DIRCACHE_VERSION 1
+
+#if defined(__APPLE__) || defined(__MACH__)
+#define DIRCACHE_MTIME_NSEC(st) ((st)->st_mtimespec.tv_nsec)
+#define DIRCACHE_CTIME_NSEC(st) ((st)->st_ctimespec.tv_nsec)
+#elif defined(_WIN32)
+#define DIRCACHE_MTIME_NSEC(st) 0
+#define DIRCACHE_CTIME_NSEC(st) 0
+#else
+#define DIRCACHE_MTIME_NSEC(st) ((st)->st_mtim.tv_nsec)
+#define DIRCACHE_CTIME_NSEC(st) ((st)->st_ctim.tv_nsec)
+#endif
+
+typedef struct {
+    int64_t sec;
+    int64_t nsec;
+} dircache_time_t;
+
+typedef struct {
+    char *key;
+    uint64_t ino;
+    dircache_time_t mtime;
+    dircache_time_t ctime;
+    dircache_time_t *ignore_mtimes; /* One per ignore_pattern_files[] entry. Zero if the file doesn't exist */
+    char *names;                    /* Entry names, each NUL-terminated, back to back */
+    uint32_t names_len;
+    unsigned char *types; /* d_type of each entry, DT_UNKNOWN already resolved */
+    uint32_t entries_len;
+    UT_hash_handle hh;
+} dircache_record_t;
+
+struct dircache_dir {
+    char *key;
+    int depth;
+    uint64_t ino;
+    dircache_time_t mtime;
+    dircache_time_t ctime;
+    dircache_time_t *ignore_mtimes;
+};
+
+static dircache_record_t *records = NULL;
+static char *cache_file_path = NULL;
+static uint64_t fingerprint = 0;
+static uint32_t ignore_files_len = 0;
+static int dirty = FALSE;
+/* Shallowest directory on the current traversal path whose listing was rebuilt.
+ * Everything below it has to be re-filtered too, since its ignores may have changed. */
+static int stale_depth = INT_MAX;
+
+static void fnv1a(uint64_t *hash, const void *data, size_t len) {
+    const unsigned char *p = data;
+    size_t i;
+    for (i = 0; i < len; i++) {
+        *hash ^= p[i];
+        *hash *= 1099511628211ULL;
+    }
+}
+
+static void fnv1a_strings(uint64_t *hash, char **strs, const size_t strs_len) {
+    size_t i;
+    fnv1a(hash, &strs_len, sizeof(strs_len));
+    for (i = 0; i < strs_len; i++) {
+        fnv1a(hash, strs[i], strlen(strs[i]) + 1);
+    }
+}
+
+/* Everything that can change the result of filename_filter() besides the per-directory ignore files */
+static uint64_t options_fingerprint(const cli_options *o, const ignores *root_ig) {
+    uint64_t hash = 14695981039346656037ULL;
+    int filter_opts[] = {
+        o->search_hidden_files,
+        o->search_all_files,
+        o->path_to_ignore,
+        o->follow_symlinks,
+        o->skip_vcs_ignores
+    };
+
+    fnv1a(&hash, filter_opts, sizeof(filter_opts));
+    fnv1a_strings(&hash, root_ig->extensions, root_ig->extensions_len);
+    fnv1a_strings(&hash, root_ig->names, root_ig->names_len);
+    fnv1a_strings(&hash, root_ig->slash_names, root_ig->slash_names_len);
+    fnv1a_strings(&hash, root_ig->regexes, root_ig->regexes_len);
+    fnv1a_strings(&hash, root_ig->invert_regexes, root_ig->invert_regexes_len);
+    fnv1a_strings(&hash, root_ig->slash_regexes, root_ig->slash_regexes_len);
+    return hash;
+}
+
+static void free_record(dircache_record_t *rec) {
+    free(rec->key);
+    free(rec->ignore_mtimes);
+    free(rec->names);
+    free(rec->types);
+    free(rec);
+}
+
+static void free_records(void) {
+    dircache_record_t *rec, *tmp;
+    HASH_ITER(hh, records, rec, tmp) {
+        HASH_DEL(records, rec);
+        free_record(rec);
+    }
+}
+
+static int read_bytes(const char **pos, const char *end, void *out, size_t len) {
+    if ((size_t)(end - *pos) < len) {
+        return FALSE;
+    }
+    memcpy(out, *pos, len);
+    *pos += len;
+    return TRUE;
+}
+
+static int load_records(const char *buf, const size_t buf_len) {
+    const char *pos = buf;
+    const char *end = buf + buf_len;
+    char magic[4];
+    uint32_t version;
+    uint64_t file_fingerprint;
+    uint32_t file_ignore_files_len;
+    uint32_t records_len;
+    uint32_t i, j;
+
+    if (!read_bytes(&pos, end, magic, sizeof(magic)) || memcmp(magic, DIRCACHE_MAGIC, sizeof(magic)) != 0 ||
+        !read_bytes(&pos, end, &version, sizeof(version)) || version != DIRCACHE_VERSION) {
+        log_debug("Directory cache %s has an unknown format. Ignoring it.", cache_file_path);
+        return FALSE;
+    }
+    if (!read_bytes(&pos, end, &file_fingerprint, sizeof(file_fingerprint)) || file_fingerprint != fingerprint ||
+        !read_bytes(&pos, end, &file_ignore_files_len, sizeof(file_ignore_files_len)) || file_ignore_files_len != ignore_files_len) {
+        log_debug("Directory cache %s was built with different ignore options. Ignoring it.", cache_file_path);
+        return FALSE;
+    }
+    if (!read_bytes(&pos, end, &records_len, sizeof(records_len))) {
+        return FALSE;
+    }
+
+    for (i = 0; i < records_len; i++) {
+        uint32_t key_len;
+        dircache_record_t *rec = ag_calloc(1, sizeof(dircache_record_t));
+        rec->ignore_mtimes = ag_calloc(ignore_files_len, sizeof(dircache_time_t));
+
+        if (!read_bytes(&pos, end, &key_len, sizeof(key_len)) || (size_t)(end - pos) < key_len) {
+            free_record(rec);
+            return FALSE;
+        }
+        rec->key = ag_strndup(pos, key_len);
+        pos += key_len;
+
+        if (!read_bytes(&pos, end, &rec->ino, sizeof(rec->ino)) ||
+            !read_bytes(&pos, end, &rec->mtime, sizeof(rec->mtime)) ||
+            !read_bytes(&pos, end, &rec->ctime, sizeof(rec->ctime)) ||
+            !read_bytes(&pos, end, rec->ignore_mtimes, ignore_files_len * sizeof(dircache_time_t)) ||
+            !read_bytes(&pos, end, &rec->entries_len, sizeof(rec->entries_len)) ||
+            !read_bytes(&pos, end, &rec->names_len, sizeof(rec->names_len)) ||
+            (size_t)(end - pos) < (size_t)rec->entries_len + rec->names_len) {
+            free_record(rec);
+            return FALSE;
+        }
+        rec->types = ag_malloc(rec->entries_len + 1);
+        read_bytes(&pos, end, rec->types, rec->entries_len);
+        rec->names = ag_malloc(rec->names_len + 1);
+        read_bytes(&pos, end, rec->names, rec->names_len);
+
+        /* Make sure there are exactly entries_len NUL-terminated names */
+        uint32_t names_found = 0;
+        for (j = 0; j < rec->names_len; j++) {
+            if (rec->names[j] == '\0') {
+                names_found++;
+            }
+        }
+        if (names_found != rec->entries_len || (rec->names_len > 0 && rec->names[rec->names_len - 1] != '\0')) {
+            free_record(rec);
+            return FALSE;
+        }
+
+        HASH_ADD_KEYPTR(hh, records, rec->key, strlen(rec->key), rec);
+    }
+    return TRUE;
+}
+
+void dircache_init(const char *cache_path, const cli_options *o, const ignores *root_ig) {
+    FILE *fp;
+    char *buf = NULL;
+    size_t buf_len = 0;
+    size_t buf_cap = 0;
+    size_t bytes_read;
+
+    if (o->ackmate_dir_filter) {
+        log_debug("Not using directory cache: --ackmate-dir-filter can't be fingerprinted.");
+        return;
+    }
+
+    for (ignore_files_len = 0; ignore_pattern_files[ignore_files_len] != NULL; ignore_files_len++) {
+    }
+    cache_file_path = ag_strdup(cache_path);
+    fingerprint = options_fingerprint(o, root_ig);
+
+    fp = fopen(cache_file_path, "rb");
+    if (fp == NULL) {
+        log_debug("Directory cache %s not readable. Starting a new one.", cache_file_path);
+        return;
+    }
+    do {
+        buf_cap = buf_cap ? buf_cap * 2 : 64 * 1024;
+        buf = ag_realloc(buf, buf_cap);
+        bytes_read = fread(buf + buf_len, 1, buf_cap - buf_len, fp);
+        buf_len += bytes_read;
+    } while (buf_len == buf_cap);
+    fclose(fp);
+
+    if (!load_records(buf, buf_len)) {
+        log_debug("Discarding directory cache %s.", cache_file_path);
+        free_records();
+        dirty = TRUE;
+    } else {
+        log_debug("Loaded %u directories from cache %s.", HASH_COUNT(records), cache_file_path);
+    }
+    free(buf);
+}
+
+static int write_records(FILE *fp) {
+    dircache_record_t *rec, *tmp;
+    uint32_t version = DIRCACHE_VERSION;
+    uint32_t records_len = HASH_COUNT(records);
+
+    fwrite(DIRCACHE_MAGIC, 1, 4, fp);
+    fwrite(&version, sizeof(version), 1, fp);
+    fwrite(&fingerprint, sizeof(fingerprint), 1, fp);
+    fwrite(&ignore_files_len, sizeof(ignore_files_len), 1, fp);
+    fwrite(&records_len, sizeof(records_len), 1, fp);
+
+    HASH_ITER(hh, records, rec, tmp) {
+        uint32_t key_len = strlen(rec->key);
+        fwrite(&key_len, sizeof(key_len), 1, fp);
+        fwrite(rec->key, 1, key_len, fp);
+        fwrite(&rec->ino, sizeof(rec->ino), 1, fp);
+        fwrite(&rec->mtime, sizeof(rec->mtime), 1, fp);
+        fwrite(&rec->ctime, sizeof(rec->ctime), 1, fp);
+        fwrite(rec->ignore_mtimes, sizeof(dircache_time_t), ignore_files_len, fp);
+        fwrite(&rec->entries_len, sizeof(rec->entries_len), 1, fp);
+        fwrite(&rec->names_len, sizeof(rec->names_len), 1, fp);
+        fwrite(rec->types, 1, rec->entries_len, fp);
+        fwrite(rec->names, 1, rec->names_len, fp);
+    }
+    return !ferror(fp);
+}
+
+void dircache_cleanup(void) {
+    if (cache_file_path == NULL) {
+        return;
+    }
+
+    if (dirty) {
+        char *tmp_path;
+        FILE *fp;
+        ag_asprintf(&tmp_path, "%s.%ld.tmp", cache_file_path, (long)getpid());
+        fp = fopen(tmp_path, "wb");
+        if (fp == NULL) {
+            log_err("Unable to write directory cache %s: %s", tmp_path, strerror(errno));
+        } else {
+            int ok = write_records(fp);
+            if (fclose(fp) != 0 || !ok) {
+                log_err("Unable to write directory cache %s", tmp_path);
+                unlink(tmp_path);
+            } else if (rename(tmp_path, cache_file_path) != 0) {
+                log_err("Unable to replace directory cache %s: %s", cache_file_path, strerror(errno));
+                unlink(tmp_path);
+            } else {
+                log_debug("Saved %u directories to cache %s.", HASH_COUNT(records), cache_file_path);
+            }
+        }
+        free(tmp_path);
+    }
+
+    free_records();
+    free(cache_file_path);
+    cache_file_path = NULL;
+}
+
+dircache_dir_t *dircache_enter(const char *base_path, const char *path, const int depth) {
+    struct stat s;
+    dircache_dir_t *dc;
+
+    if (cache_file_path == NULL || base_path == NULL) {
+        return NULL;
+    }
+    if (stat(path, &s) != 0 || !S_ISDIR(s.st_mode)) {
+        return NULL;
+    }
+
+    dc = ag_calloc(1, sizeof(dircache_dir_t));
+    ag_asprintf(&dc->key, "%s\n%s", base_path, path);
+    dc->depth = depth;
+    dc->ino = (uint64_t)s.st_ino;
+    dc->mtime.sec = (int64_t)s.st_mtime;
+    dc->mtime.nsec = (int64_t)DIRCACHE_MTIME_NSEC(&s);
+    dc->ctime.sec = (int64_t)s.st_ctime;
+    dc->ctime.nsec = (int64_t)DIRCACHE_CTIME_NSEC(&s);
+    dc->ignore_mtimes = ag_calloc(ignore_files_len, sizeof(dircache_time_t));
+    return dc;
+}
+
+/* Records the ignore file's mtime. Returns FALSE if it doesn't exist, so the caller can skip loading it. */
+int dircache_check_ignore_file(dircache_dir_t *dc, const int ignore_file_index, const char *ignore_file_path) {
+    struct stat s;
+
+    if (dc == NULL) {
+        return TRUE;
+    }
+    if (stat(ignore_file_path, &s) != 0) {
+        return FALSE;
+    }
+    dc->ignore_mtimes[ignore_file_index].sec = (int64_t)s.st_mtime;
+    dc->ignore_mtimes[ignore_file_index].nsec = (int64_t)DIRCACHE_MTIME_NSEC(&s);
+    return TRUE;
+}
+
+/* Returns the cached listing in the same form as ag_scandir(), or -1 if there's no usable record. */
+int dircache_scandir(dircache_dir_t *dc, dirlist_t *list) {
+    dircache_record_t *rec = NULL;
+    const char *name;
+    uint32_t i;
+
+    if (dc == NULL) {
+        return -1;
+    }
+
+    if (stale_depth > dc->depth) {
+        HASH_FIND_STR(records, dc->key, rec);
+    }
+    if (rec == NULL ||
+        rec->ino != dc->ino ||
+        memcmp(&rec->mtime, &dc->mtime, sizeof(dircache_time_t)) != 0 ||
+        memcmp(&rec->ctime, &dc->ctime, sizeof(dircache_time_t)) != 0 ||
+        memcmp(rec->ignore_mtimes, dc->ignore_mtimes, ignore_files_len * sizeof(dircache_time_t)) != 0) {
+        if (dc->depth < stale_depth) {
+            stale_depth = dc->depth;
+        }
+        return -1;
+    }
+
+    dirlist_init(list);
+    name = rec->names;
+    for (i = 0; i < rec->entries_len; i++) {
+        size_t name_len = strlen(name);
+        dirlist_add(list, name, name_len, rec->types[i]);
+        name += name_len + 1;
+    }
+    log_debug("Using cached listing of %s (%u entries)", dc->key + strcspn(dc->key, "\n") + 1, rec->entries_len);
+    return (int)rec->entries_len;
+}
+
+#ifdef HAVE_DIRENT_DTYPE
+static unsigned char resolve_d_type(const char *path, const dirlist_entry_t *d) {
+    char *full_path;
+    struct stat s;
+    unsigned char type = DT_UNKNOWN;
+
+    if (d->type != DT_UNKNOWN) {
+        return d->type;
+    }
+    ag_asprintf(&full_path, "%s/%s", path, d->name);
+    if (lstat(full_path, &s) == 0) {
+        if (S_ISDIR(s.st_mode)) {
+            type = DT_DIR;
+        } else if (S_ISREG(s.st_mode)) {
+            type = DT_REG;
+        } else if (S_ISLNK(s.st_mode)) {
+            type = DT_LNK;
+        } else if (S_ISFIFO(s.st_mode)) {
+            type = DT_FIFO;
+        }
+    }
+    free(full_path);
+    return type;
+}
+#endif
+
+void dircache_store(dircache_dir_t *dc, const char *path, const dirlist_t *list) {
+    dircache_record_t *rec = NULL;
+    dirlist_entry_t entry;
+    size_t names_len = 0;
+    int i;
+
+    if (dc == NULL) {
+        return;
+    }
+
+    HASH_FIND_STR(records, dc->key, rec);
+    if (rec) {
+        HASH_DEL(records, rec);
+        free_record(rec);
+    }
+
+    /* Each packed entry is a type byte and a NUL-terminated name */
+    names_len = list->buf_len - list->len;
+
+    rec = ag_calloc(1, sizeof(dircache_record_t));
+    rec->key = ag_strdup(dc->key);
+    rec->ino = dc->ino;
+    rec->mtime = dc->mtime;
+    rec->ctime = dc->ctime;
+    rec->ignore_mtimes = ag_malloc(ignore_files_len * sizeof(dircache_time_t) + 1);
+    memcpy(rec->ignore_mtimes, dc->ignore_mtimes, ignore_files_len * sizeof(dircache_time_t));
+    rec->entries_len = list->len;
+    rec->names_len = names_len;
+    rec->names = ag_malloc(names_len + 1);
+    rec->types = ag_malloc(list->len + 1);
+
+    names_len = 0;
+    for (i = 0; i < list->len; i++) {
+        dirlist_entry(list, i, &entry);
+        memcpy(rec->names + names_len, entry.name, entry.name_len + 1);
+        names_len += entry.name_len + 1;
+#ifdef HAVE_DIRENT_DTYPE
+        rec->types[i] = resolve_d_type(path, &entry);
+#else
+        (void)path;
+        rec->types[i] = 0;
+#endif
+    }
+
+    HASH_ADD_KEYPTR(hh, records, rec->key, strlen(rec->key), rec);
+    dirty = TRUE;
+}
+
+void dircache_leave(dircache_dir_t *dc) {
+    if (dc == NULL) {
+        return;
+    }
+    if (stale_depth == dc->depth) {
+        stale_depth = INT_MAX;
+    }
+    free(dc->key);
+    free(dc->ignore_mtimes);
+    free(dc);
+}
@@ -0,0 +1,34 @@
+#ifndef DIRCACHE_H
+#define DIRCACHE_H
+
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "ignore.h"
+#include "options.h"
+#include "scandir.h"
+
+/*
+ * On-disk cache of filtered directory listings (--dir-cache FILE).
+ *
+ * Each record holds the entries of one directory that survived
+ * filename_filter(), keyed by the search root and the directory's path.
+ * A record is only trusted if the directory's mtime/ctime/inode and the
+ * mtimes of its ignore files are unchanged, and every ancestor directory
+ * was trusted too (since ancestors' ignore patterns apply to it).
+ */
+
+typedef struct dircache_dir dircache_dir_t;
+
+/* o and root_ig are the search's options and root ignores, which the cache's records must have been made with */
+void dircache_init(const char *cache_path, const cli_options *o, const ignores *root_ig);
+void dircache_cleanup(void);
+
+dircache_dir_t *dircache_enter(const char *base_path, const char *path, const int depth);
+int dircache_check_ignore_file(dircache_dir_t *dc, const int ignore_file_index, const char *ignore_file_path);
+int dircache_scandir(dircache_dir_t *dc, dirlist_t *list);
+void dircache_store(dircache_dir_t *dc, const char *path, const dirlist_t *list);
+void dircache_leave(dircache_dir_t *dc);
+
+#endif
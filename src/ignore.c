@@ -180,7 +180,7 @@ void add_ignore_pattern(ignores *ig, const char *pattern) {
     }
     patterns[i] = ag_strndup(pattern, pattern_len);
     log_debug("added ignore pattern %s to %s", pattern,
-              ig == root_ignores ? "root ignores" : ig->abs_path);
+              ig->parent == NULL ? "root ignores" : ig->abs_path);
 }
 
 /* For loading git/hg ignore patterns */
@@ -289,20 +289,20 @@ cleanup:
     fclose(fp);
 }
 
-static int ackmate_dir_match(const char *dir_name) {
-    if (opts.ackmate_dir_filter == NULL) {
+static int ackmate_dir_match(const cli_options *o, const char *dir_name) {
+    if (o->ackmate_dir_filter == NULL) {
         return 0;
     }
 /* we just care about the match, not where the matches are */
 #ifdef HAVE_PCRE2
-    return ag_pcre_match(opts.ackmate_dir_filter, NULL, dir_name, strlen(dir_name), 0, 0, NULL, 0);
+    return ag_pcre_match(o->ackmate_dir_filter, NULL, dir_name, strlen(dir_name), 0, 0, NULL, 0);
 #else
-    return pcre_exec(opts.ackmate_dir_filter, NULL, dir_name, strlen(dir_name), 0, 0, NULL, 0);
+    return pcre_exec(o->ackmate_dir_filter, NULL, dir_name, strlen(dir_name), 0, 0, NULL, 0);
 #endif
 }
 
 /* This is the hottest code in Ag. 10-15% of all execution time is spent here */
-static int path_ignore_search(const ignores *ig, const char *path, const char *filename) {
+static int path_ignore_search(const cli_options *o, const ignores *ig, const char *path, const char *filename) {
     char *temp;
     int temp_start_pos;
     size_t i;
@@ -379,15 +379,17 @@ static int path_ignore_search(const ignores *ig, const char *path, const char *f
         log_debug("pattern %s doesn't match file %s", ig->regexes[i], filename);
     }
 
-    int rv = ackmate_dir_match(temp);
+    int rv = ackmate_dir_match(o, temp);
     free(temp);
     return rv;
 }
 
 /* This function is REALLY HOT. It gets called for every file */
-int filename_filter(const char *path, const struct dirent *dir, void *baton) {
-    const char *filename = dir->d_name;
-    if (!opts.search_hidden_files && filename[0] == '.') {
+int filename_filter(const char *path, const dirlist_entry_t *dir, void *baton) {
+    const scandir_baton_t *scandir_baton = (const scandir_baton_t *)baton;
+    const cli_options *o = scandir_baton->opts;
+    const char *filename = dir->name;
+    if (!o->search_hidden_files && filename[0] == '.') {
         return 0;
     }
 
@@ -398,8 +400,8 @@ int filename_filter(const char *path, const struct dirent *dir, void *baton) {
         }
     }
 
-    if (!opts.follow_symlinks && is_symlink(path, dir)) {
-        log_debug("File %s ignored becaused it's a symlink", dir->d_name);
+    if (!o->follow_symlinks && is_symlink(path, dir)) {
+        log_debug("File %s ignored becaused it's a symlink", dir->name);
         return 0;
     }
 
@@ -408,11 +410,10 @@ int filename_filter(const char *path, const struct dirent *dir, void *baton) {
         return 0;
     }
 
-    if (opts.search_all_files && !opts.path_to_ignore) {
+    if (o->search_all_files && !o->path_to_ignore) {
         return 1;
     }
 
-    scandir_baton_t *scandir_baton = (scandir_baton_t *)baton;
     const char *path_start = scandir_baton->path_start;
 
     const char *extension = strchr(filename, '.');
@@ -426,16 +427,9 @@ int filename_filter(const char *path, const struct dirent *dir, void *baton) {
         }
     }
 
-#ifdef HAVE_DIRENT_DNAMLEN
-    size_t filename_len = dir->d_namlen;
-#else
-    size_t filename_len = 0;
-#endif
+    size_t filename_len = dir->name_len;
 
     if (strncmp(filename, "./", 2) == 0) {
-#ifndef HAVE_DIRENT_DNAMLEN
-        filename_len = strlen(filename);
-#endif
         filename++;
         filename_len--;
     }
@@ -451,20 +445,15 @@ int filename_filter(const char *path, const struct dirent *dir, void *baton) {
             }
         }
 
-        if (path_ignore_search(ig, path_start, filename)) {
+        if (path_ignore_search(o, ig, path_start, filename)) {
             return 0;
         }
 
         if (is_directory(path, dir)) {
-#ifndef HAVE_DIRENT_DNAMLEN
-            if (!filename_len) {
-                filename_len = strlen(filename);
-            }
-#endif
             if (filename[filename_len - 1] != '/') {
                 char *temp;
                 ag_asprintf(&temp, "%s/", filename);
-                int rv = path_ignore_search(ig, path_start, temp);
+                int rv = path_ignore_search(o, ig, path_start, temp);
                 free(temp);
                 if (rv) {
                     return 0;
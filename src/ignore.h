@@ -4,6 +4,8 @@
 #include <dirent.h>
 #include <sys/types.h>
 
+#include "util.h"
+
 #define SVN_DIR_PROP_BASE "dir-prop-base"
 #define SVN_DIR ".svn"
 #define SVN_PROP_IGNORE "svn:ignore"
@@ -46,7 +48,7 @@ void add_ignore_pattern(ignores *ig, const char *pattern);
 void load_ignore_patterns(ignores *ig, const char *path);
 void load_svn_ignore_patterns(ignores *ig, const char *path);
 
-int filename_filter(const char *path, const struct dirent *dir, void *baton);
+int filename_filter(const char *path, const dirlist_entry_t *dir, void *baton);
 
 int is_empty(ignores *ig);
 
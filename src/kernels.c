@@ -0,0 +1,774 @@
+#include <string.h>
+
+#include "config.h"
+#include "kernels.h"
+#include "util.h"
+
+#ifdef HAVE_X86_KERNELS
+#include <immintrin.h>
+#endif
+
+static const char *level_names[KERNEL_LEVEL_COUNT] = { "generic", "sse2", "sse4.2", "avx2", "avx512bw" };
+
+static size_t count_newlines_generic(const char *buf, const size_t buf_len) {
+    const char *end = buf + buf_len;
+    size_t count = 0;
+
+    while (buf < end && (buf = memchr(buf, '\n', end - buf)) != NULL) {
+        count++;
+        buf++;
+    }
+    return count;
+}
+
+/* Checks positions from i on, byte by byte */
+static const char *litset_tail(const litset_masks_t *masks, const char *s, const size_t s_len, size_t i, unsigned int *buckets) {
+    const unsigned char *u = (const unsigned char *)s;
+    for (; i + masks->len <= s_len; i++) {
+        unsigned int b = masks->bytes[0][u[i]];
+        size_t k;
+        for (k = 1; b && k < masks->len; k++) {
+            b &= masks->bytes[k][u[i + k]];
+        }
+        if (b) {
+            *buckets = b;
+            return s + i;
+        }
+    }
+    return NULL;
+}
+
+static const char *litset_generic(const litset_masks_t *masks, const char *s, const size_t s_len, unsigned int *buckets) {
+    return litset_tail(masks, s, s_len, 0, buckets);
+}
+
+#ifdef HAVE_X86_KERNELS
+
+/* Checks the positions the vector loop didn't get to */
+static const char *strnstr_tail(const char *s, const char *find, const size_t s_len, const size_t f_len, size_t i) {
+    for (; i + f_len <= s_len; i++) {
+        if (s[i] == find[0] && memcmp(s + i + 1, find + 1, f_len - 1) == 0) {
+            return s + i;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Candidates that aren't matches nearly always differ early on, so only
+ * the first VERIFY_CHUNK bytes are charged to the budget unless they
+ * match. Returns -1 if the budget ran out.
+ */
+#define VERIFY_CHUNK 32
+
+static int verify(const char *s, const char *find, const size_t len, size_t *left) {
+    const size_t chunk = len < VERIFY_CHUNK ? len : VERIFY_CHUNK;
+    if (*left < len) {
+        return -1;
+    }
+    *left -= chunk;
+    if (memcmp(s, find, chunk) != 0) {
+        return FALSE;
+    }
+    *left -= len - chunk;
+    return memcmp(s + chunk, find + chunk, len - chunk) == 0;
+}
+
+/*
+ * Compare a block of candidate starts against the needle's first byte and
+ * the block f_len - 1 bytes later against its last byte. Only positions
+ * where both match are checked with memcmp, so text that rarely contains
+ * the first and last bytes the right distance apart is skipped a block at
+ * a time.
+ */
+__attribute__((target("sse2"))) static const char *strnstr_sse2(const char *s, const char *find, const size_t s_len, const size_t f_len, size_t *budget) {
+    const __m128i first = _mm_set1_epi8(find[0]);
+    const __m128i last = _mm_set1_epi8(find[f_len - 1]);
+    size_t left = *budget;
+    size_t i = 0;
+
+    for (; i + f_len - 1 + 16 <= s_len; i += 16) {
+        const __m128i a = _mm_loadu_si128((const __m128i *)(s + i));
+        const __m128i b = _mm_loadu_si128((const __m128i *)(s + i + f_len - 1));
+        unsigned int mask = (unsigned int)_mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(a, first), _mm_cmpeq_epi8(b, last)));
+        while (mask) {
+            const int bit = __builtin_ctz(mask);
+            const int found = f_len <= 2 ? TRUE : verify(s + i + bit + 1, find + 1, f_len - 2, &left);
+            if (found < 0) {
+                *budget = 0;
+                return NULL;
+            }
+            if (found) {
+                *budget = left;
+                return s + i + bit;
+            }
+            mask &= mask - 1;
+        }
+    }
+    *budget = left;
+    return strnstr_tail(s, find, s_len, f_len, i);
+}
+
+__attribute__((target("avx2"))) static const char *strnstr_avx2(const char *s, const char *find, const size_t s_len, const size_t f_len, size_t *budget) {
+    const __m256i first = _mm256_set1_epi8(find[0]);
+    const __m256i last = _mm256_set1_epi8(find[f_len - 1]);
+    size_t left = *budget;
+    size_t i = 0;
+
+    for (; i + f_len - 1 + 32 <= s_len; i += 32) {
+        const __m256i a = _mm256_loadu_si256((const __m256i *)(s + i));
+        const __m256i b = _mm256_loadu_si256((const __m256i *)(s + i + f_len - 1));
+        unsigned int mask = (unsigned int)_mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(a, first), _mm256_cmpeq_epi8(b, last)));
+        while (mask) {
+            const int bit = __builtin_ctz(mask);
+            const int found = f_len <= 2 ? TRUE : verify(s + i + bit + 1, find + 1, f_len - 2, &left);
+            if (found < 0) {
+                *budget = 0;
+                return NULL;
+            }
+            if (found) {
+                *budget = left;
+                return s + i + bit;
+            }
+            mask &= mask - 1;
+        }
+    }
+    *budget = left;
+    return strnstr_tail(s, find, s_len, f_len, i);
+}
+
+__attribute__((target("avx512bw"))) static const char *strnstr_avx512bw(const char *s, const char *find, const size_t s_len, const size_t f_len, size_t *budget) {
+    const __m512i first = _mm512_set1_epi8(find[0]);
+    const __m512i last = _mm512_set1_epi8(find[f_len - 1]);
+    size_t left = *budget;
+    size_t i = 0;
+
+    for (; i + f_len - 1 + 64 <= s_len; i += 64) {
+        const __m512i a = _mm512_loadu_si512((const void *)(s + i));
+        const __m512i b = _mm512_loadu_si512((const void *)(s + i + f_len - 1));
+        uint64_t mask = _mm512_cmpeq_epi8_mask(a, first) & _mm512_cmpeq_epi8_mask(b, last);
+        while (mask) {
+            const int bit = __builtin_ctzll(mask);
+            const int found = f_len <= 2 ? TRUE : verify(s + i + bit + 1, find + 1, f_len - 2, &left);
+            if (found < 0) {
+                *budget = 0;
+                return NULL;
+            }
+            if (found) {
+                *budget = left;
+                return s + i + bit;
+            }
+            mask &= mask - 1;
+        }
+    }
+    *budget = left;
+    return strnstr_tail(s, find, s_len, f_len, i);
+}
+
+/*
+ * Case-insensitive versions of the above. find is lowercase, and the
+ * haystack is folded a block at a time by setting 0x20 on A-Z.
+ */
+static int fold_equal(const char *s, const char *find, const size_t len) {
+    size_t i;
+    for (i = 0; i < len; i++) {
+        if (AG_FOLD(s[i]) != find[i]) {
+            return FALSE;
+        }
+    }
+    return TRUE;
+}
+
+/* Like verify(), but charges exactly the bytes compared */
+static int fold_verify(const char *s, const char *find, const size_t len, size_t *left) {
+    size_t i;
+    if (*left < len) {
+        return -1;
+    }
+    for (i = 0; i < len; i++) {
+        if (AG_FOLD(s[i]) != find[i]) {
+            *left -= i + 1;
+            return FALSE;
+        }
+    }
+    *left -= len;
+    return TRUE;
+}
+
+static const char *strncasestr_tail(const char *s, const char *find, const size_t s_len, const size_t f_len, size_t i) {
+    for (; i + f_len <= s_len; i++) {
+        if (fold_equal(s + i, find, f_len)) {
+            return s + i;
+        }
+    }
+    return NULL;
+}
+
+__attribute__((target("sse2"))) static __m128i fold_sse2(const __m128i x) {
+    const __m128i upper = _mm_and_si128(_mm_cmpgt_epi8(x, _mm_set1_epi8('A' - 1)), _mm_cmplt_epi8(x, _mm_set1_epi8('Z' + 1)));
+    return _mm_or_si128(x, _mm_and_si128(upper, _mm_set1_epi8(0x20)));
+}
+
+__attribute__((target("sse2"))) static const char *strncasestr_sse2(const char *s, const char *find, const size_t s_len, const size_t f_len, size_t *budget) {
+    const __m128i first = _mm_set1_epi8(find[0]);
+    const __m128i last = _mm_set1_epi8(find[f_len - 1]);
+    size_t left = *budget;
+    size_t i = 0;
+
+    for (; i + f_len - 1 + 16 <= s_len; i += 16) {
+        const __m128i a = fold_sse2(_mm_loadu_si128((const __m128i *)(s + i)));
+        const __m128i b = fold_sse2(_mm_loadu_si128((const __m128i *)(s + i + f_len - 1)));
+        unsigned int mask = (unsigned int)_mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(a, first), _mm_cmpeq_epi8(b, last)));
+        while (mask) {
+            const int bit = __builtin_ctz(mask);
+            const int found = f_len <= 2 ? TRUE : fold_verify(s + i + bit + 1, find + 1, f_len - 2, &left);
+            if (found < 0) {
+                *budget = 0;
+                return NULL;
+            }
+            if (found) {
+                *budget = left;
+                return s + i + bit;
+            }
+            mask &= mask - 1;
+        }
+    }
+    *budget = left;
+    return strncasestr_tail(s, find, s_len, f_len, i);
+}
+
+__attribute__((target("avx2"))) static __m256i fold_avx2(const __m256i x) {
+    const __m256i upper = _mm256_and_si256(_mm256_cmpgt_epi8(x, _mm256_set1_epi8('A' - 1)), _mm256_cmpgt_epi8(_mm256_set1_epi8('Z' + 1), x));
+    return _mm256_or_si256(x, _mm256_and_si256(upper, _mm256_set1_epi8(0x20)));
+}
+
+__attribute__((target("avx2"))) static const char *strncasestr_avx2(const char *s, const char *find, const size_t s_len, const size_t f_len, size_t *budget) {
+    const __m256i first = _mm256_set1_epi8(find[0]);
+    const __m256i last = _mm256_set1_epi8(find[f_len - 1]);
+    size_t left = *budget;
+    size_t i = 0;
+
+    for (; i + f_len - 1 + 32 <= s_len; i += 32) {
+        const __m256i a = fold_avx2(_mm256_loadu_si256((const __m256i *)(s + i)));
+        const __m256i b = fold_avx2(_mm256_loadu_si256((const __m256i *)(s + i + f_len - 1)));
+        unsigned int mask = (unsigned int)_mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(a, first), _mm256_cmpeq_epi8(b, last)));
+        while (mask) {
+            const int bit = __builtin_ctz(mask);
+            const int found = f_len <= 2 ? TRUE : fold_verify(s + i + bit + 1, find + 1, f_len - 2, &left);
+            if (found < 0) {
+                *budget = 0;
+                return NULL;
+            }
+            if (found) {
+                *budget = left;
+                return s + i + bit;
+            }
+            mask &= mask - 1;
+        }
+    }
+    *budget = left;
+    return strncasestr_tail(s, find, s_len, f_len, i);
+}
+
+__attribute__((target("avx512bw"))) static __m512i fold_avx512bw(const __m512i x) {
+    const __mmask64 upper = _mm512_cmpge_epu8_mask(x, _mm512_set1_epi8('A')) & _mm512_cmple_epu8_mask(x, _mm512_set1_epi8('Z'));
+    return _mm512_mask_add_epi8(x, upper, x, _mm512_set1_epi8(0x20));
+}
+
+__attribute__((target("avx512bw"))) static const char *strncasestr_avx512bw(const char *s, const char *find, const size_t s_len, const size_t f_len, size_t *budget) {
+    const __m512i first = _mm512_set1_epi8(find[0]);
+    const __m512i last = _mm512_set1_epi8(find[f_len - 1]);
+    size_t left = *budget;
+    size_t i = 0;
+
+    for (; i + f_len - 1 + 64 <= s_len; i += 64) {
+        const __m512i a = fold_avx512bw(_mm512_loadu_si512((const void *)(s + i)));
+        const __m512i b = fold_avx512bw(_mm512_loadu_si512((const void *)(s + i + f_len - 1)));
+        uint64_t mask = _mm512_cmpeq_epi8_mask(a, first) & _mm512_cmpeq_epi8_mask(b, last);
+        while (mask) {
+            const int bit = __builtin_ctzll(mask);
+            const int found = f_len <= 2 ? TRUE : fold_verify(s + i + bit + 1, find + 1, f_len - 2, &left);
+            if (found < 0) {
+                *budget = 0;
+                return NULL;
+            }
+            if (found) {
+                *budget = left;
+                return s + i + bit;
+            }
+            mask &= mask - 1;
+        }
+    }
+    *budget = left;
+    return strncasestr_tail(s, find, s_len, f_len, i);
+}
+
+/*
+ * Each byte lane of acc counts the newlines it's seen. A lane overflows
+ * after 255, so the lanes are summed with psadbw every 255 blocks.
+ */
+__attribute__((target("sse2"))) static size_t count_newlines_sse2(const char *buf, const size_t buf_len) {
+    const __m128i nl = _mm_set1_epi8('\n');
+    size_t count = 0;
+    size_t i = 0;
+
+    while (i + 16 <= buf_len) {
+        const size_t end = buf_len - i > 255 * 16 ? i + 255 * 16 : buf_len;
+        __m128i acc = _mm_setzero_si128();
+        __m128i sums;
+        for (; i + 16 <= end; i += 16) {
+            acc = _mm_sub_epi8(acc, _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(buf + i)), nl));
+        }
+        sums = _mm_sad_epu8(acc, _mm_setzero_si128());
+        count += (size_t)_mm_cvtsi128_si32(sums) + (size_t)_mm_extract_epi16(sums, 4);
+    }
+    return count + count_newlines_generic(buf + i, buf_len - i);
+}
+
+__attribute__((target("avx2"))) static size_t count_newlines_avx2(const char *buf, const size_t buf_len) {
+    const __m256i nl = _mm256_set1_epi8('\n');
+    size_t count = 0;
+    size_t i = 0;
+
+    while (i + 32 <= buf_len) {
+        const size_t end = buf_len - i > 255 * 32 ? i + 255 * 32 : buf_len;
+        __m256i acc = _mm256_setzero_si256();
+        __m256i sums256;
+        __m128i sums;
+        for (; i + 32 <= end; i += 32) {
+            acc = _mm256_sub_epi8(acc, _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(buf + i)), nl));
+        }
+        sums256 = _mm256_sad_epu8(acc, _mm256_setzero_si256());
+        sums = _mm_add_epi64(_mm256_castsi256_si128(sums256), _mm256_extracti128_si256(sums256, 1));
+        count += (size_t)_mm_cvtsi128_si32(sums) + (size_t)_mm_extract_epi16(sums, 4);
+    }
+    return count + count_newlines_generic(buf + i, buf_len - i);
+}
+
+__attribute__((target("avx512bw,popcnt"))) static size_t count_newlines_avx512bw(const char *buf, const size_t buf_len) {
+    const __m512i nl = _mm512_set1_epi8('\n');
+    size_t count = 0;
+    size_t i = 0;
+
+    for (; i + 64 <= buf_len; i += 64) {
+        count += __builtin_popcountll(_mm512_cmpeq_epi8_mask(_mm512_loadu_si512((const void *)(buf + i)), nl));
+    }
+    return count + count_newlines_generic(buf + i, buf_len - i);
+}
+
+/*
+ * is_binary() kernels. They must make exactly the same decisions as
+ * is_binary(), so they only decide the cases where that's easy to prove,
+ * and hand everything else to is_binary().
+ *
+ * Bytes in the first 512 are sorted into classes, one bit per byte. If
+ * every byte >= 0x80 is part of a complete UTF-8 character (by
+ * is_binary()'s rules), is_binary() never skips a byte. Then it says
+ * binary iff there's a NUL or more than 10% of the bytes are suspicious.
+ * Its early exit only happens when that's already true.
+ */
+#define IS_BINARY_BYTES 512
+#define IS_BINARY_WORDS (IS_BINARY_BYTES / 64)
+
+typedef struct {
+    uint64_t nul[IS_BINARY_WORDS];
+    uint64_t suspicious[IS_BINARY_WORDS]; /* Control characters other than BS, TAB, LF, VT, FF and CR, and DEL */
+    uint64_t cont[IS_BINARY_WORDS];       /* 10xxxxxx */
+    uint64_t lead2[IS_BINARY_WORDS];      /* C2-DF */
+    uint64_t lead3[IS_BINARY_WORDS];      /* E0-EF */
+    uint64_t lead4[IS_BINARY_WORDS];      /* F0-F4 */
+    uint64_t bad[IS_BINARY_WORDS];        /* C0, C1 and F5-FF */
+} byte_classes_t;
+
+/* Inputs that is_binary() treats specially, or that are too short to bother with */
+static int is_binary_special(const char *buf, const size_t buf_len) {
+    return buf_len < 16 || (unsigned char)buf[0] == 0xEF || buf[0] == '%';
+}
+
+static int is_plain_byte(const unsigned char c) {
+    return (c >= 32 && c <= 126) || (c >= 8 && c <= 13);
+}
+
+static void classify_byte(byte_classes_t *classes, const unsigned char c, const size_t i) {
+    const uint64_t bit = (uint64_t)1 << (i % 64);
+    const size_t w = i / 64;
+
+    if (is_plain_byte(c)) {
+        return;
+    }
+    if (c == 0) {
+        classes->nul[w] |= bit;
+    } else if (c <= 127) {
+        classes->suspicious[w] |= bit;
+    } else if (c < 0xC0) {
+        classes->cont[w] |= bit;
+    } else if (c >= 0xC2 && c < 0xE0) {
+        classes->lead2[w] |= bit;
+    } else if (c >= 0xE0 && c < 0xF0) {
+        classes->lead3[w] |= bit;
+    } else if (c >= 0xF0 && c < 0xF5) {
+        classes->lead4[w] |= bit;
+    } else {
+        classes->bad[w] |= bit;
+    }
+}
+
+static int is_binary_decide(const byte_classes_t *classes, const char *buf, const size_t buf_len, const size_t total) {
+    uint64_t carry = 0;
+    int nul = FALSE;
+    size_t suspicious_bytes = 0;
+    size_t w;
+
+    for (w = 0; w < (total + 63) / 64; w++) {
+        const uint64_t lead234 = classes->lead2[w] | classes->lead3[w] | classes->lead4[w];
+        const uint64_t lead34 = classes->lead3[w] | classes->lead4[w];
+        /* Where continuation bytes have to be, and nowhere else */
+        const uint64_t expected = (lead234 << 1) | (lead34 << 2) | (classes->lead4[w] << 3) | carry;
+        if (expected != classes->cont[w] || classes->bad[w]) {
+            return is_binary(buf, buf_len);
+        }
+        carry = (lead234 >> 63) | (lead34 >> 62) | (classes->lead4[w] >> 61);
+        nul |= classes->nul[w] != 0;
+        suspicious_bytes += __builtin_popcountll(classes->suspicious[w]);
+    }
+    /* A character runs past the bytes is_binary() looks at. It reads on, but we don't. */
+    if (carry) {
+        return is_binary(buf, buf_len);
+    }
+    return nul || 10 * suspicious_bytes > total;
+}
+
+/* Non-plain bytes: anything but 32-126 and 8-13 */
+__attribute__((target("sse2"))) static __m128i nonplain_sse2(const __m128i x) {
+    const __m128i printable = _mm_andnot_si128(_mm_cmpeq_epi8(x, _mm_set1_epi8(127)), _mm_cmpgt_epi8(x, _mm_set1_epi8(31)));
+    const __m128i space = _mm_and_si128(_mm_cmpgt_epi8(x, _mm_set1_epi8(7)), _mm_cmplt_epi8(x, _mm_set1_epi8(14)));
+    return _mm_andnot_si128(_mm_or_si128(printable, space), _mm_set1_epi8(-1));
+}
+
+/* Unsigned lo <= x <= hi */
+__attribute__((target("sse2"))) static unsigned int range_sse2(const __m128i x, const unsigned char lo, const unsigned char hi) {
+    const __m128i ge = _mm_cmpeq_epi8(_mm_max_epu8(x, _mm_set1_epi8((char)lo)), x);
+    const __m128i le = _mm_cmpeq_epi8(_mm_min_epu8(x, _mm_set1_epi8((char)hi)), x);
+    return (unsigned int)_mm_movemask_epi8(_mm_and_si128(ge, le));
+}
+
+__attribute__((target("sse2"))) static int is_binary_sse2(const char *buf, const size_t buf_len) {
+    const size_t total = buf_len > IS_BINARY_BYTES ? IS_BINARY_BYTES : buf_len;
+    const unsigned char *s = (const unsigned char *)buf;
+    __m128i nonplain = _mm_setzero_si128();
+    byte_classes_t classes;
+    size_t i;
+
+    if (is_binary_special(buf, buf_len)) {
+        return is_binary(buf, buf_len);
+    }
+    for (i = 0; i + 16 <= total; i += 16) {
+        nonplain = _mm_or_si128(nonplain, nonplain_sse2(_mm_loadu_si128((const __m128i *)(s + i))));
+    }
+    if (!_mm_movemask_epi8(nonplain)) {
+        for (; i < total && is_plain_byte(s[i]); i++) {
+        }
+        if (i == total) {
+            return 0;
+        }
+    }
+
+    memset(&classes, 0, sizeof(classes));
+    for (i = 0; i + 16 <= total; i += 16) {
+        const __m128i x = _mm_loadu_si128((const __m128i *)(s + i));
+        const size_t w = i / 64;
+        const int shift = i % 64;
+        classes.nul[w] |= (uint64_t)(unsigned int)_mm_movemask_epi8(_mm_cmpeq_epi8(x, _mm_setzero_si128())) << shift;
+        classes.suspicious[w] |= (uint64_t)(range_sse2(x, 1, 7) | range_sse2(x, 14, 31) | range_sse2(x, 127, 127)) << shift;
+        classes.cont[w] |= (uint64_t)range_sse2(x, 0x80, 0xBF) << shift;
+        classes.lead2[w] |= (uint64_t)range_sse2(x, 0xC2, 0xDF) << shift;
+        classes.lead3[w] |= (uint64_t)range_sse2(x, 0xE0, 0xEF) << shift;
+        classes.lead4[w] |= (uint64_t)range_sse2(x, 0xF0, 0xF4) << shift;
+        classes.bad[w] |= (uint64_t)(range_sse2(x, 0xC0, 0xC1) | range_sse2(x, 0xF5, 0xFF)) << shift;
+    }
+    for (; i < total; i++) {
+        classify_byte(&classes, s[i], i);
+    }
+    return is_binary_decide(&classes, buf, buf_len, total);
+}
+
+__attribute__((target("avx2"))) static __m256i nonplain_avx2(const __m256i x) {
+    const __m256i printable = _mm256_andnot_si256(_mm256_cmpeq_epi8(x, _mm256_set1_epi8(127)), _mm256_cmpgt_epi8(x, _mm256_set1_epi8(31)));
+    const __m256i space = _mm256_and_si256(_mm256_cmpgt_epi8(x, _mm256_set1_epi8(7)), _mm256_cmpgt_epi8(_mm256_set1_epi8(14), x));
+    return _mm256_andnot_si256(_mm256_or_si256(printable, space), _mm256_set1_epi8(-1));
+}
+
+__attribute__((target("avx2"))) static uint64_t range_avx2(const __m256i x, const unsigned char lo, const unsigned char hi) {
+    const __m256i ge = _mm256_cmpeq_epi8(_mm256_max_epu8(x, _mm256_set1_epi8((char)lo)), x);
+    const __m256i le = _mm256_cmpeq_epi8(_mm256_min_epu8(x, _mm256_set1_epi8((char)hi)), x);
+    return (uint32_t)_mm256_movemask_epi8(_mm256_and_si256(ge, le));
+}
+
+__attribute__((target("avx2"))) static int is_binary_avx2(const char *buf, const size_t buf_len) {
+    const size_t total = buf_len > IS_BINARY_BYTES ? IS_BINARY_BYTES : buf_len;
+    const unsigned char *s = (const unsigned char *)buf;
+    __m256i nonplain = _mm256_setzero_si256();
+    byte_classes_t classes;
+    size_t i;
+
+    if (is_binary_special(buf, buf_len)) {
+        return is_binary(buf, buf_len);
+    }
+    for (i = 0; i + 32 <= total; i += 32) {
+        nonplain = _mm256_or_si256(nonplain, nonplain_avx2(_mm256_loadu_si256((const __m256i *)(s + i))));
+    }
+    if (_mm256_testz_si256(nonplain, nonplain)) {
+        for (; i < total && is_plain_byte(s[i]); i++) {
+        }
+        if (i == total) {
+            return 0;
+        }
+    }
+
+    memset(&classes, 0, sizeof(classes));
+    for (i = 0; i + 32 <= total; i += 32) {
+        const __m256i x = _mm256_loadu_si256((const __m256i *)(s + i));
+        const size_t w = i / 64;
+        const int shift = i % 64;
+        classes.nul[w] |= (uint64_t)(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(x, _mm256_setzero_si256())) << shift;
+        classes.suspicious[w] |= (range_avx2(x, 1, 7) | range_avx2(x, 14, 31) | range_avx2(x, 127, 127)) << shift;
+        classes.cont[w] |= range_avx2(x, 0x80, 0xBF) << shift;
+        classes.lead2[w] |= range_avx2(x, 0xC2, 0xDF) << shift;
+        classes.lead3[w] |= range_avx2(x, 0xE0, 0xEF) << shift;
+        classes.lead4[w] |= range_avx2(x, 0xF0, 0xF4) << shift;
+        classes.bad[w] |= (range_avx2(x, 0xC0, 0xC1) | range_avx2(x, 0xF5, 0xFF)) << shift;
+    }
+    for (; i < total; i++) {
+        classify_byte(&classes, s[i], i);
+    }
+    return is_binary_decide(&classes, buf, buf_len, total);
+}
+
+__attribute__((target("avx512bw"))) static uint64_t range_avx512bw(const __m512i x, const unsigned char lo, const unsigned char hi) {
+    return _mm512_cmpge_epu8_mask(x, _mm512_set1_epi8((char)lo)) & _mm512_cmple_epu8_mask(x, _mm512_set1_epi8((char)hi));
+}
+
+/* The masked load never faults on the bytes it leaves out, so there's no scalar tail */
+__attribute__((target("avx512bw,popcnt"))) static int is_binary_avx512bw(const char *buf, const size_t buf_len) {
+    const size_t total = buf_len > IS_BINARY_BYTES ? IS_BINARY_BYTES : buf_len;
+    byte_classes_t classes;
+    uint64_t nonplain = 0;
+    size_t i;
+
+    if (is_binary_special(buf, buf_len)) {
+        return is_binary(buf, buf_len);
+    }
+    for (i = 0; i < total; i += 64) {
+        const __mmask64 load = total - i >= 64 ? ~(__mmask64)0 : ((__mmask64)1 << (total - i)) - 1;
+        const __m512i x = _mm512_maskz_loadu_epi8(load, buf + i);
+        const uint64_t plain = range_avx512bw(x, 32, 126) | range_avx512bw(x, 8, 13);
+        nonplain |= ~plain & load;
+    }
+    if (!nonplain) {
+        return 0;
+    }
+
+    for (i = 0; i < total; i += 64) {
+        const __mmask64 load = total - i >= 64 ? ~(__mmask64)0 : ((__mmask64)1 << (total - i)) - 1;
+        const __m512i x = _mm512_maskz_loadu_epi8(load, buf + i);
+        const size_t w = i / 64;
+        classes.nul[w] = _mm512_cmpeq_epi8_mask(x, _mm512_setzero_si512()) & load;
+        classes.suspicious[w] = range_avx512bw(x, 1, 7) | range_avx512bw(x, 14, 31) | range_avx512bw(x, 127, 127);
+        classes.cont[w] = range_avx512bw(x, 0x80, 0xBF);
+        classes.lead2[w] = range_avx512bw(x, 0xC2, 0xDF);
+        classes.lead3[w] = range_avx512bw(x, 0xE0, 0xEF);
+        classes.lead4[w] = range_avx512bw(x, 0xF0, 0xF4);
+        classes.bad[w] = range_avx512bw(x, 0xC0, 0xC1) | range_avx512bw(x, 0xF5, 0xFF);
+    }
+    return is_binary_decide(&classes, buf, buf_len, total);
+}
+
+/*
+ * Teddy: each of the first masks->len bytes of a block is split into
+ * nibbles, and pshufb looks up which buckets have a literal with that
+ * nibble there. ANDing all of them leaves the buckets whose literals
+ * could start at each position. Nibbles are coarser than bytes, so some
+ * of those are false positives, which the caller's check weeds out.
+ */
+__attribute__((target("sse4.2"))) static const char *litset_sse42(const litset_masks_t *masks, const char *s, const size_t s_len, unsigned int *buckets) {
+    const __m128i nibble = _mm_set1_epi8(0x0f);
+    const size_t len = masks->len;
+    __m128i lo[LITSET_MASK_BYTES];
+    __m128i hi[LITSET_MASK_BYTES];
+    size_t i = 0;
+    size_t k;
+
+    for (k = 0; k < len; k++) {
+        lo[k] = _mm_loadu_si128((const __m128i *)masks->lo[k]);
+        hi[k] = _mm_loadu_si128((const __m128i *)masks->hi[k]);
+    }
+    for (; i + len - 1 + 16 <= s_len; i += 16) {
+        __m128i r = _mm_set1_epi8(-1);
+        unsigned int mask;
+        for (k = 0; k < len; k++) {
+            const __m128i x = _mm_loadu_si128((const __m128i *)(s + i + k));
+            const __m128i l = _mm_shuffle_epi8(lo[k], _mm_and_si128(x, nibble));
+            const __m128i h = _mm_shuffle_epi8(hi[k], _mm_and_si128(_mm_srli_epi16(x, 4), nibble));
+            r = _mm_and_si128(r, _mm_and_si128(l, h));
+        }
+        mask = ~(unsigned int)_mm_movemask_epi8(_mm_cmpeq_epi8(r, _mm_setzero_si128())) & 0xFFFF;
+        if (mask) {
+            uint8_t r_bytes[16];
+            const int bit = __builtin_ctz(mask);
+            _mm_storeu_si128((__m128i *)r_bytes, r);
+            *buckets = r_bytes[bit];
+            return s + i + bit;
+        }
+    }
+    return litset_tail(masks, s, s_len, i, buckets);
+}
+
+__attribute__((target("avx2"))) static const char *litset_avx2(const litset_masks_t *masks, const char *s, const size_t s_len, unsigned int *buckets) {
+    const __m256i nibble = _mm256_set1_epi8(0x0f);
+    const size_t len = masks->len;
+    __m256i lo[LITSET_MASK_BYTES];
+    __m256i hi[LITSET_MASK_BYTES];
+    size_t i = 0;
+    size_t k;
+
+    /* vpshufb looks up within each 128-bit lane, so both lanes get the table */
+    for (k = 0; k < len; k++) {
+        lo[k] = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)masks->lo[k]));
+        hi[k] = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)masks->hi[k]));
+    }
+    for (; i + len - 1 + 32 <= s_len; i += 32) {
+        __m256i r = _mm256_set1_epi8(-1);
+        unsigned int mask;
+        for (k = 0; k < len; k++) {
+            const __m256i x = _mm256_loadu_si256((const __m256i *)(s + i + k));
+            const __m256i l = _mm256_shuffle_epi8(lo[k], _mm256_and_si256(x, nibble));
+            const __m256i h = _mm256_shuffle_epi8(hi[k], _mm256_and_si256(_mm256_srli_epi16(x, 4), nibble));
+            r = _mm256_and_si256(r, _mm256_and_si256(l, h));
+        }
+        mask = ~(unsigned int)_mm256_movemask_epi8(_mm256_cmpeq_epi8(r, _mm256_setzero_si256()));
+        if (mask) {
+            uint8_t r_bytes[32];
+            const int bit = __builtin_ctz(mask);
+            _mm256_storeu_si256((__m256i *)r_bytes, r);
+            *buckets = r_bytes[bit];
+            return s + i + bit;
+        }
+    }
+    return litset_tail(masks, s, s_len, i, buckets);
+}
+
+#endif
+
+/*
+ * What each level adds. A NULL slot is inherited from the level below, and
+ * the generic level's NULL searches mean util.c's. The literal set search
+ * needs pshufb, so it starts at SSE4.2 (which implies SSSE3).
+ */
+static const ag_kernels levels[KERNEL_LEVEL_COUNT] = {
+    { KERNEL_GENERIC, NULL, NULL, &count_newlines_generic, &is_binary, &litset_generic, 0, 0, 0, 0, 0 },
+#ifdef HAVE_X86_KERNELS
+    { KERNEL_SSE2, &strnstr_sse2, &strncasestr_sse2, &count_newlines_sse2, &is_binary_sse2, NULL, 0, 0, 0, 0, 0 },
+    { KERNEL_SSE42, NULL, NULL, NULL, NULL, &litset_sse42, 0, 0, 0, 0, 0 },
+    { KERNEL_AVX2, &strnstr_avx2, &strncasestr_avx2, &count_newlines_avx2, &is_binary_avx2, &litset_avx2, 0, 0, 0, 0, 0 },
+    { KERNEL_AVX512BW, &strnstr_avx512bw, &strncasestr_avx512bw, &count_newlines_avx512bw, &is_binary_avx512bw, NULL, 0, 0, 0, 0, 0 },
+#endif
+};
+
+ag_kernels kernels = { KERNEL_GENERIC, NULL, NULL, &count_newlines_generic, &is_binary, &litset_generic, 0, 0, 0, 0, 0 };
+
+int kernels_level_supported(const kernel_level_t level) {
+#ifdef HAVE_X86_KERNELS
+    __builtin_cpu_init();
+    switch (level) {
+        case KERNEL_GENERIC:
+            return TRUE;
+        case KERNEL_SSE2:
+            return __builtin_cpu_supports("sse2");
+        case KERNEL_SSE42:
+            return __builtin_cpu_supports("sse4.2");
+        case KERNEL_AVX2:
+            return __builtin_cpu_supports("avx2");
+        case KERNEL_AVX512BW:
+            return __builtin_cpu_supports("avx512bw") && __builtin_cpu_supports("popcnt");
+        default:
+            return FALSE;
+    }
+#else
+    return level == KERNEL_GENERIC;
+#endif
+}
+
+kernel_level_t kernels_best_level(void) {
+    int level;
+    for (level = KERNEL_LEVEL_COUNT - 1; level > KERNEL_GENERIC; level--) {
+        if (kernels_level_supported(level)) {
+            return level;
+        }
+    }
+    return KERNEL_GENERIC;
+}
+
+void kernels_for_level(ag_kernels *k, const kernel_level_t level) {
+    int i;
+
+    *k = levels[KERNEL_GENERIC];
+    for (i = KERNEL_GENERIC + 1; i <= (int)level && i < KERNEL_LEVEL_COUNT; i++) {
+        const ag_kernels *l = &levels[i];
+        if (l->strnstr) {
+            k->strnstr = l->strnstr;
+            k->strnstr_level = i;
+        }
+        if (l->strncasestr) {
+            k->strncasestr = l->strncasestr;
+            k->strncasestr_level = i;
+        }
+        if (l->count_newlines) {
+            k->count_newlines = l->count_newlines;
+            k->count_newlines_level = i;
+        }
+        if (l->is_binary) {
+            k->is_binary = l->is_binary;
+            k->is_binary_level = i;
+        }
+        if (l->litset) {
+            k->litset = l->litset;
+            k->litset_level = i;
+        }
+    }
+    k->level = level;
+}
+
+void kernels_init(const char *force) {
+    kernel_level_t best = kernels_best_level();
+    kernel_level_t level = best;
+
+    if (force) {
+        level = kernel_level_from_name(force);
+        if (level == KERNEL_LEVEL_COUNT) {
+            die("Unknown kernel %s. Use one of generic, sse2, sse4.2, avx2 or avx512bw.", force);
+        }
+        if (!kernels_level_supported(level)) {
+            die("This CPU can't run the %s kernels.", force);
+        }
+    }
+    kernels_for_level(&kernels, level);
+    log_debug("Using %s kernels (best for this CPU: %s). Literal search: %s, case-insensitive search: %s, newlines: %s, is_binary: %s, literal sets: %s",
+              level_names[level], level_names[best],
+              level_names[kernels.strnstr_level], level_names[kernels.strncasestr_level],
+              level_names[kernels.count_newlines_level], level_names[kernels.is_binary_level],
+              level_names[kernels.litset_level]);
+}
+
+const char *kernel_level_name(const kernel_level_t level) {
+    return level < KERNEL_LEVEL_COUNT ? level_names[level] : "unknown";
+}
+
+kernel_level_t kernel_level_from_name(const char *name) {
+    int i;
+    for (i = 0; i < KERNEL_LEVEL_COUNT; i++) {
+        if (strcmp(name, level_names[i]) == 0) {
+            return i;
+        }
+    }
+    return KERNEL_LEVEL_COUNT;
+}
@@ -0,0 +1,79 @@
+#ifndef KERNELS_H
+#define KERNELS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * The hot byte-scanning loops, picked at startup for the CPU ag is running
+ * on. Distro builds can't assume anything past the base instruction set, so
+ * every SIMD version is compiled with a target attribute and only used if
+ * the CPU (and OS) support it.
+ *
+ * Each slot gets the best implementation at or below the chosen level. A
+ * NULL search slot means "use the Boyer-Moore/hash/Two-Way searches in util.c".
+ */
+
+typedef enum {
+    KERNEL_GENERIC,
+    KERNEL_SSE2,
+    KERNEL_SSE42,
+    KERNEL_AVX2,
+    KERNEL_AVX512BW,
+    KERNEL_LEVEL_COUNT
+} kernel_level_t;
+
+/* Returns the first occurrence of find in s, or NULL. budget works like the util.c searches' (see VERIFY_BUDGET). */
+typedef const char *(*kernel_strnstr_fp)(const char *s, const char *find, const size_t s_len, const size_t f_len, size_t *budget);
+typedef size_t (*kernel_count_fp)(const char *buf, const size_t buf_len);
+typedef int (*kernel_is_binary_fp)(const char *buf, const size_t buf_len);
+
+/*
+ * The first len bytes of a set of literals that's been split into up to 8
+ * buckets (see litset.c). For byte k of a literal, lo[k] and hi[k] have its
+ * bucket's bit set under the byte's low and high nibble, and bytes[k] under
+ * the byte itself. Every literal is at least len bytes long.
+ */
+#define LITSET_MASK_BYTES 3
+
+typedef struct {
+    size_t len;
+    uint8_t lo[LITSET_MASK_BYTES][16];
+    uint8_t hi[LITSET_MASK_BYTES][16];
+    uint8_t bytes[LITSET_MASK_BYTES][256];
+} litset_masks_t;
+
+/* Returns the first position where some bucket's literals might start and sets *buckets to their bits, or NULL */
+typedef const char *(*kernel_litset_fp)(const litset_masks_t *masks, const char *s, const size_t s_len, unsigned int *buckets);
+
+typedef struct {
+    kernel_level_t level;
+    kernel_strnstr_fp strnstr;
+    kernel_strnstr_fp strncasestr; /* find must already be lowercase */
+    kernel_count_fp count_newlines;
+    kernel_is_binary_fp is_binary;
+    kernel_litset_fp litset;
+    /* The level each slot's implementation was written for */
+    kernel_level_t strnstr_level;
+    kernel_level_t strncasestr_level;
+    kernel_level_t count_newlines_level;
+    kernel_level_t is_binary_level;
+    kernel_level_t litset_level;
+} ag_kernels;
+
+/* Generic kernels until kernels_init() is called */
+extern ag_kernels kernels;
+
+/* Picks the kernels for this CPU, or for the level named by force (dies if the CPU can't run it) */
+void kernels_init(const char *force);
+
+kernel_level_t kernels_best_level(void);
+int kernels_level_supported(const kernel_level_t level);
+/* Fills k with the kernels for level, whether or not this CPU supports it */
+void kernels_for_level(ag_kernels *k, const kernel_level_t level);
+
+const char *kernel_level_name(const kernel_level_t level);
+/* Returns KERNEL_LEVEL_COUNT if name isn't a level */
+kernel_level_t kernel_level_from_name(const char *name);
+
+#endif
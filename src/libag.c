@@ -0,0 +1,221 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "config.h"
+#include "ignore.h"
+#include "libag.h"
+#include "log.h"
+#include "options.h"
+#ifdef HAVE_PCRE2
+#include "pcre_api.h"
+#endif
+#include "print.h"
+#include "search.h"
+#include "util.h"
+
+/* What ag_search() sets up once for every context */
+static pthread_once_t libag_once = PTHREAD_ONCE_INIT;
+
+static void libag_init(void) {
+    if (out_fd == NULL) {
+        out_fd = stderr;
+    }
+    kernels_init(NULL);
+}
+
+void ag_config_init(ag_config *config) {
+    memset(config, 0, sizeof(ag_config));
+    config->search_zip_files = TRUE;
+    config->multiline = TRUE;
+    config->max_search_depth = DEFAULT_MAX_SEARCH_DEPTH;
+}
+
+ag_ctx *ag_ctx_new(const ag_config *config) {
+    ag_config defaults;
+    cli_options o;
+
+    if (config == NULL) {
+        ag_config_init(&defaults);
+        config = &defaults;
+    }
+    init_cli_options(&o);
+    o.color = FALSE;
+    o.use_thread_affinity = FALSE;
+    o.search_hidden_files = config->search_hidden_files;
+    o.search_binary_files = config->search_binary_files;
+    o.search_zip_files = config->search_zip_files;
+    o.follow_symlinks = config->follow_symlinks;
+    o.one_dev = config->one_dev;
+    o.skip_vcs_ignores = config->skip_vcs_ignores;
+    o.multiline = config->multiline;
+    o.max_search_depth = config->max_search_depth;
+    o.max_matches_per_file = config->max_matches_per_file;
+    o.workers = config->workers;
+    o.casing = CASE_SMART;
+    return search_ctx_new(&o, init_ignore(NULL, "", 0));
+}
+
+void ag_ctx_free(ag_ctx *ctx) {
+    search_ctx_free(ctx);
+}
+
+static int check_regex(const char *pattern, char **err) {
+#ifdef HAVE_PCRE2
+    int pcre2_err = 0;
+    PCRE2_SIZE err_offset = 0;
+    char err_buf[120] = { 0 };
+    pcre2_code *re = pcre2_compile((PCRE2_SPTR8)pattern, PCRE2_ZERO_TERMINATED, 0, &pcre2_err, &err_offset, NULL);
+    if (re == NULL) {
+        if (err) {
+            pcre2_get_error_message(pcre2_err, (PCRE2_UCHAR8 *)err_buf, sizeof(err_buf));
+            ag_asprintf(err, "Bad regex at position %lu: %s", (unsigned long)err_offset, err_buf);
+        }
+        return -1;
+    }
+    pcre2_code_free(re);
+#else
+    const char *pcre_err = NULL;
+    int err_offset = 0;
+    pcre *re = pcre_compile(pattern, 0, &pcre_err, &err_offset, NULL);
+    if (re == NULL) {
+        if (err) {
+            ag_asprintf(err, "Bad regex at position %i: %s", err_offset, pcre_err);
+        }
+        return -1;
+    }
+    pcre_free(re);
+#endif
+    return 0;
+}
+
+int ag_add_query(ag_ctx *ctx, const char *id, const char *pattern, int flags, char **err) {
+    enum case_behavior casing = CASE_SMART;
+    int literal = (flags & AG_QUERY_LITERAL) || !is_regex(pattern);
+
+    if (err) {
+        *err = NULL;
+    }
+    if (!literal && check_regex(pattern, err) != 0) {
+        return -1;
+    }
+    if (flags & AG_QUERY_CASE_SENSITIVE) {
+        casing = CASE_SENSITIVE;
+    } else if (flags & AG_QUERY_CASE_INSENSITIVE) {
+        casing = CASE_INSENSITIVE;
+    }
+    add_matcher(ctx, id, pattern, literal, casing, flags & AG_QUERY_WORD);
+    if (ctx->opts.query == NULL) {
+        /* search_file() looks at the first query to decide whether empty files can match */
+        ctx->opts.query = ag_strdup(pattern);
+        ctx->opts.query_len = strlen(pattern);
+        ctx->opts.literal = literal;
+    }
+    return 0;
+}
+
+void ag_add_ignore(ag_ctx *ctx, const char *pattern) {
+    add_ignore_pattern(ctx->root_ignores, pattern);
+}
+
+/* Turns search_buf()'s match offsets into ag_match records */
+static void deliver_matches(ag_ctx *ctx, const char *path, const matcher_t *m, const char *buf, const size_t buf_len,
+                            const size_t first_line, const size_t buf_offset, const match_t matches[], const size_t matches_len) {
+    ag_match match;
+    size_t line = first_line;
+    size_t line_start = 0;
+    size_t i;
+
+    match.path = path;
+    match.query_id = m->id;
+
+    pthread_mutex_lock(&ctx->match_fn_mtx);
+    for (i = 0; i < matches_len; i++) {
+        const char *newline;
+        const char *line_end;
+
+        while (line_start < matches[i].start &&
+               (newline = memchr(buf + line_start, '\n', matches[i].start - line_start)) != NULL) {
+            line++;
+            line_start = newline - buf + 1;
+        }
+        line_end = memchr(buf + line_start, '\n', buf_len - line_start);
+
+        match.line = line;
+        match.column = matches[i].start - line_start + 1;
+        match.byte_start = buf_offset + matches[i].start;
+        match.byte_end = buf_offset + matches[i].end;
+        match.line_text = buf + line_start;
+        match.line_len = line_end ? (size_t)(line_end - (buf + line_start)) : buf_len - line_start;
+        ctx->match_fn(&match, ctx->match_baton);
+        ctx->match_count++;
+    }
+    pthread_mutex_unlock(&ctx->match_fn_mtx);
+}
+
+ssize_t ag_search(ag_ctx *ctx, const char *const *paths, size_t paths_len, ag_match_fn fn, void *baton) {
+    char **search_paths_list;
+    char **base_paths;
+    char *base_path;
+    size_t path_len;
+    size_t i;
+    int num_cores;
+    int workers_len;
+    ssize_t rv;
+
+    if (ctx->matchers_len == 0) {
+        return -1;
+    }
+    pthread_once(&libag_once, &libag_init);
+
+    /* Same normalization as parse_options() */
+    ctx->opts.paths_len = paths_len;
+    search_paths_list = ag_calloc(paths_len + 1, sizeof(char *));
+    base_paths = ag_calloc(paths_len + 1, sizeof(char *));
+    for (i = 0; i < paths_len; i++) {
+        search_paths_list[i] = ag_strdup(paths[i]);
+        path_len = strlen(search_paths_list[i]);
+        if (path_len > 1 && search_paths_list[i][path_len - 1] == '/') {
+            search_paths_list[i][path_len - 1] = '\0';
+        }
+        base_path = realpath(search_paths_list[i], NULL);
+        if (base_path) {
+            path_len = strlen(base_path);
+            if (path_len > 1 && base_path[path_len - 1] != '/') {
+                base_path = ag_realloc(base_path, path_len + 2);
+                base_path[path_len] = '/';
+                base_path[path_len + 1] = '\0';
+            }
+        }
+        base_paths[i] = base_path;
+    }
+
+    num_cores = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    workers_len = ctx->opts.workers;
+    if (workers_len < 1) {
+        workers_len = num_cores < 8 ? num_cores : 8;
+    }
+    if (workers_len < 1) {
+        workers_len = 1;
+    }
+
+    ctx->match_fn = fn;
+    ctx->match_baton = baton;
+    ctx->match_count = 0;
+    ctx->match_callback = &deliver_matches;
+    if (search_paths(ctx, search_paths_list, base_paths, workers_len, num_cores, &walk_paths) == 0) {
+        rv = (ssize_t)ctx->match_count;
+    } else {
+        rv = -1;
+    }
+
+    for (i = 0; i < paths_len; i++) {
+        free(search_paths_list[i]);
+        free(base_paths[i]);
+    }
+    free(search_paths_list);
+    free(base_paths);
+    return rv;
+}
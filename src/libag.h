@@ -0,0 +1,76 @@
+#ifndef LIBAG_H
+#define LIBAG_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+/*
+ * libag: ag's traversal, ignore handling and search as a library.
+ *
+ *   ag_config config;
+ *   ag_config_init(&config);
+ *   ag_ctx *ctx = ag_ctx_new(&config);
+ *   ag_add_query(ctx, NULL, "TODO", AG_QUERY_LITERAL, NULL);
+ *   ag_search(ctx, paths, paths_len, &on_match, baton);
+ *   ag_ctx_free(ctx);
+ *
+ * Each context holds its own options, ignores, queries and work queue, so
+ * searches in different contexts can run at the same time from different
+ * threads. A context runs one search at a time, and shouldn't be changed
+ * while it's searching. Don't call ag_search() on a context from its own
+ * ag_match_fn.
+ *
+ * Bad patterns, unreadable files and threads that can't be started are
+ * reported, not fatal. Running out of memory still exits the process, as it
+ * does in ag.
+ */
+
+#define AG_QUERY_LITERAL (1 << 0)          /* Like -Q. Patterns that aren't regexes are always literal. */
+#define AG_QUERY_WORD (1 << 1)             /* Like -w */
+#define AG_QUERY_CASE_SENSITIVE (1 << 2)   /* Like -s. Default is smart case. */
+#define AG_QUERY_CASE_INSENSITIVE (1 << 3) /* Like -i */
+
+typedef struct {
+    int search_hidden_files; /* --hidden */
+    int search_binary_files; /* --search-binary */
+    int search_zip_files;    /* -z */
+    int follow_symlinks;     /* -f */
+    int one_dev;             /* --one-device */
+    int skip_vcs_ignores;    /* -U */
+    int multiline;           /* Let regexes match across lines. Default on. */
+    int max_search_depth;    /* --depth. -1 for unlimited */
+    size_t max_matches_per_file;
+    int workers; /* 0 to pick based on the number of CPUs */
+} ag_config;
+
+typedef struct ag_ctx ag_ctx;
+
+typedef struct {
+    const char *path;
+    const char *query_id; /* As passed to ag_add_query() */
+    size_t line;          /* 1-based */
+    size_t column;        /* 1-based, in bytes */
+    size_t byte_start;    /* Offset of the match in the file */
+    size_t byte_end;
+    const char *line_text; /* The line the match starts on. Not NUL-terminated. */
+    size_t line_len;
+} ag_match;
+
+/* Called for every match. Calls for one context are serialized. Pointers are only valid during the call. */
+typedef void (*ag_match_fn)(const ag_match *match, void *baton);
+
+void ag_config_init(ag_config *config);
+
+ag_ctx *ag_ctx_new(const ag_config *config);
+void ag_ctx_free(ag_ctx *ctx);
+
+/* Returns 0, or -1 if pattern isn't a valid regex. If err isn't NULL, it's set to a message the caller frees. */
+int ag_add_query(ag_ctx *ctx, const char *id, const char *pattern, int flags, char **err);
+
+/* Same syntax as --ignore */
+void ag_add_ignore(ag_ctx *ctx, const char *pattern);
+
+/* Returns the number of matches, or -1 if ctx has no queries or no search thread could be started. */
+ssize_t ag_search(ag_ctx *ctx, const char *const *paths, size_t paths_len, ag_match_fn fn, void *baton);
+
+#endif
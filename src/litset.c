@@ -0,0 +1,293 @@
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "kernels.h"
+#include "litset.h"
+#include "util.h"
+
+#define LITSET_BUCKETS 8
+
+struct litset {
+    char **literals; /* In pattern order, folded if caseless */
+    size_t *lens;
+    unsigned int *buckets; /* Each literal's bucket bit */
+    size_t literals_len;
+    int caseless;
+    int word; /* \b on both ends */
+    litset_masks_t masks;
+};
+
+/* What a pattern is made of, once escapes are resolved */
+enum {
+    TOKEN_LITERAL,
+    TOKEN_BAR,
+    TOKEN_OPEN,
+    TOKEN_CLOSE,
+    TOKEN_WORD_BOUNDARY
+};
+
+typedef struct {
+    int type;
+    unsigned char c; /* For TOKEN_LITERAL */
+} token_t;
+
+static int hex_value(const char c) {
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    }
+    if (c >= 'a' && c <= 'f') {
+        return c - 'a' + 10;
+    }
+    if (c >= 'A' && c <= 'F') {
+        return c - 'A' + 10;
+    }
+    return -1;
+}
+
+/* Returns how many tokens pattern has, or -1 if it uses anything but literals, |, plain groups and \b */
+static int tokenize(const char *pattern, token_t *tokens) {
+    const char *p = pattern;
+    int len = 0;
+
+    while (*p) {
+        token_t *t = &tokens[len++];
+        t->type = TOKEN_LITERAL;
+        switch (*p) {
+            case '\\':
+                p++;
+                switch (*p) {
+                    case 'b':
+                        t->type = TOKEN_WORD_BOUNDARY;
+                        break;
+                    case 't':
+                        t->c = '\t';
+                        break;
+                    case 'r':
+                        t->c = '\r';
+                        break;
+                    case 'f':
+                        t->c = '\f';
+                        break;
+                    case 'e':
+                        t->c = '\033';
+                        break;
+                    case 'a':
+                        t->c = '\a';
+                        break;
+                    case 'x':
+                        /* Only the two-digit form. PCRE also takes fewer digits and \x{...}. */
+                        if (hex_value(p[1]) < 0 || hex_value(p[2]) < 0) {
+                            return -1;
+                        }
+                        t->c = hex_value(p[1]) * 16 + hex_value(p[2]);
+                        if (t->c == '\0' || t->c == '\n') {
+                            return -1;
+                        }
+                        p += 2;
+                        break;
+                    default:
+                        if (!ispunct((unsigned char)*p) && *p != ' ') {
+                            return -1;
+                        }
+                        t->c = *p;
+                        break;
+                }
+                break;
+            case '(':
+                if (p[1] == '?') {
+                    if (p[2] != ':') {
+                        return -1;
+                    }
+                    p += 2;
+                }
+                t->type = TOKEN_OPEN;
+                break;
+            case ')':
+                t->type = TOKEN_CLOSE;
+                break;
+            case '|':
+                t->type = TOKEN_BAR;
+                break;
+            case '.':
+            case '[':
+            case '{':
+            case '*':
+            case '+':
+            case '?':
+            case '^':
+            case '$':
+            case '\n':
+                return -1;
+            default:
+                t->c = *p;
+                break;
+        }
+        p++;
+    }
+    return len;
+}
+
+static void add_to_masks(litset_masks_t *masks, const size_t k, const unsigned char c, const unsigned int bucket) {
+    masks->bytes[k][c] |= bucket;
+    masks->lo[k][c & 0x0f] |= bucket;
+    masks->hi[k][c >> 4] |= bucket;
+}
+
+litset_t *litset_compile(const char *pattern, const int caseless, const int word_regexp) {
+    const size_t pattern_len = strlen(pattern);
+    token_t *tokens = ag_malloc((pattern_len + 1) * sizeof(token_t));
+    int first = 0;
+    int last = tokenize(pattern, tokens) - 1;
+    int word = FALSE;
+    int grouped = FALSE;
+    litset_t *ls = NULL;
+    size_t min_len = SIZE_MAX;
+    int i;
+    size_t j;
+    size_t k;
+
+    if (last < 0) {
+        goto done;
+    }
+    if (tokens[first].type == TOKEN_WORD_BOUNDARY || tokens[last].type == TOKEN_WORD_BOUNDARY) {
+        if (first == last || tokens[first].type != tokens[last].type) {
+            goto done;
+        }
+        word = TRUE;
+        first++;
+        last--;
+    }
+    /* One group around everything. Anything else with a group in it goes to PCRE. */
+    if (first < last && tokens[first].type == TOKEN_OPEN && tokens[last].type == TOKEN_CLOSE) {
+        grouped = TRUE;
+        first++;
+        last--;
+    }
+
+    ls = ag_calloc(1, sizeof(litset_t));
+    ls->literals = ag_malloc(LITSET_MAX_LITERALS * sizeof(char *));
+    ls->lens = ag_malloc(LITSET_MAX_LITERALS * sizeof(size_t));
+    ls->buckets = ag_malloc(LITSET_MAX_LITERALS * sizeof(unsigned int));
+    ls->caseless = caseless;
+    ls->word = word || word_regexp;
+
+    for (i = first; i <= last + 1; i++) {
+        int start = i;
+        char *lit;
+        /* \bfoo|bar\b means (\bfoo)|(bar\b), which isn't a set of literals with \b on both ends */
+        for (; i <= last && tokens[i].type == TOKEN_LITERAL; i++) {
+        }
+        if ((i <= last && tokens[i].type != TOKEN_BAR) || i == start || (word && !grouped && i <= last) ||
+            ls->literals_len == LITSET_MAX_LITERALS) {
+            litset_free(ls);
+            ls = NULL;
+            goto done;
+        }
+        lit = ag_malloc(i - start + 1);
+        for (j = 0; j < (size_t)(i - start); j++) {
+            lit[j] = caseless ? AG_FOLD(tokens[start + j].c) : (char)tokens[start + j].c;
+        }
+        lit[j] = '\0';
+        ls->literals[ls->literals_len] = lit;
+        ls->lens[ls->literals_len] = j;
+        ls->literals_len++;
+        if (j < min_len) {
+            min_len = j;
+        }
+    }
+
+    ls->masks.len = min_len < LITSET_MASK_BYTES ? min_len : LITSET_MASK_BYTES;
+    for (j = 0; j < ls->literals_len; j++) {
+        ls->buckets[j] = 1U << (j % LITSET_BUCKETS);
+        for (k = 0; k < ls->masks.len; k++) {
+            const unsigned char c = ls->literals[j][k];
+            add_to_masks(&ls->masks, k, c, ls->buckets[j]);
+            if (caseless && c >= 'a' && c <= 'z') {
+                add_to_masks(&ls->masks, k, c - 'a' + 'A', ls->buckets[j]);
+            }
+        }
+    }
+    if (ls->word) {
+        init_wordchar_table();
+    }
+
+done:
+    free(tokens);
+    return ls;
+}
+
+void litset_free(litset_t *ls) {
+    size_t i;
+
+    if (ls == NULL) {
+        return;
+    }
+    for (i = 0; i < ls->literals_len; i++) {
+        free(ls->literals[i]);
+    }
+    free(ls->literals);
+    free(ls->lens);
+    free(ls->buckets);
+    free(ls);
+}
+
+size_t litset_count(const litset_t *ls) {
+    return ls->literals_len;
+}
+
+const char *litset_single(const litset_t *ls, size_t *len) {
+    if (ls->literals_len != 1 || ls->word) {
+        return NULL;
+    }
+    *len = ls->lens[0];
+    return ls->literals[0];
+}
+
+static int literal_at(const litset_t *ls, const size_t i, const char *s) {
+    const char *lit = ls->literals[i];
+    size_t j;
+
+    if (!ls->caseless) {
+        return memcmp(s, lit, ls->lens[i]) == 0;
+    }
+    for (j = 0; j < ls->lens[i]; j++) {
+        if (AG_FOLD(s[j]) != lit[j]) {
+            return FALSE;
+        }
+    }
+    return TRUE;
+}
+
+int litset_search(const litset_t *ls, const char *buf, const size_t buf_len, const size_t start,
+                  size_t *match_start, size_t *match_end) {
+    size_t pos = start;
+
+    while (pos < buf_len) {
+        unsigned int buckets;
+        const char *candidate = kernels.litset(&ls->masks, buf + pos, buf_len - pos, &buckets);
+        size_t i;
+
+        if (candidate == NULL) {
+            return FALSE;
+        }
+        pos = candidate - buf;
+        /* Whether there's a boundary before the match doesn't depend on which literal it is */
+        if (!ls->word || is_word_boundary(buf, buf_len, pos)) {
+            for (i = 0; i < ls->literals_len; i++) {
+                const size_t len = ls->lens[i];
+                if (!(ls->buckets[i] & buckets) || len > buf_len - pos || !literal_at(ls, i, buf + pos)) {
+                    continue;
+                }
+                if (ls->word && !is_word_boundary(buf, buf_len, pos + len)) {
+                    continue;
+                }
+                *match_start = pos;
+                *match_end = pos + len;
+                return TRUE;
+            }
+        }
+        pos++;
+    }
+    return FALSE;
+}
@@ -0,0 +1,32 @@
+#ifndef LITSET_H
+#define LITSET_H
+
+#include <stddef.h>
+
+/*
+ * Regexes that are nothing but an alternation of literals, like foo|bar|baz,
+ * (foo|bar) or what -w makes of them, \b(?:foo|bar)\b. The literals are
+ * spread over 8 buckets, and kernels.litset finds the positions where some
+ * bucket's literals could start by looking at their first few bytes. Each
+ * of those is checked in the order PCRE would try the alternatives, so the
+ * matches are PCRE's: the leftmost position, and the first alternative in
+ * the pattern that matches there.
+ */
+
+#define LITSET_MAX_LITERALS 64
+
+typedef struct litset litset_t;
+
+/* Returns NULL if pattern is anything more than literals and |. word_regexp puts \b on both ends, like -w. */
+litset_t *litset_compile(const char *pattern, const int caseless, const int word_regexp);
+void litset_free(litset_t *ls);
+
+size_t litset_count(const litset_t *ls);
+/* If the set is a single literal with no \b, returns it (lowercase if caseless) and sets *len. Otherwise NULL. */
+const char *litset_single(const litset_t *ls, size_t *len);
+
+/* Finds the first match at or after start. Returns FALSE if there isn't one. */
+int litset_search(const litset_t *ls, const char *buf, const size_t buf_len, const size_t start,
+                  size_t *match_start, size_t *match_end);
+
+#endif
@@ -40,10 +40,12 @@ Output Options:\n\
      --ackmate            Print results in AckMate-parseable format\n\
   -A --after [LINES]      Print lines after match (Default: 2)\n\
   -B --before [LINES]     Print lines before match (Default: 2)\n\
+     --binary-output      Print a length-prefixed binary record per matching line\n\
      --[no]break          Print newlines between matches in different files\n\
                           (Enabled by default)\n\
   -c --count              Only print the number of matches in each file.\n\
                           (This often differs from the number of matching lines)\n\
+     --count-lines        Only print the number of matching lines in each file\n\
      --[no]color          Print color codes in results (Enabled by default)\n\
      --color-line-number  Color codes for line numbers (Default: 1;33)\n\
      --color-match        Color codes for result match numbers (Default: 30;43)\n\
@@ -66,6 +68,7 @@ Output Options:\n\
                           Print filenames matching PATTERN\n\
   -l --files-with-matches Only print filenames that contain matches\n\
                           (don't print the matching lines)\n\
+     --json               Print a JSON object per matching line\n\
   -L --files-without-matches\n\
                           Only print filenames that don't contain matches\n\
      --print-all-files    Print headings for all files searched, even those that\n\
@@ -80,6 +83,7 @@ Output Options:\n\
      --stats              Print stats (files scanned, time taken, etc.)\n\
      --stats-only         Print stats and nothing else.\n\
                           (Same as --count when searching a single file)\n\
+     --trace FILE         Write what each thread did to FILE as Chrome trace JSON\n\
      --vimgrep            Print results like vim's :vimgrep /pattern/g would\n\
                           (it reports every match on the line)\n\
   -0 --null --print0      Separate filenames with null (for 'xargs -0')\n\
@@ -89,6 +93,13 @@ Search Options:\n\
                           or patterns from ignore files)\n\
   -D --debug              Ridiculous debugging (probably not useful)\n\
      --depth NUM          Search up to NUM directories deep (Default: 25)\n\
+     --[no]dfa            Find regex matches with a DFA before asking PCRE for\n\
+                          their bounds (Enabled by default)\n\
+     --dir-cache FILE     Cache filtered directory listings in FILE and reuse\n\
+                          them for directories that haven't changed\n\
+     --file-time-limit SECS\n\
+                          Stop searching a file for a regex after SECS seconds\n\
+                          of CPU time\n\
   -f --follow             Follow symlinks\n\
   -F --fixed-strings      Alias for --literal for compatibility with grep\n\
   -G --file-search-regex  PATTERN Limit search to filenames matching PATTERN\n\
@@ -98,11 +109,25 @@ Search Options:\n\
      --ignore PATTERN     Ignore files/directories matching PATTERN\n\
                           (literal file/directory names also allowed)\n\
      --ignore-dir NAME    Alias for --ignore for compatibility with ack.\n\
+     --kernel NAME        Use the generic, sse2, sse4.2, avx2 or avx512bw search\n\
+                          kernels (Default: the fastest this CPU supports)\n\
   -m --max-count NUM      Skip the rest of a file after NUM matches (Default: 10,000)\n\
+     --max-total-matches NUM\n\
+                          Stop searching after printing NUM matches (or NUM\n\
+                          paths with -c, -g, -l or -L)\n\
      --one-device         Don't follow links to other devices.\n\
   -p --path-to-ignore STRING\n\
                           Use .ignore file at STRING\n\
   -Q --literal            Don't parse PATTERN as a regular expression\n\
+     --regex-depth-limit NUM\n\
+     --regex-match-limit NUM\n\
+                          Limit how deep and how long PCRE backtracks before\n\
+                          giving up on the rest of a line or file\n\
+                          (Default: PCRE's own limits)\n\
+     --queries FILE       Search for every query in FILE in one pass, prefixing\n\
+                          results with the query's id. Lines are PATTERN,\n\
+                          ID<tab>PATTERN or ID<tab>FLAGS<tab>PATTERN, where\n\
+                          FLAGS are any of Q, i, s, S or w (as in -Q -i -s -S -w)\n\
   -s --case-sensitive     Match case sensitively\n\
   -S --smart-case         Match case insensitively unless PATTERN contains\n\
                           uppercase characters (Enabled by default)\n\
@@ -116,6 +141,11 @@ Search Options:\n\
   -w --word-regexp        Only match whole words\n\
   -W --width NUM          Truncate match lines after NUM characters\n\
   -z --search-zip         Search contents of compressed (e.g., gzip) files\n\
+\n\
+Server Options:\n\
+     --serve SOCKET       Walk PATHs once, keep the results up to date with\n\
+                          inotify, and answer queries sent to SOCKET\n\
+     --connect SOCKET     Send this search to the ag serving SOCKET\n\
 \n");
     printf("File Types:\n\
 The search can be restricted to certain types of files. Example:\n\
@@ -158,79 +188,86 @@ void print_version(void) {
     printf("  %cjit %cpcre %cpcre2 %clzma %czlib\n", jit, pcre1, pcre2, lzma, zlib);
 }
 
-void init_options(void) {
+void init_cli_options(cli_options *o) {
     char *term = getenv("TERM");
 
-    memset(&opts, 0, sizeof(opts));
-    opts.casing = CASE_DEFAULT;
-    opts.color = TRUE;
+    memset(o, 0, sizeof(cli_options));
+    o->casing = CASE_DEFAULT;
+    o->color = TRUE;
     if (term && !strcmp(term, "dumb")) {
-        opts.color = FALSE;
+        o->color = FALSE;
     }
-    opts.color_win_ansi = FALSE;
-    opts.max_matches_per_file = 0;
-    opts.max_search_depth = DEFAULT_MAX_SEARCH_DEPTH;
+    o->color_win_ansi = FALSE;
+    o->max_matches_per_file = 0;
+    o->max_search_depth = DEFAULT_MAX_SEARCH_DEPTH;
 #if defined(__APPLE__) || defined(__MACH__)
     /* mamp() is slower than normal read() on macos. default to off */
-    opts.mmap = FALSE;
+    o->mmap = FALSE;
 #else
-    opts.mmap = TRUE;
+    o->mmap = TRUE;
 #endif
-    opts.multiline = TRUE;
-    opts.width = 0;
-    opts.path_sep = '\n';
-    opts.print_break = TRUE;
-    opts.print_path = PATH_PRINT_DEFAULT;
-    opts.print_all_paths = FALSE;
-    opts.print_line_numbers = TRUE;
-    opts.recurse_dirs = TRUE;
-    opts.color_path = ag_strdup(color_path);
-    opts.color_match = ag_strdup(color_match);
-    opts.color_line_number = ag_strdup(color_line_number);
-    opts.use_thread_affinity = TRUE;
-    opts.algorithm = ALGORITHM_BOYER_MOORE;
-    opts.search_zip_files = 1; // gcflymoto - check/search compressed files without the need of additional switch
+    o->multiline = TRUE;
+    o->dfa = TRUE;
+    o->width = 0;
+    o->path_sep = '\n';
+    o->print_break = TRUE;
+    o->print_path = PATH_PRINT_DEFAULT;
+    o->print_all_paths = FALSE;
+    o->print_line_numbers = TRUE;
+    o->recurse_dirs = TRUE;
+    o->color_path = ag_strdup(color_path);
+    o->color_match = ag_strdup(color_match);
+    o->color_line_number = ag_strdup(color_line_number);
+    o->use_thread_affinity = TRUE;
+    o->algorithm = ALGORITHM_BOYER_MOORE;
+    o->search_zip_files = 1; // gcflymoto - check/search compressed files without the need of additional switch
 }
 
-void cleanup_options(void) {
-    free(opts.color_path);
-    free(opts.color_match);
-    free(opts.color_line_number);
+void cleanup_cli_options(cli_options *o) {
+    free(o->color_path);
+    free(o->color_match);
+    free(o->color_line_number);
+    free(o->dir_cache);
+    free(o->serve);
+    free(o->queries);
+    free(o->trace);
+    free(o->kernel);
 
-    if (opts.query) {
-        free(opts.query);
+    if (o->query) {
+        free(o->query);
     }
 
 #ifdef HAVE_PCRE2
     // Note, ag_pcre_free_* will do NULL checks and set the pointer to NULL after freeing
-    ag_pcre_free_re(&opts.re);
-    ag_pcre_free_extra(&opts.re_extra);
-    ag_pcre_free_re(&opts.ackmate_dir_filter);
-    ag_pcre_free_extra(&opts.ackmate_dir_filter_extra);
-    ag_pcre_free_re(&opts.file_search_regex);
-    ag_pcre_free_extra(&opts.file_search_regex_extra);
+    ag_pcre_free_re(&o->ackmate_dir_filter);
+    ag_pcre_free_extra(&o->ackmate_dir_filter_extra);
+    ag_pcre_free_re(&o->file_search_regex);
+    ag_pcre_free_extra(&o->file_search_regex_extra);
 #else
-    pcre_free(opts.re);
-    if (opts.re_extra) {
-        /* Using pcre_free_study on pcre_extra* can segfault on some versions of PCRE */
-        pcre_free(opts.re_extra);
-    }
-    if (opts.ackmate_dir_filter) {
-        pcre_free(opts.ackmate_dir_filter);
+    if (o->ackmate_dir_filter) {
+        pcre_free(o->ackmate_dir_filter);
     }
-    if (opts.ackmate_dir_filter_extra) {
-        pcre_free(opts.ackmate_dir_filter_extra);
+    if (o->ackmate_dir_filter_extra) {
+        pcre_free(o->ackmate_dir_filter_extra);
     }
 
-    if (opts.file_search_regex) {
-        pcre_free(opts.file_search_regex);
+    if (o->file_search_regex) {
+        pcre_free(o->file_search_regex);
     }
-    if (opts.file_search_regex_extra) {
-        pcre_free(opts.file_search_regex_extra);
+    if (o->file_search_regex_extra) {
+        pcre_free(o->file_search_regex_extra);
     }
 #endif
 }
 
+void init_options(void) {
+    init_cli_options(&opts);
+}
+
+void cleanup_options(void) {
+    cleanup_cli_options(&opts);
+}
+
 void parse_options(int argc, char **argv, char **base_paths[], char **paths[]) {
     int ch;
     size_t i;
@@ -262,6 +299,7 @@ void parse_options(int argc, char **argv, char **base_paths[], char **paths[]) {
 
     option_t base_longopts[] = {
         { "ackmate", no_argument, &opts.ackmate, 1 },
+        { "binary-output", no_argument, &opts.binary_output, 1 },
         { "ackmate-dir-filter", required_argument, NULL, 0 },
         { "affinity", no_argument, &opts.use_thread_affinity, 1 },
         { "after", optional_argument, NULL, 'A' },
@@ -278,11 +316,15 @@ void parse_options(int argc, char **argv, char **base_paths[], char **paths[]) {
         { "column", no_argument, &opts.column, 1 },
         { "context", optional_argument, NULL, 'C' },
         { "count", no_argument, NULL, 'c' },
+        { "count-lines", no_argument, NULL, 0 },
         { "debug", no_argument, NULL, 'D' },
         { "depth", required_argument, NULL, 0 },
+        { "dfa", no_argument, &opts.dfa, TRUE },
+        { "dir-cache", required_argument, NULL, 0 },
         { "filename", no_argument, NULL, 0 },
         { "filename-pattern", required_argument, NULL, 'g' },
         { "file-search-regex", required_argument, NULL, 'G' },
+        { "file-time-limit", required_argument, NULL, 0 },
         { "files-with-matches", no_argument, NULL, 'l' },
         { "files-without-matches", no_argument, NULL, 'L' },
         { "fixed-strings", no_argument, NULL, 'F' },
@@ -296,12 +338,15 @@ void parse_options(int argc, char **argv, char **base_paths[], char **paths[]) {
         { "ignore-case", no_argument, NULL, 'i' },
         { "ignore-dir", required_argument, NULL, 0 },
         { "invert-match", no_argument, NULL, 'v' },
+        { "json", no_argument, &opts.json, 1 },
+        { "kernel", required_argument, NULL, 0 },
         /* deprecated for --numbers. Remove eventually. */
         { "line-numbers", no_argument, &opts.print_line_numbers, 2 },
         { "list-file-types", no_argument, &list_file_types, 1 },
         { "literal", no_argument, NULL, 'Q' },
         { "match", no_argument, &useless, 0 },
         { "max-count", required_argument, NULL, 'm' },
+        { "max-total-matches", required_argument, NULL, 0 },
         { "mmap", no_argument, &opts.mmap, TRUE },
         { "multiline", no_argument, &opts.multiline, TRUE },
         /* Accept both --no-* and --no* forms for convenience/BC */
@@ -310,6 +355,8 @@ void parse_options(int argc, char **argv, char **base_paths[], char **paths[]) {
         { "no-break", no_argument, &opts.print_break, 0 },
         { "nobreak", no_argument, &opts.print_break, 0 },
         { "no-color", no_argument, &opts.color, 0 },
+        { "no-dfa", no_argument, &opts.dfa, FALSE },
+        { "nodfa", no_argument, &opts.dfa, FALSE },
         { "nocolor", no_argument, &opts.color, 0 },
         { "no-filename", no_argument, NULL, 0 },
         { "nofilename", no_argument, NULL, 0 },
@@ -341,15 +388,21 @@ void parse_options(int argc, char **argv, char **base_paths[], char **paths[]) {
         { "print0", no_argument, NULL, '0' },
         { "print-all-files", no_argument, NULL, 0 },
         { "print-long-lines", no_argument, &opts.print_long_lines, 1 },
+        { "queries", required_argument, NULL, 0 },
         { "recurse", no_argument, NULL, 'r' },
+        { "regex-depth-limit", required_argument, NULL, 0 },
+        { "regex-match-limit", required_argument, NULL, 0 },
         { "search-binary", no_argument, &opts.search_binary_files, 1 },
         { "search-files", no_argument, &opts.search_stream, 0 },
         { "search-zip", no_argument, &opts.search_zip_files, 1 },
+        { "serve", required_argument, NULL, 0 },
+        { "serve-query", no_argument, &opts.serve_query, 1 },
         { "silent", no_argument, NULL, 0 },
         { "skip-vcs-ignores", no_argument, NULL, 'U' },
         { "smart-case", no_argument, NULL, 'S' },
         { "stats", no_argument, &opts.stats, 1 },
         { "stats-only", no_argument, NULL, 0 },
+        { "trace", required_argument, NULL, 0 },
         { "unrestricted", no_argument, NULL, 'u' },
         { "version", no_argument, &version, 1 },
         { "vimgrep", no_argument, &opts.vimgrep, 1 },
@@ -554,13 +607,28 @@ void parse_options(int argc, char **argv, char **base_paths[], char **paths[]) {
                     compile_study(&opts.ackmate_dir_filter, &opts.ackmate_dir_filter_extra, optarg, 0, 0);
 #endif
                     break;
+                } else if (strcmp(longopts[opt_index].name, "count-lines") == 0) {
+                    opts.count_lines = TRUE;
+                    opts.print_count = 1;
+                    opts.print_filename_only = 1;
+                    break;
                 } else if (strcmp(longopts[opt_index].name, "depth") == 0) {
                     opts.max_search_depth = atoi(optarg);
                     break;
+                } else if (strcmp(longopts[opt_index].name, "dir-cache") == 0) {
+                    free(opts.dir_cache);
+                    opts.dir_cache = ag_strdup(optarg);
+                    break;
+                } else if (strcmp(longopts[opt_index].name, "file-time-limit") == 0) {
+                    opts.file_time_limit = atof(optarg);
+                    break;
                 } else if (strcmp(longopts[opt_index].name, "filename") == 0) {
                     opts.print_path = PATH_PRINT_DEFAULT;
                     opts.print_line_numbers = TRUE;
                     break;
+                } else if (strcmp(longopts[opt_index].name, "max-total-matches") == 0) {
+                    opts.max_total_matches = strtoul(optarg, NULL, 10);
+                    break;
                 } else if (strcmp(longopts[opt_index].name, "ignore-dir") == 0) {
                     add_ignore_pattern(root_ignores, optarg);
                     break;
@@ -583,6 +651,12 @@ void parse_options(int argc, char **argv, char **base_paths[], char **paths[]) {
                 } else if (strcmp(longopts[opt_index].name, "print-all-files") == 0) {
                     opts.print_all_paths = TRUE;
                     break;
+                } else if (strcmp(longopts[opt_index].name, "regex-depth-limit") == 0) {
+                    opts.regex_depth_limit = strtoul(optarg, NULL, 10);
+                    break;
+                } else if (strcmp(longopts[opt_index].name, "regex-match-limit") == 0) {
+                    opts.regex_match_limit = strtoul(optarg, NULL, 10);
+                    break;
                 } else if (strcmp(longopts[opt_index].name, "workers") == 0) {
                     opts.workers = atoi(optarg);
                     break;
@@ -598,6 +672,16 @@ void parse_options(int argc, char **argv, char **base_paths[], char **paths[]) {
                     free(opts.color_path);
                     ag_asprintf(&opts.color_path, "\033[%sm", optarg);
                     break;
+                } else if (strcmp(longopts[opt_index].name, "queries") == 0) {
+                    free(opts.queries);
+                    opts.queries = ag_strdup(optarg);
+                    needs_query = accepts_query = 0;
+                    break;
+                } else if (strcmp(longopts[opt_index].name, "serve") == 0) {
+                    free(opts.serve);
+                    opts.serve = ag_strdup(optarg);
+                    needs_query = accepts_query = 0;
+                    break;
                 } else if (strcmp(longopts[opt_index].name, "silent") == 0) {
                     set_log_level(LOG_LEVEL_NONE);
                     break;
@@ -606,6 +690,14 @@ void parse_options(int argc, char **argv, char **base_paths[], char **paths[]) {
                     opts.print_path = PATH_PRINT_NOTHING;
                     opts.stats = 1;
                     break;
+                } else if (strcmp(longopts[opt_index].name, "kernel") == 0) {
+                    free(opts.kernel);
+                    opts.kernel = ag_strdup(optarg);
+                    break;
+                } else if (strcmp(longopts[opt_index].name, "trace") == 0) {
+                    free(opts.trace);
+                    opts.trace = ag_strdup(optarg);
+                    break;
                 }
 
                 /* Continue to usage if we don't recognize the option */
@@ -720,14 +812,14 @@ void parse_options(int argc, char **argv, char **base_paths[], char **paths[]) {
         exit(1);
     }
 
-    if (home_dir && !opts.search_all_files) {
+    if (home_dir && !opts.search_all_files && !opts.serve_query) {
         log_debug("Found user's home dir: %s", home_dir);
         ag_asprintf(&ignore_file_path, "%s/.agignore", home_dir);
         load_ignore_patterns(root_ignores, ignore_file_path);
         free(ignore_file_path);
     }
 
-    if (!opts.skip_vcs_ignores) {
+    if (!opts.skip_vcs_ignores && !opts.serve_query) {
         FILE *gitconfig_file = NULL;
         size_t buf_len = 0;
         char *gitconfig_res = NULL;
@@ -787,7 +879,14 @@ void parse_options(int argc, char **argv, char **base_paths[], char **paths[]) {
         opts.print_path = PATH_PRINT_NOTHING;
     }
 
-    if (opts.parallel) {
+    if (opts.json || opts.binary_output) {
+        opts.color = 0;
+        if (opts.json && opts.binary_output) {
+            die("--json and --binary-output can't be used together.");
+        }
+    }
+
+    if (opts.parallel || opts.queries) {
         opts.search_stream = 0;
     }
 
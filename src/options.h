@@ -64,13 +64,16 @@ typedef struct {
     char *color_path;
     int color_win_ansi;
     int column;
+    int count_lines; /* --count-lines. Implies print_count. */
     int context;
+    int dfa;
+    char *dir_cache;
+    double file_time_limit; /* CPU seconds, or 0 for no limit */
     int follow_symlinks;
     int invert_match;
     int literal;
-    int literal_starts_wordchar;
-    int literal_ends_wordchar;
     size_t max_matches_per_file;
+    size_t max_total_matches; /* Across all files, or 0 for no limit */
     int max_search_depth;
     int mmap;
     int multiline;
@@ -87,37 +90,39 @@ typedef struct {
     int print_line_numbers;
     int print_long_lines; /* TODO: support this in print.c */
     int passthrough;
-#ifdef HAVE_PCRE2
-    ag_pcre_re_t *re;
-    ag_pcre_extra_t *re_extra;
-#else
-    pcre *re;
-    pcre_extra *re_extra;
-#endif
     int recurse_dirs;
+    unsigned long regex_depth_limit; /* 0 leaves PCRE's default */
+    unsigned long regex_match_limit;
     int search_all_files;
     int skip_vcs_ignores;
     int search_binary_files;
     int search_zip_files;
     int search_hidden_files;
     int search_stream; /* true if tail -F blah | ag */
+    char *serve;       /* socket path for --serve */
+    int serve_query;   /* Parsing a query sent to --serve. The server's ignores already apply. */
     int stats;
+    char *trace; /* --trace file */
+    char *kernel; /* --kernel level, or NULL to pick the best */
     size_t stream_line_num; /* This should totally not be in here */
     int match_found;        /* This should totally not be in here */
     ino_t stdout_inode;
     char *query;
     int query_len;
+    char *queries; /* --queries file */
     char *pager;
     int paths_len;
     int parallel;
     int use_thread_affinity;
     int vimgrep;
+    int json;
+    int binary_output;
     size_t width;
     int word_regexp;
     int workers;
 } cli_options;
 
-/* global options. parse_options gives it sane values, everything else reads from it */
+/* global options. parse_options gives it sane values. A search reads the copy in its ag_ctx. */
 extern cli_options opts;
 
 typedef struct option option_t;
@@ -125,6 +130,10 @@ typedef struct option option_t;
 void usage(void);
 void print_version(void);
 
+void init_cli_options(cli_options *o);
+void cleanup_cli_options(cli_options *o);
+
+/* The same for the global opts */
 void init_options(void);
 void parse_options(int argc, char **argv, char **base_paths[], char **paths[]);
 void cleanup_options(void);
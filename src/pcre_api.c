@@ -17,6 +17,14 @@
 #include "pcre_api.h"
 #include "util.h"
 
+static unsigned long match_limit = 0;
+static unsigned long depth_limit = 0;
+
+#ifdef HAVE_PCRE2
+/* Used for matches without their own match context, so each thread needs its own */
+static __thread pcre2_match_context *thread_match_context = NULL;
+#endif
+
 /*
  * Return the pcre version string
  */
@@ -100,6 +108,92 @@ void ag_pcre_compile(ag_pcre_re_t **re, ag_pcre_extra_t **re_extra, char *q, con
 #endif
 }
 
+/*
+ * Set the limits for every later match. Each thread picks them up the next
+ * time it matches after ag_pcre_thread_cleanup(). Legacy pcre needs them
+ * copied into the pcre_extra with ag_pcre_limit_extra().
+ */
+void ag_pcre_set_limits(const unsigned long match, const unsigned long depth) {
+    match_limit = match;
+    depth_limit = depth;
+    ag_pcre_thread_cleanup();
+}
+
+#ifndef HAVE_PCRE2
+/*
+ * Add the limits to extra, allocating it if pcre_study didn't
+ */
+void ag_pcre_limit_extra(pcre_extra **extra) {
+    if (!match_limit && !depth_limit) {
+        return;
+    }
+    if (*extra == NULL) {
+        *extra = pcre_malloc(sizeof(pcre_extra));
+        if (*extra == NULL) {
+            die("Memory allocation failed.");
+        }
+        memset(*extra, 0, sizeof(pcre_extra));
+    }
+    if (match_limit) {
+        (*extra)->flags |= PCRE_EXTRA_MATCH_LIMIT;
+        (*extra)->match_limit = match_limit;
+    }
+    if (depth_limit) {
+        (*extra)->flags |= PCRE_EXTRA_MATCH_LIMIT_RECURSION;
+        (*extra)->match_limit_recursion = depth_limit;
+    }
+}
+#else
+static pcre2_match_context *get_match_context(void) {
+    if (thread_match_context == NULL) {
+        thread_match_context = pcre2_match_context_create(NULL);
+        if (thread_match_context == NULL) {
+            die("Memory allocation failed.");
+        }
+        if (match_limit) {
+            pcre2_set_match_limit(thread_match_context, match_limit);
+        }
+        if (depth_limit) {
+#ifdef PCRE2_ERROR_DEPTHLIMIT
+            pcre2_set_depth_limit(thread_match_context, depth_limit);
+#else
+            pcre2_set_recursion_limit(thread_match_context, depth_limit);
+#endif
+        }
+    }
+    return thread_match_context;
+}
+#endif
+
+/*
+ * Free the calling thread's match context
+ */
+void ag_pcre_thread_cleanup(void) {
+#ifdef HAVE_PCRE2
+    ag_pcre_free_extra(&thread_match_context);
+#endif
+}
+
+/*
+ * Return which limit a match that returned rc ran into
+ */
+const char *ag_pcre_limit_name(const int rc) {
+    switch (rc) {
+        case AG_PCRE_ERROR_MATCHLIMIT:
+            return "PCRE's match limit";
+        case AG_PCRE_ERROR_RECURSIONLIMIT:
+            return "PCRE's depth limit";
+        case AG_PCRE_ERROR_JIT_STACKLIMIT:
+            return "PCRE's JIT stack limit";
+#ifdef PCRE2_ERROR_HEAPLIMIT
+        case PCRE2_ERROR_HEAPLIMIT:
+            return "PCRE's heap limit";
+#endif
+        default:
+            return NULL;
+    }
+}
+
 /*
  * Run either pcre_match or pcre_exec
  */
@@ -112,6 +206,9 @@ int ag_pcre_match(ag_pcre_re_t *re, ag_pcre_extra_t *extra, const char *buf, int
     PCRE2_SIZE *ovec_pointer;
     int i;
 
+    if (extra == NULL && (match_limit || depth_limit)) {
+        extra = get_match_context();
+    }
     rc = pcre2_match(re, (const PCRE2_UCHAR8 *)buf, (PCRE2_SIZE)length, offset, options, match_data, extra);
     ovec_count = pcre2_get_ovector_count(match_data);
     ovec_pointer = pcre2_get_ovector_pointer(match_data);
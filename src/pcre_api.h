@@ -78,6 +78,9 @@
 #define AG_PCRE_CONFIG_JITTARGET AG_PCRE_PREFIX(CONFIG_JITTARGET)
 #define AG_PCRE_CONFIG_NEWLINE AG_PCRE_PREFIX(CONFIG_NEWLINE)
 #define AG_PCRE_CONFIG_STACKRECURSE AG_PCRE_PREFIX(CONFIG_STACKRECURSE)
+#define AG_PCRE_ERROR_MATCHLIMIT AG_PCRE_PREFIX(ERROR_MATCHLIMIT)
+#define AG_PCRE_ERROR_RECURSIONLIMIT AG_PCRE_PREFIX(ERROR_RECURSIONLIMIT)
+#define AG_PCRE_ERROR_JIT_STACKLIMIT AG_PCRE_PREFIX(ERROR_JIT_STACKLIMIT)
 
 // Stringification Macros
 #define AG_STRINGIFY(s) AG_STRINGIFY_(s)
@@ -118,4 +121,13 @@ void ag_pcre_compile(ag_pcre_re_t **re, ag_pcre_extra_t **re_extra, char *q,
 int ag_pcre_match(ag_pcre_re_t *re, ag_pcre_extra_t *extra, const char *buf, int length,
                   int offset, int options, int *ovector, int ovecsize);
 
+// Match and depth limits. 0 leaves PCRE's default.
+void ag_pcre_set_limits(const unsigned long match_limit, const unsigned long depth_limit);
+#ifndef HAVE_PCRE2
+void ag_pcre_limit_extra(pcre_extra **extra);
+#endif
+void ag_pcre_thread_cleanup(void);
+// Returns the name of the limit a match stopped at, or NULL if rc isn't a limit error
+const char *ag_pcre_limit_name(const int rc);
+
 #endif // __PCRE_API_H__
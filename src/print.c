@@ -23,6 +23,7 @@ const char *truncate_marker = " [...]";
 __thread struct print_context {
     size_t line;
     char **context_prev_lines;
+    size_t *context_prev_sizes; /* Each line's buffer is reused for the lines after it */
     size_t prev_line;
     size_t last_prev_line;
     size_t prev_line_offset;
@@ -33,11 +34,19 @@ __thread struct print_context {
     int printing_a_match;
 } print_context;
 
-void print_init_context(void) {
+/* Per-worker buffer that --json and --binary-output records are rendered into before being written */
+__thread struct record_buf {
+    char *data;
+    size_t len;
+    size_t size;
+} record_buf;
+
+void print_init_context(const ag_ctx *ctx) {
     if (print_context.context_prev_lines != NULL) {
         return;
     }
-    print_context.context_prev_lines = ag_calloc(sizeof(char *), (opts.before + 1));
+    print_context.context_prev_lines = ag_calloc(sizeof(char *), (ctx->opts.before + 1));
+    print_context.context_prev_sizes = ag_calloc(sizeof(size_t), (ctx->opts.before + 1));
     print_context.line = 1;
     print_context.prev_line = 0;
     print_context.last_prev_line = 0;
@@ -49,46 +58,53 @@ void print_init_context(void) {
     print_context.printing_a_match = FALSE;
 }
 
-void print_cleanup_context(void) {
+void print_cleanup_context(const ag_ctx *ctx) {
     size_t i;
 
     if (print_context.context_prev_lines == NULL) {
         return;
     }
 
-    for (i = 0; i < opts.before; i++) {
+    for (i = 0; i < ctx->opts.before; i++) {
         if (print_context.context_prev_lines[i] != NULL) {
             free(print_context.context_prev_lines[i]);
         }
     }
     free(print_context.context_prev_lines);
     print_context.context_prev_lines = NULL;
+    free(print_context.context_prev_sizes);
+    print_context.context_prev_sizes = NULL;
 }
 
-void print_context_append(const char *line, size_t len) {
-    if (opts.before == 0) {
+void print_context_append(const ag_ctx *ctx, const char *line, size_t len) {
+    char **prev_line = &print_context.context_prev_lines[print_context.last_prev_line];
+    size_t *prev_size = &print_context.context_prev_sizes[print_context.last_prev_line];
+
+    if (ctx->opts.before == 0) {
         return;
     }
-    if (print_context.context_prev_lines[print_context.last_prev_line] != NULL) {
-        free(print_context.context_prev_lines[print_context.last_prev_line]);
+    if (*prev_size < len + 1) {
+        *prev_size = len + 1;
+        *prev_line = ag_realloc(*prev_line, *prev_size);
     }
-    print_context.context_prev_lines[print_context.last_prev_line] = ag_strndup(line, len);
-    print_context.last_prev_line = (print_context.last_prev_line + 1) % opts.before;
+    memcpy(*prev_line, line, len);
+    (*prev_line)[len] = '\0';
+    print_context.last_prev_line = (print_context.last_prev_line + 1) % ctx->opts.before;
 }
 
-void print_trailing_context(const char *path, const char *buf, size_t n) {
+void print_trailing_context(const ag_ctx *ctx, const char *path, const char *buf, size_t n) {
     char sep = '-';
 
-    if (opts.ackmate || opts.vimgrep) {
+    if (ctx->opts.ackmate || ctx->opts.vimgrep) {
         sep = ':';
     }
 
     if (print_context.lines_since_last_match != 0 &&
-        print_context.lines_since_last_match <= opts.after) {
-        if (opts.print_path == PATH_PRINT_EACH_LINE) {
-            print_path(path, ':');
+        print_context.lines_since_last_match <= ctx->opts.after) {
+        if (ctx->opts.print_path == PATH_PRINT_EACH_LINE) {
+            print_path(ctx, path, ':');
         }
-        print_line_number(print_context.line, sep);
+        print_line_number(ctx, print_context.line, sep);
 
         fwrite(buf, 1, n, out_fd);
         fputc('\n', out_fd);
@@ -100,103 +116,125 @@ void print_trailing_context(const char *path, const char *buf, size_t n) {
     }
 }
 
-void print_path(const char *path, const char sep) {
-    if (opts.print_path == PATH_PRINT_NOTHING && !opts.vimgrep) {
+void print_path(const ag_ctx *ctx, const char *path, const char sep) {
+    if (ctx->opts.print_path == PATH_PRINT_NOTHING && !ctx->opts.vimgrep) {
         return;
     }
     path = normalize_path(path);
 
-    if (opts.ackmate) {
+    if (ctx->opts.ackmate) {
         fprintf(out_fd, ":%s%c", path, sep);
-    } else if (opts.vimgrep) {
+    } else if (ctx->opts.vimgrep) {
         fprintf(out_fd, "%s%c", path, sep);
     } else {
-        if (opts.color) {
-            fprintf(out_fd, "%s%s%s%c", opts.color_path, path, color_reset, sep);
+        if (ctx->opts.color) {
+            fprintf(out_fd, "%s%s%s%c", ctx->opts.color_path, path, color_reset, sep);
         } else {
             fprintf(out_fd, "%s%c", path, sep);
         }
     }
 }
 
-void print_path_count(const char *path, const char sep, const size_t count) {
+void print_path_count(const ag_ctx *ctx, const char *path, const char sep, const size_t count) {
     if (*path) {
-        print_path(path, ':');
+        print_path(ctx, path, ':');
     }
-    if (opts.color) {
-        fprintf(out_fd, "%s%lu%s%c", opts.color_line_number, (unsigned long)count, color_reset, sep);
+    if (ctx->opts.color) {
+        fprintf(out_fd, "%s%lu%s%c", ctx->opts.color_line_number, (unsigned long)count, color_reset, sep);
     } else {
         fprintf(out_fd, "%lu%c", (unsigned long)count, sep);
     }
 }
 
-void print_line(const char *buf, size_t buf_pos, size_t prev_line_offset) {
+void print_line(const ag_ctx *ctx, const char *buf, size_t buf_pos, size_t prev_line_offset) {
     size_t write_chars = buf_pos - prev_line_offset + 1;
-    if (opts.width > 0 && opts.width < write_chars) {
-        write_chars = opts.width;
+    if (ctx->opts.width > 0 && ctx->opts.width < write_chars) {
+        write_chars = ctx->opts.width;
     }
 
     fwrite(buf + prev_line_offset, 1, write_chars, out_fd);
 }
 
-void print_binary_file_matches(const char *path) {
+void print_binary_file_matches(const ag_ctx *ctx, const char *path) {
     path = normalize_path(path);
-    print_file_separator();
+    print_file_separator(ctx);
     fprintf(out_fd, "Binary file %s matches.\n", path);
 }
 
-void print_file_matches(const char *path, const char *buf, const size_t buf_len, const match_t matches[], const size_t matches_len) {
+void print_file_matches(ag_ctx *ctx, const char *path, const char *buf, const size_t buf_len, const match_t matches[], const size_t matches_len) {
     size_t cur_match = 0;
     ssize_t lines_to_print = 0;
     char sep = '-';
     size_t i, j;
-    int blanks_between_matches = opts.context || opts.after || opts.before;
+    int blanks_between_matches = ctx->opts.context || ctx->opts.after || ctx->opts.before;
 
-    if (opts.ackmate || opts.vimgrep) {
+    if (ctx->opts.ackmate || ctx->opts.vimgrep) {
         sep = ':';
     }
 
-    print_file_separator();
+    print_file_separator(ctx);
 
-    if (opts.print_path == PATH_PRINT_DEFAULT) {
-        opts.print_path = PATH_PRINT_TOP;
-    } else if (opts.print_path == PATH_PRINT_DEFAULT_EACH_LINE) {
-        opts.print_path = PATH_PRINT_EACH_LINE;
+    if (ctx->opts.print_path == PATH_PRINT_DEFAULT) {
+        ctx->opts.print_path = PATH_PRINT_TOP;
+    } else if (ctx->opts.print_path == PATH_PRINT_DEFAULT_EACH_LINE) {
+        ctx->opts.print_path = PATH_PRINT_EACH_LINE;
     }
 
-    if (opts.print_path == PATH_PRINT_TOP) {
-        if (opts.print_count) {
-            print_path_count(path, opts.path_sep, matches_len);
+    if (ctx->opts.print_path == PATH_PRINT_TOP) {
+        if (ctx->opts.print_count) {
+            print_path_count(ctx, path, ctx->opts.path_sep, matches_len);
         } else {
-            print_path(path, opts.path_sep);
+            print_path(ctx, path, ctx->opts.path_sep);
         }
     }
 
-    for (i = 0; i <= buf_len && (cur_match < matches_len || print_context.lines_since_last_match <= opts.after); i++) {
+    for (i = 0; i <= buf_len && (cur_match < matches_len || print_context.lines_since_last_match <= ctx->opts.after); i++) {
+        /* Nothing is printed between here and the line of the next match, so just count the lines in between */
+        if (i == print_context.prev_line_offset && ctx->opts.before == 0 && !ctx->opts.search_stream && !print_context.in_a_match &&
+            print_context.lines_since_last_match > ctx->opts.after && cur_match < matches_len && matches[cur_match].start > i) {
+            size_t line_start = matches[cur_match].start;
+            while (line_start > i && buf[line_start - 1] != '\n') {
+                line_start--;
+            }
+            if (line_start > i) {
+                size_t lines = kernels.count_newlines(buf + i, line_start - i);
+                print_context.line += lines;
+                if (print_context.lines_since_last_match < INT_MAX) {
+                    print_context.lines_since_last_match += lines;
+                    if (print_context.lines_since_last_match > INT_MAX) {
+                        print_context.lines_since_last_match = INT_MAX;
+                    }
+                }
+                i = line_start;
+                print_context.prev_line_offset = i;
+                print_context.line_preceding_current_match_offset = i;
+            }
+        }
+
         if (cur_match < matches_len && i == matches[cur_match].start) {
             print_context.in_a_match = TRUE;
             /* We found the start of a match */
-            if (cur_match > 0 && blanks_between_matches && print_context.lines_since_last_match > (opts.before + opts.after + 1)) {
+            if (cur_match > 0 && blanks_between_matches && print_context.lines_since_last_match > (ctx->opts.before + ctx->opts.after + 1)) {
                 fprintf(out_fd, "--\n");
             }
 
-            if (print_context.lines_since_last_match > 0 && opts.before > 0) {
+            if (print_context.lines_since_last_match > 0 && ctx->opts.before > 0) {
                 /* TODO: better, but still needs work */
                 /* print the previous line(s) */
-                lines_to_print = print_context.lines_since_last_match - (opts.after + 1);
+                lines_to_print = print_context.lines_since_last_match - (ctx->opts.after + 1);
                 if (lines_to_print < 0) {
                     lines_to_print = 0;
-                } else if ((size_t)lines_to_print > opts.before) {
-                    lines_to_print = opts.before;
+                } else if ((size_t)lines_to_print > ctx->opts.before) {
+                    lines_to_print = ctx->opts.before;
                 }
 
-                for (j = (opts.before - lines_to_print); j < opts.before; j++) {
-                    print_context.prev_line = (print_context.last_prev_line + j) % opts.before;
+                for (j = (ctx->opts.before - lines_to_print); j < ctx->opts.before; j++) {
+                    print_context.prev_line = (print_context.last_prev_line + j) % ctx->opts.before;
                     if (print_context.context_prev_lines[print_context.prev_line] != NULL) {
-                        if (opts.print_path == PATH_PRINT_EACH_LINE) {
-                            print_path(path, ':');
+                        if (ctx->opts.print_path == PATH_PRINT_EACH_LINE) {
+                            print_path(ctx, path, ':');
                         }
-                        print_line_number(print_context.line - (opts.before - j), sep);
+                        print_line_number(ctx, print_context.line - (ctx->opts.before - j), sep);
                         fprintf(out_fd, "%s\n", print_context.context_prev_lines[print_context.prev_line]);
                     }
                 }
@@ -211,19 +249,19 @@ void print_file_matches(const char *path, const char *buf, const size_t buf_len,
         }
 
         /* We found the end of a line. */
-        if ((i == buf_len || buf[i] == '\n') && opts.before > 0) {
+        if ((i == buf_len || buf[i] == '\n') && ctx->opts.before > 0) {
             /* We don't want to strcpy the \n */
-            print_context_append(&buf[print_context.prev_line_offset], i - print_context.prev_line_offset);
+            print_context_append(ctx, &buf[print_context.prev_line_offset], i - print_context.prev_line_offset);
         }
 
         if (i == buf_len || buf[i] == '\n') {
             if (print_context.lines_since_last_match == 0) {
-                if (opts.print_path == PATH_PRINT_EACH_LINE && !opts.search_stream) {
-                    print_path(path, ':');
+                if (ctx->opts.print_path == PATH_PRINT_EACH_LINE && !ctx->opts.search_stream) {
+                    print_path(ctx, path, ':');
                 }
-                if (opts.ackmate) {
+                if (ctx->opts.ackmate) {
                     /* print headers for ackmate to parse */
-                    print_line_number(print_context.line, ';');
+                    print_line_number(ctx, print_context.line, ';');
                     for (; print_context.last_printed_match < cur_match; print_context.last_printed_match++) {
                         size_t start = matches[print_context.last_printed_match].start - print_context.line_preceding_current_match_offset;
                         //https://github.com/ggreer/the_silver_searcher/pull/1266
@@ -232,40 +270,40 @@ void print_file_matches(const char *path, const char *buf, const size_t buf_len,
                                 matches[print_context.last_printed_match].end - matches[print_context.last_printed_match].start);
                         print_context.last_printed_match == cur_match - 1 ? fputc(':', out_fd) : fputc(',', out_fd);
                     }
-                    print_line(buf, i, print_context.prev_line_offset);
-                } else if (opts.vimgrep) {
+                    print_line(ctx, buf, i, print_context.prev_line_offset);
+                } else if (ctx->opts.vimgrep) {
                     for (; print_context.last_printed_match < cur_match; print_context.last_printed_match++) {
-                        print_path(path, sep);
-                        print_line_number(print_context.line, sep);
+                        print_path(ctx, path, sep);
+                        print_line_number(ctx, print_context.line, sep);
                         print_column_number(matches, print_context.last_printed_match, print_context.prev_line_offset, sep);
-                        print_line(buf, i, print_context.prev_line_offset);
+                        print_line(ctx, buf, i, print_context.prev_line_offset);
                     }
                 } else {
-                    print_line_number(print_context.line, ':');
+                    print_line_number(ctx, print_context.line, ':');
                     int printed_match = FALSE;
-                    if (opts.column) {
+                    if (ctx->opts.column) {
                         print_column_number(matches, print_context.last_printed_match, print_context.prev_line_offset, ':');
                     }
 
-                    if (print_context.printing_a_match && opts.color) {
-                        fprintf(out_fd, "%s", opts.color_match);
+                    if (print_context.printing_a_match && ctx->opts.color) {
+                        fprintf(out_fd, "%s", ctx->opts.color_match);
                     }
                     for (j = print_context.prev_line_offset; j <= i; j++) {
                         /* close highlight of match term */
                         if (print_context.last_printed_match < matches_len && j == matches[print_context.last_printed_match].end) {
-                            if (opts.color) {
+                            if (ctx->opts.color) {
                                 fprintf(out_fd, "%s", color_reset);
                             }
                             print_context.printing_a_match = FALSE;
                             print_context.last_printed_match++;
                             printed_match = TRUE;
-                            if (opts.only_matching) {
+                            if (ctx->opts.only_matching) {
                                 fputc('\n', out_fd);
                             }
                         }
                         /* skip remaining characters if truncation width exceeded, needs to be done
                          * before highlight opening */
-                        if (j < buf_len && opts.width > 0 && j - print_context.prev_line_offset >= opts.width) {
+                        if (j < buf_len && ctx->opts.width > 0 && j - print_context.prev_line_offset >= ctx->opts.width) {
                             if (j < i) {
                                 fputs(truncate_marker, out_fd);
                             }
@@ -277,43 +315,43 @@ void print_file_matches(const char *path, const char *buf, const size_t buf_len,
                         }
                         /* open highlight of match term */
                         if (print_context.last_printed_match < matches_len && j == matches[print_context.last_printed_match].start) {
-                            if (opts.only_matching && printed_match) {
-                                if (opts.print_path == PATH_PRINT_EACH_LINE) {
-                                    print_path(path, ':');
+                            if (ctx->opts.only_matching && printed_match) {
+                                if (ctx->opts.print_path == PATH_PRINT_EACH_LINE) {
+                                    print_path(ctx, path, ':');
                                 }
-                                print_line_number(print_context.line, ':');
-                                if (opts.column) {
+                                print_line_number(ctx, print_context.line, ':');
+                                if (ctx->opts.column) {
                                     print_column_number(matches, print_context.last_printed_match, print_context.prev_line_offset, ':');
                                 }
                             }
-                            if (opts.color) {
-                                fprintf(out_fd, "%s", opts.color_match);
+                            if (ctx->opts.color) {
+                                fprintf(out_fd, "%s", ctx->opts.color_match);
                             }
                             print_context.printing_a_match = TRUE;
                         }
                         /* Don't print the null terminator */
                         if (j < buf_len) {
                             /* if only_matching is set, print only matches and newlines */
-                            if (!opts.only_matching || print_context.printing_a_match) {
-                                if (opts.width == 0 || j - print_context.prev_line_offset < opts.width) {
+                            if (!ctx->opts.only_matching || print_context.printing_a_match) {
+                                if (ctx->opts.width == 0 || j - print_context.prev_line_offset < ctx->opts.width) {
                                     fputc(buf[j], out_fd);
                                 }
                             }
                         }
                     }
-                    if (print_context.printing_a_match && opts.color) {
+                    if (print_context.printing_a_match && ctx->opts.color) {
                         fprintf(out_fd, "%s", color_reset);
                     }
                 }
             }
 
-            if (opts.search_stream) {
+            if (ctx->opts.search_stream) {
                 print_context.last_printed_match = 0;
                 break;
             }
 
             /* print context after matching line */
-            print_trailing_context(path, &buf[print_context.prev_line_offset], i - print_context.prev_line_offset);
+            print_trailing_context(ctx, path, &buf[print_context.prev_line_offset], i - print_context.prev_line_offset);
 
             print_context.prev_line_offset = i + 1; /* skip the newline */
             if (!print_context.in_a_match) {
@@ -327,17 +365,17 @@ void print_file_matches(const char *path, const char *buf, const size_t buf_len,
         }
     }
     /* Flush output if stdout is not a tty */
-    if (opts.stdout_inode) {
+    if (ctx->opts.stdout_inode) {
         fflush(out_fd);
     }
 }
 
-void print_line_number(size_t line, const char sep) {
-    if (!opts.print_line_numbers) {
+void print_line_number(const ag_ctx *ctx, size_t line, const char sep) {
+    if (!ctx->opts.print_line_numbers) {
         return;
     }
-    if (opts.color) {
-        fprintf(out_fd, "%s%lu%s%c", opts.color_line_number, (unsigned long)line, color_reset, sep);
+    if (ctx->opts.color) {
+        fprintf(out_fd, "%s%lu%s%c", ctx->opts.color_line_number, (unsigned long)line, color_reset, sep);
     } else {
         fprintf(out_fd, "%lu%c", (unsigned long)line, sep);
     }
@@ -352,8 +390,8 @@ void print_column_number(const match_t matches[], size_t last_printed_match,
     fprintf(out_fd, "%lu%c", (unsigned long)column, sep);
 }
 
-void print_file_separator(void) {
-    if (first_file_match == 0 && opts.print_break) {
+void print_file_separator(const ag_ctx *ctx) {
+    if (first_file_match == 0 && ctx->opts.print_break) {
         fprintf(out_fd, "\n");
     }
     first_file_match = 0;
@@ -371,3 +409,180 @@ const char *normalize_path(const char *path) {
     }
     return path;
 }
+
+static void record_reserve(size_t n) {
+    if (record_buf.len + n > record_buf.size) {
+        record_buf.size = record_buf.size ? record_buf.size : 4096;
+        while (record_buf.len + n > record_buf.size) {
+            record_buf.size *= 2;
+        }
+        record_buf.data = ag_realloc(record_buf.data, record_buf.size);
+    }
+}
+
+static void record_append(const char *s, size_t n) {
+    record_reserve(n);
+    memcpy(record_buf.data + record_buf.len, s, n);
+    record_buf.len += n;
+}
+
+static void record_append_str(const char *s) {
+    record_append(s, strlen(s));
+}
+
+static void record_append_size(size_t n) {
+    char num[32];
+    int num_len = snprintf(num, sizeof(num), "%lu", (unsigned long)n);
+    record_append(num, num_len);
+}
+
+/* Bytes that aren't part of valid UTF-8 are escaped as \u00XX, so the output is always valid JSON */
+static void record_append_json_string(const char *s, size_t n) {
+    static const char hex[] = "0123456789abcdef";
+    size_t char_len;
+    size_t i;
+
+    record_reserve(n + 2);
+    record_buf.data[record_buf.len++] = '"';
+    for (i = 0; i < n; i++) {
+        unsigned char c = (unsigned char)s[i];
+        if (c == '"' || c == '\\') {
+            record_reserve(2);
+            record_buf.data[record_buf.len++] = '\\';
+            record_buf.data[record_buf.len++] = c;
+        } else if (c < 0x20 || c == 0x7f) {
+            char esc[6] = { '\\', 'u', '0', '0', hex[c >> 4], hex[c & 0xf] };
+            record_append(esc, sizeof(esc));
+        } else if (c < 0x80) {
+            record_reserve(1);
+            record_buf.data[record_buf.len++] = c;
+        } else if ((char_len = utf8_char_len(s + i, n - i)) > 0) {
+            record_append(s + i, char_len);
+            i += char_len - 1;
+        } else {
+            char esc[6] = { '\\', 'u', '0', '0', hex[c >> 4], hex[c & 0xf] };
+            record_append(esc, sizeof(esc));
+        }
+    }
+    record_reserve(1);
+    record_buf.data[record_buf.len++] = '"';
+}
+
+/* Binary records are little-endian regardless of the host */
+static void record_append_le(uint64_t n, size_t width) {
+    size_t i;
+    record_reserve(width);
+    for (i = 0; i < width; i++) {
+        record_buf.data[record_buf.len++] = (char)((n >> (8 * i)) & 0xff);
+    }
+}
+
+static void record_patch_le32(size_t offset, uint32_t n) {
+    size_t i;
+    for (i = 0; i < 4; i++) {
+        record_buf.data[offset + i] = (char)((n >> (8 * i)) & 0xff);
+    }
+}
+
+static void record_flush(void) {
+    TRACE_LOCK(&print_mtx, "print lock wait");
+    fwrite(record_buf.data, 1, record_buf.len, out_fd);
+    pthread_mutex_unlock(&print_mtx);
+    record_buf.len = 0;
+}
+
+/*
+ * One record per line that has matches. JSON:
+ *   {"path":P,"query":ID,"line":N,"line_start":BYTE,"text":LINE,"submatches":[{"start":BYTE,"end":BYTE,"column":N}]}
+ * ("query" only with --queries). Binary, all integers little-endian:
+ *   u32 record length (not counting itself), u32 path length, path, u32 id length, id,
+ *   u64 line, u64 line_start, u32 text length, text, u32 submatch count, {u64 start, u64 end}...
+ */
+static void print_match_records(const int json, const char *path, const matcher_t *m, const char *buf, const size_t buf_len,
+                                const size_t first_line, const size_t buf_offset, const match_t matches[], const size_t matches_len) {
+    size_t line = first_line;
+    size_t line_start = 0;
+    size_t line_len;
+    size_t i = 0;
+    size_t j;
+    const char *newline;
+
+    path = normalize_path(path);
+    while (i < matches_len) {
+        while (line_start < matches[i].start &&
+               (newline = memchr(buf + line_start, '\n', matches[i].start - line_start)) != NULL) {
+            line++;
+            line_start = newline - buf + 1;
+        }
+        newline = memchr(buf + line_start, '\n', buf_len - line_start);
+        line_len = newline ? (size_t)(newline - (buf + line_start)) : buf_len - line_start;
+
+        /* Every match that starts on this line */
+        for (j = i; j < matches_len && matches[j].start <= line_start + line_len; j++) {
+        }
+
+        if (json) {
+            record_append_str("{\"path\":");
+            record_append_json_string(path, strlen(path));
+            if (m->id) {
+                record_append_str(",\"query\":");
+                record_append_json_string(m->id, strlen(m->id));
+            }
+            record_append_str(",\"line\":");
+            record_append_size(line);
+            record_append_str(",\"line_start\":");
+            record_append_size(buf_offset + line_start);
+            record_append_str(",\"text\":");
+            record_append_json_string(buf + line_start, line_len);
+            record_append_str(",\"submatches\":[");
+            for (; i < j; i++) {
+                record_append_str("{\"start\":");
+                record_append_size(buf_offset + matches[i].start);
+                record_append_str(",\"end\":");
+                record_append_size(buf_offset + matches[i].end);
+                record_append_str(",\"column\":");
+                record_append_size(matches[i].start - line_start + 1);
+                record_append_str(i + 1 < j ? "}," : "}");
+            }
+            record_append_str("]}\n");
+        } else {
+            size_t record_start = record_buf.len;
+            size_t id_len = m->id ? strlen(m->id) : 0;
+            record_append_le(0, 4);
+            record_append_le(strlen(path), 4);
+            record_append_str(path);
+            record_append_le(id_len, 4);
+            record_append(m->id ? m->id : "", id_len);
+            record_append_le(line, 8);
+            record_append_le(buf_offset + line_start, 8);
+            record_append_le(line_len, 4);
+            record_append(buf + line_start, line_len);
+            record_append_le(j - i, 4);
+            for (; i < j; i++) {
+                record_append_le(buf_offset + matches[i].start, 8);
+                record_append_le(buf_offset + matches[i].end, 8);
+            }
+            record_patch_le32(record_start, (uint32_t)(record_buf.len - record_start - 4));
+        }
+    }
+    record_flush();
+}
+
+void print_matches_json(ag_ctx *ctx, const char *path, const matcher_t *m, const char *buf, const size_t buf_len,
+                        const size_t first_line, const size_t buf_offset, const match_t matches[], const size_t matches_len) {
+    (void)ctx;
+    print_match_records(TRUE, path, m, buf, buf_len, first_line, buf_offset, matches, matches_len);
+}
+
+void print_matches_binary(ag_ctx *ctx, const char *path, const matcher_t *m, const char *buf, const size_t buf_len,
+                          const size_t first_line, const size_t buf_offset, const match_t matches[], const size_t matches_len) {
+    (void)ctx;
+    print_match_records(FALSE, path, m, buf, buf_len, first_line, buf_offset, matches, matches_len);
+}
+
+void print_cleanup_records(void) {
+    free(record_buf.data);
+    record_buf.data = NULL;
+    record_buf.len = 0;
+    record_buf.size = 0;
+}
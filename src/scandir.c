@@ -1,77 +1,200 @@
 #include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <stdlib.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "config.h"
+
+#ifdef HAVE_GETDENTS64
+#include <sys/syscall.h>
+#endif
 
 #include "scandir.h"
 #include "util.h"
 
+#if defined(HAVE_FSTATAT) && defined(HAVE_DIRENT_DTYPE)
+#define SCANDIR_RESOLVE_TYPES
+#if defined(HAVE_GETDENTS64)
+#define SCANDIR_GETDENTS64
+#endif
+#endif
+
+#ifdef SCANDIR_GETDENTS64
+/* What getdents64 fills its buffer with */
+struct ag_dirent64 {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+#define GETDENTS_BUF_SIZE (64 * 1024)
+#endif
+
+void dirlist_init(dirlist_t *list) {
+    list->buf = NULL;
+    list->buf_len = 0;
+    list->buf_size = 0;
+    list->offsets = NULL;
+    list->len = 0;
+    list->size = 0;
+}
+
+void dirlist_add(dirlist_t *list, const char *name, const size_t name_len, const unsigned char type) {
+    const size_t entry_len = name_len + 2;
+
+    if (list->buf_len + entry_len > list->buf_size) {
+        list->buf_size = list->buf_size ? list->buf_size * 2 : 4096;
+        if (list->buf_size < list->buf_len + entry_len) {
+            list->buf_size = list->buf_len + entry_len;
+        }
+        list->buf = ag_realloc(list->buf, list->buf_size);
+    }
+    if (list->len == list->size) {
+        list->size = list->size ? list->size * 2 : 64;
+        list->offsets = ag_realloc(list->offsets, list->size * sizeof(uint32_t));
+    }
+    list->offsets[list->len++] = (uint32_t)list->buf_len;
+    list->buf[list->buf_len] = (char)type;
+    memcpy(list->buf + list->buf_len + 1, name, name_len);
+    list->buf[list->buf_len + 1 + name_len] = '\0';
+    list->buf_len += entry_len;
+}
+
+void dirlist_entry(const dirlist_t *list, const int i, dirlist_entry_t *entry) {
+    const size_t start = list->offsets[i];
+    const size_t end = i + 1 < list->len ? list->offsets[i + 1] : list->buf_len;
+
+    entry->type = (unsigned char)list->buf[start];
+    entry->name = list->buf + start + 1;
+    entry->name_len = end - start - 2;
+}
+
+void dirlist_free(dirlist_t *list) {
+    free(list->buf);
+    free(list->offsets);
+    dirlist_init(list);
+}
+
+#ifdef SCANDIR_RESOLVE_TYPES
+/*
+ * Some filesystems, e.g. ReiserFS and XFS or NFS depending on how they're set
+ * up, return DT_UNKNOWN. Look the type up relative to the directory's fd, so
+ * it's one fstatat here instead of a stat on the full path in each of
+ * is_symlink(), is_named_pipe() and is_directory().
+ */
+static unsigned char stat_d_type(const int dir_fd, const char *name) {
+    struct stat s;
+
+    if (fstatat(dir_fd, name, &s, AT_SYMLINK_NOFOLLOW) != 0) {
+        return DT_UNKNOWN;
+    }
+    if (S_ISREG(s.st_mode)) {
+        return DT_REG;
+    } else if (S_ISDIR(s.st_mode)) {
+        return DT_DIR;
+    } else if (S_ISLNK(s.st_mode)) {
+        return DT_LNK;
+    } else if (S_ISFIFO(s.st_mode)) {
+        return DT_FIFO;
+#ifdef S_ISSOCK
+    } else if (S_ISSOCK(s.st_mode)) {
+        return DT_SOCK;
+#endif
+    } else if (S_ISCHR(s.st_mode)) {
+        return DT_CHR;
+    } else if (S_ISBLK(s.st_mode)) {
+        return DT_BLK;
+    }
+    return DT_UNKNOWN;
+}
+#endif
+
+#ifdef SCANDIR_GETDENTS64
+/* Reads the directory straight into one big buffer instead of through readdir() */
 int ag_scandir(const char *dirname,
-               struct dirent ***namelist,
+               dirlist_t *list,
                filter_fp filter,
                void *baton) {
-    DIR *dirp = NULL;
-    struct dirent **names = NULL;
-    struct dirent *entry, *d;
-    int names_len = 32;
-    int results_len = 0;
+    struct ag_dirent64 *d;
+    dirlist_entry_t entry;
+    char *buf;
+    long buf_len;
+    long pos;
+    int fd;
 
-    dirp = opendir(dirname);
-    if (dirp == NULL) {
-        goto fail;
+    dirlist_init(list);
+    fd = open(dirname, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd == -1) {
+        return -1;
     }
 
-    names = malloc(sizeof(struct dirent *) * names_len);
-    if (names == NULL) {
-        goto fail;
-    }
-
-    while ((entry = readdir(dirp)) != NULL) {
-        if ((*filter)(dirname, entry, baton) == FALSE) {
-            continue;
-        }
-        if (results_len >= names_len) {
-            struct dirent **tmp_names = names;
-            names_len *= 2;
-            names = realloc(names, sizeof(struct dirent *) * names_len);
-            if (names == NULL) {
-                free(tmp_names);
-                goto fail;
+    buf = ag_malloc(GETDENTS_BUF_SIZE);
+    while ((buf_len = syscall(SYS_getdents64, fd, buf, GETDENTS_BUF_SIZE)) > 0) {
+        for (pos = 0; pos < buf_len; pos += d->d_reclen) {
+            d = (struct ag_dirent64 *)(buf + pos);
+            entry.name = d->d_name;
+            entry.name_len = strlen(d->d_name);
+            entry.type = d->d_type;
+            if (entry.type == DT_UNKNOWN) {
+                entry.type = stat_d_type(fd, entry.name);
             }
+            if ((*filter)(dirname, &entry, baton) == FALSE) {
+                continue;
+            }
+            dirlist_add(list, entry.name, entry.name_len, entry.type);
         }
+    }
+    if (buf_len < 0) {
+        log_debug("Error reading directory %s: %s", dirname, strerror(errno));
+    }
 
-#if defined(__MINGW32__) || defined(__CYGWIN__)
-        d = malloc(sizeof(struct dirent));
+    free(buf);
+    close(fd);
+    return list->len;
+}
 #else
-        d = malloc(entry->d_reclen);
-#endif
+int ag_scandir(const char *dirname,
+               dirlist_t *list,
+               filter_fp filter,
+               void *baton) {
+    DIR *dirp = NULL;
+    struct dirent *d;
+    dirlist_entry_t entry;
 
-        if (d == NULL) {
-            goto fail;
-        }
-#if defined(__MINGW32__) || defined(__CYGWIN__)
-        memcpy(d, entry, sizeof(struct dirent));
+    dirlist_init(list);
+    dirp = opendir(dirname);
+    if (dirp == NULL) {
+        return -1;
+    }
+
+    while ((d = readdir(dirp)) != NULL) {
+        entry.name = d->d_name;
+#ifdef HAVE_DIRENT_DNAMLEN
+        entry.name_len = d->d_namlen;
 #else
-        memcpy(d, entry, entry->d_reclen);
+        entry.name_len = strlen(d->d_name);
 #endif
-
-        names[results_len] = d;
-        results_len++;
+#ifdef HAVE_DIRENT_DTYPE
+        entry.type = d->d_type;
+#else
+        entry.type = DT_UNKNOWN;
+#endif
+#ifdef SCANDIR_RESOLVE_TYPES
+        if (entry.type == DT_UNKNOWN) {
+            entry.type = stat_d_type(dirfd(dirp), entry.name);
+        }
+#endif
+        if ((*filter)(dirname, &entry, baton) == FALSE) {
+            continue;
+        }
+        dirlist_add(list, entry.name, entry.name_len, entry.type);
     }
 
     closedir(dirp);
-    *namelist = names;
-    return results_len;
-
-fail:
-    if (dirp) {
-        closedir(dirp);
-    }
-
-    if (names != NULL) {
-        int i;
-        for (i = 0; i < results_len; i++) {
-            free(names[i]);
-        }
-        free(names);
-    }
-    return -1;
+    return list->len;
 }
+#endif
@@ -1,19 +1,43 @@
 #ifndef SCANDIR_H
 #define SCANDIR_H
 
+#include <stdint.h>
+
 #include "ignore.h"
+#include "options.h"
+#include "util.h"
 
 typedef struct {
+    const cli_options *opts; /* The search's options, for filename_filter() */
     const ignores *ig;
     const char *base_path;
     size_t base_path_len;
     const char *path_start;
 } scandir_baton_t;
 
-typedef int (*filter_fp)(const char *path, const struct dirent *, void *);
+/*
+ * A directory's entries, packed into one buffer instead of a dirent apiece.
+ * Entry i starts at buf + offsets[i]: its type byte, then its NUL-terminated name.
+ */
+typedef struct {
+    char *buf;
+    size_t buf_len;
+    size_t buf_size;
+    uint32_t *offsets;
+    int len;
+    int size;
+} dirlist_t;
+
+typedef int (*filter_fp)(const char *path, const dirlist_entry_t *, void *);
+
+void dirlist_init(dirlist_t *list);
+void dirlist_add(dirlist_t *list, const char *name, const size_t name_len, const unsigned char type);
+void dirlist_entry(const dirlist_t *list, const int i, dirlist_entry_t *entry);
+void dirlist_free(dirlist_t *list);
 
+/* Returns the number of entries filter accepted, or -1 if dirname can't be opened */
 int ag_scandir(const char *dirname,
-               struct dirent ***namelist,
+               dirlist_t *list,
                filter_fp filter,
                void *baton);
 
@@ -1,182 +1,701 @@
 #include "search.h"
+#include "dircache.h"
 #include "print.h"
 #include "scandir.h"
 
-size_t alpha_skip_lookup[256];
-size_t *find_skip_lookup;
-uint8_t h_table[H_SIZE] __attribute__((aligned(64)));
-size_t bad_char_skip_lookup[UCHAR_MAX + 1];
+#ifdef HAVE_SYS_CPUSET_H
+#include <sys/cpuset.h>
+#endif
 
-work_queue_t *work_queue = NULL;
-work_queue_t *work_queue_tail = NULL;
-int done_adding_files = 0;
-pthread_cond_t files_ready = PTHREAD_COND_INITIALIZER;
-pthread_mutex_t stats_mtx = PTHREAD_MUTEX_INITIALIZER;
-pthread_mutex_t work_queue_mtx = PTHREAD_MUTEX_INITIALIZER;
+#if defined(HAVE_PTHREAD_SETAFFINITY_NP) && defined(__FreeBSD__)
+#include <pthread_np.h>
+#endif
 
-symdir_t *symhash = NULL;
+typedef struct {
+    pthread_t thread;
+    int id;
+    ag_ctx *ctx;
+    ag_stats *stats; /* NULL unless --stats */
+} worker_t;
+
+/*
+ * Queueing a file shouldn't cost a malloc and a cross-thread free. Work
+ * items come from slabs, and paths are copied into big blocks. Workers
+ * give back the item they just searched while they hold work_queue_mtx to
+ * take the next one, and a block is reused once none of its paths are
+ * queued or being searched. The context's slabs and blocks are guarded by
+ * work_queue_mtx.
+ */
+#define WORK_ITEMS_PER_SLAB 1024
+#define PATH_BLOCK_SIZE (256 * 1024)
+
+struct path_block {
+    char *data;
+    size_t size;
+    size_t used;
+    size_t pending; /* Items whose path is in this block */
+    struct path_block *next_free;
+};
+
+/* Line number of the buffer passed to search_buf() when search_stream() is feeding it lines */
+static __thread size_t search_stream_line = 0;
+static __thread size_t search_stream_offset = 0;
+
+static inline int is_search_stopped(ag_ctx *ctx) {
+    return __atomic_load_n(&ctx->search_stopped, __ATOMIC_ACQUIRE);
+}
 
-/* Returns: -1 if skipped, otherwise # of matches */
-ssize_t search_buf(const char *buf, const size_t buf_len,
-                   const char *dir_full_path) {
-    int binary = -1; /* 1 = yes, 0 = no, -1 = don't know */
-    size_t buf_offset = 0;
+static inline void set_search_stopped(ag_ctx *ctx, const int stopped) {
+    __atomic_store_n(&ctx->search_stopped, stopped, __ATOMIC_RELEASE);
+}
 
-    if (opts.search_stream) {
-        binary = 0;
-    } else if (!opts.search_binary_files && opts.mmap) { /* if not using mmap, binary files have already been skipped */
-        // https://github.com/ggreer/the_silver_searcher/pull/204
-        binary = is_binary(buf, buf_len);
-        if (binary) {
-            log_debug("File %s is binary. Skipping...", dir_full_path);
-            return -1;
+/* Any worker can set it. It's read once they've been joined. */
+static inline void set_match_found(ag_ctx *ctx) {
+    __atomic_store_n(&ctx->opts.match_found, 1, __ATOMIC_RELAXED);
+}
+
+ag_ctx *search_ctx_new(const cli_options *o, ignores *root_ig) {
+    ag_ctx *ctx = ag_calloc(1, sizeof(ag_ctx));
+
+    ctx->opts = *o;
+    ctx->root_ignores = root_ig;
+    if (pthread_cond_init(&ctx->files_ready, NULL)) {
+        die("pthread_cond_init failed!");
+    }
+    if (pthread_mutex_init(&ctx->work_queue_mtx, NULL) ||
+        pthread_mutex_init(&ctx->truncated_files_mtx, NULL) ||
+        pthread_mutex_init(&ctx->total_printed_mtx, NULL) ||
+        pthread_mutex_init(&ctx->match_fn_mtx, NULL)) {
+        die("pthread_mutex_init failed!");
+    }
+    return ctx;
+}
+
+void search_ctx_free(ag_ctx *ctx) {
+    if (ctx == NULL) {
+        return;
+    }
+    cleanup_matchers(ctx);
+    cleanup_ignore(ctx->root_ignores);
+    cleanup_cli_options(&ctx->opts);
+    pthread_cond_destroy(&ctx->files_ready);
+    pthread_mutex_destroy(&ctx->work_queue_mtx);
+    pthread_mutex_destroy(&ctx->truncated_files_mtx);
+    pthread_mutex_destroy(&ctx->total_printed_mtx);
+    pthread_mutex_destroy(&ctx->match_fn_mtx);
+    free(ctx);
+}
+
+/* How many regex searches run between looks at the clock for --file-time-limit */
+#define DEADLINE_CHECK_INTERVAL 16
+
+void add_matcher(ag_ctx *ctx, const char *id, const char *query, const int literal, const enum case_behavior casing, const int word_regexp) {
+    matcher_t *m;
+#ifdef HAVE_PCRE2
+    int pcre_opts = AG_PCRE_MULTILINE;
+    int use_jit = 0;
+#else
+    int pcre_opts = PCRE_MULTILINE;
+    int study_opts = 0;
+#endif
+
+    ctx->matchers = ag_realloc(ctx->matchers, (ctx->matchers_len + 1) * sizeof(matcher_t));
+    m = &ctx->matchers[ctx->matchers_len++];
+    memset(m, 0, sizeof(matcher_t));
+    m->id = id ? ag_strdup(id) : NULL;
+    m->query = ag_strdup(query);
+    m->query_len = strlen(m->query);
+    m->literal = literal;
+    m->word_regexp = word_regexp;
+    m->casing = casing;
+    if (m->casing == CASE_SMART || m->casing == CASE_DEFAULT) {
+        m->casing = is_lowercase(m->query) ? CASE_INSENSITIVE : CASE_SENSITIVE;
+    }
+
+    if (!m->literal) {
+        size_t single_len;
+        const char *single;
+        m->litset = litset_compile(m->query, m->casing == CASE_INSENSITIVE, m->word_regexp);
+        if (m->litset && (single = litset_single(m->litset, &single_len)) != NULL) {
+            /* A regex like foo\.bar is searched for like any other literal */
+            log_debug("Regex %s is the literal %s", m->query, single);
+            free(m->query);
+            m->query = ag_strndup(single, single_len);
+            m->query_len = single_len;
+            m->literal = TRUE;
+            litset_free(m->litset);
+            m->litset = NULL;
+        } else if (m->litset) {
+            log_debug("Regex %s is a set of %lu literals", m->query, litset_count(m->litset));
+            return;
         }
     }
 
-    size_t matches_len = 0;
-    match_t *matches;
-    size_t matches_size;
-    size_t matches_spare;
+    if (m->literal) {
+        if (m->casing == CASE_INSENSITIVE) {
+            /* Search routine needs the query to be lowercase */
+            char *c = m->query;
+            for (; *c != '\0'; ++c) {
+                *c = AG_FOLD(*c);
+            }
+        }
+        m->h_table = ag_calloc(H_SIZE, sizeof(uint8_t));
+        if (ctx->opts.algorithm == ALGORITHM_BOYER_MOORE) {
+            generate_alpha_skip(m->query, m->query_len, m->alpha_skip_lookup, m->casing == CASE_SENSITIVE);
+            generate_find_skip(m->query, m->query_len, &m->find_skip_lookup, m->casing == CASE_SENSITIVE);
+            generate_hash(m->query, m->query_len, m->h_table, m->casing == CASE_SENSITIVE);
+            if (m->query_len >= TWO_WAY_MIN_LEN) {
+                m->two_way = ag_malloc(sizeof(two_way_t));
+                generate_two_way(m->query, m->query_len, m->two_way, m->casing == CASE_SENSITIVE);
+            }
+        } else {
+            generate_bad_char_skip(m->query, m->query_len, m->bad_char_skip_lookup, m->casing == CASE_SENSITIVE);
+            generate_hash(m->query, m->query_len, m->h_table, m->casing == CASE_SENSITIVE);
+        }
 
-    if (opts.invert_match) {
-        /* If we are going to invert the set of matches at the end, we will need
-         * one extra match struct, even if there are no matches at all. So make
-         * sure we have a nonempty array; and make sure we always have spare
-         * capacity for one extra.
-         */
-        matches_size = 100;
-        matches = ag_malloc(matches_size * sizeof(match_t));
-        matches_spare = 1;
-    } else {
-        matches_size = 0;
-        matches = NULL;
-        matches_spare = 0;
+        if (m->word_regexp) {
+            init_wordchar_table();
+        }
+        return;
     }
 
-    if (!opts.literal && opts.query_len == 1 && opts.query[0] == '.') {
-        matches_size = 1;
-        matches = matches == NULL ? ag_malloc(matches_size * sizeof(match_t)) : matches;
-        matches[0].start = 0;
-        matches[0].end = buf_len;
-        matches_len = 1;
-    } else if (opts.literal) {
-        const char *match_ptr = buf;
-        strncmp_fp ag_strnstr_fp = get_strstr(opts.casing, opts.algorithm);
-        size_t *lookup = (opts.algorithm == ALGORITHM_BOYER_MOORE) ? alpha_skip_lookup : bad_char_skip_lookup;
+#ifdef USE_PCRE_JIT
+#ifdef HAVE_PCRE2
+    if (ag_pcre_config(AG_PCRE_CONFIG_JIT, &use_jit)) {
+        use_jit = TRUE;
+    }
+#else
+    int has_jit = 0;
+    pcre_config(PCRE_CONFIG_JIT, &has_jit);
+    if (has_jit) {
+        study_opts |= PCRE_STUDY_JIT_COMPILE;
+    }
+#endif
+#endif
 
-        while (buf_offset < buf_len) {
-/* hash_strnstr only for little-endian platforms that allow unaligned access */
-#if defined(__i386__) || defined(__x86_64__)
-            /* Decide whether to fall back on boyer-moore */
-            if ((size_t)opts.query_len < 2 * sizeof(uint16_t) - 1 || opts.query_len >= UCHAR_MAX) {
-                match_ptr = ag_strnstr_fp(match_ptr, opts.query, buf_len - buf_offset, opts.query_len, lookup, find_skip_lookup);
-                //match_ptr = boyer_moore_strnstr(match_ptr, opts.query, buf_len - buf_offset, opts.query_len, alpha_skip_lookup, find_skip_lookup, opts.casing == CASE_INSENSITIVE);
-            } else {
-                match_ptr = hash_strnstr(match_ptr, opts.query, buf_len - buf_offset, opts.query_len, h_table, opts.casing == CASE_SENSITIVE);
+    if (m->casing == CASE_INSENSITIVE) {
+#ifdef HAVE_PCRE2
+        pcre_opts |= AG_PCRE_CASELESS;
+#else
+        pcre_opts |= PCRE_CASELESS;
+#endif
+    }
+    ag_pcre_set_limits(ctx->opts.regex_match_limit, ctx->opts.regex_depth_limit);
+#ifdef HAVE_PCRE2
+    ag_pcre_compile(&m->re, &m->re_extra, m->query, pcre_opts, use_jit);
+#else
+    compile_study(&m->re, &m->re_extra, m->query, pcre_opts, study_opts);
+    ag_pcre_limit_extra(&m->re_extra);
+#endif
+    if (m->word_regexp) {
+        /* \b(?:...)\b would hide the query's literal prefix from PCRE's start-of-match optimizations (and the DFA's) */
+        char *word_regexp_query;
+        ag_asprintf(&word_regexp_query, "\\b(?:%s)\\b", m->query);
+#ifdef HAVE_PCRE2
+        ag_pcre_compile(&m->word_re, &m->word_re_extra, word_regexp_query, pcre_opts, use_jit);
+#else
+        compile_study(&m->word_re, &m->word_re_extra, word_regexp_query, pcre_opts, study_opts);
+        ag_pcre_limit_extra(&m->word_re_extra);
+#endif
+        free(word_regexp_query);
+        init_wordchar_table();
+    }
+    if (ctx->opts.dfa) {
+        m->dfa = dfa_compile(m->query, m->casing == CASE_INSENSITIVE);
+        log_debug("%s regex %s", m->dfa ? "Using a DFA for" : "Only PCRE can search for", m->query);
+    }
+}
+
+/* Each line is "ID<tab>FLAGS<tab>PATTERN", "ID<tab>PATTERN" or just "PATTERN".
+ * FLAGS are any of Q (literal), i, s, S (casing) and w (word), or - for none.
+ * Anything not set by FLAGS comes from the command line. */
+void load_queries(ag_ctx *ctx, const char *path) {
+    FILE *fp;
+    char *line = NULL;
+    size_t line_cap = 0;
+    ssize_t line_len;
+    size_t line_num = 0;
+    char *default_id;
+    char *id;
+    char *flags;
+    char *pattern;
+    char *tab;
+    char *c;
+
+    fp = fopen(path, "r");
+    if (fp == NULL) {
+        die("Unable to open query file %s: %s", path, strerror(errno));
+    }
+
+    while ((line_len = getline(&line, &line_cap, fp)) > 0) {
+        int literal = ctx->opts.literal;
+        enum case_behavior casing = ctx->opts.casing;
+        int word_regexp = ctx->opts.word_regexp;
+
+        line_num++;
+        while (line_len > 0 && (line[line_len - 1] == '\n' || line[line_len - 1] == '\r')) {
+            line[--line_len] = '\0';
+        }
+        if (line_len == 0 || line[0] == '#') {
+            continue;
+        }
+
+        ag_asprintf(&default_id, "%lu", (unsigned long)line_num);
+        id = default_id;
+        flags = NULL;
+        pattern = line;
+        tab = strchr(line, '\t');
+        if (tab) {
+            *tab = '\0';
+            id = line;
+            pattern = tab + 1;
+            tab = strchr(pattern, '\t');
+            if (tab) {
+                *tab = '\0';
+                flags = pattern;
+                pattern = tab + 1;
+            }
+        }
+
+        for (c = flags; c && *c; c++) {
+            switch (*c) {
+                case 'Q':
+                    literal = 1;
+                    break;
+                case 'i':
+                    casing = CASE_INSENSITIVE;
+                    break;
+                case 's':
+                    casing = CASE_SENSITIVE;
+                    break;
+                case 'S':
+                    casing = CASE_SMART;
+                    break;
+                case 'w':
+                    word_regexp = 1;
+                    break;
+                case '-':
+                    break;
+                default:
+                    die("%s line %lu: unknown query flag '%c'", path, (unsigned long)line_num, *c);
             }
+        }
+        if (*pattern == '\0') {
+            die("%s line %lu: no pattern", path, (unsigned long)line_num);
+        }
+        if (!is_regex(pattern)) {
+            literal = 1;
+        }
+
+        log_debug("Query %s is %s", id, pattern);
+        add_matcher(ctx, id, pattern, literal, casing, word_regexp);
+        free(default_id);
+    }
+
+    free(line);
+    fclose(fp);
+    if (ctx->matchers_len == 0) {
+        die("No queries in %s", path);
+    }
+}
+
+void cleanup_matchers(ag_ctx *ctx) {
+    size_t i;
+
+    for (i = 0; i < ctx->matchers_len; i++) {
+        free(ctx->matchers[i].id);
+        free(ctx->matchers[i].query);
+        litset_free(ctx->matchers[i].litset);
+        free(ctx->matchers[i].find_skip_lookup);
+        free(ctx->matchers[i].h_table);
+        free(ctx->matchers[i].two_way);
+        dfa_free(ctx->matchers[i].dfa);
+#ifdef HAVE_PCRE2
+        ag_pcre_free_re(&ctx->matchers[i].re);
+        ag_pcre_free_extra(&ctx->matchers[i].re_extra);
+        ag_pcre_free_re(&ctx->matchers[i].word_re);
+        ag_pcre_free_extra(&ctx->matchers[i].word_re_extra);
 #else
-            match_ptr = ag_strnstr_fp(match_ptr, opts.query, buf_len - buf_offset, opts.query_len, lookup, find_skip_lookup);
-//match_ptr = boyer_moore_strnstr(match_ptr, opts.query, buf_len - buf_offset, opts.query_len, alpha_skip_lookup, find_skip_lookup, opts.casing == CASE_INSENSITIVE);
+        pcre_free(ctx->matchers[i].re);
+        if (ctx->matchers[i].re_extra) {
+            /* Using pcre_free_study on pcre_extra* can segfault on some versions of PCRE */
+            pcre_free(ctx->matchers[i].re_extra);
+        }
+        pcre_free(ctx->matchers[i].word_re);
+        if (ctx->matchers[i].word_re_extra) {
+            pcre_free(ctx->matchers[i].word_re_extra);
+        }
 #endif
+    }
+    free(ctx->matchers);
+    ctx->matchers = NULL;
+    ctx->matchers_len = 0;
+    dfa_thread_cleanup();
+    ag_pcre_thread_cleanup();
+    arena_thread_cleanup();
+}
 
-            if (match_ptr == NULL) {
-                break;
+/* Returns the start of the line pos is on, or from if that's later */
+static size_t line_start(const char *buf, const size_t from, size_t pos) {
+    while (pos > from && buf[pos - 1] != '\n') {
+        pos--;
+    }
+    return pos;
+}
+
+/* The line number of buf[pos] */
+static size_t line_number(const char *buf, const size_t pos) {
+    return (search_stream_line ? search_stream_line : 1) + kernels.count_newlines(buf, pos);
+}
+
+/* How many lines buf has. The last one doesn't need a newline. */
+static size_t buf_lines(const char *buf, const size_t buf_len) {
+    return kernels.count_newlines(buf, buf_len) + (buf_len > 0 && buf[buf_len - 1] != '\n');
+}
+
+/* Takes ownership of reason */
+static void add_truncated_file(ag_ctx *ctx, const char *path, char *reason) {
+    log_debug("Didn't finish searching %s: %s", path, reason);
+    pthread_mutex_lock(&ctx->truncated_files_mtx);
+    ctx->truncated_files = ag_realloc(ctx->truncated_files, (ctx->truncated_files_len + 1) * sizeof(truncated_file_t));
+    ctx->truncated_files[ctx->truncated_files_len].path = ag_strdup(*path ? path : "(standard input)");
+    ctx->truncated_files[ctx->truncated_files_len].reason = reason;
+    ctx->truncated_files_len++;
+    pthread_mutex_unlock(&ctx->truncated_files_mtx);
+}
+
+static int cmp_truncated_files(const void *a, const void *b) {
+    return strcmp(((const truncated_file_t *)a)->path, ((const truncated_file_t *)b)->path);
+}
+
+void print_truncated_files(ag_ctx *ctx) {
+    size_t i;
+
+    if (ctx->truncated_files_len == 0) {
+        return;
+    }
+    qsort(ctx->truncated_files, ctx->truncated_files_len, sizeof(truncated_file_t), cmp_truncated_files);
+    log_err("Didn't finish searching %lu file%s:", ctx->truncated_files_len, ctx->truncated_files_len == 1 ? "" : "s");
+    for (i = 0; i < ctx->truncated_files_len; i++) {
+        log_err("%s: %s", ctx->truncated_files[i].path, ctx->truncated_files[i].reason);
+        free(ctx->truncated_files[i].path);
+        free(ctx->truncated_files[i].reason);
+    }
+    free(ctx->truncated_files);
+    ctx->truncated_files = NULL;
+    ctx->truncated_files_len = 0;
+}
+
+/* Returns how many of wanted matches (or paths) can still be printed without going over --max-total-matches */
+static size_t claim_output(ag_ctx *ctx, const size_t wanted) {
+    size_t allowed = wanted;
+
+    if (ctx->opts.max_total_matches == 0) {
+        return wanted;
+    }
+    pthread_mutex_lock(&ctx->total_printed_mtx);
+    if (allowed > ctx->opts.max_total_matches - ctx->total_printed) {
+        allowed = ctx->opts.max_total_matches - ctx->total_printed;
+    }
+    ctx->total_printed += allowed;
+    if (ctx->total_printed == ctx->opts.max_total_matches && !is_search_stopped(ctx)) {
+        log_debug("Printed %lu matches. Stopping the search.", ctx->total_printed);
+        set_search_stopped(ctx, TRUE);
+    }
+    pthread_mutex_unlock(&ctx->total_printed_mtx);
+    return allowed;
+}
+
+/* Whether only a file's first match matters. -l and -L just print paths. */
+static int first_match_only(const ag_ctx *ctx) {
+    return (ctx->opts.print_filename_only || ctx->opts.print_nonmatching_files) && !ctx->opts.print_count && !ctx->opts.invert_match &&
+           !ctx->opts.stats && ctx->match_callback == NULL;
+}
+
+/* Returns TRUE once find_matches() has all the matches it needs from the file */
+static int enough_matches(ag_ctx *ctx, const size_t matches_len, const char *dir_full_path) {
+    if (first_match_only(ctx) || is_search_stopped(ctx)) {
+        return TRUE;
+    }
+    if (ctx->opts.max_matches_per_file > 0 && matches_len >= ctx->opts.max_matches_per_file) {
+        log_err("Too many matches in %s. Skipping the rest of this file.", dir_full_path);
+        return TRUE;
+    }
+    return FALSE;
+}
+
+/* Returns TRUE once deadline (if any) has passed. Only looks at the clock every DEADLINE_CHECK_INTERVAL calls. */
+static int past_deadline(const double deadline, unsigned int *calls) {
+    return deadline > 0 && (*calls)++ % DEADLINE_CHECK_INTERVAL == 0 && thread_cpu_time() > deadline;
+}
+
+/* Whether buf[start..end) is a whole word, as \b(?:...)\b would have it */
+static int is_whole_word(const char *buf, const size_t buf_len, const size_t start, const size_t end) {
+    return is_word_boundary(buf, buf_len, start) && is_word_boundary(buf, buf_len, end);
+}
+
+/* Runs m's regex over subject from offset, like pcre_exec. With -w, m->re is the query without \b(?:...)\b.
+ * No match of the wrapped regex can start before its first match, and if that's a whole word, the wrapped
+ * regex would have found exactly that match. Otherwise the wrapped regex takes over from there. */
+static int regex_match(const matcher_t *m, const char *subject, const size_t subject_len, const size_t offset, int *offset_vector) {
+    int rc;
+#ifdef HAVE_PCRE2
+    rc = ag_pcre_match(m->re, m->re_extra, subject, subject_len, offset, 0, offset_vector, 3);
+#else
+    rc = pcre_exec(m->re, m->re_extra, subject, subject_len, offset, 0, offset_vector, 3);
+#endif
+    if (rc < 0 || !m->word_regexp || is_whole_word(subject, subject_len, offset_vector[0], offset_vector[1])) {
+        return rc;
+    }
+#ifdef HAVE_PCRE2
+    return ag_pcre_match(m->word_re, m->word_re_extra, subject, subject_len, offset_vector[0], 0, offset_vector, 3);
+#else
+    return pcre_exec(m->word_re, m->word_re_extra, subject, subject_len, offset_vector[0], 0, offset_vector, 3);
+#endif
+}
+
+/* What find_matches() does with the matches it finds */
+enum {
+    KEEP_MATCHES,
+    COUNT_MATCHES, /* -c only prints how many there are */
+    COUNT_LINES    /* --count-lines only prints how many lines they're on */
+};
+
+static int match_mode(const ag_ctx *ctx) {
+    if (!ctx->opts.print_count || ctx->match_callback != NULL) {
+        return KEEP_MATCHES;
+    }
+    if (ctx->opts.count_lines) {
+        return COUNT_LINES;
+    }
+    /* -v needs the matches to find the lines between them */
+    return ctx->opts.invert_match ? KEEP_MATCHES : COUNT_MATCHES;
+}
+
+/* Adds the match at buf[start..end) and returns where to look for the next one, which is next unless
+ * --count-lines skips the rest of the match's last line. Counting never stores the match. */
+static size_t add_match(const int mode, match_t **matches, size_t *matches_size, size_t *matches_len, const size_t matches_spare,
+                        const char *buf, const size_t buf_len, const size_t start, const size_t end, const size_t next) {
+    const size_t last = end > start ? end - 1 : start;
+    const char *eol;
+
+    switch (mode) {
+        case COUNT_MATCHES:
+            (*matches_len)++;
+            return next;
+        case COUNT_LINES:
+            *matches_len += 1 + kernels.count_newlines(buf + start, last - start);
+            if (last >= buf_len) {
+                return buf_len;
             }
+            eol = memchr(buf + last, '\n', buf_len - last);
+            return eol ? (size_t)(eol - buf) + 1 : buf_len;
+        default:
+            if (*matches_len + matches_spare >= *matches_size) {
+                const size_t old_size = *matches_size;
+                *matches_size = *matches ? *matches_size * 2 : 100;
+                *matches = arena_grow(*matches, old_size * sizeof(match_t), *matches_size * sizeof(match_t));
+            }
+            (*matches)[*matches_len].start = start;
+            (*matches)[*matches_len].end = end;
+            (*matches_len)++;
+            return next;
+    }
+}
 
-            if (opts.word_regexp) {
-                const char *start = match_ptr;
-                const char *end = match_ptr + opts.query_len;
+/* Finds m's matches in buf. Returns how many there are (or how many lines they're on, for --count-lines).
+ * Regex searches stop at deadline (in thread CPU seconds, or 0 for none). */
+static size_t find_matches(ag_ctx *ctx, const matcher_t *m, const char *buf, const size_t buf_len, const char *dir_full_path,
+                           match_t **matches_ptr, size_t *matches_size_ptr, const size_t matches_spare,
+                           const double deadline) {
+    size_t buf_offset = 0;
+    size_t matches_len = 0;
+    /* --nomultiline skips just the lines that hit a PCRE limit */
+    size_t skipped_lines = 0;
+    size_t first_skipped_line = 0;
+    const char *skipped_limit = NULL;
+    char *reason;
+    match_t *matches = *matches_ptr;
+    size_t matches_size = *matches_size_ptr;
+    const int mode = match_mode(ctx);
+
+    if (!m->literal && m->query_len == 1 && m->query[0] == '.' && !m->word_regexp) {
+        add_match(mode, &matches, &matches_size, &matches_len, matches_spare, buf, buf_len, 0, buf_len, buf_len);
+    } else if (m->literal) {
+        const char *match_ptr = buf;
+        strncmp_fp ag_strnstr_fp = get_strstr(m->casing, ctx->opts.algorithm);
+        const size_t *lookup = (ctx->opts.algorithm == ALGORITHM_BOYER_MOORE) ? m->alpha_skip_lookup : m->bad_char_skip_lookup;
+        /* --horspool asks for a particular search, so only replace the default one */
+        kernel_strnstr_fp kernel_strnstr = NULL;
+        if (ctx->opts.algorithm == ALGORITHM_BOYER_MOORE) {
+            kernel_strnstr = m->casing == CASE_SENSITIVE ? kernels.strnstr : kernels.strncasestr;
+        }
+/* hash_strnstr only for little-endian platforms that allow unaligned access */
+#if defined(__i386__) || defined(__x86_64__)
+        /* Decide whether to fall back on boyer-moore */
+        const int use_hash = (size_t)m->query_len >= 2 * sizeof(uint16_t) - 1 && m->query_len < UCHAR_MAX;
+#else
+        const int use_hash = FALSE;
+#endif
+        /* Two-Way is used from the start for long needles, or once near misses use up the verify budget */
+        const two_way_t *linear = kernel_strnstr ? NULL : m->two_way;
+        two_way_t two_way;
+        size_t verify_budget = VERIFY_BUDGET(buf_len);
 
-                /* Check whether both start and end of the match lie on a word
-                 * boundary
-                 */
-                if ((start == buf ||
-                     is_wordchar(*(start - 1)) != opts.literal_starts_wordchar) &&
-                    (end == buf + buf_len ||
-                     is_wordchar(*end) != opts.literal_ends_wordchar)) {
-                    /* It's a match */
+        while (buf_offset < buf_len) {
+            if (linear) {
+                match_ptr = two_way_strnstr(match_ptr, m->query, buf_len - buf_offset, m->query_len, linear);
+            } else if (kernel_strnstr) {
+                match_ptr = kernel_strnstr(match_ptr, m->query, buf_len - buf_offset, m->query_len, &verify_budget);
+            } else if (use_hash) {
+                match_ptr = hash_strnstr(match_ptr, m->query, buf_len - buf_offset, m->query_len, m->h_table, m->casing == CASE_SENSITIVE, &verify_budget);
+            } else {
+                match_ptr = ag_strnstr_fp(match_ptr, m->query, buf_len - buf_offset, m->query_len, lookup, m->find_skip_lookup, &verify_budget);
+            }
+
+            if (match_ptr == NULL) {
+                if (linear || verify_budget > 0 || m->query_len < 2) {
+                    break;
+                }
+                log_debug("Too many near misses in %s. Searching the rest of it in linear time.", dir_full_path);
+                if (m->two_way) {
+                    linear = m->two_way;
                 } else {
-                    /* It's not a match */
-                    match_ptr += find_skip_lookup[0] - opts.query_len + 1;
-                    buf_offset = match_ptr - buf;
-                    continue;
+                    generate_two_way(m->query, m->query_len, &two_way, m->casing == CASE_SENSITIVE);
+                    linear = &two_way;
                 }
+                match_ptr = buf + buf_offset;
+                continue;
+            }
+
+            if (m->word_regexp && !is_whole_word(buf, buf_len, match_ptr - buf, match_ptr - buf + m->query_len)) {
+                match_ptr++;
+                buf_offset = match_ptr - buf;
+                continue;
             }
 
-            realloc_matches(&matches, &matches_size, matches_len + matches_spare);
+            log_debug("Match found. File %s, offset %lu bytes.", dir_full_path, (size_t)(match_ptr - buf));
+            buf_offset = match_ptr - buf + m->query_len;
+            buf_offset = add_match(mode, &matches, &matches_size, &matches_len, matches_spare, buf, buf_len,
+                                   match_ptr - buf, buf_offset, buf_offset);
+            match_ptr = buf + buf_offset;
+
+            if (enough_matches(ctx, matches_len, dir_full_path)) {
+                break;
+            }
+        }
+    } else if (m->litset) {
+        size_t match_start;
+        size_t match_end;
 
-            matches[matches_len].start = match_ptr - buf;
-            matches[matches_len].end = matches[matches_len].start + opts.query_len;
-            buf_offset = matches[matches_len].end;
-            log_debug("Match found. File %s, offset %lu bytes.", dir_full_path, matches[matches_len].start);
-            matches_len++;
-            match_ptr += opts.query_len;
+        while (buf_offset < buf_len && litset_search(m->litset, buf, buf_len, buf_offset, &match_start, &match_end)) {
+            log_debug("Match found. File %s, offset %lu bytes.", dir_full_path, match_start);
+            buf_offset = add_match(mode, &matches, &matches_size, &matches_len, matches_spare, buf, buf_len,
+                                   match_start, match_end, match_end);
 
-            if (opts.max_matches_per_file > 0 && matches_len >= opts.max_matches_per_file) {
-                log_err("Too many matches in %s. Skipping the rest of this file.", dir_full_path);
+            if (enough_matches(ctx, matches_len, dir_full_path)) {
                 break;
             }
         }
     } else {
         int offset_vector[3];
-        if (opts.multiline) {
-            while (buf_offset < buf_len &&
-#ifdef HAVE_PCRE2
-                   (ag_pcre_match(opts.re, opts.re_extra, buf, buf_len, buf_offset, 0, offset_vector, 3)) >= 0) {
-#else
-                   (pcre_exec(opts.re, opts.re_extra, buf, buf_len, buf_offset, 0, offset_vector, 3)) >= 0) {
-#endif
+        int rc;
+        const char *limit;
+        unsigned int pcre_calls = 0;
+        /* The DFA skips to where the next match might start, and PCRE finds its bounds from there */
+        int use_dfa = m->dfa != NULL;
+        size_t skip_to;
+        if (ctx->opts.multiline) {
+            while (buf_offset < buf_len) {
+                size_t pcre_offset = buf_offset;
+                if (past_deadline(deadline, &pcre_calls)) {
+                    ag_asprintf(&reason, "stopped at line %lu after using up --file-time-limit", line_number(buf, buf_offset));
+                    add_truncated_file(ctx, dir_full_path, reason);
+                    break;
+                }
+                if (use_dfa) {
+                    skip_to = dfa_search(m->dfa, buf, buf_len, buf_offset, FALSE);
+                    if (skip_to == DFA_NO_MATCH) {
+                        break;
+                    }
+                    if (skip_to == DFA_GAVE_UP) {
+                        log_debug("Too many DFA states for %s. Searching the rest of it with PCRE.", dir_full_path);
+                        use_dfa = FALSE;
+                    } else {
+                        pcre_offset = skip_to;
+                    }
+                }
+                rc = regex_match(m, buf, buf_len, pcre_offset, offset_vector);
+                if (rc < 0) {
+                    limit = ag_pcre_limit_name(rc);
+                    if (limit) {
+                        /* A later search would probably hit the same spot, so give up on the file */
+                        ag_asprintf(&reason, "stopped at line %lu after hitting %s", line_number(buf, pcre_offset), limit);
+                        add_truncated_file(ctx, dir_full_path, reason);
+                    }
+                    break;
+                }
                 log_debug("Regex match found. File %s, offset %i bytes.", dir_full_path, offset_vector[0]);
                 buf_offset = offset_vector[1];
                 if (offset_vector[0] == offset_vector[1]) {
                     ++buf_offset;
                     log_debug("Regex match is of length zero. Advancing offset one byte.");
                 }
+                buf_offset = add_match(mode, &matches, &matches_size, &matches_len, matches_spare, buf, buf_len,
+                                       offset_vector[0], offset_vector[1], buf_offset);
 
-                realloc_matches(&matches, &matches_size, matches_len + matches_spare);
-
-                matches[matches_len].start = offset_vector[0];
-                matches[matches_len].end = offset_vector[1];
-                matches_len++;
-
-                if (opts.max_matches_per_file > 0 && matches_len >= opts.max_matches_per_file) {
-                    log_err("Too many matches in %s. Skipping the rest of this file.", dir_full_path);
+                if (enough_matches(ctx, matches_len, dir_full_path)) {
                     break;
                 }
             }
         } else {
             while (buf_offset < buf_len) {
                 const char *line;
+                if (past_deadline(deadline, &pcre_calls)) {
+                    ag_asprintf(&reason, "stopped at line %lu after using up --file-time-limit", line_number(buf, buf_offset));
+                    add_truncated_file(ctx, dir_full_path, reason);
+                    break;
+                }
+                if (use_dfa) {
+                    skip_to = dfa_search(m->dfa, buf, buf_len, buf_offset, TRUE);
+                    if (skip_to == DFA_NO_MATCH) {
+                        break;
+                    }
+                    if (skip_to == DFA_GAVE_UP) {
+                        log_debug("Too many DFA states for %s. Searching the rest of it with PCRE.", dir_full_path);
+                        use_dfa = FALSE;
+                    } else {
+                        buf_offset = line_start(buf, buf_offset, skip_to);
+                    }
+                }
                 size_t line_len = buf_getline(&line, buf, buf_len, buf_offset);
                 if (!line) {
                     break;
                 }
                 size_t line_offset = 0;
                 while (line_offset < line_len) {
-#ifdef HAVE_PCRE2
-                    int rv = ag_pcre_match(opts.re, opts.re_extra, line, line_len, line_offset, 0, offset_vector, 3);
-#else
-                    int rv = pcre_exec(opts.re, opts.re_extra, line, line_len, line_offset, 0, offset_vector, 3);
-#endif
-                    if (rv < 0) {
+                    rc = regex_match(m, line, line_len, line_offset, offset_vector);
+                    if (rc < 0) {
+                        limit = ag_pcre_limit_name(rc);
+                        if (limit && skipped_lines++ == 0) {
+                            first_skipped_line = line_number(buf, buf_offset);
+                            skipped_limit = limit;
+                        }
                         break;
                     }
-                    size_t line_to_buf = buf_offset + line_offset;
+                    size_t line_to_buf = buf_offset;
                     log_debug("Regex match found. File %s, offset %i bytes.", dir_full_path, offset_vector[0]);
                     line_offset = offset_vector[1];
                     if (offset_vector[0] == offset_vector[1]) {
                         ++line_offset;
                         log_debug("Regex match is of length zero. Advancing offset one byte.");
                     }
+                    line_offset = add_match(mode, &matches, &matches_size, &matches_len, matches_spare, buf, buf_len,
+                                            offset_vector[0] + line_to_buf, offset_vector[1] + line_to_buf,
+                                            line_offset + line_to_buf) -
+                                  line_to_buf;
 
-                    realloc_matches(&matches, &matches_size, matches_len + matches_spare);
-
-                    matches[matches_len].start = offset_vector[0] + line_to_buf;
-                    matches[matches_len].end = offset_vector[1] + line_to_buf;
-                    matches_len++;
-
-                    if (opts.max_matches_per_file > 0 && matches_len >= opts.max_matches_per_file) {
-                        log_err("Too many matches in %s. Skipping the rest of this file.", dir_full_path);
+                    if (enough_matches(ctx, matches_len, dir_full_path)) {
                         goto multiline_done;
                     }
                 }
@@ -186,62 +705,167 @@ ssize_t search_buf(const char *buf, const size_t buf_len,
     }
 
 multiline_done:
-
-    if (opts.invert_match) {
-        matches_len = invert_matches(buf, buf_len, matches, matches_len);
+    if (skipped_lines > 0) {
+        ag_asprintf(&reason, "skipped %lu line%s after hitting %s, starting at line %lu",
+                    skipped_lines, skipped_lines == 1 ? "" : "s", skipped_limit, first_skipped_line);
+        add_truncated_file(ctx, dir_full_path, reason);
     }
+    *matches_ptr = matches;
+    *matches_size_ptr = matches_size;
+    return matches_len;
+}
 
-    if (opts.stats) {
-        pthread_mutex_lock(&stats_mtx);
-        stats.total_bytes += buf_len;
-        stats.total_files++;
-        stats.total_matches += matches_len;
-        if (matches_len > 0) {
-            stats.total_file_matches++;
+/* Returns: -1 if skipped, otherwise # of matches */
+ssize_t search_buf(ag_ctx *ctx, const char *buf, const size_t buf_len,
+                   const char *dir_full_path) {
+    int binary = -1; /* 1 = yes, 0 = no, -1 = don't know */
+    size_t total_matches_len = 0;
+    int file_matched = FALSE;
+    size_t i;
+    ag_stats *thread_stats = stats_thread();
+    stats_phase_t prev_phase = stats_phase(STATS_PHASE_MATCH);
+    /* --file-time-limit covers every query run over the file */
+    const double deadline = ctx->opts.file_time_limit > 0 ? thread_cpu_time() + ctx->opts.file_time_limit : 0;
+
+    if (ctx->opts.search_stream) {
+        binary = 0;
+    } else if (!ctx->opts.search_binary_files && ctx->opts.mmap) { /* if not using mmap, binary files have already been skipped */
+        // https://github.com/ggreer/the_silver_searcher/pull/204
+        stats_phase(STATS_PHASE_BINARY);
+        binary = kernels.is_binary(buf, buf_len);
+        stats_phase(STATS_PHASE_MATCH);
+        if (binary) {
+            log_debug("File %s is binary. Skipping...", dir_full_path);
+            stats_phase(prev_phase);
+            return -1;
         }
-        pthread_mutex_unlock(&stats_mtx);
     }
 
-    if (!opts.print_nonmatching_files && (matches_len > 0 || opts.print_all_paths)) {
-        if (binary == -1 && !opts.print_filename_only) {
-            // https://github.com/ggreer/the_silver_searcher/pull/204
-            binary = is_binary(buf, buf_len);
+    size_t matches_len = 0;
+    match_t *matches;
+    size_t matches_size;
+    size_t matches_spare;
+
+    if (ctx->opts.invert_match && match_mode(ctx) != COUNT_LINES) {
+        /* If we are going to invert the set of matches at the end, we will need
+         * one extra match struct, even if there are no matches at all. So make
+         * sure we have a nonempty array; and make sure we always have spare
+         * capacity for one extra.
+         */
+        matches_size = 100;
+        matches = arena_alloc(matches_size * sizeof(match_t));
+        matches_spare = 1;
+    } else {
+        matches_size = 0;
+        matches = NULL;
+        matches_spare = 0;
+    }
+
+    /* With --queries, every query runs over the same buffer and its results are tagged with its id */
+    for (i = 0; i < ctx->matchers_len; i++) {
+        const matcher_t *m = &ctx->matchers[i];
+        char *tagged_path = NULL;
+        const char *path = dir_full_path;
+
+        stats_phase(STATS_PHASE_MATCH);
+        matches_len = find_matches(ctx, m, buf, buf_len, dir_full_path, &matches, &matches_size, matches_spare, deadline);
+
+        if (ctx->opts.invert_match) {
+            if (match_mode(ctx) == COUNT_LINES) {
+                /* The lines that don't match are the ones that are left */
+                matches_len = buf_lines(buf, buf_len) - matches_len;
+            } else {
+                matches_len = invert_matches(buf, buf_len, matches, matches_len);
+            }
         }
-        pthread_mutex_lock(&print_mtx);
-        if (opts.print_filename_only) {
-            if (opts.print_count) {
-                print_path_count(dir_full_path, opts.path_sep, (size_t)matches_len);
+        total_matches_len += matches_len;
+
+        if (!ctx->opts.print_nonmatching_files && (matches_len > 0 || ctx->opts.print_all_paths)) {
+            size_t wanted;
+            size_t allowed;
+            if (binary == -1 && !ctx->opts.print_filename_only) {
+                // https://github.com/ggreer/the_silver_searcher/pull/204
+                stats_phase(STATS_PHASE_BINARY);
+                binary = kernels.is_binary(buf, buf_len);
+            }
+            stats_phase(STATS_PHASE_PRINT);
+            /* -c, -l and binary files print one line for the whole file */
+            wanted = (ctx->opts.print_filename_only || (binary && !ctx->match_callback)) ? 1 : matches_len;
+            allowed = claim_output(ctx, wanted);
+            if (allowed < wanted) {
+                if (allowed == 0) {
+                    continue;
+                }
+                matches_len = allowed;
+            }
+            if (ctx->match_callback) {
+                if (matches_len > 0) {
+                    ctx->match_callback(ctx, dir_full_path, m, buf, buf_len, search_stream_line ? search_stream_line : 1, search_stream_offset, matches, matches_len);
+                    set_match_found(ctx);
+                    file_matched = TRUE;
+                }
+                continue;
+            }
+            if (m->id) {
+                tagged_path = arena_sprintf("%s:%s", m->id, normalize_path(dir_full_path));
+                path = tagged_path;
+                if (file_matched && !ctx->opts.search_stream) {
+                    /* Each query's matches are printed as if the file was new */
+                    print_cleanup_context(ctx);
+                    print_init_context(ctx);
+                }
+            }
+            TRACE_LOCK(&print_mtx, "print lock wait");
+            if (ctx->opts.print_filename_only) {
+                if (ctx->opts.print_count) {
+                    print_path_count(ctx, path, ctx->opts.path_sep, (size_t)matches_len);
+                } else {
+                    print_path(ctx, path, ctx->opts.path_sep);
+                }
+            } else if (binary) {
+                print_binary_file_matches(ctx, path);
             } else {
-                print_path(dir_full_path, opts.path_sep);
+                print_file_matches(ctx, path, buf, buf_len, matches, matches_len);
             }
-        } else if (binary) {
-            print_binary_file_matches(dir_full_path);
-        } else {
-            print_file_matches(dir_full_path, buf, buf_len, matches, matches_len);
+            pthread_mutex_unlock(&print_mtx);
+            set_match_found(ctx);
+            file_matched = TRUE;
+        }
+    }
+
+    stats_phase(STATS_PHASE_PRINT);
+    if (thread_stats) {
+        thread_stats->total_bytes += buf_len;
+        thread_stats->total_files++;
+        thread_stats->total_matches += total_matches_len;
+        if (total_matches_len > 0) {
+            thread_stats->total_file_matches++;
         }
-        pthread_mutex_unlock(&print_mtx);
-        opts.match_found = 1;
-    } else if (opts.search_stream && opts.passthrough) {
-        fprintf(out_fd, "%s", buf);
-    } else {
-        log_debug("No match in %s", dir_full_path);
     }
 
-    if (matches_len == 0 && opts.search_stream) {
-        print_context_append(buf, buf_len - 1);
+    if (!file_matched) {
+        if (ctx->opts.search_stream && ctx->opts.passthrough) {
+            fprintf(out_fd, "%s", buf);
+        } else {
+            log_debug("No match in %s", dir_full_path);
+        }
     }
 
-    if (matches_size > 0) {
-        free(matches);
+    if (total_matches_len == 0 && ctx->opts.search_stream) {
+        print_context_append(ctx, buf, buf_len - 1);
     }
 
+    /* The matches and tagged paths */
+    arena_reset();
+
+    stats_phase(prev_phase);
     /* FIXME: handle case where matches_len > SSIZE_MAX */
-    return (ssize_t)matches_len;
+    return (ssize_t)total_matches_len;
 }
 
 /* Return value: -1 if skipped, otherwise # of matches */
 /* TODO: this will only match single lines. multi-line regexes silently don't match */
-ssize_t search_stream(FILE *stream, const char *path) {
+ssize_t search_stream(ag_ctx *ctx, FILE *stream, const char *path) {
     char *line = NULL;
     ssize_t matches_count = 0;
     ssize_t line_len = 0;
@@ -252,12 +876,14 @@ ssize_t search_stream(FILE *stream, const char *path) {
     if (stream == NULL) {
         return 0;
     }
-    print_init_context();
+    print_init_context(ctx);
 
-    for (i = 1; (line_len = getline(&line, &line_cap, stream)) > 0; i++) {
+    for (i = 1; !is_search_stopped(ctx) && (line_len = getline(&line, &line_cap, stream)) > 0; i++) {
         ssize_t result;
-        opts.stream_line_num = i;
-        result = search_buf(line, line_len, path);
+        ctx->opts.stream_line_num = i;
+        search_stream_line = i;
+        result = search_buf(ctx, line, line_len, path);
+        search_stream_offset += line_len;
         if (result > 0) {
             if (matches_count == -1) {
                 matches_count = 0;
@@ -269,17 +895,19 @@ ssize_t search_stream(FILE *stream, const char *path) {
         if (line[line_len - 1] == '\n') {
             line_len--;
         }
-        print_trailing_context(path, line, line_len);
+        print_trailing_context(ctx, path, line, line_len);
     }
 
     free(line);
-    print_cleanup_context();
+    search_stream_line = 0;
+    search_stream_offset = 0;
+    print_cleanup_context(ctx);
     return matches_count;
 }
 
 #define AG_MIN(a, b) ((b < a) ? b : a)
 
-void search_file(const char *file_full_path) {
+void search_file(ag_ctx *ctx, const char *file_full_path) {
     int fd = -1;
     off_t f_len = 0;
     char *buf = NULL;
@@ -287,6 +915,8 @@ void search_file(const char *file_full_path) {
     int rv = 0;
     int matches_count = -1;
     FILE *fp = NULL;
+    stats_phase_t prev_phase = stats_phase(STATS_PHASE_READ);
+    int trace_token = TRACE_BEGIN("search_file", file_full_path);
 
     rv = stat(file_full_path, &statbuf);
     if (rv != 0) {
@@ -294,7 +924,7 @@ void search_file(const char *file_full_path) {
         goto cleanup;
     }
 
-    if (opts.stdout_inode != 0 && opts.stdout_inode == statbuf.st_ino) {
+    if (ctx->opts.stdout_inode != 0 && ctx->opts.stdout_inode == statbuf.st_ino) {
         log_debug("Skipping %s: stdout is redirected to it", file_full_path);
         goto cleanup;
     }
@@ -319,7 +949,7 @@ void search_file(const char *file_full_path) {
         goto cleanup;
     }
 
-    if (opts.stdout_inode != 0 && opts.stdout_inode == statbuf.st_ino) {
+    if (ctx->opts.stdout_inode != 0 && ctx->opts.stdout_inode == statbuf.st_ino) {
         log_debug("Skipping %s: stdout is redirected to it", file_full_path);
         goto cleanup;
     }
@@ -330,12 +960,12 @@ void search_file(const char *file_full_path) {
         goto cleanup;
     }
 
-    print_init_context();
+    print_init_context(ctx);
 
     if (statbuf.st_mode & S_IFIFO) {
         log_debug("%s is a named pipe. stream searching", file_full_path);
         fp = fdopen(fd, "r");
-        matches_count = search_stream(fp, file_full_path);
+        matches_count = search_stream(ctx, fp, file_full_path);
         fclose(fp);
         goto cleanup;
     }
@@ -343,8 +973,8 @@ void search_file(const char *file_full_path) {
     f_len = statbuf.st_size;
 
     if (f_len == 0) {
-        if (opts.query[0] == '.' && opts.query_len == 1 && !opts.literal && opts.search_all_files) {
-            matches_count = search_buf(buf, f_len, file_full_path);
+        if (ctx->opts.query[0] == '.' && ctx->opts.query_len == 1 && !ctx->opts.literal && ctx->opts.search_all_files) {
+            matches_count = search_buf(ctx, buf, f_len, file_full_path);
         } else {
             log_debug("Skipping %s: file is empty.", file_full_path);
         }
@@ -353,7 +983,7 @@ void search_file(const char *file_full_path) {
 
 #ifdef HAVE_PCRE2
 #else
-    if (!opts.literal && f_len > INT_MAX) {
+    if (!ctx->opts.literal && f_len > INT_MAX) {
         log_err("Skipping %s: pcre_exec() can't handle files larger than %i bytes.", file_full_path, INT_MAX);
         goto cleanup;
     }
@@ -379,7 +1009,7 @@ void search_file(const char *file_full_path) {
     }
 #else
 
-    if (opts.mmap) {
+    if (ctx->opts.mmap) {
         buf = mmap(0, f_len, PROT_READ, MAP_PRIVATE, fd, 0);
         if (buf == MAP_FAILED) {
             log_err("File %s failed to load: %s.", file_full_path, strerror(errno));
@@ -395,7 +1025,7 @@ void search_file(const char *file_full_path) {
 
         ssize_t bytes_read = 0;
 
-        if (!opts.search_binary_files) {
+        if (!ctx->opts.search_binary_files) {
             // https://github.com/ggreer/the_silver_searcher/pull/1260
             bytes_read += read(fd, buf, AG_MIN(f_len, 512));
             if (bytes_read < 0) {
@@ -405,10 +1035,12 @@ void search_file(const char *file_full_path) {
 
             // https://github.com/ggreer/the_silver_searcher/pull/204
             // Optimization: If skipping binary files, don't read the whole buffer before checking if binary or not.
-            if (is_binary(buf, f_len)) {
+            stats_phase(STATS_PHASE_BINARY);
+            if (kernels.is_binary(buf, f_len)) {
                 log_debug("File %s is binary. Skipping...", file_full_path);
                 goto cleanup;
             }
+            stats_phase(STATS_PHASE_READ);
         }
 
         while (bytes_read < f_len) {
@@ -419,14 +1051,17 @@ void search_file(const char *file_full_path) {
             bytes_read += r;
         }
         if (bytes_read != f_len) {
-            die("File %s read(): expected to read %u bytes but read %u", file_full_path, f_len, bytes_read);
+            log_err("File %s read(): expected to read %u bytes but read %u", file_full_path, f_len, bytes_read);
+            goto cleanup;
         }
     }
 #endif
 
-    if (opts.search_zip_files) {
+    if (ctx->opts.search_zip_files) {
         ag_compression_type zip_type = is_zipped(buf, f_len);
         if (zip_type != AG_NO_COMPRESSION) {
+            stats_phase(STATS_PHASE_DECOMPRESS);
+            int decompress_trace_token = TRACE_BEGIN("decompress", NULL);
 #if HAVE_FOPENCOOKIE
             log_debug("%s is a compressed file. stream searching", file_full_path);
             fp = decompress_open(fd, "r", zip_type);
@@ -435,7 +1070,7 @@ void search_file(const char *file_full_path) {
                 log_err("Skipping %s: Unable to decompress", file_full_path);
                 goto cleanup;
             } else {
-                matches_count = search_stream(fp, file_full_path);
+                matches_count = search_stream(ctx, fp, file_full_path);
                 fclose(fp);
             }
 #else
@@ -446,30 +1081,33 @@ void search_file(const char *file_full_path) {
                 log_err("Cannot decompress zipped file %s", file_full_path);
                 goto cleanup;
             }
-            matches_count = search_buf(_buf, _buf_len, file_full_path);
+            matches_count = search_buf(ctx, _buf, _buf_len, file_full_path);
             free(_buf);
 #endif
+            TRACE_END(decompress_trace_token);
             goto cleanup;
         }
     }
 
-    matches_count = search_buf(buf, f_len, file_full_path);
+    matches_count = search_buf(ctx, buf, f_len, file_full_path);
 
 cleanup:
 
-    if (opts.print_nonmatching_files && matches_count == 0) {
+    if (ctx->opts.print_nonmatching_files && matches_count == 0 && claim_output(ctx, 1) > 0) {
+        stats_phase(STATS_PHASE_PRINT);
         pthread_mutex_lock(&print_mtx);
-        print_path(file_full_path, opts.path_sep);
+        print_path(ctx, file_full_path, ctx->opts.path_sep);
         pthread_mutex_unlock(&print_mtx);
-        opts.match_found = 1;
+        set_match_found(ctx);
     }
 
-    print_cleanup_context();
+    stats_phase(STATS_PHASE_READ);
+    print_cleanup_context(ctx);
     if (buf != NULL) {
 #ifdef _WIN32
         UnmapViewOfFile(buf);
 #else
-        if (opts.mmap) {
+        if (ctx->opts.mmap) {
             if (buf != MAP_FAILED) {
                 munmap(buf, f_len);
             }
@@ -481,37 +1119,199 @@ cleanup:
     if (fd != -1) {
         close(fd);
     }
+    TRACE_END(trace_token);
+    stats_phase(prev_phase);
+}
+
+/* A file given as a path to search, rather than one found in a directory */
+void search_file_arg(ag_ctx *ctx, const char *path) {
+    if (ctx->opts.paths_len == 1 && !ctx->opts.queries) {
+        /* If we're only searching one file, don't print the filename header at the top. */
+        if (ctx->opts.print_path == PATH_PRINT_DEFAULT || ctx->opts.print_path == PATH_PRINT_DEFAULT_EACH_LINE) {
+            ctx->opts.print_path = PATH_PRINT_NOTHING;
+        }
+        /* If we're only searching one file and --only-matching is specified, disable line numbers too. */
+        if (ctx->opts.only_matching && ctx->opts.print_path == PATH_PRINT_NOTHING) {
+            ctx->opts.print_line_numbers = FALSE;
+        }
+    }
+    search_file(ctx, path);
+}
+
+/* Returns an item holding a copy of path. Call with ctx->work_queue_mtx held. */
+static work_queue_t *new_work_item(ag_ctx *ctx, const char *path) {
+    const size_t path_size = strlen(path) + 1;
+    work_queue_t *item;
+    size_t i;
+
+    if (ctx->free_work_items == NULL) {
+        work_queue_t *slab = ag_malloc(WORK_ITEMS_PER_SLAB * sizeof(work_queue_t));
+        ctx->work_item_slabs = ag_realloc(ctx->work_item_slabs, (ctx->work_item_slabs_len + 1) * sizeof(work_queue_t *));
+        ctx->work_item_slabs[ctx->work_item_slabs_len++] = slab;
+        for (i = 0; i < WORK_ITEMS_PER_SLAB; i++) {
+            slab[i].next = ctx->free_work_items;
+            ctx->free_work_items = &slab[i];
+        }
+    }
+    item = ctx->free_work_items;
+    ctx->free_work_items = item->next;
+
+    if (ctx->path_block == NULL || ctx->path_block->size - ctx->path_block->used < path_size) {
+        struct path_block *b = ctx->free_path_blocks;
+        if (ctx->path_block && ctx->path_block->pending == 0) {
+            /* Its paths have all been searched already */
+            ctx->path_block->used = 0;
+            ctx->path_block->next_free = ctx->free_path_blocks;
+            ctx->free_path_blocks = ctx->path_block;
+            b = ctx->free_path_blocks;
+        }
+        if (b && b->size >= path_size) {
+            ctx->free_path_blocks = b->next_free;
+        } else {
+            b = ag_malloc(sizeof(struct path_block));
+            b->size = path_size > PATH_BLOCK_SIZE ? path_size : PATH_BLOCK_SIZE;
+            b->data = ag_malloc(b->size);
+            b->used = 0;
+            b->pending = 0;
+            ctx->path_blocks = ag_realloc(ctx->path_blocks, (ctx->path_blocks_len + 1) * sizeof(struct path_block *));
+            ctx->path_blocks[ctx->path_blocks_len++] = b;
+        }
+        ctx->path_block = b;
+    }
+    item->path = ctx->path_block->data + ctx->path_block->used;
+    memcpy(item->path, path, path_size);
+    ctx->path_block->used += path_size;
+    ctx->path_block->pending++;
+    item->path_block = ctx->path_block;
+    item->next = NULL;
+    return item;
+}
+
+/* Call with ctx->work_queue_mtx held */
+static void recycle_work_item(ag_ctx *ctx, work_queue_t *item) {
+    struct path_block *b = item->path_block;
+
+    if (--b->pending == 0 && b != ctx->path_block) {
+        b->used = 0;
+        b->next_free = ctx->free_path_blocks;
+        ctx->free_path_blocks = b;
+    }
+    item->next = ctx->free_work_items;
+    ctx->free_work_items = item;
+}
+
+/* Once the workers are gone */
+static void free_work_items_and_paths(ag_ctx *ctx) {
+    size_t i;
+
+    for (i = 0; i < ctx->work_item_slabs_len; i++) {
+        free(ctx->work_item_slabs[i]);
+    }
+    free(ctx->work_item_slabs);
+    ctx->work_item_slabs = NULL;
+    ctx->work_item_slabs_len = 0;
+    ctx->free_work_items = NULL;
+    for (i = 0; i < ctx->path_blocks_len; i++) {
+        free(ctx->path_blocks[i]->data);
+        free(ctx->path_blocks[i]);
+    }
+    free(ctx->path_blocks);
+    ctx->path_blocks = NULL;
+    ctx->path_blocks_len = 0;
+    ctx->path_block = NULL;
+    ctx->free_path_blocks = NULL;
 }
 
 void *search_file_worker(void *i) {
-    work_queue_t *queue_item;
-    int worker_id = *(int *)i;
+    work_queue_t *queue_item = NULL;
+    worker_t *worker = (worker_t *)i;
+    ag_ctx *ctx = worker->ctx;
+    int worker_id = worker->id;
 
     log_debug("Worker %i started", worker_id);
+    stats_thread_start(worker->stats, STATS_PHASE_QUEUE_WAIT);
+    trace_thread_start(worker_id);
     while (TRUE) {
-        pthread_mutex_lock(&work_queue_mtx);
-        while (work_queue == NULL) {
-            if (done_adding_files) {
-                pthread_mutex_unlock(&work_queue_mtx);
+        stats_phase(STATS_PHASE_QUEUE_WAIT);
+        pthread_mutex_lock(&ctx->work_queue_mtx);
+        if (queue_item) {
+            recycle_work_item(ctx, queue_item);
+            queue_item = NULL;
+        }
+        while (ctx->work_queue == NULL) {
+            if (ctx->done_adding_files) {
+                pthread_mutex_unlock(&ctx->work_queue_mtx);
                 log_debug("Worker %i finished.", worker_id);
+                print_cleanup_records();
+                dfa_thread_cleanup();
+                ag_pcre_thread_cleanup();
+                arena_thread_cleanup();
+                stats_thread_stop();
                 pthread_exit(NULL);
             }
-            pthread_cond_wait(&files_ready, &work_queue_mtx);
+            pthread_cond_wait(&ctx->files_ready, &ctx->work_queue_mtx);
         }
-        queue_item = work_queue;
-        work_queue = work_queue->next;
-        if (work_queue == NULL) {
-            work_queue_tail = NULL;
+        queue_item = ctx->work_queue;
+        ctx->work_queue = ctx->work_queue->next;
+        if (ctx->work_queue == NULL) {
+            ctx->work_queue_tail = NULL;
         }
-        pthread_mutex_unlock(&work_queue_mtx);
+        pthread_mutex_unlock(&ctx->work_queue_mtx);
 
-        search_file(queue_item->path);
-        free(queue_item->path);
-        free(queue_item);
+        stats_phase(STATS_PHASE_OTHER);
+        if (!is_search_stopped(ctx)) {
+            search_file(ctx, queue_item->path);
+        }
     }
 }
 
-static int check_symloop_enter(const char *path, dirkey_t *outkey) {
+/* Adds a copy of a file found while walking the tree to the work queue, after applying -G/-g */
+void queue_file(ag_ctx *ctx, const char *file_full_path) {
+    int offset_vector[3];
+    int rc = 0;
+    work_queue_t *queue_item;
+
+    if (is_search_stopped(ctx)) {
+        return;
+    }
+    if (ctx->opts.file_search_regex) {
+#ifdef HAVE_PCRE2
+        rc = ag_pcre_match(ctx->opts.file_search_regex, NULL, file_full_path, strlen(file_full_path),
+                           0, 0, offset_vector, 3);
+#else
+        rc = pcre_exec(ctx->opts.file_search_regex, NULL, file_full_path, strlen(file_full_path),
+                       0, 0, offset_vector, 3);
+#endif
+        if (rc < 0) { /* no match */
+            log_debug("Skipping %s due to file_search_regex.", file_full_path);
+            return;
+        } else if (ctx->opts.match_files) {
+            log_debug("match_files: file_search_regex matched for %s.", file_full_path);
+            if (claim_output(ctx, 1) == 0) {
+                return;
+            }
+            pthread_mutex_lock(&print_mtx);
+            print_path(ctx, file_full_path, ctx->opts.path_sep);
+            pthread_mutex_unlock(&print_mtx);
+            set_match_found(ctx);
+            return;
+        }
+    }
+
+    pthread_mutex_lock(&ctx->work_queue_mtx);
+    queue_item = new_work_item(ctx, file_full_path);
+    if (ctx->work_queue_tail == NULL) {
+        ctx->work_queue = queue_item;
+    } else {
+        ctx->work_queue_tail->next = queue_item;
+    }
+    ctx->work_queue_tail = queue_item;
+    pthread_cond_signal(&ctx->files_ready);
+    pthread_mutex_unlock(&ctx->work_queue_mtx);
+    log_debug("%s added to work queue", file_full_path);
+}
+
+static int check_symloop_enter(ag_ctx *ctx, const char *path, dirkey_t *outkey) {
 #ifdef _WIN32
     return SYMLOOP_OK;
 #else
@@ -532,19 +1332,19 @@ static int check_symloop_enter(const char *path, dirkey_t *outkey) {
     outkey->dev = buf.st_dev;
     outkey->ino = buf.st_ino;
 
-    HASH_FIND(hh, symhash, outkey, sizeof(dirkey_t), item_found);
+    HASH_FIND(hh, ctx->symhash, outkey, sizeof(dirkey_t), item_found);
     if (item_found) {
         return SYMLOOP_LOOP;
     }
 
     new_item = (symdir_t *)ag_malloc(sizeof(symdir_t));
     memcpy(&new_item->key, outkey, sizeof(dirkey_t));
-    HASH_ADD(hh, symhash, key, sizeof(dirkey_t), new_item);
+    HASH_ADD(hh, ctx->symhash, key, sizeof(dirkey_t), new_item);
     return SYMLOOP_OK;
 #endif
 }
 
-static int check_symloop_leave(dirkey_t *dirkey) {
+static int check_symloop_leave(ag_ctx *ctx, dirkey_t *dirkey) {
 #ifdef _WIN32
     return SYMLOOP_OK;
 #else
@@ -554,26 +1354,35 @@ static int check_symloop_leave(dirkey_t *dirkey) {
         return SYMLOOP_ERROR;
     }
 
-    HASH_FIND(hh, symhash, dirkey, sizeof(dirkey_t), item_found);
+    HASH_FIND(hh, ctx->symhash, dirkey, sizeof(dirkey_t), item_found);
     if (!item_found) {
         log_err("item not found! weird stuff...\n");
         return SYMLOOP_ERROR;
     }
 
-    HASH_DELETE(hh, symhash, item_found);
+    HASH_DELETE(hh, ctx->symhash, item_found);
     free(item_found);
     return SYMLOOP_OK;
 #endif
 }
 
+/* Charges filtering directory entries to the ignore phase */
+static int timed_filename_filter(const char *path, const dirlist_entry_t *dir, void *baton) {
+    stats_phase_t prev_phase = stats_phase(STATS_PHASE_IGNORE);
+    int rv = filename_filter(path, dir, baton);
+    stats_phase(prev_phase);
+    return rv;
+}
+
 /* TODO: Append matches to some data structure instead of just printing them out.
  * Then ag can have sweet summaries of matches/files scanned/time/etc.
  */
-void search_dir(ignores *ig, const char *base_path, const char *path, const int depth,
+void search_dir(ag_ctx *ctx, ignores *ig, const char *base_path, const char *path, const int depth,
                 dev_t original_dev) {
-    struct dirent **dir_list = NULL;
-    struct dirent *dir = NULL;
+    dirlist_t dir_list;
+    dirlist_entry_t dir;
     scandir_baton_t scandir_baton;
+    dircache_dir_t *dc = NULL;
     int results = 0;
     size_t base_path_len = 0;
     const char *path_start = path;
@@ -584,18 +1393,25 @@ void search_dir(ignores *ig, const char *base_path, const char *path, const int
 
     int symres;
     dirkey_t current_dirkey;
+    int trace_token;
 
-    symres = check_symloop_enter(path, &current_dirkey);
+    symres = check_symloop_enter(ctx, path, &current_dirkey);
     if (symres == SYMLOOP_LOOP) {
         log_err("Recursive directory loop: %s", path);
         return;
     }
+    trace_token = TRACE_BEGIN("search_dir", path);
+
+    dc = dircache_enter(base_path, path, depth);
 
     /* find .*ignore files to load ignore patterns from */
-    for (i = 0; opts.skip_vcs_ignores ? (i == 0) : (ignore_pattern_files[i] != NULL); i++) {
+    stats_phase(STATS_PHASE_IGNORE);
+    for (i = 0; ctx->opts.skip_vcs_ignores ? (i == 0) : (ignore_pattern_files[i] != NULL); i++) {
         ignore_file = ignore_pattern_files[i];
         ag_asprintf(&dir_full_path, "%s/%s", path, ignore_file);
-        if (strcmp(SVN_DIR, ignore_file) == 0) {
+        if (!dircache_check_ignore_file(dc, i, dir_full_path)) {
+            /* Doesn't exist, nothing to load */
+        } else if (strcmp(SVN_DIR, ignore_file) == 0) {
             load_svn_ignore_patterns(ig, dir_full_path);
         } else {
             load_ignore_patterns(ig, dir_full_path);
@@ -603,6 +1419,7 @@ void search_dir(ignores *ig, const char *base_path, const char *path, const int
         free(dir_full_path);
         dir_full_path = NULL;
     }
+    stats_phase(STATS_PHASE_WALK);
 
     /* path_start is the part of path that isn't in base_path
      * base_path will have a trailing '/' because we put it there in parse_options
@@ -613,112 +1430,81 @@ void search_dir(ignores *ig, const char *base_path, const char *path, const int
     }
     log_debug("search_dir: path is '%s', base_path is '%s', path_start is '%s'", path, base_path, path_start);
 
+    scandir_baton.opts = &ctx->opts;
     scandir_baton.ig = ig;
     scandir_baton.base_path = base_path;
     scandir_baton.base_path_len = base_path_len;
     scandir_baton.path_start = path_start;
 
-    results = ag_scandir(path, &dir_list, &filename_filter, &scandir_baton);
+    results = dircache_scandir(dc, &dir_list);
+    if (results == -1) {
+        results = ag_scandir(path, &dir_list, ctx->opts.stats ? &timed_filename_filter : &filename_filter, &scandir_baton);
+        if (results >= 0) {
+            dircache_store(dc, path, &dir_list);
+        }
+    }
     if (results == 0) {
         log_debug("No results found in directory %s", path);
         goto search_dir_cleanup;
     } else if (results == -1) {
         if (errno == ENOTDIR) {
             /* Not a directory. Probably a file. */
-            if (depth == 0 && opts.paths_len == 1) {
-                /* If we're only searching one file, don't print the filename header at the top. */
-                if (opts.print_path == PATH_PRINT_DEFAULT || opts.print_path == PATH_PRINT_DEFAULT_EACH_LINE) {
-                    opts.print_path = PATH_PRINT_NOTHING;
-                }
-                /* If we're only searching one file and --only-matching is specified, disable line numbers too. */
-                if (opts.only_matching && opts.print_path == PATH_PRINT_NOTHING) {
-                    opts.print_line_numbers = FALSE;
-                }
+            if (depth == 0) {
+                search_file_arg(ctx, path);
+            } else {
+                search_file(ctx, path);
             }
-            search_file(path);
         } else {
             log_err("Error opening directory %s: %s", path, strerror(errno));
         }
         goto search_dir_cleanup;
     }
 
-    int offset_vector[3];
-    int rc = 0;
-    work_queue_t *queue_item;
+    /* Every entry's full path is built in the same buffer. queue_file() copies it. */
+    const size_t path_len = strlen(path);
+    size_t dir_full_path_size = 0;
 
-    for (i = 0; i < results; i++) {
-        queue_item = NULL;
-        dir = dir_list[i];
-        ag_asprintf(&dir_full_path, "%s/%s", path, dir->d_name);
+    for (i = 0; i < results && !is_search_stopped(ctx); i++) {
+        dirlist_entry(&dir_list, i, &dir);
+        if (path_len + dir.name_len + 2 > dir_full_path_size) {
+            dir_full_path_size = path_len + dir.name_len + 2;
+            dir_full_path = ag_realloc(dir_full_path, dir_full_path_size);
+        }
+        memcpy(dir_full_path, path, path_len);
+        dir_full_path[path_len] = '/';
+        memcpy(dir_full_path + path_len + 1, dir.name, dir.name_len + 1);
 #ifndef _WIN32
-        if (opts.one_dev) {
+        if (ctx->opts.one_dev) {
             struct stat s;
             if (lstat(dir_full_path, &s) != 0) {
-                log_err("Failed to get device information for %s. Skipping...", dir->d_name);
-                goto cleanup;
+                log_err("Failed to get device information for %s. Skipping...", dir.name);
+                continue;
             }
             if (s.st_dev != original_dev) {
-                log_debug("File %s crosses a device boundary (is probably a mount point.) Skipping...", dir->d_name);
-                goto cleanup;
+                log_debug("File %s crosses a device boundary (is probably a mount point.) Skipping...", dir.name);
+                continue;
             }
         }
 #endif
 
         /* If a link points to a directory then we need to treat it as a directory. */
-        if (!opts.follow_symlinks && is_symlink(path, dir)) {
-            log_debug("File %s ignored becaused it's a symlink", dir->d_name);
-            goto cleanup;
+        if (!ctx->opts.follow_symlinks && is_symlink(path, &dir)) {
+            log_debug("File %s ignored becaused it's a symlink", dir.name);
+            continue;
         }
 
-        if (!is_directory(path, dir)) {
-            if (opts.file_search_regex) {
-#ifdef HAVE_PCRE2
-                rc = ag_pcre_match(opts.file_search_regex, NULL, dir_full_path, strlen(dir_full_path),
-                                   0, 0, offset_vector, 3);
-#else
-                rc = pcre_exec(opts.file_search_regex, NULL, dir_full_path, strlen(dir_full_path),
-                               0, 0, offset_vector, 3);
-#endif
-                if (rc < 0) { /* no match */
-                    log_debug("Skipping %s due to file_search_regex.", dir_full_path);
-                    goto cleanup;
-                } else if (opts.match_files) {
-                    log_debug("match_files: file_search_regex matched for %s.", dir_full_path);
-                    pthread_mutex_lock(&print_mtx);
-                    print_path(dir_full_path, opts.path_sep);
-                    pthread_mutex_unlock(&print_mtx);
-                    opts.match_found = 1;
-                    goto cleanup;
-                }
-            }
-
-            queue_item = ag_malloc(sizeof(work_queue_t));
-            queue_item->path = dir_full_path;
-            queue_item->next = NULL;
-            pthread_mutex_lock(&work_queue_mtx);
-            if (work_queue_tail == NULL) {
-                work_queue = queue_item;
-            } else {
-                work_queue_tail->next = queue_item;
-            }
-            work_queue_tail = queue_item;
-            pthread_cond_signal(&files_ready);
-            pthread_mutex_unlock(&work_queue_mtx);
-            log_debug("%s added to work queue", dir_full_path);
-        } else if (opts.recurse_dirs) {
-            if (depth < opts.max_search_depth || opts.max_search_depth == -1) {
+        if (!is_directory(path, &dir)) {
+            queue_file(ctx, dir_full_path);
+        } else if (ctx->opts.recurse_dirs) {
+            if (depth < ctx->opts.max_search_depth || ctx->opts.max_search_depth == -1) {
                 log_debug("Searching dir %s", dir_full_path);
                 ignores *child_ig;
-#ifdef HAVE_DIRENT_DNAMLEN
-                child_ig = init_ignore(ig, dir->d_name, dir->d_namlen);
-#else
-                child_ig = init_ignore(ig, dir->d_name, strlen(dir->d_name));
-#endif
-                search_dir(child_ig, base_path, dir_full_path, depth + 1,
+                child_ig = init_ignore(ig, dir.name, dir.name_len);
+                search_dir(ctx, child_ig, base_path, dir_full_path, depth + 1,
                            original_dev);
                 cleanup_ignore(child_ig);
             } else {
-                if (opts.max_search_depth == DEFAULT_MAX_SEARCH_DEPTH) {
+                if (ctx->opts.max_search_depth == DEFAULT_MAX_SEARCH_DEPTH) {
                     /*
                      * If the user didn't intentionally specify a particular depth,
                      * this is a warning...
@@ -730,18 +1516,122 @@ void search_dir(ignores *ig, const char *base_path, const char *path, const int
                 }
             }
         }
+    }
+
+search_dir_cleanup:
+    free(dir_full_path);
+    dircache_leave(dc);
+    check_symloop_leave(ctx, &current_dirkey);
+    dirlist_free(&dir_list);
+    TRACE_END(trace_token);
+}
+
+void walk_paths(ag_ctx *ctx, char **paths, char **base_paths) {
+    int i;
+
+    for (i = 0; paths[i] != NULL; i++) {
+        log_debug("searching path %s for %s", paths[i], ctx->opts.query);
+        ctx->symhash = NULL;
+        ignores *ig = init_ignore(ctx->root_ignores, "", 0);
+        struct stat s = {.st_dev = 0 };
+#ifndef _WIN32
+        /* The device is ignored if ctx->opts.one_dev is false, so it's fine
+         * to leave it at the default 0
+         */
+        if (ctx->opts.one_dev && lstat(paths[i], &s) == -1) {
+            log_err("Failed to get device information for path %s. Skipping...", paths[i]);
+        }
+#endif
+        search_dir(ctx, ig, base_paths[i], paths[i], 0, s.st_dev);
+        cleanup_ignore(ig);
+    }
+}
+
+/* Starts the workers, lets walk() fill the work queue, and waits for the workers to empty it.
+ * Returns 0, or -1 if not even one worker could be started. */
+int search_paths(ag_ctx *ctx, char **paths, char **base_paths, const int workers_len, const int num_cores, walk_paths_fn walk) {
+    worker_t *workers;
+    int started = 0;
+    int i;
+
+    ctx->work_queue = NULL;
+    ctx->work_queue_tail = NULL;
+    ctx->done_adding_files = FALSE;
+    /* A context can run one search after another */
+    ctx->total_printed = 0;
+    set_search_stopped(ctx, FALSE);
+    workers = ag_calloc(workers_len, sizeof(worker_t));
 
-    cleanup:
-        free(dir);
-        dir = NULL;
-        if (queue_item == NULL) {
-            free(dir_full_path);
-            dir_full_path = NULL;
+    if (ctx->opts.stats) {
+        stats_init_workers(workers_len);
+    }
+    if (ctx->opts.dir_cache) {
+        dircache_init(ctx->opts.dir_cache, &ctx->opts, ctx->root_ignores);
+    }
+    for (i = 0; i < workers_len; i++) {
+        workers[i].id = i;
+        workers[i].ctx = ctx;
+        if (ctx->opts.stats) {
+            workers[i].stats = &stats_workers[stats_workers_len - workers_len + i];
+        }
+        int rv = pthread_create(&(workers[i].thread), NULL, &search_file_worker, &workers[i]);
+        if (rv != 0) {
+            log_err("Error in pthread_create(): %s", strerror(rv));
+            break;
         }
+        started++;
+#if defined(HAVE_PTHREAD_SETAFFINITY_NP) && (defined(USE_CPU_SET) || defined(HAVE_SYS_CPUSET_H))
+        if (ctx->opts.use_thread_affinity) {
+#if defined(__linux__) || defined(__midipix__)
+            cpu_set_t cpu_set;
+#elif __FreeBSD__
+            cpuset_t cpu_set;
+#endif
+            CPU_ZERO(&cpu_set);
+            CPU_SET(i % num_cores, &cpu_set);
+            rv = pthread_setaffinity_np(workers[i].thread, sizeof(cpu_set), &cpu_set);
+            if (rv) {
+                log_err("Error in pthread_setaffinity_np(): %s", strerror(rv));
+                log_err("Performance may be affected. Use --noaffinity to suppress this message.");
+            } else {
+                log_debug("Thread %i set to CPU %i", i, i);
+            }
+        } else {
+            log_debug("Thread affinity disabled.");
+        }
+#else
+        (void)num_cores;
+        log_debug("No CPU affinity support.");
+#endif
     }
 
-search_dir_cleanup:
-    check_symloop_leave(&current_dirkey);
-    free(dir_list);
-    dir_list = NULL;
+    if (started == 0) {
+        dircache_cleanup();
+        free(workers);
+        return -1;
+    }
+
+#ifdef HAVE_PLEDGE
+    if (pledge("stdio rpath", NULL) == -1) {
+        die("pledge: %s", strerror(errno));
+    }
+#endif
+    stats_phase_t prev_phase = stats_phase(STATS_PHASE_WALK);
+    walk(ctx, paths, base_paths);
+    stats_phase(prev_phase);
+
+    pthread_mutex_lock(&ctx->work_queue_mtx);
+    ctx->done_adding_files = TRUE;
+    pthread_cond_broadcast(&ctx->files_ready);
+    pthread_mutex_unlock(&ctx->work_queue_mtx);
+    for (i = 0; i < started; i++) {
+        if (pthread_join(workers[i].thread, NULL)) {
+            die("pthread_join failed!");
+        }
+    }
+    dircache_cleanup();
+    free(workers);
+    free_work_items_and_paths(ctx);
+    print_truncated_files(ctx);
+    return 0;
 }
@@ -2,6 +2,7 @@
 #define SEARCH_H
 
 #include <limits.h>
+#include <ctype.h>
 #include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
@@ -24,32 +25,70 @@
 #include <pthread.h>
 #endif
 
+#include "arena.h"
 #include "decompress.h"
 #include "ignore.h"
+#include "dfa.h"
+#include "kernels.h"
+#include "libag.h"
+#include "litset.h"
 #include "log.h"
 #include "options.h"
 #include "print.h"
+#include "stats.h"
+#include "trace.h"
 #include "uthash.h"
 #include "util.h"
 
-extern size_t alpha_skip_lookup[UCHAR_MAX + 1];
-extern size_t *find_skip_lookup;
-extern uint8_t h_table[H_SIZE] __attribute__((aligned(64)));
-extern size_t bad_char_skip_lookup[UCHAR_MAX + 1];
-
+/* A compiled query. Normally there's one; --queries adds one per line of the file. */
+typedef struct {
+    char *id; /* Prefixed to paths in the output. NULL unless from --queries */
+    char *query;
+    int query_len;
+    int literal;
+    enum case_behavior casing;
+    int word_regexp; /* Matches of query that aren't whole words are filtered out afterwards */
+    size_t alpha_skip_lookup[UCHAR_MAX + 1];
+    size_t *find_skip_lookup;
+    size_t bad_char_skip_lookup[UCHAR_MAX + 1];
+    uint8_t *h_table;
+    two_way_t *two_way; /* Only for needles of at least TWO_WAY_MIN_LEN. Others make one if they need it. */
+#ifdef HAVE_PCRE2
+    ag_pcre_re_t *re;
+    ag_pcre_extra_t *re_extra;
+    /* With -w, \b(?:query)\b. Only used from a match of re that isn't a whole word. */
+    ag_pcre_re_t *word_re;
+    ag_pcre_extra_t *word_re_extra;
+#else
+    pcre *re;
+    pcre_extra *re_extra;
+    pcre *word_re;
+    pcre_extra *word_re_extra;
+#endif
+    dfa_t *dfa; /* NULL if the DFA can't handle the regex or --nodfa */
+    litset_t *litset; /* Set instead of re if the regex is just literals and | */
+} matcher_t;
+
+/* If set, matches are passed here instead of being printed.
+ * first_line and buf_offset are the line number and byte offset buf starts at
+ * (they're only past the start when searching a stream line by line). */
+typedef void (*match_cb_t)(ag_ctx *ctx, const char *path, const matcher_t *m, const char *buf, const size_t buf_len,
+                           const size_t first_line, const size_t buf_offset, const match_t matches[], const size_t matches_len);
+
+/* match_cb_t implementations for --json and --binary-output. Defined in print.c. */
+void print_matches_json(ag_ctx *ctx, const char *path, const matcher_t *m, const char *buf, const size_t buf_len,
+                        const size_t first_line, const size_t buf_offset, const match_t matches[], const size_t matches_len);
+void print_matches_binary(ag_ctx *ctx, const char *path, const matcher_t *m, const char *buf, const size_t buf_len,
+                          const size_t first_line, const size_t buf_offset, const match_t matches[], const size_t matches_len);
+
+/* Items and paths are carved out of blocks by queue_file(). See search.c. */
 struct work_queue_t {
     char *path;
+    struct path_block *path_block;
     struct work_queue_t *next;
 };
 typedef struct work_queue_t work_queue_t;
 
-extern work_queue_t *work_queue;
-extern work_queue_t *work_queue_tail;
-extern int done_adding_files;
-extern pthread_cond_t files_ready;
-extern pthread_mutex_t stats_mtx;
-extern pthread_mutex_t work_queue_mtx;
-
 
 /* For symlink loop detection */
 #define SYMLOOP_ERROR (-1)
@@ -66,15 +105,82 @@ typedef struct {
     UT_hash_handle hh;
 } symdir_t;
 
-extern symdir_t *symhash;
+/* Files whose regex search a limit cut short, listed once the search is done */
+typedef struct {
+    char *path;
+    char *reason;
+} truncated_file_t;
+
+/*
+ * Everything a search reads and writes. ag builds one from the options it parsed and libag callers get
+ * one from ag_ctx_new(), so searches in different contexts don't share any state. A context runs one
+ * search at a time.
+ */
+struct ag_ctx {
+    cli_options opts;
+    ignores *root_ignores;
+    matcher_t *matchers;
+    size_t matchers_len;
+    match_cb_t match_callback;
+
+    work_queue_t *work_queue;
+    work_queue_t *work_queue_tail;
+    int done_adding_files;
+    pthread_cond_t files_ready;
+    pthread_mutex_t work_queue_mtx;
+    /* Where queued items and their paths come from. Guarded by work_queue_mtx. See search.c. */
+    work_queue_t *free_work_items;
+    work_queue_t **work_item_slabs;
+    size_t work_item_slabs_len;
+    struct path_block **path_blocks;
+    size_t path_blocks_len;
+    struct path_block *path_block; /* Where the next path goes */
+    struct path_block *free_path_blocks;
+
+    symdir_t *symhash;
+
+    truncated_file_t *truncated_files;
+    size_t truncated_files_len;
+    pthread_mutex_t truncated_files_mtx;
+
+    /* With --max-total-matches, how many matches (or paths) have been printed. Once that's all of them, the
+     * walk stops queueing files and the workers skip the rest of the queue. search_stopped is set under
+     * total_printed_mtx but read without it, so it's only touched through atomics. */
+    size_t total_printed;
+    int search_stopped;
+    pthread_mutex_t total_printed_mtx;
+
+    /* libag's match_callback hands matches to match_fn, one call at a time */
+    ag_match_fn match_fn;
+    void *match_baton;
+    size_t match_count;
+    pthread_mutex_t match_fn_mtx;
+};
+
+/* Copies o and takes over what it points to, along with root_ig */
+ag_ctx *search_ctx_new(const cli_options *o, ignores *root_ig);
+void search_ctx_free(ag_ctx *ctx);
 
-ssize_t search_buf(const char *buf, const size_t buf_len,
+void add_matcher(ag_ctx *ctx, const char *id, const char *query, const int literal, const enum case_behavior casing, const int word_regexp);
+void load_queries(ag_ctx *ctx, const char *path);
+void cleanup_matchers(ag_ctx *ctx);
+
+ssize_t search_buf(ag_ctx *ctx, const char *buf, const size_t buf_len,
                    const char *dir_full_path);
-ssize_t search_stream(FILE *stream, const char *path);
-void search_file(const char *file_full_path);
+ssize_t search_stream(ag_ctx *ctx, FILE *stream, const char *path);
+/* Lists the files whose regex search a PCRE limit or --file-time-limit cut short, and forgets them */
+void print_truncated_files(ag_ctx *ctx);
+void search_file(ag_ctx *ctx, const char *file_full_path);
+void search_file_arg(ag_ctx *ctx, const char *path);
 
 void *search_file_worker(void *i);
 
-void search_dir(ignores *ig, const char *base_path, const char *path, const int depth, dev_t original_dev);
+void queue_file(ag_ctx *ctx, const char *file_full_path);
+
+void search_dir(ag_ctx *ctx, ignores *ig, const char *base_path, const char *path, const int depth, dev_t original_dev);
+
+typedef void (*walk_paths_fn)(ag_ctx *ctx, char **paths, char **base_paths);
+void walk_paths(ag_ctx *ctx, char **paths, char **base_paths);
+int search_paths(ag_ctx *ctx, char **paths, char **base_paths, const int workers_len, const int num_cores, walk_paths_fn walk);
 
 #endif
@@ -0,0 +1,1127 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "config.h"
+
+#ifdef HAVE_SYS_INOTIFY_H
+#include <poll.h>
+#include <sys/inotify.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#endif
+
+#include "ignore.h"
+#include "log.h"
+#include "options.h"
+#include "scandir.h"
+#include "search.h"
+#include "serve.h"
+#include "uthash.h"
+#include "util.h"
+
+char *serve_connect_arg(int *argc, char **argv) {
+    char *socket_path = NULL;
+    int removed = 0;
+    int i;
+
+    for (i = 1; i < *argc && strcmp(argv[i], "--") != 0; i++) {
+        if (strcmp(argv[i], "--connect") == 0 && i + 1 < *argc) {
+            socket_path = argv[i + 1];
+            removed = 2;
+            break;
+        }
+        if (strncmp(argv[i], "--connect=", 10) == 0) {
+            socket_path = argv[i] + 10;
+            removed = 1;
+            break;
+        }
+    }
+    if (socket_path) {
+        memmove(argv + i, argv + i + removed, (*argc - i - removed + 1) * sizeof(char *));
+        *argc -= removed;
+    }
+    return socket_path;
+}
+
+#ifdef HAVE_SYS_INOTIFY_H
+
+#define SERVE_MAGIC "AGQ1"
+#define SERVE_MAX_QUERY_LEN (256 * 1024)
+#define SERVE_QUERY_TIMEOUT 5 /* Seconds a client gets to send its whole query */
+#define SERVE_WATCH_MASK (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_CLOSE_WRITE | \
+                          IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR)
+/* .git is never walked, so .git/info/exclude needs a watch of its own. Until .git/info exists, .git is watched for it. */
+#define SERVE_GIT_DIR ".git"
+#define SERVE_GIT_INFO_DIR ".git/info"
+#define SERVE_GIT_INFO_MASK (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_CLOSE_WRITE | IN_ONLYDIR)
+
+enum serve_pending {
+    SERVE_UP_TO_DATE,
+    SERVE_RESCAN, /* Entries were added or removed. Re-list this directory only. */
+    SERVE_REWALK  /* An ignore file changed. Reload ignores and re-walk everything below. */
+};
+
+typedef struct serve_dir serve_dir_t;
+
+typedef struct {
+    char *name;
+    serve_dir_t *dir; /* NULL for files */
+} serve_entry_t;
+
+struct serve_dir {
+    char *path;
+    char *name;
+    ignores *ig;
+    int depth;
+    int wd;
+    dev_t dev;
+    ino_t ino;
+    int git_info_wd; /* Watch on SERVE_GIT_INFO_DIR or SERVE_GIT_DIR, or -1 */
+    struct serve_root *root;
+    serve_dir_t *parent;
+    serve_entry_t *entries;
+    size_t entries_len;
+    enum serve_pending pending;
+    size_t pending_index;
+    UT_hash_handle hh_name; /* siblings, keyed by name. Only used while rescanning */
+};
+
+typedef struct {
+    serve_dir_t *dir;
+    int git_info; /* The watch is on dir's SERVE_GIT_INFO_DIR or SERVE_GIT_DIR, not on dir */
+} serve_watcher_t;
+
+/*
+ * inotify gives every path to the same directory the same wd: followed
+ * symlinks, and a renamed directory whose new name is listed before its
+ * old name is dropped. All of them get the events, and the watch is only
+ * removed once the last one is freed.
+ */
+typedef struct {
+    int wd;
+    serve_watcher_t *watchers;
+    size_t watchers_len;
+    UT_hash_handle hh; /* watches, keyed by wd */
+} serve_watch_t;
+
+/* What the server walked with. A query can't change these, since the tree is already filtered. */
+typedef struct {
+    int search_all_files;
+    int search_hidden_files;
+    int skip_vcs_ignores;
+    int follow_symlinks;
+    int one_dev;
+    int recurse_dirs;
+    int max_search_depth;
+    size_t ignore_patterns_len;
+} serve_walk_opts_t;
+
+static serve_walk_opts_t served_walk_opts;
+
+typedef struct serve_root {
+    char *path;
+    char *base_path;
+    dev_t original_dev;
+    serve_dir_t *dir; /* NULL if path isn't a directory */
+} serve_root_t;
+
+static serve_root_t *roots = NULL;
+static size_t roots_len = 0;
+static serve_watch_t *watches = NULL;
+static int inotify_fd = -1;
+static serve_dir_t **pending = NULL;
+static size_t pending_len = 0;
+static size_t pending_size = 0;
+static volatile sig_atomic_t stop_serving = 0;
+
+/* Queries run in forked processes. The server keeps going while they do, and answers each client once its query exits. */
+typedef struct {
+    pid_t pid;
+    int conn;
+} serve_query_t;
+
+static serve_query_t *queries = NULL;
+static size_t queries_len = 0;
+static size_t queries_size = 0;
+static int sigchld_pipe[2] = { -1, -1 }; /* Written to on SIGCHLD, so poll() wakes up to reap */
+
+static void serve_dir_scan(serve_dir_t *d, const int recursive);
+
+static void mark_pending(serve_dir_t *d, enum serve_pending what) {
+    if (d->pending == SERVE_UP_TO_DATE) {
+        if (pending_len >= pending_size) {
+            pending_size = pending_size ? pending_size * 2 : 64;
+            pending = ag_realloc(pending, pending_size * sizeof(serve_dir_t *));
+        }
+        d->pending_index = pending_len;
+        pending[pending_len++] = d;
+    }
+    if (what > d->pending) {
+        d->pending = what;
+    }
+}
+
+/* Returns the wd, or -1 if path can't be watched */
+static int watch_add(serve_dir_t *d, const char *path, const uint32_t mask, const int git_info) {
+    serve_watch_t *w = NULL;
+    int wd;
+
+    wd = inotify_add_watch(inotify_fd, path, mask);
+    if (wd < 0) {
+        return -1;
+    }
+    HASH_FIND_INT(watches, &wd, w);
+    if (w == NULL) {
+        w = ag_calloc(1, sizeof(serve_watch_t));
+        w->wd = wd;
+        HASH_ADD_INT(watches, wd, w);
+    }
+    w->watchers = ag_realloc(w->watchers, (w->watchers_len + 1) * sizeof(serve_watcher_t));
+    w->watchers[w->watchers_len].dir = d;
+    w->watchers[w->watchers_len].git_info = git_info;
+    w->watchers_len++;
+    return wd;
+}
+
+static void watch_remove(serve_dir_t *d, int wd, const int git_info) {
+    serve_watch_t *w = NULL;
+    size_t i;
+
+    if (wd < 0) {
+        return;
+    }
+    HASH_FIND_INT(watches, &wd, w);
+    if (w == NULL) {
+        return;
+    }
+    for (i = 0; i < w->watchers_len; i++) {
+        if (w->watchers[i].dir == d && w->watchers[i].git_info == git_info) {
+            w->watchers[i] = w->watchers[--w->watchers_len];
+            break;
+        }
+    }
+    if (w->watchers_len == 0) {
+        HASH_DELETE(hh, watches, w);
+        inotify_rm_watch(inotify_fd, w->wd);
+        free(w->watchers);
+        free(w);
+    }
+}
+
+static void free_entries(serve_entry_t *entries, size_t entries_len);
+
+static void serve_dir_free(serve_dir_t *d) {
+    if (d == NULL) {
+        return;
+    }
+    free_entries(d->entries, d->entries_len);
+    watch_remove(d, d->wd, FALSE);
+    watch_remove(d, d->git_info_wd, TRUE);
+    if (d->pending != SERVE_UP_TO_DATE) {
+        pending[d->pending_index] = NULL;
+    }
+    cleanup_ignore(d->ig);
+    free(d->path);
+    free(d->name);
+    free(d);
+}
+
+static void free_entries(serve_entry_t *entries, size_t entries_len) {
+    size_t i;
+    for (i = 0; i < entries_len; i++) {
+        serve_dir_free(entries[i].dir);
+        free(entries[i].name);
+    }
+    free(entries);
+}
+
+static void serve_dir_load_ignores(serve_dir_t *d) {
+    char *ignore_path;
+    struct stat s;
+    int i;
+
+    if (d->parent) {
+        d->ig = init_ignore(d->parent->ig, d->name, strlen(d->name));
+    } else {
+        d->ig = init_ignore(root_ignores, "", 0);
+    }
+    for (i = 0; opts.skip_vcs_ignores ? (i == 0) : (ignore_pattern_files[i] != NULL); i++) {
+        ag_asprintf(&ignore_path, "%s/%s", d->path, ignore_pattern_files[i]);
+        if (strcmp(SVN_DIR, ignore_pattern_files[i]) == 0) {
+            load_svn_ignore_patterns(d->ig, ignore_path);
+        } else {
+            load_ignore_patterns(d->ig, ignore_path);
+        }
+        free(ignore_path);
+    }
+
+    watch_remove(d, d->git_info_wd, TRUE);
+    d->git_info_wd = -1;
+    if (!opts.skip_vcs_ignores) {
+        ag_asprintf(&ignore_path, "%s/%s", d->path, SERVE_GIT_INFO_DIR);
+        if (stat(ignore_path, &s) != 0 || !S_ISDIR(s.st_mode)) {
+            free(ignore_path);
+            ag_asprintf(&ignore_path, "%s/%s", d->path, SERVE_GIT_DIR);
+        }
+        if (stat(ignore_path, &s) == 0 && S_ISDIR(s.st_mode)) {
+            d->git_info_wd = watch_add(d, ignore_path, SERVE_GIT_INFO_MASK, TRUE);
+            if (d->git_info_wd < 0) {
+                log_err("Unable to watch %s: %s. Changes to it won't be noticed.", ignore_path, strerror(errno));
+            }
+        }
+        free(ignore_path);
+    }
+}
+
+static serve_dir_t *serve_dir_new(serve_root_t *root, serve_dir_t *parent, const char *path, const char *name) {
+    struct stat s;
+    serve_dir_t *d;
+    serve_dir_t *ancestor;
+
+    if (stat(path, &s) != 0) {
+        log_err("Error stat()ing: %s", path);
+        return NULL;
+    }
+    for (ancestor = parent; ancestor != NULL; ancestor = ancestor->parent) {
+        if (ancestor->dev == s.st_dev && ancestor->ino == s.st_ino) {
+            log_err("Recursive directory loop: %s", path);
+            return NULL;
+        }
+    }
+
+    d = ag_calloc(1, sizeof(serve_dir_t));
+    d->path = ag_strdup(path);
+    d->name = ag_strdup(name);
+    d->depth = parent ? parent->depth + 1 : 0;
+    d->dev = s.st_dev;
+    d->ino = s.st_ino;
+    d->root = root;
+    d->parent = parent;
+    d->git_info_wd = -1;
+
+    d->wd = watch_add(d, path, SERVE_WATCH_MASK, FALSE);
+    if (d->wd < 0) {
+        log_err("Unable to watch %s: %s. Changes to it won't be noticed.", path, strerror(errno));
+    }
+
+    serve_dir_load_ignores(d);
+    serve_dir_scan(d, TRUE);
+    return d;
+}
+
+/* Same filtering as search_dir(), but the results are kept instead of queued. */
+static void serve_dir_scan(serve_dir_t *d, const int recursive) {
+    dirlist_t dir_list;
+    dirlist_entry_t dir;
+    scandir_baton_t scandir_baton;
+    serve_dir_t *old_dirs = NULL;
+    serve_dir_t *child;
+    serve_dir_t *tmp;
+    serve_entry_t *entries = NULL;
+    size_t entries_len = 0;
+    const char *base_path = d->root->base_path;
+    const char *path_start = d->path;
+    size_t base_path_len = base_path ? strlen(base_path) : 0;
+    char *full_path;
+    int results;
+    int i;
+
+    for (i = 0; ((size_t)i < base_path_len) && (d->path[i]) && (base_path[i] == d->path[i]); i++) {
+        path_start = d->path + i + 1;
+    }
+
+    /* Keep the subdirectories we already know about */
+    for (i = 0; (size_t)i < d->entries_len; i++) {
+        if (d->entries[i].dir) {
+            if (recursive) {
+                serve_dir_free(d->entries[i].dir);
+            } else {
+                HASH_ADD_KEYPTR(hh_name, old_dirs, d->entries[i].dir->name, strlen(d->entries[i].dir->name), d->entries[i].dir);
+            }
+            d->entries[i].dir = NULL;
+        }
+    }
+    free_entries(d->entries, d->entries_len);
+    d->entries = NULL;
+    d->entries_len = 0;
+
+    scandir_baton.opts = &opts;
+    scandir_baton.ig = d->ig;
+    scandir_baton.base_path = base_path;
+    scandir_baton.base_path_len = base_path_len;
+    scandir_baton.path_start = path_start;
+
+    results = ag_scandir(d->path, &dir_list, &filename_filter, &scandir_baton);
+    if (results < 0) {
+        log_debug("Error opening directory %s: %s", d->path, strerror(errno));
+        results = 0;
+    }
+    if (results > 0) {
+        entries = ag_malloc(results * sizeof(serve_entry_t));
+    }
+
+    for (i = 0; i < results; i++) {
+        dirlist_entry(&dir_list, i, &dir);
+        child = NULL;
+        ag_asprintf(&full_path, "%s/%s", d->path, dir.name);
+
+        if (opts.one_dev) {
+            struct stat s;
+            if (lstat(full_path, &s) != 0 || s.st_dev != d->root->original_dev) {
+                goto next;
+            }
+        }
+        if (!opts.follow_symlinks && is_symlink(d->path, &dir)) {
+            goto next;
+        }
+        if (is_directory(d->path, &dir)) {
+            if (!opts.recurse_dirs || (d->depth >= opts.max_search_depth && opts.max_search_depth != -1)) {
+                goto next;
+            }
+            HASH_FIND(hh_name, old_dirs, dir.name, dir.name_len, child);
+            if (child) {
+                HASH_DELETE(hh_name, old_dirs, child);
+            } else {
+                child = serve_dir_new(d->root, d, full_path, dir.name);
+                if (child == NULL) {
+                    goto next;
+                }
+            }
+        }
+        entries[entries_len].name = ag_strdup(dir.name);
+        entries[entries_len].dir = child;
+        entries_len++;
+
+    next:
+        free(full_path);
+    }
+    dirlist_free(&dir_list);
+
+    /* Whatever is left was removed */
+    HASH_ITER(hh_name, old_dirs, child, tmp) {
+        HASH_DELETE(hh_name, old_dirs, child);
+        serve_dir_free(child);
+    }
+
+    d->entries = entries;
+    d->entries_len = entries_len;
+}
+
+static void serve_dir_rewalk(serve_dir_t *d) {
+    log_debug("Ignore files changed in %s. Walking it again.", d->path);
+    cleanup_ignore(d->ig);
+    serve_dir_load_ignores(d);
+    serve_dir_scan(d, TRUE);
+}
+
+/* Whether name is an ignore file, or the first directory in the path to one (.git for .git/info/exclude) */
+static int is_ignore_file_name(const char *name) {
+    size_t name_len = strlen(name);
+    int i;
+    for (i = 0; ignore_pattern_files[i] != NULL; i++) {
+        if (strncmp(name, ignore_pattern_files[i], name_len) == 0 &&
+            (ignore_pattern_files[i][name_len] == '\0' || ignore_pattern_files[i][name_len] == '/')) {
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+static int cmp_pending_depth(const void *a, const void *b) {
+    const serve_dir_t *da = *(serve_dir_t *const *)a;
+    const serve_dir_t *db = *(serve_dir_t *const *)b;
+    if (da == NULL || db == NULL) {
+        return (da == NULL) - (db == NULL);
+    }
+    return da->depth - db->depth;
+}
+
+static void apply_pending(void) {
+    enum serve_pending what;
+    size_t i;
+
+    /* Shallowest first, so a re-walk of a parent makes updates below it moot */
+    qsort(pending, pending_len, sizeof(serve_dir_t *), &cmp_pending_depth);
+    for (i = 0; i < pending_len; i++) {
+        pending[i]->pending_index = i;
+    }
+    for (i = 0; i < pending_len; i++) {
+        serve_dir_t *d = pending[i];
+        if (d == NULL) {
+            continue;
+        }
+        what = d->pending;
+        d->pending = SERVE_UP_TO_DATE;
+        pending[i] = NULL;
+        if (what == SERVE_REWALK) {
+            serve_dir_rewalk(d);
+        } else {
+            log_debug("%s changed. Listing it again.", d->path);
+            serve_dir_scan(d, FALSE);
+        }
+    }
+    pending_len = 0;
+}
+
+static void serve_read_events(void) {
+    char buf[64 * 1024] __attribute__((aligned(__alignof__(struct inotify_event))));
+    const struct inotify_event *ev;
+    serve_watch_t *w;
+    serve_dir_t *d;
+    ssize_t len;
+    char *ptr;
+    size_t i;
+    size_t j;
+    int wd;
+    int overflow = FALSE;
+
+    while ((len = read(inotify_fd, buf, sizeof(buf))) > 0) {
+        for (ptr = buf; ptr < buf + len; ptr += sizeof(struct inotify_event) + ev->len) {
+            ev = (const struct inotify_event *)ptr;
+            if (ev->mask & IN_Q_OVERFLOW) {
+                overflow = TRUE;
+                continue;
+            }
+            wd = ev->wd;
+            HASH_FIND_INT(watches, &wd, w);
+            if (w == NULL) {
+                continue;
+            }
+            for (j = 0; j < w->watchers_len; j++) {
+                d = w->watchers[j].dir;
+                if (w->watchers[j].git_info) {
+                    /* "info" only shows up while .git itself is watched */
+                    if (ev->len > 0 && (strcmp(ev->name, "exclude") == 0 || strcmp(ev->name, "info") == 0)) {
+                        mark_pending(d, SERVE_REWALK);
+                    }
+                } else if (ev->mask & (IN_DELETE_SELF | IN_MOVE_SELF)) {
+                    /* The parent gets its own event for this. Only roots need handling here. */
+                    if (d->parent == NULL) {
+                        mark_pending(d, SERVE_RESCAN);
+                    }
+                } else if (ev->len > 0 && is_ignore_file_name(ev->name)) {
+                    mark_pending(d, SERVE_REWALK);
+                } else if (ev->mask & (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO)) {
+                    mark_pending(d, SERVE_RESCAN);
+                }
+            }
+        }
+    }
+
+    if (overflow) {
+        log_err("inotify queue overflowed. Walking all served paths again.");
+        for (i = 0; i < roots_len; i++) {
+            if (roots[i].dir) {
+                mark_pending(roots[i].dir, SERVE_REWALK);
+            }
+        }
+    }
+    apply_pending();
+}
+
+static void handle_stop_signal(int sig) {
+    (void)sig;
+    stop_serving = 1;
+}
+
+static void handle_sigchld(int sig) {
+    int saved_errno = errno;
+    char c = 0;
+    (void)sig;
+    if (write(sigchld_pipe[1], &c, 1) < 0) {
+        /* The pipe is full, so poll() will wake up anyway */
+    }
+    errno = saved_errno;
+}
+
+static int serve_listen(const char *socket_path) {
+    struct sockaddr_un addr;
+    int fd;
+
+    if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+        die("Socket path %s is too long.", socket_path);
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strlcpy(addr.sun_path, socket_path, sizeof(addr.sun_path));
+
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        die("Error creating socket: %s", strerror(errno));
+    }
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0) {
+        die("Another ag is already serving %s", socket_path);
+    }
+    close(fd);
+    unlink(socket_path);
+
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        die("Error creating socket: %s", strerror(errno));
+    }
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        die("Error binding to %s: %s", socket_path, strerror(errno));
+    }
+    if (listen(fd, 16) != 0) {
+        die("Error listening on %s: %s", socket_path, strerror(errno));
+    }
+    return fd;
+}
+
+static int read_fully(int fd, void *buf, size_t len) {
+    size_t done = 0;
+    while (done < len) {
+        ssize_t r = read(fd, (char *)buf + done, len - done);
+        if (r < 0 && errno == EINTR) {
+            continue;
+        }
+        if (r <= 0) {
+            return FALSE;
+        }
+        done += r;
+    }
+    return TRUE;
+}
+
+static int write_fully(int fd, const void *buf, size_t len) {
+    size_t done = 0;
+    while (done < len) {
+        ssize_t r = write(fd, (const char *)buf + done, len - done);
+        if (r < 0 && errno == EINTR) {
+            continue;
+        }
+        if (r <= 0) {
+            return FALSE;
+        }
+        done += r;
+    }
+    return TRUE;
+}
+
+/* Sends each finished query's exit status to its client. Waits for all of them if block is set. */
+static void reap_queries(const int block) {
+    char status_byte;
+    int status;
+    pid_t pid;
+    size_t i;
+
+    while (queries_len > 0 && (pid = waitpid(-1, &status, block ? 0 : WNOHANG)) != 0) {
+        if (pid < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        for (i = 0; i < queries_len; i++) {
+            if (queries[i].pid == pid) {
+                status_byte = WIFEXITED(status) ? (char)WEXITSTATUS(status) : 2;
+                write_fully(queries[i].conn, &status_byte, 1);
+                close(queries[i].conn);
+                queries[i] = queries[--queries_len];
+                break;
+            }
+        }
+    }
+}
+
+/*
+ * Query format: "AGQ1", uint32 payload length, then the payload: the client's
+ * cwd followed by its argv, all NUL-terminated. The client's stdout and stderr
+ * come along as SCM_RIGHTS. The reply is a single byte: ag's exit status.
+ *
+ * Runs in the query process, so a slow client only holds up its own query.
+ */
+static void serve_read_query(int conn, int *argc, char ***argv) {
+    char header[8];
+    char cmsg_buf[CMSG_SPACE(2 * sizeof(int))];
+    struct iovec iov = { header, sizeof(header) };
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+    int client_fds[2] = { -1, -1 };
+    char *payload;
+    uint32_t payload_len;
+    char **query_argv;
+    int query_argc;
+    uint32_t i;
+    int devnull;
+
+    /* SIGALRM's default action ends the process if the whole query hasn't arrived by then */
+    alarm(SERVE_QUERY_TIMEOUT);
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = cmsg_buf;
+    msg.msg_controllen = sizeof(cmsg_buf);
+    if (recvmsg(conn, &msg, MSG_WAITALL) != sizeof(header) || memcmp(header, SERVE_MAGIC, 4) != 0) {
+        die("Ignoring malformed query.");
+    }
+    for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS &&
+            cmsg->cmsg_len == CMSG_LEN(2 * sizeof(int))) {
+            memcpy(client_fds, CMSG_DATA(cmsg), sizeof(client_fds));
+        }
+    }
+    memcpy(&payload_len, header + 4, sizeof(payload_len));
+    if (client_fds[0] < 0 || client_fds[1] < 0 || payload_len == 0 || payload_len > SERVE_MAX_QUERY_LEN) {
+        die("Ignoring malformed query.");
+    }
+    payload = ag_malloc(payload_len + 1);
+    if (!read_fully(conn, payload, payload_len) || payload[payload_len - 1] != '\0') {
+        die("Ignoring malformed query.");
+    }
+    alarm(0);
+    close(conn);
+
+    devnull = open("/dev/null", O_RDONLY);
+    if (devnull >= 0) {
+        dup2(devnull, STDIN_FILENO);
+        close(devnull);
+    }
+    dup2(client_fds[0], STDOUT_FILENO);
+    dup2(client_fds[1], STDERR_FILENO);
+    close(client_fds[0]);
+    close(client_fds[1]);
+    signal(SIGPIPE, SIG_DFL);
+
+    /* Relative paths in the query are relative to the client */
+    if (chdir(payload) != 0) {
+        die("Unable to change to directory %s: %s", payload, strerror(errno));
+    }
+    query_argc = 0;
+    for (i = strlen(payload) + 1; i < payload_len; i += strlen(payload + i) + 1) {
+        query_argc++;
+    }
+    query_argv = ag_calloc(query_argc + 1, sizeof(char *));
+    query_argc = 0;
+    for (i = strlen(payload) + 1; i < payload_len; i += strlen(payload + i) + 1) {
+        query_argv[query_argc++] = payload + i;
+    }
+    *argc = query_argc;
+    *argv = query_argv;
+    /* The query gets parsed from scratch */
+    optind = 0;
+}
+
+/* Forks a query process for the next client. Returns TRUE in it, with argc/argv set to the query's arguments. */
+static int serve_accept(int listen_fd, int *argc, char ***argv) {
+    size_t i;
+    pid_t pid;
+
+    int conn = accept(listen_fd, NULL, NULL);
+    if (conn < 0) {
+        return FALSE;
+    }
+
+    /* Bring the tree up to date before the query sees it. Anything the client changed before connecting is queued by now. */
+    serve_read_events();
+
+    pid = fork();
+    if (pid < 0) {
+        log_err("fork() failed: %s", strerror(errno));
+        close(conn);
+        return FALSE;
+    }
+    if (pid == 0) {
+        close(listen_fd);
+        close(inotify_fd);
+        close(sigchld_pipe[0]);
+        close(sigchld_pipe[1]);
+        for (i = 0; i < queries_len; i++) {
+            close(queries[i].conn);
+        }
+        free(queries);
+        queries = NULL;
+        queries_len = 0;
+        signal(SIGINT, SIG_DFL);
+        signal(SIGTERM, SIG_DFL);
+        signal(SIGCHLD, SIG_DFL);
+        serve_read_query(conn, argc, argv);
+        return TRUE;
+    }
+
+    if (queries_len >= queries_size) {
+        queries_size = queries_size ? queries_size * 2 : 16;
+        queries = ag_realloc(queries, queries_size * sizeof(serve_query_t));
+    }
+    queries[queries_len].pid = pid;
+    queries[queries_len].conn = conn;
+    queries_len++;
+    return FALSE;
+}
+
+static char *with_trailing_slash(const char *path) {
+    char *res;
+    if (path == NULL) {
+        return NULL;
+    }
+    if (path[0] != '\0' && path[strlen(path) - 1] == '/') {
+        return ag_strdup(path);
+    }
+    ag_asprintf(&res, "%s/", path);
+    return res;
+}
+
+static size_t ignore_patterns_len(const ignores *ig) {
+    return ig->extensions_len + ig->names_len + ig->slash_names_len + ig->regexes_len + ig->slash_regexes_len;
+}
+
+static void reject_query_option(const char *option) {
+    die("%s can't be used in a query. Restart the server with it instead.", option);
+}
+
+/* A query may repeat what the server walked with, or leave it out, but not ask for something else */
+void serve_check_query_options(void) {
+    if (opts.search_all_files && !served_walk_opts.search_all_files) {
+        reject_query_option("--all-types or --unrestricted");
+    }
+    if (opts.search_hidden_files && !served_walk_opts.search_hidden_files) {
+        reject_query_option("--hidden");
+    }
+    if (opts.skip_vcs_ignores && !served_walk_opts.skip_vcs_ignores) {
+        reject_query_option("--skip-vcs-ignores");
+    }
+    if (opts.follow_symlinks && !served_walk_opts.follow_symlinks) {
+        reject_query_option("--follow");
+    }
+    if (opts.one_dev && !served_walk_opts.one_dev) {
+        reject_query_option("--one-device");
+    }
+    if (!opts.recurse_dirs && served_walk_opts.recurse_dirs) {
+        reject_query_option("--norecurse");
+    }
+    if (opts.max_search_depth != DEFAULT_MAX_SEARCH_DEPTH && opts.max_search_depth != served_walk_opts.max_search_depth) {
+        reject_query_option("--depth");
+    }
+    if (opts.path_to_ignore || ignore_patterns_len(root_ignores) != served_walk_opts.ignore_patterns_len) {
+        reject_query_option("--ignore, --ignore-dir or --path-to-ignore");
+    }
+}
+
+void serve(const char *socket_path, char **paths, char **base_paths, int *argc, char ***argv) {
+    struct sigaction sa;
+    int listen_fd;
+    size_t i;
+
+    served_walk_opts.search_all_files = opts.search_all_files;
+    served_walk_opts.search_hidden_files = opts.search_hidden_files;
+    served_walk_opts.skip_vcs_ignores = opts.skip_vcs_ignores;
+    served_walk_opts.follow_symlinks = opts.follow_symlinks;
+    served_walk_opts.one_dev = opts.one_dev;
+    served_walk_opts.recurse_dirs = opts.recurse_dirs;
+    served_walk_opts.max_search_depth = opts.max_search_depth;
+    served_walk_opts.ignore_patterns_len = ignore_patterns_len(root_ignores);
+
+    inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (inotify_fd < 0) {
+        die("inotify_init1() failed: %s", strerror(errno));
+    }
+
+    for (roots_len = 0; paths[roots_len] != NULL; roots_len++) {
+    }
+    roots = ag_calloc(roots_len, sizeof(serve_root_t));
+    for (i = 0; i < roots_len; i++) {
+        struct stat s;
+        roots[i].path = ag_strdup(paths[i]);
+        roots[i].base_path = with_trailing_slash(base_paths[i]);
+        if (stat(paths[i], &s) != 0) {
+            log_err("Skipping %s: %s", paths[i], strerror(errno));
+            continue;
+        }
+        roots[i].original_dev = s.st_dev;
+        if (S_ISDIR(s.st_mode)) {
+            roots[i].dir = serve_dir_new(&roots[i], NULL, paths[i], "");
+        }
+    }
+
+    listen_fd = serve_listen(socket_path);
+    if (pipe2(sigchld_pipe, O_NONBLOCK | O_CLOEXEC) != 0) {
+        die("pipe2() failed: %s", strerror(errno));
+    }
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = &handle_stop_signal;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    sa.sa_handler = &handle_sigchld;
+    sa.sa_flags = SA_NOCLDSTOP | SA_RESTART;
+    sigaction(SIGCHLD, &sa, NULL);
+    signal(SIGPIPE, SIG_IGN);
+    log_debug("Serving %lu paths on %s", (unsigned long)roots_len, socket_path);
+
+    while (!stop_serving) {
+        struct pollfd fds[3] = {
+            { listen_fd, POLLIN, 0 },
+            { inotify_fd, POLLIN, 0 },
+            { sigchld_pipe[0], POLLIN, 0 }
+        };
+        if (poll(fds, 3, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            die("poll() failed: %s", strerror(errno));
+        }
+        if (fds[2].revents & POLLIN) {
+            char drain[64];
+            while (read(sigchld_pipe[0], drain, sizeof(drain)) > 0) {
+            }
+            reap_queries(FALSE);
+        }
+        if (fds[1].revents & POLLIN) {
+            serve_read_events();
+        }
+        if ((fds[0].revents & POLLIN) && serve_accept(listen_fd, argc, argv)) {
+            /* We're the query process now */
+            return;
+        }
+    }
+
+    close(listen_fd);
+    unlink(socket_path);
+    reap_queries(TRUE);
+    free(queries);
+    close(sigchld_pipe[0]);
+    close(sigchld_pipe[1]);
+    for (i = 0; i < roots_len; i++) {
+        serve_dir_free(roots[i].dir);
+        free(roots[i].path);
+        free(roots[i].base_path);
+    }
+    free(roots);
+    free(pending);
+    close(inotify_fd);
+    cleanup_options();
+    cleanup_ignore(root_ignores);
+    for (i = 0; paths[i] != NULL; i++) {
+        free(paths[i]);
+        free(base_paths[i]);
+    }
+    free(paths);
+    free(base_paths);
+    exit(0);
+}
+
+/*
+ * Finds a query path in the served tree. base_path is absolute and ends with a slash, like the roots'.
+ * Returns FALSE if it isn't there. Otherwise *dir is the directory to search, or NULL for a file.
+ */
+static int serve_lookup(const char *base_path, const serve_dir_t **dir) {
+    const serve_dir_t *d;
+    const char *rel;
+    const char *end;
+    size_t root_len;
+    size_t name_len;
+    size_t i;
+    size_t j;
+
+    for (i = 0; i < roots_len; i++) {
+        if (roots[i].base_path == NULL) {
+            continue;
+        }
+        root_len = strlen(roots[i].base_path);
+        if (roots[i].dir == NULL) {
+            if (strcmp(base_path, roots[i].base_path) == 0) {
+                *dir = NULL;
+                return TRUE;
+            }
+            continue;
+        }
+        if (strncmp(base_path, roots[i].base_path, root_len) != 0) {
+            continue;
+        }
+        d = roots[i].dir;
+        for (rel = base_path + root_len; d && *rel; rel = end + 1) {
+            end = strchr(rel, '/');
+            name_len = end - rel;
+            for (j = 0; j < d->entries_len; j++) {
+                if (strncmp(d->entries[j].name, rel, name_len) == 0 && d->entries[j].name[name_len] == '\0') {
+                    break;
+                }
+            }
+            if (j == d->entries_len) {
+                d = NULL;
+            } else if (d->entries[j].dir) {
+                d = d->entries[j].dir;
+            } else if (end[1] == '\0') {
+                *dir = NULL;
+                return TRUE;
+            } else {
+                d = NULL;
+            }
+        }
+        if (d) {
+            *dir = d;
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+/* Queues d's files, named from path the way the client spelled it, so they print the way plain ag would print them */
+static void serve_search_dir(ag_ctx *ctx, const serve_dir_t *d, const char *path) {
+    char *child_path;
+    size_t i;
+
+    for (i = 0; i < d->entries_len; i++) {
+        ag_asprintf(&child_path, "%s/%s", path, d->entries[i].name);
+        if (d->entries[i].dir) {
+            serve_search_dir(ctx, d->entries[i].dir, child_path);
+        } else {
+            queue_file(ctx, child_path);
+        }
+        free(child_path);
+    }
+}
+
+void serve_search(ag_ctx *ctx, char **paths, char **base_paths) {
+    const serve_dir_t **dirs;
+    size_t paths_len;
+    size_t i;
+
+    for (paths_len = 0; paths[paths_len] != NULL; paths_len++) {
+    }
+    dirs = ag_calloc(paths_len + 1, sizeof(serve_dir_t *));
+
+    /* Check every path before searching any, so a bad one doesn't leave partial output */
+    for (i = 0; i < paths_len; i++) {
+        char *base_path = with_trailing_slash(base_paths[i]);
+        if (base_path && !serve_lookup(base_path, &dirs[i])) {
+            die("%s isn't in the tree the server watches. Search it without --connect, or serve it too.", paths[i]);
+        }
+        free(base_path);
+    }
+
+    for (i = 0; i < paths_len; i++) {
+        if (base_paths[i] == NULL) {
+            log_err("Error stat()ing: %s", paths[i]);
+        } else if (dirs[i]) {
+            serve_search_dir(ctx, dirs[i], paths[i]);
+        } else {
+            search_file_arg(ctx, paths[i]);
+        }
+    }
+    free(dirs);
+}
+
+int serve_client(const char *socket_path, int argc, char **argv) {
+    struct sockaddr_un addr;
+    char header[8];
+    char cmsg_buf[CMSG_SPACE(2 * sizeof(int))];
+    struct iovec iov = { header, sizeof(header) };
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+    int client_fds[2] = { STDOUT_FILENO, STDERR_FILENO };
+    char cwd[PATH_MAX];
+    char *payload;
+    uint32_t payload_len;
+    char status_byte;
+    int fd;
+    int i;
+
+    if (getcwd(cwd, sizeof(cwd)) == NULL) {
+        die("Unable to get the current directory: %s", strerror(errno));
+    }
+    payload_len = strlen(cwd) + 1;
+    for (i = 0; i < argc; i++) {
+        payload_len += strlen(argv[i]) + 1;
+    }
+    if (payload_len > SERVE_MAX_QUERY_LEN) {
+        die("Query is too long.");
+    }
+    payload = ag_malloc(payload_len);
+    payload_len = 0;
+    memcpy(payload, cwd, strlen(cwd) + 1);
+    payload_len += strlen(cwd) + 1;
+    for (i = 0; i < argc; i++) {
+        memcpy(payload + payload_len, argv[i], strlen(argv[i]) + 1);
+        payload_len += strlen(argv[i]) + 1;
+    }
+
+    if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+        die("Socket path %s is too long.", socket_path);
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strlcpy(addr.sun_path, socket_path, sizeof(addr.sun_path));
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        die("Unable to connect to %s: %s", socket_path, strerror(errno));
+    }
+
+    memcpy(header, SERVE_MAGIC, 4);
+    memcpy(header + 4, &payload_len, sizeof(payload_len));
+    memset(&msg, 0, sizeof(msg));
+    memset(cmsg_buf, 0, sizeof(cmsg_buf));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = cmsg_buf;
+    msg.msg_controllen = sizeof(cmsg_buf);
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(client_fds));
+    memcpy(CMSG_DATA(cmsg), client_fds, sizeof(client_fds));
+
+    if (sendmsg(fd, &msg, 0) != sizeof(header) || !write_fully(fd, payload, payload_len)) {
+        die("Unable to send query to %s: %s", socket_path, strerror(errno));
+    }
+    free(payload);
+
+    if (!read_fully(fd, &status_byte, 1)) {
+        log_err("Lost connection to %s", socket_path);
+        close(fd);
+        return 2;
+    }
+    close(fd);
+    return (unsigned char)status_byte;
+}
+
+#else
+
+int serve_client(const char *socket_path, int argc, char **argv) {
+    (void)socket_path;
+    (void)argc;
+    (void)argv;
+    die("--connect isn't supported on this platform.");
+    return 2;
+}
+
+static char *with_trailing_slash(const char *path) {
+    char *res;
+    if (path == NULL) {
+        return NULL;
+    }
+    if (path[0] != '\0' && path[strlen(path) - 1] == '/') {
+        return ag_strdup(path);
+    }
+    ag_asprintf(&res, "%s/", path);
+    return res;
+}
+
+void serve(const char *socket_path, char **paths, char **base_paths, int *argc, char ***argv) {
+    (void)socket_path;
+    (void)paths;
+    (void)base_paths;
+    (void)argc;
+    (void)argv;
+    die("--serve requires inotify, which isn't available on this platform.");
+}
+
+void serve_check_query_options(void) {
+}
+
+void serve_search(ag_ctx *ctx, char **paths, char **base_paths) {
+    (void)ctx;
+    (void)paths;
+    (void)base_paths;
+}
+
+#endif
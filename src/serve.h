@@ -0,0 +1,26 @@
+#ifndef SERVE_H
+#define SERVE_H
+
+#include "libag.h"
+
+/*
+ * ag --serve SOCKET keeps the walked tree (filtered listings and compiled
+ * ignores) in memory, keeps it current with inotify, and answers queries
+ * sent by ag --connect SOCKET. Each query is run in a forked copy of the
+ * server, so query options never leak into the server's state.
+ */
+
+/* Removes --connect SOCKET from argv and returns SOCKET, or NULL if it isn't there. */
+char *serve_connect_arg(int *argc, char **argv);
+int serve_client(const char *socket_path, int argc, char **argv);
+
+/* Only returns in a forked query process, with argc/argv set to the query's arguments. */
+void serve(const char *socket_path, char **paths, char **base_paths, int *argc, char ***argv);
+
+/* In a query process: dies if the query asks for a walk the server's tree can't give it, e.g. --hidden. */
+void serve_check_query_options(void);
+
+/* In a query process: queue every served file below the query's paths. Dies if one of them isn't served. */
+void serve_search(ag_ctx *ctx, char **paths, char **base_paths);
+
+#endif
@@ -0,0 +1,163 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#ifndef _WIN32
+#include <sys/resource.h>
+#endif
+
+#include "stats.h"
+#include "util.h"
+
+ag_stats stats;
+ag_stats *stats_workers = NULL;
+int stats_workers_len = 0;
+
+static __thread ag_stats *thread_stats = NULL;
+static __thread stats_phase_t thread_phase = STATS_PHASE_OTHER;
+static __thread struct timespec thread_wall;
+static __thread struct timespec thread_cpu;
+
+static const char *phase_names[STATS_PHASE_COUNT] = {
+    "other",
+    "traversal",
+    "ignores",
+    "open/read/mmap",
+    "binary detection",
+    "decompression",
+    "matching",
+    "printing",
+    "queue wait",
+};
+
+static void stats_now(struct timespec *wall, struct timespec *cpu) {
+    clock_gettime(CLOCK_MONOTONIC, wall);
+#ifdef CLOCK_THREAD_CPUTIME_ID
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, cpu);
+#else
+    cpu->tv_sec = 0;
+    cpu->tv_nsec = 0;
+#endif
+}
+
+static double timespec_diff(const struct timespec *end, const struct timespec *start) {
+    return (double)(end->tv_sec - start->tv_sec) + (double)(end->tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static double timeval_diff(const struct timeval *end, const struct timeval *start) {
+    return (double)(end->tv_sec - start->tv_sec) + (double)(end->tv_usec - start->tv_usec) / 1e6;
+}
+
+void stats_init(void) {
+    memset(&stats, 0, sizeof(stats));
+    gettimeofday(&(stats.time_start), NULL);
+    stats_thread_start(&stats, STATS_PHASE_OTHER);
+}
+
+/* Called before the workers start. Keeps the slots of any earlier search (serve queries reuse the process). */
+void stats_init_workers(const int workers_len) {
+    stats_workers = ag_realloc(stats_workers, (stats_workers_len + workers_len) * sizeof(ag_stats));
+    memset(stats_workers + stats_workers_len, 0, workers_len * sizeof(ag_stats));
+    stats_workers_len += workers_len;
+}
+
+void stats_cleanup(void) {
+    stats_thread_stop();
+    free(stats_workers);
+    stats_workers = NULL;
+    stats_workers_len = 0;
+}
+
+void stats_thread_start(ag_stats *s, const stats_phase_t phase) {
+    thread_stats = s;
+    thread_phase = phase;
+    if (s) {
+        stats_now(&thread_wall, &thread_cpu);
+    }
+}
+
+void stats_thread_stop(void) {
+    stats_phase(STATS_PHASE_OTHER);
+    thread_stats = NULL;
+}
+
+ag_stats *stats_thread(void) {
+    return thread_stats;
+}
+
+stats_phase_t stats_phase(const stats_phase_t phase) {
+    stats_phase_t prev = thread_phase;
+    struct timespec wall;
+    struct timespec cpu;
+
+    if (thread_stats == NULL) {
+        return phase;
+    }
+    stats_now(&wall, &cpu);
+    thread_stats->phase_wall[prev] += timespec_diff(&wall, &thread_wall);
+    thread_stats->phase_cpu[prev] += timespec_diff(&cpu, &thread_cpu);
+    thread_wall = wall;
+    thread_cpu = cpu;
+    thread_phase = phase;
+    return prev;
+}
+
+static void stats_add(ag_stats *total, const ag_stats *s) {
+    int i;
+
+    total->total_bytes += s->total_bytes;
+    total->total_files += s->total_files;
+    total->total_matches += s->total_matches;
+    total->total_file_matches += s->total_file_matches;
+    if (s->arena_peak > total->arena_peak) {
+        total->arena_peak = s->arena_peak;
+    }
+    for (i = 0; i < STATS_PHASE_COUNT; i++) {
+        total->phase_wall[i] += s->phase_wall[i];
+        total->phase_cpu[i] += s->phase_cpu[i];
+    }
+}
+
+/*
+ * The totals go to stdout in the same format as always. The breakdown goes
+ * to stderr so scripts reading the totals aren't affected by it.
+ */
+void stats_print(void) {
+    ag_stats total;
+    int i;
+
+    stats_phase(STATS_PHASE_OTHER);
+    gettimeofday(&(stats.time_end), NULL);
+
+    total = stats;
+    for (i = 0; i < stats_workers_len; i++) {
+        stats_add(&total, &stats_workers[i]);
+    }
+
+    // https://github.com/ggreer/the_silver_searcher/pull/1159/commits/b36c2ff5f21ebf1fa445d4122068a0051ae0193d
+    printf("%zu matches\n%zu files contained matches\n%zu files searched\n%zu bytes searched\n%f seconds\n",
+           total.total_matches, total.total_file_matches, total.total_files, total.total_bytes,
+           timeval_diff(&stats.time_end, &stats.time_start));
+    fflush(stdout);
+
+    fprintf(stderr, "%-18s %12s %12s\n", "phase", "wall s", "cpu s");
+    for (i = 0; i < STATS_PHASE_COUNT; i++) {
+        fprintf(stderr, "%-18s %12.6f %12.6f\n", phase_names[i], total.phase_wall[i], total.phase_cpu[i]);
+    }
+#ifndef _WIN32
+    {
+        struct rusage usage;
+        if (getrusage(RUSAGE_SELF, &usage) == 0) {
+            fprintf(stderr, "process cpu: %f user, %f system\n",
+                    timeval_diff(&usage.ru_utime, &(struct timeval){ 0, 0 }),
+                    timeval_diff(&usage.ru_stime, &(struct timeval){ 0, 0 }));
+        }
+    }
+#endif
+    for (i = 0; i < stats_workers_len; i++) {
+        const ag_stats *w = &stats_workers[i];
+        fprintf(stderr, "worker %i: %zu files, %zu bytes, %zu matches, %f s matching, %f s waiting for files, %zu bytes of match storage at most\n",
+                i, w->total_files, w->total_bytes, w->total_matches,
+                w->phase_wall[STATS_PHASE_MATCH], w->phase_wall[STATS_PHASE_QUEUE_WAIT], w->arena_peak);
+    }
+}
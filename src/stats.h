@@ -0,0 +1,62 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stddef.h>
+#include <sys/time.h>
+
+/*
+ * --stats. Every thread counts into its own ag_stats (workers get a slot
+ * in stats_workers, everything else counts into stats), so nothing is
+ * locked while searching. The counters are summed when they're printed.
+ *
+ * A thread is always in exactly one phase. stats_phase() switches phases
+ * and charges the wall and CPU time since the last switch to the phase
+ * being left, so nested phases are never counted twice.
+ */
+
+typedef enum {
+    STATS_PHASE_OTHER,
+    STATS_PHASE_WALK,       /* Reading directories */
+    STATS_PHASE_IGNORE,     /* Loading ignore files and filtering directory entries */
+    STATS_PHASE_READ,       /* stat/open/mmap/read of files being searched */
+    STATS_PHASE_BINARY,     /* is_binary() */
+    STATS_PHASE_DECOMPRESS, /* -z */
+    STATS_PHASE_MATCH,
+    STATS_PHASE_PRINT,      /* Includes waiting for the print lock */
+    STATS_PHASE_QUEUE_WAIT, /* Workers waiting for files to search */
+    STATS_PHASE_COUNT
+} stats_phase_t;
+
+typedef struct {
+    size_t total_bytes;
+    size_t total_files;
+    size_t total_matches;
+    size_t total_file_matches;
+    size_t arena_peak; /* Most arena.c handed out for one file, in bytes */
+    double phase_wall[STATS_PHASE_COUNT]; /* Seconds */
+    double phase_cpu[STATS_PHASE_COUNT];
+    struct timeval time_start;
+    struct timeval time_end;
+} ag_stats;
+
+extern ag_stats stats;
+extern ag_stats *stats_workers;
+extern int stats_workers_len;
+
+void stats_init(void);
+void stats_init_workers(const int workers_len);
+void stats_cleanup(void);
+
+/* Start or stop charging the calling thread's time to s. s may be NULL. */
+void stats_thread_start(ag_stats *s, const stats_phase_t phase);
+void stats_thread_stop(void);
+
+/* The calling thread's counters, or NULL if --stats isn't on */
+ag_stats *stats_thread(void);
+
+/* Returns the phase the thread was in. Does nothing if the thread isn't counting. */
+stats_phase_t stats_phase(const stats_phase_t phase);
+
+void stats_print(void);
+
+#endif
@@ -0,0 +1,203 @@
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "trace.h"
+#include "util.h"
+
+/* Finished events kept per thread */
+#define TRACE_RING_SIZE (64 * 1024)
+
+typedef struct {
+    const char *name;
+    char *arg;
+    uint64_t start; /* Nanoseconds since trace_init() */
+    uint64_t dur;
+} trace_event_t;
+
+typedef struct trace_thread {
+    int tid;
+    char name[32];
+    trace_event_t *ring;
+    size_t ring_len; /* Events ever recorded. The ring holds the last TRACE_RING_SIZE. */
+    trace_event_t *open;
+    int open_len;
+    int open_size;
+    struct trace_thread *next;
+} trace_thread_t;
+
+int trace_enabled = FALSE;
+
+static FILE *trace_fp = NULL;
+static struct timespec trace_start;
+static trace_thread_t *threads = NULL;
+static int threads_len = 0;
+static pthread_mutex_t threads_mtx = PTHREAD_MUTEX_INITIALIZER;
+static __thread trace_thread_t *thread = NULL;
+
+static uint64_t trace_now(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)(now.tv_sec - trace_start.tv_sec) * 1000000000 + (uint64_t)now.tv_nsec - (uint64_t)trace_start.tv_nsec;
+}
+
+static trace_thread_t *trace_thread_register(void) {
+    trace_thread_t *t = ag_calloc(1, sizeof(trace_thread_t));
+
+    t->ring = ag_calloc(TRACE_RING_SIZE, sizeof(trace_event_t));
+    pthread_mutex_lock(&threads_mtx);
+    t->tid = threads_len++;
+    t->next = threads;
+    threads = t;
+    pthread_mutex_unlock(&threads_mtx);
+    snprintf(t->name, sizeof(t->name), "thread %i", t->tid);
+    thread = t;
+    return t;
+}
+
+void trace_init(const char *path) {
+    trace_fp = fopen(path, "w");
+    if (trace_fp == NULL) {
+        die("Error opening trace file %s: %s", path, strerror(errno));
+    }
+    clock_gettime(CLOCK_MONOTONIC, &trace_start);
+    trace_enabled = TRUE;
+    trace_thread_register();
+    strcpy(thread->name, "main");
+}
+
+void trace_thread_start(const int worker_id) {
+    if (!trace_enabled) {
+        return;
+    }
+    if (thread == NULL) {
+        trace_thread_register();
+    }
+    snprintf(thread->name, sizeof(thread->name), "worker %i", worker_id);
+}
+
+int trace_begin(const char *name, const char *arg) {
+    trace_thread_t *t = thread ? thread : trace_thread_register();
+    trace_event_t *e;
+
+    if (t->open_len == t->open_size) {
+        t->open_size = t->open_size ? t->open_size * 2 : 16;
+        t->open = ag_realloc(t->open, t->open_size * sizeof(trace_event_t));
+    }
+    e = &t->open[t->open_len];
+    e->name = name;
+    e->arg = arg ? ag_strdup(arg) : NULL;
+    e->start = trace_now();
+    e->dur = 0;
+    return t->open_len++;
+}
+
+void trace_end(const int token) {
+    trace_thread_t *t = thread;
+    uint64_t now;
+
+    if (t == NULL || token < 0) {
+        return;
+    }
+    now = trace_now();
+    while (t->open_len > token) {
+        trace_event_t *e = &t->open[--t->open_len];
+        trace_event_t *slot = &t->ring[t->ring_len % TRACE_RING_SIZE];
+        free(slot->arg);
+        *slot = *e;
+        slot->dur = now - e->start;
+        t->ring_len++;
+    }
+}
+
+void trace_lock(pthread_mutex_t *mtx, const char *name) {
+    int token;
+
+    if (pthread_mutex_trylock(mtx) == 0) {
+        return;
+    }
+    token = trace_begin(name, NULL);
+    pthread_mutex_lock(mtx);
+    trace_end(token);
+}
+
+/* Like --json, bytes that aren't part of valid UTF-8 are escaped as \u00XX */
+static void trace_write_string(const char *s) {
+    size_t len = strlen(s);
+    size_t char_len;
+
+    fputc('"', trace_fp);
+    while (len > 0) {
+        unsigned char c = (unsigned char)*s;
+        char_len = 1;
+        if (c == '"' || c == '\\') {
+            fprintf(trace_fp, "\\%c", c);
+        } else if (c < 0x20 || c == 0x7f) {
+            fprintf(trace_fp, "\\u%04x", c);
+        } else if (c < 0x80) {
+            fputc(c, trace_fp);
+        } else if ((char_len = utf8_char_len(s, len)) > 0) {
+            fwrite(s, 1, char_len, trace_fp);
+        } else {
+            char_len = 1;
+            fprintf(trace_fp, "\\u%04x", c);
+        }
+        s += char_len;
+        len -= char_len;
+    }
+    fputc('"', trace_fp);
+}
+
+/* Must be called after every other thread has finished. Frees everything. */
+void trace_write(void) {
+    trace_thread_t *t;
+    trace_thread_t *next;
+    size_t i;
+    int first = TRUE;
+
+    if (!trace_enabled) {
+        return;
+    }
+    trace_end(0);
+    trace_enabled = FALSE;
+
+    fprintf(trace_fp, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+    for (t = threads; t != NULL; t = next) {
+        next = t->next;
+        fprintf(trace_fp, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%i,\"args\":{\"name\":",
+                first ? "" : ",\n", t->tid);
+        trace_write_string(t->name);
+        fprintf(trace_fp, "}}");
+        first = FALSE;
+
+        i = t->ring_len > TRACE_RING_SIZE ? t->ring_len - TRACE_RING_SIZE : 0;
+        for (; i < t->ring_len; i++) {
+            trace_event_t *e = &t->ring[i % TRACE_RING_SIZE];
+            fprintf(trace_fp, ",\n{\"name\":");
+            trace_write_string(e->name);
+            fprintf(trace_fp, ",\"cat\":\"ag\",\"ph\":\"X\",\"pid\":1,\"tid\":%i,\"ts\":%.3f,\"dur\":%.3f",
+                    t->tid, e->start / 1000.0, e->dur / 1000.0);
+            if (e->arg) {
+                fprintf(trace_fp, ",\"args\":{\"path\":");
+                trace_write_string(e->arg);
+                fprintf(trace_fp, "}");
+            }
+            fprintf(trace_fp, "}");
+        }
+
+        for (i = 0; i < TRACE_RING_SIZE && i < t->ring_len; i++) {
+            free(t->ring[i].arg);
+        }
+        free(t->ring);
+        free(t->open);
+        free(t);
+    }
+    fprintf(trace_fp, "\n]}\n");
+    fclose(trace_fp);
+    trace_fp = NULL;
+    threads = NULL;
+    thread = NULL;
+}
@@ -0,0 +1,46 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <pthread.h>
+
+/*
+ * --trace FILE records what every thread was doing and writes it as Chrome
+ * trace JSON (chrome://tracing, ui.perfetto.dev) when ag exits.
+ *
+ * Each thread keeps its own ring buffer of finished events, so recording
+ * takes no locks. If a thread records more than fits, its oldest events
+ * are dropped. When --trace isn't given, the macros only test trace_enabled.
+ */
+
+extern int trace_enabled;
+
+void trace_init(const char *path);
+void trace_write(void);
+
+void trace_thread_start(const int worker_id);
+
+/* Returns a token for trace_end(). arg is copied and may be NULL. */
+int trace_begin(const char *name, const char *arg);
+/* Ends the event that returned token, and any events begun after it that are still open */
+void trace_end(const int token);
+
+/* Locks mtx, recording an event if it has to wait */
+void trace_lock(pthread_mutex_t *mtx, const char *name);
+
+#define TRACE_BEGIN(name, arg) (trace_enabled ? trace_begin(name, arg) : -1)
+#define TRACE_END(token)      \
+    do {                      \
+        if (trace_enabled) {  \
+            trace_end(token); \
+        }                     \
+    } while (0)
+#define TRACE_LOCK(mtx, name)        \
+    do {                             \
+        if (trace_enabled) {         \
+            trace_lock(mtx, name);   \
+        } else {                     \
+            pthread_mutex_lock(mtx); \
+        }                            \
+    } while (0)
+
+#endif
@@ -5,6 +5,7 @@
 #include <string.h>
 #include <sys/stat.h>
 #include <limits.h>
+#include <time.h>
 
 #include "config.h"
 #include "util.h"
@@ -23,7 +24,14 @@
     return ptr;
 
 FILE *out_fd = NULL;
-ag_stats stats;
+
+/* ASCII tolower(), without the function call or the locale */
+#define FOLD1(c) ((c) >= 'A' && (c) <= 'Z' ? (c) + ('a' - 'A') : (c))
+#define FOLD4(c) FOLD1(c), FOLD1(c + 1), FOLD1(c + 2), FOLD1(c + 3)
+#define FOLD16(c) FOLD4(c), FOLD4(c + 4), FOLD4(c + 8), FOLD4(c + 12)
+#define FOLD64(c) FOLD16(c), FOLD16(c + 16), FOLD16(c + 32), FOLD16(c + 48)
+const unsigned char ag_fold_table[UCHAR_MAX + 1] = { FOLD64(0), FOLD64(64), FOLD64(128), FOLD64(192) };
+
 void *ag_malloc(size_t size) {
     void *ptr = malloc(size);
     CHECK_AND_RETURN(ptr)
@@ -80,7 +88,7 @@ void generate_alpha_skip(const char *find, size_t f_len, size_t skip_lookup[], c
         if (case_sensitive) {
             skip_lookup[(unsigned char)find[i]] = f_len - i;
         } else {
-            skip_lookup[(unsigned char)tolower(find[i])] = f_len - i;
+            skip_lookup[ag_fold_table[(unsigned char)find[i]]] = f_len - i;
             skip_lookup[(unsigned char)toupper(find[i])] = f_len - i;
         }
     }
@@ -108,8 +116,8 @@ void generate_bad_char_skip(const char *needle, size_t nlen, size_t bad_char_ski
         if (case_sensitive) {
             bad_char_skip_lookup[(unsigned char)needle[scan]] = last - scan;
         } else {
-            bad_char_skip_lookup[tolower(needle[scan])] = last - scan;
-            bad_char_skip_lookup[toupper(needle[scan])] = last - scan;
+            bad_char_skip_lookup[ag_fold_table[(unsigned char)needle[scan]]] = last - scan;
+            bad_char_skip_lookup[(unsigned char)toupper((unsigned char)needle[scan])] = last - scan;
         }
     }
 }
@@ -124,7 +132,7 @@ int is_prefix(const char *s, const size_t s_len, const size_t pos, const int cas
                 return 0;
             }
         } else {
-            if (tolower(s[i]) != tolower(s[i + pos])) {
+            if (AG_FOLD(s[i]) != AG_FOLD(s[i + pos])) {
                 return 0;
             }
         }
@@ -142,7 +150,7 @@ size_t suffix_len(const char *s, const size_t s_len, const size_t pos, const int
                 break;
             }
         } else {
-            if (tolower(s[pos - i]) != tolower(s[s_len - i - 1])) {
+            if (AG_FOLD(s[pos - i]) != AG_FOLD(s[s_len - i - 1])) {
                 break;
             }
         }
@@ -174,6 +182,7 @@ void generate_find_skip(const char *find, const size_t f_len, size_t **skip_look
 }
 
 #define AG_MAX(a, b) ((b > a) ? b : a)
+#define AG_MIN(a, b) ((b < a) ? b : a)
 
 void generate_hash(const char *find, const size_t f_len, uint8_t *h_table, const int case_sensitive) {
     int i;
@@ -202,39 +211,55 @@ void generate_hash(const char *find, const size_t f_len, uint8_t *h_table, const
 }
 
 /* Boyer-Moore strstr */
-_GL_ATTRIBUTE_PURE _GL_ATTRIBUTE_HOT _GL_ATTRIBUTE_NOTHROW const char *boyer_moore_strnstr(const char *s, const char *find, const size_t s_len, const size_t f_len,
-                                                                                           const size_t alpha_skip_lookup[], const size_t *find_skip_lookup) {
+_GL_ATTRIBUTE_HOT _GL_ATTRIBUTE_NOTHROW const char *boyer_moore_strnstr(const char *s, const char *find, const size_t s_len, const size_t f_len,
+                                                                     const size_t alpha_skip_lookup[], const size_t *find_skip_lookup, size_t *budget) {
     ssize_t i;
     size_t pos = f_len - 1;
+    size_t left = *budget;
 
     while (pos < s_len) {
         for (i = f_len - 1; i >= 0 && s[pos] == find[i]; pos--, i--) {
         }
         if (i < 0) {
+            *budget = left;
             return s + pos + 1;
         }
+        if (f_len - 1 - i > left) {
+            *budget = 0;
+            return NULL;
+        }
+        left -= f_len - 1 - i;
         pos += AG_MAX(alpha_skip_lookup[(unsigned char)s[pos]], find_skip_lookup[i]);
     }
 
+    *budget = left;
     return NULL;
 }
 
 
 /* Copy-pasted from above. Yes I know this is bad. One day I might even fix it. */
-_GL_ATTRIBUTE_PURE _GL_ATTRIBUTE_HOT _GL_ATTRIBUTE_NOTHROW const char *boyer_moore_strncasestr(const char *s, const char *find, const size_t s_len, const size_t f_len,
-                                                                                               const size_t alpha_skip_lookup[], const size_t *find_skip_lookup) {
+_GL_ATTRIBUTE_HOT _GL_ATTRIBUTE_NOTHROW const char *boyer_moore_strncasestr(const char *s, const char *find, const size_t s_len, const size_t f_len,
+                                                                         const size_t alpha_skip_lookup[], const size_t *find_skip_lookup, size_t *budget) {
     ssize_t i;
     size_t pos = f_len - 1;
+    size_t left = *budget;
 
     while (pos < s_len) {
-        for (i = f_len - 1; i >= 0 && tolower(s[pos]) == find[i]; --pos, --i) {
+        for (i = f_len - 1; i >= 0 && AG_FOLD(s[pos]) == find[i]; --pos, --i) {
         }
         if (i < 0) {
+            *budget = left;
             return s + pos + 1;
         }
+        if (f_len - 1 - i > left) {
+            *budget = 0;
+            return NULL;
+        }
+        left -= f_len - 1 - i;
         pos += AG_MAX(alpha_skip_lookup[(unsigned char)s[pos]], find_skip_lookup[i]);
     }
 
+    *budget = left;
     return NULL;
 }
 
@@ -247,15 +272,14 @@ _GL_ATTRIBUTE_PURE _GL_ATTRIBUTE_HOT _GL_ATTRIBUTE_NOTHROW const char *boyer_moo
  * 0x00 will be cut off, so you could call this example with
  * boyermoore_horspool_strcasestr(haystack, hlen, "abc", sizeof("abc")-1)
  */
-_GL_ATTRIBUTE_PURE _GL_ATTRIBUTE_HOT _GL_ATTRIBUTE_NOTHROW const char *boyer_moore_horspool_strnstr(const char *haystack, const char *needle, size_t hlen, size_t nlen,
-                                                                                                    const size_t bad_char_skip_lookup[], const size_t *find_skip_lookup) {
-    printf("In boyer_moore_horspool_strnstr\n");
-
+_GL_ATTRIBUTE_HOT _GL_ATTRIBUTE_NOTHROW const char *boyer_moore_horspool_strnstr(const char *haystack, const char *needle, size_t hlen, size_t nlen,
+                                                                                 const size_t bad_char_skip_lookup[], const size_t *find_skip_lookup, size_t *budget) {
     /* Sanity checks on the parameters */
     if (nlen <= 0 || !haystack || !needle)
         return NULL;
 
     size_t scan = 0;
+    size_t left = *budget;
 
     /* C arrays have the first byte at [0], therefore:
      * [nlen - 1] is the last byte of the array. */
@@ -267,8 +291,15 @@ _GL_ATTRIBUTE_PURE _GL_ATTRIBUTE_HOT _GL_ATTRIBUTE_NOTHROW const char *boyer_moo
     while (hlen >= nlen) {
         /* scan from the end of the needle */
         for (scan = last; haystack[scan] == needle[scan]; --scan)
-            if (scan == 0) /* If the first byte matches, we've found it. */
+            if (scan == 0) { /* If the first byte matches, we've found it. */
+                *budget = left;
                 return haystack;
+            }
+        if (last - scan > left) {
+            *budget = 0;
+            return NULL;
+        }
+        left -= last - scan;
 
         /* otherwise, we need to skip some bytes and start again.
            Note that here we are getting the skip value based on the last byte
@@ -283,6 +314,7 @@ _GL_ATTRIBUTE_PURE _GL_ATTRIBUTE_HOT _GL_ATTRIBUTE_NOTHROW const char *boyer_moo
         haystack += bad_char_skip_lookup[(unsigned char)haystack[last]];
     }
 
+    *budget = left;
     return NULL;
 }
 
@@ -295,14 +327,14 @@ _GL_ATTRIBUTE_PURE _GL_ATTRIBUTE_HOT _GL_ATTRIBUTE_NOTHROW const char *boyer_moo
  * 0x00 will be cut off, so you could call this example with
  * boyermoore_horspool_strcasestr(haystack, hlen, "abc", sizeof("abc")-1)
  */
-_GL_ATTRIBUTE_PURE _GL_ATTRIBUTE_HOT _GL_ATTRIBUTE_NOTHROW const char *boyer_moore_horspool_strncasestr(const char *haystack, const char *needle, size_t hlen, size_t nlen,
-                                                                                                        const size_t bad_char_skip_lookup[], const size_t *find_skip_lookup) {
-    printf("In boyer_moore_horspool_strncasestr\n");
+_GL_ATTRIBUTE_HOT _GL_ATTRIBUTE_NOTHROW const char *boyer_moore_horspool_strncasestr(const char *haystack, const char *needle, size_t hlen, size_t nlen,
+                                                                                     const size_t bad_char_skip_lookup[], const size_t *find_skip_lookup, size_t *budget) {
     /* Sanity checks on the parameters */
     if (nlen <= 0 || !haystack || !needle)
         return NULL;
 
     size_t scan = 0;
+    size_t left = *budget;
 
     /* C arrays have the first byte at [0], therefore:
      * [nlen - 1] is the last byte of the array. */
@@ -313,9 +345,16 @@ _GL_ATTRIBUTE_PURE _GL_ATTRIBUTE_HOT _GL_ATTRIBUTE_NOTHROW const char *boyer_moo
     /* Search the haystack, while the needle can still be within it. */
     while (hlen >= nlen) {
         /* scan from the end of the needle */
-        for (scan = last; tolower(haystack[scan]) == needle[scan]; --scan)
-            if (scan == 0) /* If the first byte matches, we've found it. */
+        for (scan = last; AG_FOLD(haystack[scan]) == needle[scan]; --scan)
+            if (scan == 0) { /* If the first byte matches, we've found it. */
+                *budget = left;
                 return haystack;
+            }
+        if (last - scan > left) {
+            *budget = 0;
+            return NULL;
+        }
+        left -= last - scan;
 
         /* otherwise, we need to skip some bytes and start again.
            Note that here we are getting the skip value based on the last byte
@@ -330,6 +369,7 @@ _GL_ATTRIBUTE_PURE _GL_ATTRIBUTE_HOT _GL_ATTRIBUTE_NOTHROW const char *boyer_moo
         haystack += bad_char_skip_lookup[(unsigned char)haystack[last]];
     }
 
+    *budget = left;
     return NULL;
 }
 
@@ -348,10 +388,11 @@ strncmp_fp get_strstr(enum case_behavior casing, enum algorithm_type algorithm)
 
 // Clang's -fsanitize=alignment (included in -fsanitize=undefined) will flag
 // the intentional unaligned access here, so suppress it for this function
-_GL_ATTRIBUTE_PURE _GL_ATTRIBUTE_HOT _GL_ATTRIBUTE_NOTHROW NO_SANITIZE_ALIGNMENT const char *hash_strnstr(const char *s, const char *find, const size_t s_len, const size_t f_len, uint8_t *h_table, const int case_sensitive) {
+_GL_ATTRIBUTE_HOT _GL_ATTRIBUTE_NOTHROW NO_SANITIZE_ALIGNMENT const char *hash_strnstr(const char *s, const char *find, const size_t s_len, const size_t f_len, uint8_t *h_table, const int case_sensitive, size_t *budget) {
     if (s_len < f_len)
         return NULL;
 
+    size_t left = *budget;
     // Step through s
     const size_t step = f_len - sizeof(uint16_t) + 1;
     size_t s_i = f_len - sizeof(uint16_t);
@@ -362,20 +403,26 @@ _GL_ATTRIBUTE_PURE _GL_ATTRIBUTE_HOT _GL_ATTRIBUTE_NOTHROW NO_SANITIZE_ALIGNMENT
             size_t i;
             // Check putative match
             for (i = 0; i < f_len; i++) {
-                if ((case_sensitive ? R[i] : tolower(R[i])) != find[i])
+                if ((case_sensitive ? R[i] : AG_FOLD(R[i])) != find[i])
                     goto next_hash_cell;
             }
+            *budget = left;
             return R; // Found
         next_hash_cell:
-            ;
+            if (i > left) {
+                *budget = 0;
+                return NULL;
+            }
+            left -= i;
         }
     }
+    *budget = left;
     // Check tail
     for (s_i = s_i - step + 1; s_i <= s_len - f_len; s_i++) {
         size_t i;
         const char *R = s + s_i;
         for (i = 0; i < f_len; i++) {
-            char s_c = case_sensitive ? R[i] : tolower(R[i]);
+            char s_c = case_sensitive ? R[i] : AG_FOLD(R[i]);
             if (s_c != find[i])
                 goto next_start;
         }
@@ -386,6 +433,170 @@ _GL_ATTRIBUTE_PURE _GL_ATTRIBUTE_HOT _GL_ATTRIBUTE_NOTHROW NO_SANITIZE_ALIGNMENT
     return NULL;
 }
 
+/*
+ * Two-Way string matching (Crochemore & Perrin, 1991), as in glibc's
+ * memmem() for long needles. The needle is split at a critical position.
+ * The right half is compared left to right and the left half right to
+ * left, and the period decides how far to shift after a match of the
+ * right half. That makes it linear in the worst case with O(1) extra
+ * state. A Horspool shift on the two haystack bytes under the end of the
+ * needle lets it skip most of the haystack, even with a small alphabet.
+ */
+#define TW_CANON(c) (case_sensitive ? (unsigned char)(c) : ag_fold_table[(unsigned char)(c)])
+#define TW_HASH(a, b) (((size_t)(a) << 4) ^ (size_t)(b))
+
+static size_t two_way_critical_factorization(const char *find, const size_t f_len, size_t *period, const int case_sensitive) {
+    size_t max_suffix;
+    size_t max_suffix_rev;
+    size_t j;
+    size_t k;
+    size_t p;
+    unsigned char a;
+    unsigned char b;
+
+    /* Maximal suffix for the < ordering. max_suffix starts at "-1" and wraps. */
+    max_suffix = SIZE_MAX;
+    j = 0;
+    k = p = 1;
+    while (j + k < f_len) {
+        a = TW_CANON(find[j + k]);
+        b = TW_CANON(find[max_suffix + k]);
+        if (a < b) {
+            j += k;
+            k = 1;
+            p = j - max_suffix;
+        } else if (a == b) {
+            if (k != p) {
+                ++k;
+            } else {
+                j += p;
+                k = 1;
+            }
+        } else {
+            max_suffix = j++;
+            k = p = 1;
+        }
+    }
+    *period = p;
+
+    /* And for the > ordering */
+    max_suffix_rev = SIZE_MAX;
+    j = 0;
+    k = p = 1;
+    while (j + k < f_len) {
+        a = TW_CANON(find[j + k]);
+        b = TW_CANON(find[max_suffix_rev + k]);
+        if (b < a) {
+            j += k;
+            k = 1;
+            p = j - max_suffix_rev;
+        } else if (a == b) {
+            if (k != p) {
+                ++k;
+            } else {
+                j += p;
+                k = 1;
+            }
+        } else {
+            max_suffix_rev = j++;
+            k = p = 1;
+        }
+    }
+
+    /* The later of the two is a critical factorization */
+    if (max_suffix_rev + 1 < max_suffix + 1) {
+        return max_suffix + 1;
+    }
+    *period = p;
+    return max_suffix_rev + 1;
+}
+
+void generate_two_way(const char *find, const size_t f_len, two_way_t *tw, const int case_sensitive) {
+    size_t i;
+
+    tw->case_sensitive = case_sensitive;
+    tw->suffix = two_way_critical_factorization(find, f_len, &tw->period, case_sensitive);
+    tw->periodic = TRUE;
+    for (i = 0; i < tw->suffix; i++) {
+        if (TW_CANON(find[i]) != TW_CANON(find[i + tw->period])) {
+            tw->periodic = FALSE;
+            break;
+        }
+    }
+    if (!tw->periodic) {
+        /* Any shift up to the longer half is safe */
+        tw->period = AG_MAX(tw->suffix, f_len - tw->suffix) + 1;
+    }
+
+    /* Shifts past TWO_WAY_MAX_SHIFT are cut short, which is always safe */
+    for (i = 0; i < TWO_WAY_SHIFT_SIZE; i++) {
+        tw->shift[i] = (uint16_t)AG_MIN(f_len - 1, TWO_WAY_MAX_SHIFT);
+    }
+    for (i = 1; i < f_len; i++) {
+        tw->shift[TW_HASH(TW_CANON(find[i - 1]), TW_CANON(find[i]))] = (uint16_t)AG_MIN(f_len - i - 1, TWO_WAY_MAX_SHIFT);
+    }
+}
+
+static inline const char *two_way_search(const char *s, const char *find, const size_t s_len, const size_t f_len,
+                                          const two_way_t *tw, const int case_sensitive) {
+    const size_t suffix = tw->suffix;
+    const size_t period = tw->period;
+    size_t memory = 0; /* How much of the left half is known to match already */
+    size_t shift;
+    size_t i;
+    size_t j = 0;
+
+    if (s_len < f_len) {
+        return NULL;
+    }
+    while (j <= s_len - f_len) {
+        shift = tw->shift[TW_HASH(TW_CANON(s[j + f_len - 2]), TW_CANON(s[j + f_len - 1]))];
+        if (shift > 0) {
+            /* The text matches the periodic needle up to its last byte, which is
+             * out of place, so there's no match until past it. This only holds
+             * if it was the last byte (not the one before) that didn't match. */
+            if (memory && shift < period && TW_CANON(find[f_len - 1]) != TW_CANON(s[j + f_len - 1])) {
+                shift = f_len - period;
+            }
+            memory = 0;
+            j += shift;
+            continue;
+        }
+
+        /* Right half. A shift of 0 only means the last two bytes hash the same. */
+        i = AG_MAX(suffix, memory);
+        while (i < f_len && TW_CANON(find[i]) == TW_CANON(s[i + j])) {
+            ++i;
+        }
+        if (i < f_len) {
+            j += i - suffix + 1;
+            memory = 0;
+            continue;
+        }
+
+        /* Left half */
+        i = suffix - 1;
+        while (memory < i + 1 && TW_CANON(find[i]) == TW_CANON(s[i + j])) {
+            --i;
+        }
+        if (i + 1 < memory + 1) {
+            return s + j;
+        }
+        j += period;
+        if (tw->periodic) {
+            memory = f_len - period;
+        }
+    }
+    return NULL;
+}
+
+_GL_ATTRIBUTE_PURE _GL_ATTRIBUTE_HOT _GL_ATTRIBUTE_NOTHROW const char *two_way_strnstr(const char *s, const char *find, const size_t s_len, const size_t f_len, const two_way_t *tw) {
+    if (tw->case_sensitive) {
+        return two_way_search(s, find, s_len, f_len, tw, TRUE);
+    }
+    return two_way_search(s, find, s_len, f_len, tw, FALSE);
+}
+
 size_t invert_matches(const char *buf, const size_t buf_len, match_t matches[], size_t matches_len) {
     size_t i;
     size_t match_read_index = 0;
@@ -451,15 +662,6 @@ size_t invert_matches(const char *buf, const size_t buf_len, match_t matches[],
     return inverted_match_count;
 }
 
-void realloc_matches(match_t **matches, size_t *matches_size, size_t matches_len) {
-    if (matches_len < *matches_size) {
-        return;
-    }
-    /* TODO: benchmark initial size of matches. 100 may be too small/big */
-    *matches_size = *matches ? *matches_size * 2 : 100;
-    *matches = ag_realloc(*matches, *matches_size * sizeof(match_t));
-}
-
 #ifdef HAVE_PCRE
 void compile_study(pcre **re, pcre_extra **re_extra, char *q, const int pcre_opts, const int study_opts) {
     const char *pcre_err = NULL;
@@ -641,6 +843,49 @@ int is_wordchar(char ch) {
     return wordchar_table[(unsigned char)ch];
 }
 
+int is_word_boundary(const char *buf, const size_t buf_len, const size_t pos) {
+    const int before = pos > 0 && is_wordchar(buf[pos - 1]);
+    const int after = pos < buf_len && is_wordchar(buf[pos]);
+    return before != after;
+}
+
+size_t utf8_char_len(const char *s, const size_t len) {
+    const unsigned char *u = (const unsigned char *)s;
+    size_t char_len;
+    size_t i;
+
+    if (len == 0) {
+        return 0;
+    }
+    if (u[0] < 0x80) {
+        return 1;
+    } else if (u[0] >= 0xc2 && u[0] <= 0xdf) {
+        char_len = 2;
+    } else if (u[0] >= 0xe0 && u[0] <= 0xef) {
+        char_len = 3;
+    } else if (u[0] >= 0xf0 && u[0] <= 0xf4) {
+        char_len = 4;
+    } else {
+        return 0;
+    }
+    if (len < char_len) {
+        return 0;
+    }
+    for (i = 1; i < char_len; i++) {
+        if ((u[i] & 0xc0) != 0x80) {
+            return 0;
+        }
+    }
+    /* Overlong encodings, UTF-16 surrogates and anything past U+10FFFF */
+    if ((u[0] == 0xe0 && u[1] < 0xa0) ||
+        (u[0] == 0xed && u[1] > 0x9f) ||
+        (u[0] == 0xf0 && u[1] < 0x90) ||
+        (u[0] == 0xf4 && u[1] > 0x8f)) {
+        return 0;
+    }
+    return char_len;
+}
+
 int is_lowercase(const char *s) {
     int i;
     for (i = 0; s[i] != '\0'; i++) {
@@ -651,18 +896,28 @@ int is_lowercase(const char *s) {
     return TRUE;
 }
 
-int is_directory(const char *path, const struct dirent *d) {
+double thread_cpu_time(void) {
+#ifdef CLOCK_THREAD_CPUTIME_ID
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+#else
+    return (double)clock() / CLOCKS_PER_SEC;
+#endif
+}
+
+int is_directory(const char *path, const dirlist_entry_t *d) {
 #ifdef HAVE_DIRENT_DTYPE
     /* Some filesystems, e.g. ReiserFS, always return a type DT_UNKNOWN from readdir or scandir. */
     /* Call stat if we don't find DT_DIR to get the information we need. */
     /* Also works for symbolic links to directories. */
-    if (d->d_type != DT_UNKNOWN && d->d_type != DT_LNK) {
-        return d->d_type == DT_DIR;
+    if (d->type != DT_UNKNOWN && d->type != DT_LNK) {
+        return d->type == DT_DIR;
     }
 #endif
     char *full_path;
     struct stat s;
-    ag_asprintf(&full_path, "%s/%s", path, d->d_name);
+    ag_asprintf(&full_path, "%s/%s", path, d->name);
     if (stat(full_path, &s) != 0) {
         free(full_path);
         return FALSE;
@@ -676,22 +931,22 @@ int is_directory(const char *path, const struct dirent *d) {
     return is_dir;
 }
 
-int is_symlink(const char *path, const struct dirent *d) {
+int is_symlink(const char *path, const dirlist_entry_t *d) {
 #ifdef _WIN32
     char full_path[MAX_PATH + 1] = { 0 };
-    sprintf(full_path, "%s\\%s", path, d->d_name);
+    sprintf(full_path, "%s\\%s", path, d->name);
     return (GetFileAttributesA(full_path) & FILE_ATTRIBUTE_REPARSE_POINT);
 #else
 #ifdef HAVE_DIRENT_DTYPE
     /* Some filesystems, e.g. ReiserFS, always return a type DT_UNKNOWN from readdir or scandir. */
     /* Call lstat if we find DT_UNKNOWN to get the information we need. */
-    if (d->d_type != DT_UNKNOWN) {
-        return (d->d_type == DT_LNK);
+    if (d->type != DT_UNKNOWN) {
+        return (d->type == DT_LNK);
     }
 #endif
     char *full_path;
     struct stat s;
-    ag_asprintf(&full_path, "%s/%s", path, d->d_name);
+    ag_asprintf(&full_path, "%s/%s", path, d->name);
     if (lstat(full_path, &s) != 0) {
         free(full_path);
         return FALSE;
@@ -701,15 +956,15 @@ int is_symlink(const char *path, const struct dirent *d) {
 #endif
 }
 
-int is_named_pipe(const char *path, const struct dirent *d) {
+int is_named_pipe(const char *path, const dirlist_entry_t *d) {
 #ifdef HAVE_DIRENT_DTYPE
-    if (d->d_type != DT_UNKNOWN && d->d_type != DT_LNK) {
-        return d->d_type == DT_FIFO || d->d_type == DT_SOCK;
+    if (d->type != DT_UNKNOWN && d->type != DT_LNK) {
+        return d->type == DT_FIFO || d->type == DT_SOCK;
     }
 #endif
     char *full_path;
     struct stat s;
-    ag_asprintf(&full_path, "%s/%s", path, d->d_name);
+    ag_asprintf(&full_path, "%s/%s", path, d->name);
     if (stat(full_path, &s) != 0) {
         free(full_path);
         return FALSE;
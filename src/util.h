@@ -2,6 +2,7 @@
 #define UTIL_H
 
 #include <dirent.h>
+#include <limits.h>
 #ifdef HAVE_PCRE
 #include <pcre.h>
 #endif
@@ -29,6 +30,10 @@ extern FILE *out_fd;
 
 #define H_SIZE (64 * 1024)
 
+extern const unsigned char ag_fold_table[];
+/* ASCII-only tolower(). Returns a char, so it compares like one. */
+#define AG_FOLD(c) ((char)ag_fold_table[(unsigned char)(c)])
+
 #ifdef __clang__
 #define NO_SANITIZE_ALIGNMENT __attribute__((no_sanitize("alignment")))
 #else
@@ -51,25 +56,35 @@ typedef struct {
     size_t end;   /* and where it ends */
 } match_t;
 
-typedef struct {
-    size_t total_bytes;
-    size_t total_files;
-    size_t total_matches;
-    size_t total_file_matches;
-    struct timeval time_start;
-    struct timeval time_end;
-} ag_stats;
-
-
-extern ag_stats stats;
-
 /* Union to translate between chars and words without violating strict aliasing */
 typedef union {
     char as_chars[sizeof(uint16_t)];
     uint16_t as_word;
 } word_t;
 
-typedef const char *(*strncmp_fp)(const char *, const char *, const size_t, const size_t, const size_t[], const size_t *);
+typedef const char *(*strncmp_fp)(const char *, const char *, const size_t, const size_t, const size_t[], const size_t *, size_t *);
+
+/*
+ * A haystack full of near misses can make the searches that skip ahead and
+ * then compare do O(n * m) work. They take a budget of bytes they may
+ * compare. When it runs out, they set it to 0 and return NULL, and the
+ * caller finishes the buffer with two_way_strnstr(), which is linear.
+ */
+#define VERIFY_BUDGET(buf_len) (64 * 1024 + 4 * (size_t)(buf_len))
+
+/* Needles too long for hash_strnstr() are searched with two_way_strnstr() from the start if there's no SIMD kernel */
+#define TWO_WAY_MIN_LEN UCHAR_MAX
+#define TWO_WAY_SHIFT_SIZE 4096
+#define TWO_WAY_MAX_SHIFT UINT16_MAX
+
+/* Precomputed Two-Way (Crochemore-Perrin) state for a needle */
+typedef struct {
+    size_t suffix; /* Critical position: the needle is split into [0, suffix) and [suffix, len) */
+    size_t period;
+    int periodic; /* The left half repeats with the period, so matches can reuse what's been compared */
+    int case_sensitive;
+    uint16_t shift[TWO_WAY_SHIFT_SIZE]; /* By hash of a byte pair: how far its last occurrence is from the end of the needle */
+} two_way_t;
 
 void free_strings(char **strs, const size_t strs_len);
 
@@ -81,23 +96,26 @@ void generate_hash(const char *find, const size_t f_len, uint8_t *H, const int c
 void generate_bad_char_skip(const char *needle, size_t nlen, size_t bad_char_skip_lookup[], const int case_sensitive);
 
 const char *boyer_moore_strnstr(const char *s, const char *find, const size_t s_len, const size_t f_len,
-                                const size_t alpha_skip_lookup[], const size_t *find_skip_lookup)
-    _GL_ATTRIBUTE_PURE _GL_ATTRIBUTE_HOT _GL_ATTRIBUTE_NOTHROW;
+                                const size_t alpha_skip_lookup[], const size_t *find_skip_lookup, size_t *budget)
+    _GL_ATTRIBUTE_HOT _GL_ATTRIBUTE_NOTHROW;
 const char *boyer_moore_strncasestr(const char *s, const char *find, const size_t s_len, const size_t f_len,
-                                    const size_t alpha_skip_lookup[], const size_t *find_skip_lookup)
-    _GL_ATTRIBUTE_PURE _GL_ATTRIBUTE_HOT _GL_ATTRIBUTE_NOTHROW;
+                                    const size_t alpha_skip_lookup[], const size_t *find_skip_lookup, size_t *budget)
+    _GL_ATTRIBUTE_HOT _GL_ATTRIBUTE_NOTHROW;
 const char *boyer_moore_horspool_strnstr(const char *haystack, const char *needle, size_t hlen, size_t nlen,
-                                         const size_t bad_char_skip_lookup[], const size_t *find_skip_lookup)
-    _GL_ATTRIBUTE_PURE _GL_ATTRIBUTE_HOT _GL_ATTRIBUTE_NOTHROW;
+                                         const size_t bad_char_skip_lookup[], const size_t *find_skip_lookup, size_t *budget)
+    _GL_ATTRIBUTE_HOT _GL_ATTRIBUTE_NOTHROW;
 const char *boyer_moore_horspool_strncasestr(const char *haystack, const char *needle, size_t hlen, size_t nlen,
-                                             const size_t bad_char_skip_lookup[], const size_t *find_skip_lookup)
-    _GL_ATTRIBUTE_PURE _GL_ATTRIBUTE_HOT _GL_ATTRIBUTE_NOTHROW;
-const char *hash_strnstr(const char *s, const char *find, const size_t s_len, const size_t f_len, uint8_t *h_table, const int case_sensitive)
-    _GL_ATTRIBUTE_PURE _GL_ATTRIBUTE_HOT _GL_ATTRIBUTE_NOTHROW;
+                                             const size_t bad_char_skip_lookup[], const size_t *find_skip_lookup, size_t *budget)
+    _GL_ATTRIBUTE_HOT _GL_ATTRIBUTE_NOTHROW;
+const char *hash_strnstr(const char *s, const char *find, const size_t s_len, const size_t f_len, uint8_t *h_table, const int case_sensitive, size_t *budget)
+    _GL_ATTRIBUTE_HOT _GL_ATTRIBUTE_NOTHROW;
 strncmp_fp get_strstr(enum case_behavior casing, enum algorithm_type algorithm);
+/* f_len must be at least 2 */
+void generate_two_way(const char *find, const size_t f_len, two_way_t *tw, const int case_sensitive);
+const char *two_way_strnstr(const char *s, const char *find, const size_t s_len, const size_t f_len, const two_way_t *tw)
+    _GL_ATTRIBUTE_PURE _GL_ATTRIBUTE_HOT _GL_ATTRIBUTE_NOTHROW;
 
 size_t invert_matches(const char *buf, const size_t buf_len, match_t matches[], size_t matches_len);
-void realloc_matches(match_t **matches, size_t *matches_size, size_t matches_len);
 #ifdef HAVE_PCRE
 void compile_study(pcre **re, pcre_extra **re_extra, char *q, const int pcre_opts, const int study_opts);
 #endif
@@ -110,12 +128,31 @@ int binary_search(const char *needle, char **haystack, int start, int end);
 
 void init_wordchar_table(void);
 int is_wordchar(char ch);
+/* Like PCRE's \b at buf[pos]: exactly one of the bytes on either side is a word character */
+int is_word_boundary(const char *buf, const size_t buf_len, const size_t pos);
+
+/* Bytes in the well-formed UTF-8 character at s, or 0 if there isn't one */
+size_t utf8_char_len(const char *s, const size_t len);
 
 int is_lowercase(const char *s);
 
-int is_directory(const char *path, const struct dirent *d);
-int is_symlink(const char *path, const struct dirent *d);
-int is_named_pipe(const char *path, const struct dirent *d);
+/* Seconds of CPU time the calling thread has used */
+double thread_cpu_time(void);
+
+#ifndef DT_UNKNOWN
+#define DT_UNKNOWN 0
+#endif
+
+/* A directory entry from ag_scandir(). type is its d_type, or DT_UNKNOWN if the filesystem didn't say. */
+typedef struct {
+    char *name;
+    size_t name_len;
+    unsigned char type;
+} dirlist_entry_t;
+
+int is_directory(const char *path, const dirlist_entry_t *d);
+int is_symlink(const char *path, const dirlist_entry_t *d);
+int is_named_pipe(const char *path, const dirlist_entry_t *d);
 
 void die(const char *fmt, ...);
 
@@ -24,3 +24,18 @@ Count stream matches per line (not very useful since it does not print zero):
   $ cat blah.txt | ag --count blah
   1
   1
+
+Count matching lines:
+
+  $ printf 'foo foo\nbar\nfoo\n' > lines.txt
+  $ ag --count foo lines.txt
+  3
+  $ ag --count-lines foo lines.txt
+  2
+  $ ag --count-lines -v foo lines.txt
+  1
+
+A match across lines counts each of them:
+
+  $ ag --count-lines 'foo\nbar' lines.txt
+  2
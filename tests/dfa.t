@@ -0,0 +1,31 @@
+Setup:
+
+  $ . $TESTDIR/setup.sh
+  $ A=$(printf 'a%.0s' $(seq 1 60))
+  $ printf '%sc\nxyz\naaab\n' "$A" > patho.txt
+  $ printf 'took 1234ms\nfoo_cache(x) bar_cache(y)\nabcabc\n' > simple.txt
+
+Patterns that make PCRE backtrack a lot still find their matches:
+
+  $ ag -s '(a|aa)*b' patho.txt
+  3:aaab
+
+PCRE still finds the bounds of each match the DFA finds:
+
+  $ ag -s -o --column '\w+_cache\(' simple.txt
+  1:foo_cache(
+  14:bar_cache(
+  $ ag -s --nomultiline 'took \d{4}ms' simple.txt
+  1:took 1234ms
+
+Patterns the DFA can't handle are left to PCRE:
+
+  $ ag -s --debug '(abc)\1' simple.txt 2>&1 | grep -e 'PCRE can' -e '^[0-9]'
+  DEBUG: Only PCRE can search for regex (abc)\1
+  3:abcabc
+
+--nodfa finds the same matches:
+
+  $ ag -s --nodfa -o --column '\w+_cache\(' simple.txt
+  1:foo_cache(
+  14:bar_cache(
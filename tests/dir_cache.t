@@ -0,0 +1,41 @@
+Setup:
+
+  $ . $TESTDIR/setup.sh
+  $ mkdir -p tree/sub tree/ignored
+  $ echo 'needle' > tree/a.txt
+  $ echo 'needle' > tree/sub/b.txt
+  $ echo 'needle' > tree/ignored/c.txt
+  $ echo 'ignored' > tree/.ignore
+
+First search builds the cache:
+
+  $ ag --dir-cache cache needle tree | sort
+  tree/a.txt:1:needle
+  tree/sub/b.txt:1:needle
+  $ test -s cache
+
+Unchanged tree gives the same results from the cache:
+
+  $ ag --dir-cache cache needle tree | sort
+  tree/a.txt:1:needle
+  tree/sub/b.txt:1:needle
+
+New files are picked up:
+
+  $ echo 'needle' > tree/sub/d.txt
+  $ ag --dir-cache cache needle tree | sort
+  tree/a.txt:1:needle
+  tree/sub/b.txt:1:needle
+  tree/sub/d.txt:1:needle
+
+Changed ignore files invalidate the directory and everything below it:
+
+  $ echo 'sub' > tree/.ignore
+  $ ag --dir-cache cache needle tree | sort
+  tree/a.txt:1:needle
+  tree/ignored/c.txt:1:needle
+
+Changed ignore options invalidate the whole cache:
+
+  $ ag --dir-cache cache --ignore a.txt needle tree | sort
+  tree/ignored/c.txt:1:needle
@@ -13,7 +13,7 @@ A genuine zero-length match should succeed:
   1:foo
 
 Empty files should be listed with --unrestricted --files-with-matches (-ul)
-  $ ag -lu --stats | sed '$d' | sort # Remove the last line about timing which will differ
+  $ ag -lu --stats 2>/dev/null | sed '$d' | sort # Remove the last line about timing which will differ
   2 files contained matches
   2 files searched
   2 matches
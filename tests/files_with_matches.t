@@ -61,3 +61,10 @@ Files without inverted matches:
   [1]
   $ ag --files-without-matches --invert-match duck duck.txt goose.txt
   duck.txt
+
+Only a file's first match is looked for:
+
+  $ ag --debug --files-with-matches duck duck.txt 2>&1 | grep -c 'Match found'
+  1
+  $ ag --debug --files-without-matches duck goose.txt 2>&1 | grep -c 'Match found'
+  1
@@ -0,0 +1,42 @@
+Setup:
+
+  $ . $TESTDIR/setup.sh
+  $ printf 'first\nfoo "bar" foo\n\tfoo\\\n' > json.txt
+
+One object per matching line, with byte offsets from the start of the file:
+
+  $ ag --json foo json.txt
+  {"path":"json.txt","line":2,"line_start":6,"text":"foo \"bar\" foo","submatches":[{"start":6,"end":9,"column":1},{"start":16,"end":19,"column":11}]}
+  {"path":"json.txt","line":3,"line_start":20,"text":"\u0009foo\\","submatches":[{"start":21,"end":24,"column":2}]}
+
+Offsets are still from the start of the input when searching a stream
+(the alias's --parallel would search the current directory instead):
+
+  $ printf 'a foo\nb\nfoo\n' | "$TESTDIR/../ag" --noaffinity --workers=1 --json foo
+  {"path":"","line":1,"line_start":0,"text":"a foo","submatches":[{"start":2,"end":5,"column":3}]}
+  {"path":"","line":3,"line_start":8,"text":"foo","submatches":[{"start":8,"end":11,"column":1}]}
+
+Bytes that aren't valid UTF-8 are escaped, so the output is still valid JSON:
+
+  $ printf 'plain ASCII, so the file is not taken for binary\ncaf\351 foo\n\303\251 foo\n' > latin1.txt
+  $ ag --json foo latin1.txt
+  {"path":"latin1.txt","line":2,"line_start":49,"text":"caf\u00e9 foo","submatches":[{"start":54,"end":57,"column":6}]}
+  {"path":"latin1.txt","line":3,"line_start":58,"text":"\xc3\xa9 foo","submatches":[{"start":61,"end":64,"column":4}]} (esc)
+
+Query ids are included with --queries:
+
+  $ printf 'q1\t-\tfirst\n' > queries
+  $ ag --json --queries queries json.txt
+  {"path":"json.txt","query":"q1","line":1,"line_start":0,"text":"first","submatches":[{"start":0,"end":5,"column":1}]}
+
+Binary records are length-prefixed:
+
+  $ ag --binary-output first json.txt | od -An -tx1 | tr -s ' '
+   3d 00 00 00 08 00 00 00 6a 73 6f 6e 2e 74 78 74
+   00 00 00 00 01 00 00 00 00 00 00 00 00 00 00 00
+   00 00 00 00 05 00 00 00 66 69 72 73 74 01 00 00
+   00 00 00 00 00 00 00 00 00 05 00 00 00 00 00 00
+   00
+  $ ag --json --binary-output foo json.txt
+  ERR: --json and --binary-output can't be used together.
+  [2]
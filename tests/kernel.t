@@ -0,0 +1,92 @@
+Setup:
+
+  $ . $TESTDIR/setup.sh
+  $ mkdir dir && cd dir
+  $ printf 'needle at the start\n' > start.txt
+  $ for i in $(seq 1 300); do printf 'line %s of haystack text\n' $i; done > long.txt
+  $ printf 'the needle is in the middle\n' >> long.txt
+  $ for i in $(seq 1 100); do printf 'more haystack\n'; done >> long.txt
+  $ printf 'ends with a needle' >> long.txt
+  $ printf 'nee\nneedl\n' > partial.txt
+  $ cd ..
+
+Every kernel finds the same matches on the same lines:
+
+  $ ag --kernel generic --column needle dir | sort > generic.out
+  $ cat generic.out
+  dir/long.txt:301:5:the needle is in the middle
+  dir/long.txt:402:13:ends with a needle
+  dir/start.txt:1:1:needle at the start
+  $ for k in sse2 sse4.2 avx2 avx512bw; do
+  >   if ag --kernel $k needle dir > /dev/null 2>&1; then
+  >     ag --kernel $k --column needle dir | sort | diff generic.out -
+  >   fi
+  > done
+
+Case-insensitive search only folds A-Z:
+
+  $ printf 'NEEDLE in caps, a NeEdLe in between and [needle@] next to the letters around A-Z\n' > dir/caps.txt
+  $ ag --kernel generic -i -o 'needle' dir/caps.txt > generic.out
+  $ ag --kernel generic -i -Q -o '[needle@]' dir/caps.txt >> generic.out
+  $ cat generic.out
+  NEEDLE
+  NeEdLe
+  needle
+  [needle@]
+  $ for k in sse2 sse4.2 avx2 avx512bw; do
+  >   if ag --kernel $k needle dir > /dev/null 2>&1; then
+  >     (ag --kernel $k -i -o 'needle' dir/caps.txt; ag --kernel $k -i -Q -o '[needle@]' dir/caps.txt; ag --kernel $k -i -Q -o '{NEEDLE`' dir/caps.txt) | diff generic.out -
+  >   fi
+  > done
+  $ ag --kernel generic -i -Q -o '{NEEDLE`' dir/caps.txt
+  [1]
+
+Every kernel finds the same matches for a set of literals:
+
+  $ ag --kernel generic -i --column 'needle|haystack|text' dir | sort > generic.out
+  $ wc -l < generic.out
+  404
+  $ for k in sse2 sse4.2 avx2 avx512bw; do
+  >   if ag --kernel $k needle dir > /dev/null 2>&1; then
+  >     ag --kernel $k -i --column 'needle|haystack|text' dir | sort | diff generic.out -
+  >   fi
+  > done
+
+Context lines are still counted across skipped lines:
+
+  $ ag --kernel generic -A1 -B1 middle dir/long.txt
+  300-line 300 of haystack text
+  301:the needle is in the middle
+  302-more haystack
+
+Every kernel agrees on which files are binary:
+
+  $ mkdir bin && cd bin
+  $ printf 'x plain text, long enough for the vector loops\n' > ascii.txt
+  $ printf 'x caf\303\251 na\303\257ve \342\202\254 \360\237\230\200 and some more text\n' > utf8.txt
+  $ printf 'x caf\351 in latin-1, which is not UTF-8 but mostly text\n' > latin1.txt
+  $ printf 'x \033[31mred\033[0m and \033[32mgreen\033[0m log lines\n' > ansi.txt
+  $ printf 'x \001\002\003\004\005\006\016\017\020 mostly control bytes\n' > control.txt
+  $ printf 'x text for a while, then a NUL\000 and more\n' > nul.txt
+  $ printf 'x an unfinished character \303' > truncated.txt
+  $ (printf x; printf '%509s' '' | tr ' ' a; printf '\342\202\254 straddles byte 512\n') > straddle.txt
+  $ cd ..
+  $ ag --kernel generic -l x bin | sort > generic.out
+  $ cat generic.out
+  bin/ansi.txt
+  bin/ascii.txt
+  bin/latin1.txt
+  bin/straddle.txt
+  bin/truncated.txt
+  bin/utf8.txt
+  $ for k in sse2 sse4.2 avx2 avx512bw; do
+  >   if ag --kernel $k x bin > /dev/null 2>&1; then
+  >     ag --kernel $k -l x bin | sort | diff generic.out -
+  >   fi
+  > done
+
+Unknown kernels are rejected:
+
+  $ ag --kernel mmx needle dir
+  ERR: Unknown kernel mmx. Use one of generic, sse2, sse4.2, avx2 or avx512bw.
+  [2]
@@ -0,0 +1,18 @@
+Setup:
+
+  $ . $TESTDIR/setup.sh
+  $ mkdir dir
+  $ printf 'foo\nFoo bar\n' > dir/a.txt
+  $ printf 'bar foo\n' > dir/b.txt
+  $ printf 'BAR\n' > dir/.hidden.txt
+
+A bad regex is an error, not an exit. Searches with different contexts don't see each other's settings,
+even when they run at the same time:
+
+  $ $TESTDIR/../libag_test dir
+  bad regex: rejected
+  plain: 3 matches
+  hidden: 2 matches
+  plain again: 3 matches
+  concurrent: same matches
+  no queries: -1 matches
@@ -0,0 +1,134 @@
+/*
+ * Drives libag the way an embedding program would. Run by tests/libag.t.
+ *
+ *   libag_test DIR
+ *
+ * Prints one line per check. Exits 1 if any of them went wrong.
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "libag.h"
+
+typedef struct {
+    const char *query_id;
+    size_t wrong_ids;
+} baton_t;
+
+#define CONCURRENT_ROUNDS 20
+
+/* One thread searching its own context over and over */
+typedef struct {
+    ag_ctx *ctx;
+    const char *dir;
+    baton_t baton;
+    ssize_t expected;
+    size_t wrong_counts;
+} searcher_t;
+
+static void on_match(const ag_match *match, void *baton) {
+    baton_t *b = baton;
+    if (match->query_id == NULL || strcmp(match->query_id, b->query_id) != 0) {
+        b->wrong_ids++;
+    }
+}
+
+static int search(ag_ctx *ctx, const char *name, const char *dir, const char *query_id) {
+    baton_t baton = { query_id, 0 };
+    ssize_t matches = ag_search(ctx, &dir, 1, &on_match, &baton);
+    printf("%s: %ld matches\n", name, (long)matches);
+    if (baton.wrong_ids) {
+        printf("%s: %lu matches with the wrong query id\n", name, (unsigned long)baton.wrong_ids);
+        return 1;
+    }
+    return 0;
+}
+
+static void *search_repeatedly(void *arg) {
+    searcher_t *s = arg;
+    int i;
+
+    for (i = 0; i < CONCURRENT_ROUNDS; i++) {
+        if (ag_search(s->ctx, &s->dir, 1, &on_match, &s->baton) != s->expected) {
+            s->wrong_counts++;
+        }
+    }
+    return NULL;
+}
+
+/* Searches plain and hidden from two threads at once. Each must see only its own queries and settings. */
+static int search_concurrently(ag_ctx *plain, ag_ctx *hidden, const char *dir) {
+    searcher_t searchers[2] = {
+        { plain, dir, { "foo", 0 }, 3, 0 },
+        { hidden, dir, { "bar", 0 }, 2, 0 },
+    };
+    pthread_t threads[2];
+    int i;
+
+    for (i = 0; i < 2; i++) {
+        if (pthread_create(&threads[i], NULL, &search_repeatedly, &searchers[i]) != 0) {
+            printf("concurrent: couldn't start a thread\n");
+            return 1;
+        }
+    }
+    for (i = 0; i < 2; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    for (i = 0; i < 2; i++) {
+        if (searchers[i].wrong_counts || searchers[i].baton.wrong_ids) {
+            printf("concurrent: %lu wrong counts and %lu matches with the wrong query id\n",
+                   (unsigned long)searchers[i].wrong_counts, (unsigned long)searchers[i].baton.wrong_ids);
+            return 1;
+        }
+    }
+    printf("concurrent: same matches\n");
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    ag_config config;
+    ag_ctx *plain;
+    ag_ctx *hidden;
+    ag_ctx *empty;
+    char *err = NULL;
+    int failed = 0;
+
+    if (argc != 2) {
+        fprintf(stderr, "Usage: %s DIR\n", argv[0]);
+        return 2;
+    }
+
+    ag_config_init(&config);
+    config.workers = 2;
+    plain = ag_ctx_new(&config);
+    if (ag_add_query(plain, "bad", "foo(", 0, &err) == 0 || err == NULL) {
+        printf("bad regex: accepted\n");
+        failed = 1;
+    } else {
+        printf("bad regex: rejected\n");
+    }
+    free(err);
+    ag_add_query(plain, "foo", "foo", 0, NULL);
+
+    /* Different settings and ignores, which mustn't leak into the other context's searches */
+    config.search_hidden_files = 1;
+    hidden = ag_ctx_new(&config);
+    ag_add_query(hidden, "bar", "bar", AG_QUERY_CASE_INSENSITIVE, NULL);
+    ag_add_ignore(hidden, "a.txt");
+
+    failed |= search(plain, "plain", argv[1], "foo");
+    failed |= search(hidden, "hidden", argv[1], "bar");
+    failed |= search(plain, "plain again", argv[1], "foo");
+    failed |= search_concurrently(plain, hidden, argv[1]);
+
+    empty = ag_ctx_new(NULL);
+    failed |= search(empty, "no queries", argv[1], NULL);
+
+    ag_ctx_free(plain);
+    ag_ctx_free(hidden);
+    ag_ctx_free(empty);
+    return failed;
+}
@@ -0,0 +1,49 @@
+Setup:
+
+  $ . $TESTDIR/setup.sh
+  $ printf 'foobar foo bar\nxfoo foox Foo\nnothing here\na.b a-b\n' > words.txt
+
+Alternations of literals match the way PCRE would, first alternative first:
+
+  $ ag -s -o 'foo|foobar' words.txt
+  foo
+  foo
+  foo
+  foo
+  $ ag -s -o 'foobar|foo' words.txt
+  foobar
+  foo
+  foo
+  foo
+  $ ag -s -o '(foo|foobar){1}' words.txt
+  foo
+  foo
+  foo
+  foo
+
+With -w, a later alternative can match where an earlier one isn't a word:
+
+  $ ag -s -o -w 'foo|foobar|bar' words.txt
+  foobar
+  foo
+  bar
+  $ ag -i -w --column '(?:foo|nothing)' words.txt
+  1:8:foobar foo bar
+  2:11:xfoo foox Foo
+  3:1:nothing here
+
+Escaped characters are literals too:
+
+  $ ag -o 'a\.b|a\-b' words.txt
+  a.b
+  a-b
+  $ ag --nomultiline -o --column 'a\.b' words.txt
+  1:a.b
+
+Every match on a line is found at the right column with --nomultiline:
+
+  $ ag -s --nomultiline -o --column 'fo+' words.txt
+  1:foo
+  8:foo
+  2:foo
+  6:foo
@@ -38,3 +38,8 @@ Case of a word repeating the same part:
 
   $ ag -wF --column 'blah blah' blah6.txt
   1:9:abcblah blah blah
+
+Same with Horspool:
+
+  $ ag --horspool -wF --column 'blah' blah5.txt
+  1:7:blahx blah
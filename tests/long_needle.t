@@ -0,0 +1,18 @@
+Setup:
+
+  $ . $TESTDIR/setup.sh
+  $ mkdir dir
+  $ NEEDLE=$(printf 'ab%.0s' $(seq 1 200))c
+  $ printf '%s\n' "${NEEDLE%c}d" "x${NEEDLE}" "${NEEDLE#a}" "ab$(echo $NEEDLE | tr a-z A-Z)" > dir/periodic.txt
+
+Needles longer than 255 bytes find the same matches with every kernel:
+
+  $ (ag --kernel generic -s --column "$NEEDLE" dir; ag --kernel generic -c -i "$NEEDLE" dir) | cut -c1-30 > generic.out
+  $ cat generic.out
+  dir/periodic.txt:2:2:xabababab
+  dir/periodic.txt:2
+  $ for k in sse2 sse4.2 avx2 avx512bw; do
+  >   if ag --kernel $k -c "$NEEDLE" dir > /dev/null 2>&1; then
+  >     (ag --kernel $k -s --column "$NEEDLE" dir; ag --kernel $k -c -i "$NEEDLE" dir) | cut -c1-30 | diff generic.out -
+  >   fi
+  > done
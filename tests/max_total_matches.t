@@ -0,0 +1,35 @@
+Setup:
+
+  $ . $TESTDIR/setup.sh
+  $ mkdir dir
+  $ printf 'foo\nfoo\n' > dir/a.txt
+  $ printf 'foo\nfoo\nfoo\n' > dir/b.txt
+  $ printf 'foo\n' > dir/c.txt
+  $ printf 'bar\n' > dir/d.txt
+
+Stop partway through a file:
+
+  $ ag --max-total-matches 3 foo dir | grep -c foo
+  3
+
+Each path counts as one with -l, -L and -c:
+
+  $ ag --max-total-matches 2 -l foo dir | wc -l
+  2
+  $ ag --max-total-matches 1 -L foo dir
+  dir/d.txt
+  $ ag --max-total-matches 2 -c foo dir | wc -l
+  2
+
+Files still in the queue aren't searched:
+
+  $ ag --debug --max-total-matches 1 -l foo dir 2>&1 | grep -c 'Match found'
+  1
+
+Streams (without --parallel, which turns off searching stdin):
+
+  $ unalias ag
+  $ alias ag="$TESTDIR/../ag --nocolor --workers=1"
+  $ printf 'foo\nfoo\nfoo\n' | ag --max-total-matches 2 foo
+  foo
+  foo
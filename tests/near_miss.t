@@ -0,0 +1,18 @@
+Setup:
+
+  $ . $TESTDIR/setup.sh
+  $ A=$(printf 'a%.0s' $(seq 1 64))
+  $ (for i in $(seq 1 200); do printf '%s' "$A$A$A$A"; done; printf '%sb%s\n' "$A" "$A"; printf 'x%sb%s\n' "$A" "$A") > run.txt
+
+A needle that nearly matches everywhere makes the search switch to Two-Way partway through, and it still finds every match:
+
+  $ for k in generic sse2 avx2 avx512bw; do
+  >   for alg in '' --horspool; do
+  >     if ag --kernel $k -c a run.txt > /dev/null 2>&1; then
+  >       ag --kernel $k $alg --debug -s --column "${A}b${A}" run.txt 2>&1 | grep -v '^DEBUG: Match' | grep -e 'near misses' -e '^[0-9]' | cut -c1-30
+  >     fi
+  >   done
+  > done | sort -u
+  1:51201:aaaaaaaaaaaaaaaaaaaaaa
+  2:2:xaaaaaaaaaaaaaaaaaaaaaaaaa
+  DEBUG: Too many near misses in
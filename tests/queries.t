@@ -0,0 +1,38 @@
+Setup:
+
+  $ . $TESTDIR/setup.sh
+  $ mkdir tree
+  $ printf 'password = "hunter2"\nAPI_KEY=abc\nfoo bar\nfoobar\n' > tree/a.txt
+  $ printf 'nothing here\nPassword: x\n' > tree/b.txt
+  $ printf 'secret\tQi\tpassword\napi\t-\tAPI_[A-Z]+\nfoo\tw\tfoo\n# comment\n\nbar\n' > queries
+
+Every query runs in one pass and results are tagged with its id:
+
+  $ ag --queries queries tree | sort
+  6:tree/a.txt:3:foo bar
+  6:tree/a.txt:4:foobar
+  api:tree/a.txt:2:API_KEY=abc
+  foo:tree/a.txt:3:foo bar
+  secret:tree/a.txt:1:password = "hunter2"
+  secret:tree/b.txt:2:Password: x
+
+Tags are printed when searching a single file:
+
+  $ ag --queries queries tree/b.txt
+  secret:tree/b.txt:2:Password: x
+
+Output options apply to every query:
+
+  $ ag --queries queries -c tree | sort
+  6:tree/a.txt:2
+  api:tree/a.txt:1
+  foo:tree/a.txt:1
+  secret:tree/a.txt:1
+  secret:tree/b.txt:1
+
+Bad flags are reported:
+
+  $ printf 'x\tZ\ty\n' > bad
+  $ ag --queries bad tree
+  ERR: bad line 1: unknown query flag 'Z'
+  [2]
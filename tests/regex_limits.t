@@ -0,0 +1,27 @@
+Setup:
+
+  $ . $TESTDIR/setup.sh
+  $ A=$(printf 'a%.0s' $(seq 1 30))
+  $ printf '%sc b\nxyz\naaab\n%sd b\n' "$A" "$A" > blowup.txt
+  $ printf 'aaab\n' > fine.txt
+
+Files that hit PCRE's match limit are listed at the end:
+
+  $ ag --nodfa --regex-match-limit 10000 -s '(a|aa)*b' blowup.txt fine.txt 2>&1 >/dev/null
+  ERR: Didn't finish searching 1 file:
+  ERR: blowup.txt: stopped at line 1 after hitting PCRE's match limit
+
+--nomultiline only skips the lines that hit the limit:
+
+  $ ag --nodfa --regex-match-limit 10000 --nomultiline -s '(a|aa)*b' blowup.txt 2>/dev/null
+  3:aaab
+  $ ag --nodfa --regex-match-limit 10000 --nomultiline -s '(a|aa)*b' blowup.txt 2>&1 >/dev/null
+  ERR: Didn't finish searching 1 file:
+  ERR: blowup.txt: skipped 2 lines after hitting PCRE's match limit, starting at line 1
+
+Without a lower limit, the lines are searched in full:
+
+  $ ag --nodfa --nomultiline -s '(a|aa)*b' blowup.txt
+  1:aaaaaaaaaaaaaaaaaaaaaaaaaaaaaac b
+  3:aaab
+  4:aaaaaaaaaaaaaaaaaaaaaaaaaaaaaad b
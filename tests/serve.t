@@ -0,0 +1,126 @@
+Setup:
+
+  $ . $TESTDIR/setup.sh
+  $ mkdir -p tree/sub tree/ignored
+  $ echo 'needle' > tree/a.txt
+  $ echo 'needle' > tree/sub/b.txt
+  $ echo 'needle' > tree/ignored/c.txt
+  $ echo 'ignored' > tree/.ignore
+  $ ag --serve sock tree > /dev/null 2>&1 &
+  $ SERVER=$!
+  $ while [ ! -S sock ]; do sleep 0.1; done
+
+Queries are answered from the server's tree:
+
+  $ ag --connect sock needle tree | sort
+  tree/a.txt:1:needle
+  tree/sub/b.txt:1:needle
+  $ ag --connect sock haystack tree
+  [1]
+
+Paths are printed the way plain ag would print them:
+
+  $ ag --connect sock needle tree/a.txt
+  1:needle
+  $ cd tree/sub
+  $ ag --connect ../../sock needle
+  b.txt:1:needle
+  $ cd ../..
+
+Paths the server doesn't watch are rejected:
+
+  $ mkdir other
+  $ echo 'needle' > other/b.txt
+  $ ag --connect sock needle other
+  ERR: other isn't in the tree the server watches. Search it without --connect, or serve it too.
+  [2]
+  $ ag --connect sock needle
+  ERR: . isn't in the tree the server watches. Search it without --connect, or serve it too.
+  [2]
+
+New files and directories are picked up:
+
+  $ mkdir tree/sub/new
+  $ echo 'needle' > tree/sub/new/d.txt
+  $ ag --connect sock -l needle tree | sort
+  tree/a.txt
+  tree/sub/b.txt
+  tree/sub/new/d.txt
+
+Changed ignore files apply to everything below them:
+
+  $ echo 'sub' > tree/.ignore
+  $ ag --connect sock -l needle tree | sort
+  tree/a.txt
+  tree/ignored/c.txt
+
+So does .git/info/exclude:
+
+  $ mkdir -p tree/.git/info
+  $ echo 'ignored' > tree/.git/info/exclude
+  $ ag --connect sock -l needle tree
+  tree/a.txt
+  $ rm tree/.git/info/exclude
+
+Queries can be limited to part of the tree:
+
+  $ ag --connect sock -l needle tree/ignored
+  tree/ignored/c.txt
+
+A renamed directory is still watched under its new name:
+
+  $ mkdir tree/old
+  $ echo 'needle' > tree/old/x.txt
+  $ ag --connect sock -l needle tree/old
+  tree/old/x.txt
+  $ mv tree/old tree/new
+  $ ag --connect sock -l needle tree/new
+  tree/new/x.txt
+  $ echo 'needle' > tree/new/y.txt
+  $ ag --connect sock -l needle tree/new | sort
+  tree/new/x.txt
+  tree/new/y.txt
+
+Queries run side by side. This one can't finish until its output is read:
+
+  $ seq 1 200000 | sed 's/^/line /' > tree/many.txt
+  $ (ag --connect sock line tree/many.txt | (sleep 3; wc -l)) > slow.out &
+  $ SLOW=$!
+  $ sleep 0.5
+  $ timeout 2 "$TESTDIR/../ag" --connect sock -l needle tree/a.txt
+  tree/a.txt
+  $ wait $SLOW
+  $ cat slow.out
+  200000
+
+Neither does a client that connects and never sends its query:
+
+  $ python3 -c 'import socket, time; s = socket.socket(socket.AF_UNIX); s.connect("sock"); time.sleep(3)' &
+  $ STALLED=$!
+  $ sleep 0.5
+  $ timeout 2 "$TESTDIR/../ag" --connect sock -l needle tree/a.txt
+  tree/a.txt
+  $ wait $STALLED
+
+Options that would change the walk are rejected instead of ignored:
+
+  $ ag --connect sock --hidden needle tree
+  ERR: --hidden can't be used in a query. Restart the server with it instead.
+  [2]
+  $ ag --connect sock --ignore a.txt needle tree
+  ERR: --ignore, --ignore-dir or --path-to-ignore can't be used in a query. Restart the server with it instead.
+  [2]
+  $ ag --connect sock --depth 3 needle tree
+  ERR: --depth can't be used in a query. Restart the server with it instead.
+  [2]
+
+Only one server per socket:
+
+  $ ag --serve sock tree
+  ERR: Another ag is already serving sock
+  [2]
+
+  $ kill $SERVER
+  $ wait $SERVER
+  $ test -e sock
+  [1]
@@ -0,0 +1,30 @@
+Setup:
+
+  $ . $TESTDIR/setup.sh
+  $ mkdir dir
+  $ printf 'foo\nbar\nfoo\n' > dir/a.txt
+  $ printf 'foo\n' > dir/b.txt
+
+Totals go to stdout:
+
+  $ ag --stats-only foo dir 2>/dev/null | sed '$d'
+  3 matches
+  2 files contained matches
+  2 files searched
+  16 bytes searched
+
+Time per phase and per-worker counters go to stderr:
+
+  $ ag --stats-only foo dir 2>&1 >/dev/null | sed 's/ *[0-9][0-9.]* *[0-9][0-9.]*$//'
+  phase                    wall s        cpu s
+  other
+  traversal
+  ignores
+  open/read/mmap
+  binary detection
+  decompression
+  matching
+  printing
+  queue wait
+  process cpu: * user, * system (glob)
+  worker 0: 2 files, 16 bytes, 3 matches, * s matching, * s waiting for files, * bytes of match storage at most (glob)
@@ -0,0 +1,37 @@
+Setup:
+
+  $ . $TESTDIR/setup.sh
+  $ mkdir -p dir/sub
+  $ printf 'foo\n' > dir/a.txt
+  $ printf 'foo\n' > dir/sub/b.txt
+  $ printf 'foo\n' | gzip > dir/c.txt.gz
+
+Every directory and file searched gets an event:
+
+  $ ag -z --trace trace.json foo dir | sort
+  dir/a.txt:1:foo
+  dir/c.txt.gz:1:foo
+  dir/sub/b.txt:1:foo
+  $ grep -o '"name":"[a-z_ 0-9]*"' trace.json | sort | uniq -c
+        1 "name":"decompress"
+        1 "name":"main"
+        2 "name":"search_dir"
+        3 "name":"search_file"
+        2 "name":"thread_name"
+        1 "name":"worker 0"
+  $ grep -c '"args":{"path":"dir/sub/b.txt"}' trace.json
+  1
+
+Paths that aren't valid UTF-8 are escaped:
+
+  $ printf 'foo\n' > "$(printf 'dir/caf\351.txt')"
+  $ ag --trace trace.json foo "$(printf 'dir/caf\351.txt')"
+  1:foo
+  $ grep -c '"args":{"path":"dir/caf\\u00e9.txt"}' trace.json
+  2
+
+Opening the trace file fails before searching:
+
+  $ ag --trace missing/trace.json foo dir
+  ERR: Error opening trace file missing/trace.json: No such file or directory
+  [2]
@@ -10,3 +10,14 @@ Word regexp:
   $ ag -w 'foo|bar' ./
   blah.txt:1:foo
   blah.txt:2:bar
+
+A match that isn't a whole word doesn't hide a longer one at the same spot:
+
+  $ ag -w -o 'fo+|foobar' blah.txt
+  foo
+  foobar
+
+A regex that matches any character:
+
+  $ ag -w -o '.' blah.txt
+  [1]